@@ -0,0 +1,152 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <sys/uio.h>
+
+#include <metrics.h>
+
+#define BCACHE_BLOCK_SIZE 4096
+#define BCACHE_SHARDS 16
+
+// bcache_init flags.
+#define BCACHE_WRITEBACK (1 << 0)
+#define BCACHE_HUGEPAGES (1 << 1)
+
+/**
+ * The bcache_dev_t identifies a device in the cache. It is embedded in the
+ * device, which writes dirty blocks back with `writeback`.
+ */
+typedef struct bcache_dev {
+    int (*writeback)(struct bcache_dev *dev, const void *buf, size_t len, uint64_t offset);
+} bcache_dev_t;
+
+typedef struct bcache_entry {
+    bcache_dev_t *dev;
+    uint64_t block;
+    // The next entry of the hash chain or free list.
+    uint32_t next;
+    uint8_t valid;
+    uint8_t dirty;
+    // The CLOCK reference bit, set on every hit.
+    uint8_t referenced;
+} bcache_entry_t;
+
+typedef struct bcache_shard {
+    pthread_mutex_t mu;
+    bcache_entry_t *entries;
+    uint8_t *data;
+    size_t capacity;
+    // Entries never used yet, then the free list.
+    size_t used;
+    uint32_t free;
+    uint32_t *buckets;
+    size_t bucket_mask;
+    size_t hand;
+    size_t dirty;
+} bcache_shard_t;
+
+/**
+ * The bcache_t caches blocks of one or more devices in host memory. It is
+ * split into BCACHE_SHARDS shards, each with its own lock, so that queue
+ * threads rarely contend. Blocks are evicted with the CLOCK algorithm.
+ *
+ * Reads are served from the cache when every block they cover is cached,
+ * and fill it when they complete. Writes invalidate the blocks they cover,
+ * unless the cache is in write-back mode: block-aligned writes are then
+ * absorbed into dirty blocks, which are written back when the device is
+ * flushed. Dirty blocks are never evicted, and at most half of each shard
+ * may be dirty; writes beyond that are written through.
+ *
+ * A fill is dropped if any write was invalidated since its read was
+ * submitted, as it may have read the data the write replaced.
+ */
+typedef struct bcache {
+    uint8_t *pool;
+    size_t pool_size;
+    int flags;
+    bcache_shard_t shards[BCACHE_SHARDS];
+    _Atomic uint64_t epoch;
+
+    // Counters exported through metrics_t.
+    struct {
+        _Atomic uint64_t hits;
+        _Atomic uint64_t misses;
+        _Atomic uint64_t evictions;
+        _Atomic uint64_t writebacks;
+        _Atomic uint64_t absorbed;
+    } stats;
+} bcache_t;
+
+/**
+ * bcache_init allocates a cache of `size` bytes. With BCACHE_HUGEPAGES the
+ * blocks are backed by hugetlb pages, or transparent hugepages if none are
+ * reserved.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int bcache_init(bcache_t *cache, size_t size, int flags);
+
+/**
+ * bcache_init_spec initializes `cache` from a spec of the form
+ * `size[,writeback][,hugepages]`, where `size` may have a K, M or G suffix.
+ */
+int bcache_init_spec(bcache_t *cache, const char *spec);
+
+void bcache_deinit(bcache_t *cache);
+
+/**
+ * bcache_read copies the `len` bytes at `offset` of `dev` into `iov` if
+ * they are all cached.
+ *
+ * \return 1 on a hit and 0 on a miss.
+ */
+int bcache_read(bcache_t *cache, bcache_dev_t *dev, uint64_t offset, const struct iovec *iov, int iovcnt);
+
+/**
+ * bcache_epoch returns the epoch a read must be submitted in to fill the
+ * cache on completion.
+ */
+uint64_t bcache_epoch(bcache_t *cache);
+
+/**
+ * bcache_fill completes a read of `offset` submitted in `epoch`: blocks
+ * still cached are copied over `iov`, since dirty blocks are newer than the
+ * device, and the other whole blocks of `iov` are inserted into the cache.
+ */
+void bcache_fill(bcache_t *cache, bcache_dev_t *dev, uint64_t offset, const struct iovec *iov, int iovcnt,
+                 uint64_t epoch);
+
+/**
+ * bcache_write absorbs a write into dirty blocks in write-back mode.
+ *
+ * \return 1 if the write was absorbed. Otherwise 0 is returned and the
+ *         caller must invalidate the range and write it to the device.
+ */
+int bcache_write(bcache_t *cache, bcache_dev_t *dev, uint64_t offset, const struct iovec *iov, int iovcnt);
+
+/**
+ * bcache_invalidate drops the blocks overlapping the `len` bytes at
+ * `offset`. Dirty blocks only partially overlapped are written back first.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int bcache_invalidate(bcache_t *cache, bcache_dev_t *dev, uint64_t offset, uint64_t len);
+
+/**
+ * bcache_writeback writes every dirty block of `dev` back to it.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int bcache_writeback(bcache_t *cache, bcache_dev_t *dev);
+
+int bcache_register_metrics(bcache_t *cache, metrics_t *m, const char *labels);
+
+#endif /* BCACHE_H */
@@ -9,8 +9,41 @@
 
 #include <libaio.h>
 
+#include <metrics.h>
+#include <event-loop.h>
+#include <cow.h>
+#include <stripe.h>
+#include <bcache.h>
+#include <throttle.h>
+#include <bounce.h>
+
+// bdev_queue_writev flags.
+#define BDEV_WRITE_FUA (1 << 0)
+
+// The default bounce buffer pool of each queue: one hugepage worth of
+// buffers large enough for a merged virtio-blk request segment.
+#define BDEV_BOUNCE_SLOT_SIZE (128 * 1024)
+#define BDEV_BOUNCE_SLOTS 16
+
+typedef struct bdev_io bdev_io_t;
+
 typedef struct bdev {
+    // The backing file, or -1 if the device is composed of `stripe`.
     int fd;
+    // The size of the device in bytes.
+    uint64_t size;
+    // Set if the file is a copy-on-write overlay, whose base is opened
+    // read-only. Reads and writes are then mapped through it.
+    cow_t *cow;
+    // Set if the device stripes or concatenates several files. Requests
+    // crossing a chunk or member are split into one request per extent.
+    stripe_t *stripe;
+    // The optional host block cache, which may be shared with other bdevs.
+    bcache_t *cache;
+    bcache_dev_t cache_dev;
+    // The alignment O_DIRECT requires of buffers and of their lengths.
+    size_t mem_align;
+    size_t block_size;
     size_t queue_depth;
     struct bdev_queue *queues;
     size_t queue_count;
@@ -20,12 +53,113 @@ typedef struct bdev_queue {
     bdev_t *bdev;
     int eventfd;
     io_context_t ctx;
+    event_source_t *source;
+
+    // While plugged, prepared requests are batched into `plug` and
+    // submitted with one io_submit by bdev_queue_unplug.
+    int plugged;
+    struct iocb *plug;
+    struct iocb **plug_list;
+    size_t plug_len;
+
+    // Flush, discard and write-zeroes requests are barriers: each one is
+    // held in a FIFO until every read and write submitted before it has
+    // completed. Reads and writes are tagged with the number of barriers
+    // queued before them, and `inflight` counts the incomplete requests of
+    // each tag modulo queue_depth + 1.
+    uint32_t tag;
+    uint32_t *inflight;
+    bdev_io_t *barrier_head;
+    bdev_io_t *barrier_tail;
+    size_t barrier_len;
+    // Set once the kernel rejected IOCB_CMD_FDSYNC for the backing file.
+    int sync_flush;
+
+    // Striped and copy-on-write requests take one iocb per extent, which
+    // can outnumber the slots of the aio context. The iocbs it rejects
+    // with EAGAIN are held in FIFO order and submitted as completions free
+    // slots.
+    struct bdev_backlog *backlog_head;
+    struct bdev_backlog *backlog_tail;
+
+    // Stages requests whose buffers are not aligned for O_DIRECT.
+    bounce_pool_t bounce;
+
+    // Set by bdev_set_limits. Requests the token buckets do not admit are
+    // held in FIFO order, with every request submitted after them, until
+    // `timerfd` fires.
+    throttle_t *throttle;
+    int timerfd;
+    event_source_t *timer_source;
+    struct bdev_held *held_head;
+    struct bdev_held *held_tail;
+
+    // Counters exported through metrics_t.
+    struct {
+        _Atomic uint64_t reads;
+        _Atomic uint64_t writes;
+        _Atomic uint64_t read_bytes;
+        _Atomic uint64_t write_bytes;
+        _Atomic uint64_t completions;
+        _Atomic uint64_t errors;
+        _Atomic uint64_t flushes;
+        _Atomic uint64_t discards;
+        _Atomic uint64_t write_zeroes;
+        _Atomic uint64_t throttled;
+        _Atomic uint64_t throttled_ns;
+        _Atomic uint64_t bounced;
+        _Atomic uint64_t bounce_bytes;
+        _Atomic uint64_t bounce_allocs;
+        _Atomic uint64_t backlogged;
+    } stats;
 } bdev_queue_t;
 
+/**
+ * bdev_init opens the file or block device at `path` with `queue_count`
+ * queues of `queue_depth` requests. A file created by cow_create is opened
+ * as a copy-on-write overlay of its base image, and a `path` accepted by
+ * stripe_is_spec composes the device from several files.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
 int bdev_init(bdev_t *bdev, const char *path, size_t queue_count, size_t queue_depth);
 
+/**
+ * bdev_deinit writes back the blocks of `bdev` dirty in its cache and
+ * closes it.
+ */
 void bdev_deinit(bdev_t *bdev);
 
+/**
+ * bdev_set_limits throttles the requests of `bdev` to `limits`, which are
+ * split evenly between its queues. Must be called once, before the queues
+ * are attached.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ *
+ * \exception EBUSY - The limits of `bdev` were already set.
+ */
+int bdev_set_limits(bdev_t *bdev, const throttle_limits_t *limits);
+
+/**
+ * bdev_set_bounce replaces the bounce buffer pool of each queue of `bdev`
+ * with `slots` buffers of BDEV_BOUNCE_SLOT_SIZE bytes. With
+ * BOUNCE_HUGEPAGES in `flags` the pools are backed by hugepages. Must be
+ * called before any request is submitted.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int bdev_set_bounce(bdev_t *bdev, size_t slots, int flags);
+
+/**
+ * bdev_set_cache serves reads and, in write-back mode, writes of `bdev`
+ * from `cache`. Must be called before any request is submitted.
+ */
+void bdev_set_cache(bdev_t *bdev, bcache_t *cache);
+
 int bdev_queue_init(bdev_queue_t *queue, bdev_t *bdev);
 
 void bdev_queue_deinit(bdev_queue_t *queue);
@@ -34,12 +168,119 @@ bdev_queue_t* bdev_get_queue(bdev_t *bdev, size_t i);
 
 int bdev_queue_eventfd(bdev_queue_t *queue);
 
-typedef void (*bdev_cb_t)(ssize_t res);
+typedef void (*bdev_cb_t)(bdev_io_t *io, ssize_t res);
 
-int bdev_queue_read(bdev_queue_t *queue, void *buf, size_t count, off_t offset, bdev_cb_t cb);
+typedef enum bdev_op {
+    BDEV_OP_RW,
+    BDEV_OP_FLUSH,
+    BDEV_OP_DISCARD,
+    BDEV_OP_WRITE_ZEROES,
+} bdev_op_t;
 
-int bdev_queue_write(bdev_queue_t *queue, void *buf, size_t count, off_t offset, bdev_cb_t cb);
+/**
+ * The bdev_io_t is embedded in each caller request. `cb` is called on
+ * completion with the number of bytes transferred or a negative errno, and
+ * the bdev_io_t must remain valid until then. The other fields are private
+ * to the bdev_queue_t.
+ */
+struct bdev_io {
+    bdev_cb_t cb;
 
+    bdev_op_t op;
+    uint32_t tag;
+    off_t offset;
+    off_t len;
+    int unmap;
+    bdev_io_t *next;
+};
+
+int bdev_queue_read(bdev_queue_t *queue, bdev_io_t *io, void *buf, size_t count, off_t offset);
+
+int bdev_queue_write(bdev_queue_t *queue, bdev_io_t *io, void *buf, size_t count, off_t offset);
+
+/**
+ * bdev_queue_readv reads into the `iovcnt` buffers of `iov` with a single
+ * request. The iovecs must remain valid until the request is submitted,
+ * i.e. until bdev_queue_unplug if the queue is plugged.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int bdev_queue_readv(bdev_queue_t *queue, bdev_io_t *io, const struct iovec *iov, int iovcnt, off_t offset);
+
+/**
+ * bdev_queue_writev writes the `iovcnt` buffers of `iov` with a single
+ * request. With BDEV_WRITE_FUA in `flags` the request completes once the
+ * data is durable.
+ */
+int bdev_queue_writev(bdev_queue_t *queue, bdev_io_t *io, const struct iovec *iov, int iovcnt, off_t offset,
+                      int flags);
+
+/**
+ * bdev_queue_flush makes every write that completed before the call durable.
+ * The flush is submitted as an asynchronous fdatasync once all reads and
+ * writes submitted before it have completed.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int bdev_queue_flush(bdev_queue_t *queue, bdev_io_t *io);
+
+/**
+ * bdev_queue_discard deallocates `len` bytes at `offset`. Like a flush, it
+ * runs once all reads and writes submitted before it have completed.
+ */
+int bdev_queue_discard(bdev_queue_t *queue, bdev_io_t *io, off_t offset, off_t len);
+
+/**
+ * bdev_queue_write_zeroes zeroes `len` bytes at `offset`, deallocating them
+ * if `unmap` is set and the backend supports it. Like a flush, it runs once
+ * all reads and writes submitted before it have completed.
+ */
+int bdev_queue_write_zeroes(bdev_queue_t *queue, bdev_io_t *io, off_t offset, off_t len, int unmap);
+
+/**
+ * bdev_queue_plug makes `queue` batch requests until bdev_queue_unplug, so
+ * a burst of requests costs one io_submit.
+ */
+void bdev_queue_plug(bdev_queue_t *queue);
+
+/**
+ * bdev_queue_unplug submits every batched request of `queue`. Requests that
+ * cannot be submitted are completed with the submission error before
+ * bdev_queue_unplug returns.
+ */
+void bdev_queue_unplug(bdev_queue_t *queue);
+
+/**
+ * bdev_queue_poll waits up to 100ms for completions on `queue` and calls
+ * their callbacks. Queues attached to a loop reap their completions without
+ * waiting, so this is only for callers that drain a queue.
+ *
+ * \return On success, the number of completions reaped is returned. On
+ *         error, -1 is returned and errno is set to indicate the error.
+ */
 int bdev_queue_poll(bdev_queue_t *queue);
 
+/**
+ * bdev_queue_attach reaps the completions of `queue` on `loop`. Requests
+ * must then only be submitted on the thread running `loop`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int bdev_queue_attach(bdev_queue_t *queue, event_loop_t *loop);
+
+/**
+ * bdev_queue_detach stops reaping the completions of `queue` on the loop it
+ * is attached to, which must not be running.
+ */
+void bdev_queue_detach(bdev_queue_t *queue);
+
+/**
+ * bdev_register_metrics registers the counters of every queue of `bdev`
+ * with `m`. Each series is labeled with `labels` and the queue index.
+ */
+int bdev_register_metrics(bdev_t *bdev, metrics_t *m, const char *labels);
+
 #endif
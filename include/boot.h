@@ -0,0 +1,114 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <linux/kvm.h>
+#include <asm/bootparam.h>
+
+// The PVH entry point note of an ELF kernel, see xen/include/public/elfnote.h.
+#define XEN_ELFNOTE_PHYS32_ENTRY 18
+
+// The PVH start info, see xen/include/public/arch-x86/hvm/start_info.h.
+#define HVM_START_MAGIC_VALUE 0x336ec578
+#define HVM_START_INFO_VERSION 1
+
+#define HVM_MEMMAP_TYPE_RAM 1
+#define HVM_MEMMAP_TYPE_RESERVED 2
+
+struct hvm_start_info {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t nr_modules;
+    uint64_t modlist_paddr;
+    uint64_t cmdline_paddr;
+    uint64_t rsdp_paddr;
+    uint64_t memmap_paddr;
+    uint32_t memmap_entries;
+    uint32_t reserved;
+};
+
+struct hvm_modlist_entry {
+    uint64_t paddr;
+    uint64_t size;
+    uint64_t cmdline_paddr;
+    uint64_t reserved;
+};
+
+struct hvm_memmap_table_entry {
+    uint64_t addr;
+    uint64_t size;
+    uint32_t type;
+    uint32_t reserved;
+};
+
+// Guest physical addresses of the boot structures, all below the zero page
+// at 0x10000 and the command line at 0x20000.
+#define BOOT_GDT_ADDR       0x500
+#define BOOT_PVH_INFO_ADDR  0x6000
+#define BOOT_PML4_ADDR      0x9000
+#define BOOT_PDPT_ADDR      0xa000
+#define BOOT_PD_ADDR        0xb000
+
+// The end of the low RAM usable by the guest, below the EBDA and the legacy
+// VGA and BIOS ranges.
+#define BOOT_LOW_RAM_END    0x9fc00
+#define BOOT_HIGH_RAM_START 0x100000
+
+/**
+ * The boot_elf_t describes a kernel loaded by boot_elf_load.
+ */
+typedef struct boot_elf {
+    // The physical address of the 64-bit entry point (startup_64).
+    uint64_t entry;
+    // The physical address of the 32-bit PVH entry point, or 0 if the
+    // kernel has no XEN_ELFNOTE_PHYS32_ENTRY note.
+    uint64_t pvh_entry;
+    // The physical memory the segments occupy.
+    uint64_t start;
+    uint64_t end;
+} boot_elf_t;
+
+/**
+ * boot_is_elf returns 1 if the `len` bytes at `data` start with an ELF
+ * header.
+ */
+int boot_is_elf(const void *data, size_t len);
+
+/**
+ * boot_elf_load loads the segments of the uncompressed x86-64 kernel ELF
+ * open at `fd` at their physical addresses in the `mem_size` bytes of guest
+ * memory mapped at `mem`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int boot_elf_load(void *mem, size_t mem_size, int fd, boot_elf_t *elf);
+
+/**
+ * boot_setup_pvh writes a PVH start info with a memory map of `mem_size`
+ * bytes of RAM, the command line at `cmdline_addr` and the initrd, if
+ * `initrd_size` is not 0, as its only module.
+ *
+ * \return The physical address of the start info, passed to the kernel in
+ *         %ebx.
+ */
+uint64_t boot_setup_pvh(void *mem, size_t mem_size, uint64_t cmdline_addr, uint64_t initrd_addr,
+                        uint64_t initrd_size);
+
+/**
+ * boot_setup_e820 fills the e820 table of the zero page `params` for
+ * `mem_size` bytes of RAM.
+ */
+void boot_setup_e820(struct boot_params *params, size_t mem_size);
+
+/**
+ * boot_setup_long_mode writes a GDT and page tables identity mapping the
+ * first 1GiB into guest memory and sets up `sregs` for 64-bit mode with
+ * paging enabled.
+ */
+void boot_setup_long_mode(void *mem, struct kvm_sregs *sregs);
+
+#endif /* BOOT_H */
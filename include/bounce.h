@@ -0,0 +1,52 @@
+#ifndef BOUNCE_H
+#define BOUNCE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// bounce_pool_init flags.
+#define BOUNCE_HUGEPAGES (1 << 0)
+
+/**
+ * The bounce_pool_t is a preallocated pool of page-aligned buffers of
+ * `slot_size` bytes, used to stage O_DIRECT requests whose guest buffers
+ * are not aligned. It is not thread-safe: each bdev queue owns one.
+ */
+typedef struct bounce_pool {
+    uint8_t *pool;
+    size_t pool_size;
+    size_t slot_size;
+    size_t slots;
+    // A stack of the free slot indices.
+    uint32_t *free;
+    size_t free_len;
+} bounce_pool_t;
+
+/**
+ * bounce_pool_init allocates `slots` buffers of `slot_size` bytes, a
+ * multiple of the page size. With BOUNCE_HUGEPAGES the pool is backed by
+ * hugetlb pages, or transparent hugepages if none are reserved.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int bounce_pool_init(bounce_pool_t *pool, size_t slot_size, size_t slots, int flags);
+
+void bounce_pool_deinit(bounce_pool_t *pool);
+
+/**
+ * bounce_pool_get takes a buffer of at least `len` bytes from the pool.
+ *
+ * \return The buffer, or NULL if `len` exceeds the slot size or every slot
+ *         is in use.
+ */
+void* bounce_pool_get(bounce_pool_t *pool, size_t len);
+
+/**
+ * bounce_pool_put returns `buf` to the pool.
+ *
+ * \return 1 if `buf` was taken from the pool, 0 otherwise.
+ */
+int bounce_pool_put(bounce_pool_t *pool, void *buf);
+
+#endif /* BOUNCE_H */
@@ -0,0 +1,140 @@
+#ifndef BUS_H
+#define BUS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <metrics.h>
+
+// The handlers of a range registered with BUS_LOCKLESS do their own
+// locking, or none, and may run concurrently on several vCPUs. The others
+// are serialized by a per-range mutex.
+#define BUS_LOCKLESS (1 << 0)
+
+/**
+ * The bus_ops_t are the handlers of a range. `addr` is the absolute address
+ * (or port) of the access.
+ *
+ * The string handlers are optional and perform `count` accesses of `size`
+ * bytes to `addr`, as in `rep insb` or `rep outsb`, in one call. Without
+ * them, string accesses are split into `count` calls of read or write.
+ */
+typedef struct bus_ops {
+    void (*read)(void *arg, uint64_t addr, uint8_t *data, size_t len);
+    void (*write)(void *arg, uint64_t addr, uint8_t *data, size_t len);
+    void (*read_string)(void *arg, uint64_t addr, uint8_t *data, size_t size, size_t count);
+    void (*write_string)(void *arg, uint64_t addr, uint8_t *data, size_t size, size_t count);
+} bus_ops_t;
+
+typedef struct bus_device {
+    uint64_t base;
+    uint64_t len;
+    bus_ops_t ops;
+    void *arg;
+    int flags;
+    pthread_mutex_t mu;
+} bus_device_t;
+
+/**
+ * The bus_table_t is an immutable snapshot of the ranges of a bus, sorted
+ * by base. The bases are kept apart from the devices so that the binary
+ * search touches as few cache lines as possible.
+ */
+typedef struct bus_table {
+    size_t count;
+    uint64_t *bases;
+    bus_device_t **devices;
+    // The previous table, freed with the bus.
+    struct bus_table *retired;
+} bus_table_t;
+
+/**
+ * The bus_cache_t remembers the device of the last access of a vCPU. Each
+ * vCPU has its own, so that hot registers, e.g. a queue notify register, are
+ * dispatched without a search. It also counts the accesses of its vCPU, so
+ * that no cache line is shared between vCPUs on the dispatch path.
+ */
+typedef struct bus_cache {
+    const bus_table_t *table;
+    const bus_device_t *device;
+
+    // Counters exported through metrics_t, with those of the bus.
+    struct {
+        _Atomic uint64_t dispatches;
+        _Atomic uint64_t cache_hits;
+    } stats;
+} bus_cache_t;
+
+/**
+ * The bus_t is an address space, PIO or MMIO, dispatching accesses to the
+ * devices registered for [base, base + len) ranges in O(log n).
+ *
+ * Dispatching is lock-free: registering a range publishes a new table and
+ * keeps the old one alive until bus_deinit, since registrations are rare
+ * and happen mostly before the vCPUs start.
+ */
+typedef struct bus {
+    pthread_mutex_t mu;
+    _Atomic(bus_table_t*) table;
+
+    // Counters exported through metrics_t. Accesses with a cache are
+    // counted in it instead.
+    struct {
+        _Atomic uint64_t dispatches;
+        _Atomic uint64_t unhandled;
+    } stats;
+} bus_t;
+
+/**
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int bus_init(bus_t *bus);
+
+void bus_deinit(bus_t *bus);
+
+/**
+ * bus_register registers the handlers `ops` for the `len` bytes at `base`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ *
+ * \exception EEXIST - The range overlaps a registered range.
+ */
+int bus_register(bus_t *bus, uint64_t base, uint64_t len, const bus_ops_t *ops, void *arg, int flags);
+
+/**
+ * bus_dispatch calls the handler of the range containing `addr`. A read of
+ * an address without a range returns all ones, like an open bus.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ *
+ * \exception ENOENT - No range contains `addr`.
+ */
+int bus_dispatch(bus_t *bus, bus_cache_t *cache, uint64_t addr, int is_write, uint8_t *data, size_t len);
+
+/**
+ * bus_dispatch_string is bus_dispatch for `count` accesses of `size` bytes
+ * to `addr` at once, e.g. a string port IO exit. The range is looked up and,
+ * unless lockless, locked only once.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ *
+ * \exception ENOENT - No range contains `addr`.
+ */
+int bus_dispatch_string(bus_t *bus, bus_cache_t *cache, uint64_t addr, int is_write, uint8_t *data,
+                        size_t size, size_t count);
+
+int bus_register_metrics(bus_t *bus, metrics_t *m, const char *labels);
+
+/**
+ * bus_cache_register_metrics registers the counters of `cache`, which are
+ * added up with those of its bus registered with the same `labels`.
+ */
+int bus_cache_register_metrics(bus_cache_t *cache, metrics_t *m, const char *labels);
+
+#endif /* BUS_H */
@@ -0,0 +1,82 @@
+#ifndef COALESCED_H
+#define COALESCED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <linux/kvm.h>
+
+#include <metrics.h>
+
+/**
+ * coalesced_handler_t is called for every write drained from the coalesced
+ * ring, in the order the guest performed them.
+ */
+typedef void (*coalesced_handler_t)(void *arg, uint64_t addr, uint8_t *data, uint32_t len, int pio);
+
+/**
+ * The coalesced_t ring buffers guest writes to registers that have no
+ * synchronous side effects. KVM appends such writes to a ring shared with
+ * the vCPU mmap area instead of exiting to userspace, and the VMM applies
+ * them in order before handling the next exit or from a device thread.
+ *
+ * The ring is drained under `mu` so that the vCPU thread and a device thread
+ * may both drain it. Because the vCPU cannot append to the ring while it is
+ * stopped in an exit, draining before dispatching an exit guarantees that
+ * every earlier write has been applied.
+ */
+typedef struct coalesced {
+    pthread_mutex_t mu;
+    int vm_fd;
+    int pio_supported;
+    struct kvm_coalesced_mmio_ring *ring;
+    uint32_t max;
+
+    coalesced_handler_t handler;
+    void *arg;
+
+    // Counters exported through metrics_t.
+    struct {
+        _Atomic uint64_t writes;
+        _Atomic uint64_t drains;
+    } stats;
+} coalesced_t;
+
+/**
+ * coalesced_init initializes the coalesced ring of the VM `vm_fd` using the
+ * ring page in the vCPU mmap area `run`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ *
+ * \exception ENOTSUP - KVM does not support KVM_CAP_COALESCED_MMIO.
+ */
+int coalesced_init(coalesced_t *c, int kvm_fd, int vm_fd, struct kvm_run *run,
+                   coalesced_handler_t handler, void *arg);
+
+void coalesced_deinit(coalesced_t *c);
+
+/**
+ * coalesced_add_mmio coalesces writes to the MMIO range [addr, addr + len).
+ */
+int coalesced_add_mmio(coalesced_t *c, uint64_t addr, uint32_t len);
+
+/**
+ * coalesced_add_pio coalesces writes to the IO port range [port, port + len).
+ *
+ * \exception ENOTSUP - KVM does not support KVM_CAP_COALESCED_PIO.
+ */
+int coalesced_add_pio(coalesced_t *c, uint16_t port, uint32_t len);
+
+/**
+ * coalesced_drain applies all pending writes in the ring.
+ *
+ * \return The number of writes applied.
+ */
+size_t coalesced_drain(coalesced_t *c);
+
+int coalesced_register_metrics(coalesced_t *c, metrics_t *m, const char *labels);
+
+#endif /* COALESCED_H */
@@ -0,0 +1,144 @@
+#ifndef COW_H
+#define COW_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <metrics.h>
+
+#define COW_MAGIC       "TOMUCOW1"
+#define COW_VERSION     1
+#define COW_HEADER_SIZE 4096
+#define COW_BASE_PATH_MAX 1024
+
+#define COW_DEFAULT_CLUSTER_SIZE (64 * 1024)
+#define COW_MIN_CLUSTER_BITS 12
+#define COW_MAX_CLUSTER_BITS 21
+
+// The maximum number of clusters copied from the base by one cow_map call,
+// which runs synchronously on the calling queue's thread.
+#define COW_ALLOC_MAX 32
+
+// Table entries are persisted in blocks of this size, the largest logical
+// block size an O_DIRECT write may require.
+#define COW_TABLE_BLOCK_SIZE 4096
+
+/**
+ * The cow_header_t is stored at offset 0 of an overlay file. The mapping
+ * table follows at `table_offset` with one little-endian entry per cluster
+ * of the virtual disk: the overlay offset of the cluster, or 0 if the
+ * cluster is still read from the base image. Data clusters are appended
+ * after the table, aligned to the cluster size.
+ *
+ * A relative `base_path` is resolved against the directory of the overlay.
+ */
+typedef struct cow_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t cluster_bits;
+    // The virtual size of the disk in bytes.
+    uint64_t size;
+    uint64_t table_offset;
+    uint64_t table_entries;
+    char base_path[COW_BASE_PATH_MAX];
+} cow_header_t;
+
+/**
+ * The cow_extent_t is a range of the virtual disk stored contiguously at
+ * `offset` of `fd`. An `fd` of -1 reads as zeros.
+ */
+typedef struct cow_extent {
+    int fd;
+    uint64_t offset;
+    uint64_t len;
+} cow_extent_t;
+
+typedef enum cow_map_mode {
+    COW_MAP_READ,
+    // Copy the clusters of the extent into the overlay.
+    COW_MAP_WRITE,
+    // Like COW_MAP_WRITE, but clusters entirely covered by the range are
+    // allocated as zeros instead of being copied.
+    COW_MAP_ZERO,
+} cow_map_mode_t;
+
+/**
+ * The cow_t is a copy-on-write overlay: a per-VM delta file layered on a
+ * shared read-only base image. Clusters are copied from the base into the
+ * overlay on their first write, and the mapping table is kept in memory.
+ *
+ * Allocation is ordered so that a crash never exposes a mapped cluster
+ * without its data: the copied clusters are made durable before the table
+ * entries pointing at them are written. The table itself is made durable
+ * by the next flush of the overlay.
+ */
+typedef struct cow {
+    int fd;
+    int base_fd;
+    uint64_t base_size;
+    uint32_t cluster_bits;
+    uint64_t size;
+
+    uint64_t table_offset;
+    // Table entries in their on-disk (little-endian) form.
+    uint64_t *table;
+    size_t table_entries;
+    // The overlay offset of the next allocated cluster.
+    uint64_t next_cluster;
+    // A cluster-sized bounce buffer for copying clusters from the base.
+    void *buf;
+
+    // Serializes table lookups with allocation, which may be requested by
+    // any bdev queue.
+    pthread_mutex_t mu;
+
+    // Counters exported through metrics_t.
+    struct {
+        _Atomic uint64_t allocated;
+        _Atomic uint64_t base_reads;
+    } stats;
+} cow_t;
+
+/**
+ * cow_create creates an overlay at `path` over `base_path` with a virtual
+ * size of `size` bytes, or the size of the base if `size` is 0.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int cow_create(const char *path, const char *base_path, uint64_t size, uint32_t cluster_size);
+
+/**
+ * cow_probe returns 1 if the file open at `fd` is an overlay, 0 if it is
+ * not and -1 on error.
+ */
+int cow_probe(int fd);
+
+/**
+ * cow_open reads the header and mapping table of the overlay `path` open at
+ * `fd` and opens its base image. `fd` remains owned by the caller.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int cow_open(cow_t *cow, const char *path, int fd);
+
+void cow_close(cow_t *cow);
+
+/**
+ * cow_map maps the longest contiguous extent at the start of the `len` bytes
+ * at `offset`. Unless `mode` is COW_MAP_READ, clusters still read from the
+ * base are first allocated in the overlay so that the extent can be
+ * written. At most COW_ALLOC_MAX clusters are allocated per call, so the
+ * extent may be shorter than `len`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int cow_map(cow_t *cow, uint64_t offset, uint64_t len, cow_map_mode_t mode, cow_extent_t *extent);
+
+int cow_register_metrics(cow_t *cow, metrics_t *m, const char *labels);
+
+#endif /* COW_H */
@@ -0,0 +1,57 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <linux/kvm.h>
+
+// The initial number of CPUID entries asked from KVM, doubled until
+// KVM_GET_SUPPORTED_CPUID stops failing with E2BIG.
+#define CPU_CPUID_INITIAL_ENTRIES 64
+#define CPU_CPUID_MAX_ENTRIES 4096
+
+#define CPUID_EAX 0
+#define CPUID_EBX 1
+#define CPUID_ECX 2
+#define CPUID_EDX 3
+
+/**
+ * The cpu_model_t is the CPU presented to the guest: the host features KVM
+ * can virtualize, the KVM paravirtual features the VMM supports, and the
+ * MSRs each vCPU starts with. It is built once per VM and applied to each
+ * vCPU before it first runs.
+ */
+typedef struct cpu_model {
+    struct kvm_cpuid2 *cpuid;
+    // Whether KVM emulates the TSC-deadline mode of the local APIC timer.
+    int tsc_deadline;
+} cpu_model_t;
+
+/**
+ * cpu_model_init builds the CPU model from the CPUID leaves KVM supports on
+ * this host, queried through `kvm_fd`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int cpu_model_init(cpu_model_t *model, int kvm_fd);
+
+void cpu_model_deinit(cpu_model_t *model);
+
+/**
+ * cpu_model_apply sets the CPUID leaves of `model`, with the APIC ID set to
+ * `vcpu_id`, and the initial MSRs of the vCPU open at `vcpu_fd`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int cpu_model_apply(cpu_model_t *model, int vcpu_fd, uint32_t vcpu_id);
+
+/**
+ * cpu_model_has returns 1 if the leaf `function`, subleaf `index`, of
+ * `model` has bit `bit` of register `reg` (CPUID_EAX to CPUID_EDX) set.
+ */
+int cpu_model_has(const cpu_model_t *model, uint32_t function, uint32_t index, int reg, int bit);
+
+#endif /* CPU_H */
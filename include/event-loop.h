@@ -0,0 +1,137 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <metrics.h>
+
+typedef void (*event_cb_t)(void *arg, uint32_t events);
+typedef void (*event_defer_cb_t)(void *arg);
+
+typedef struct event_source {
+    struct event_loop *loop;
+    int fd;
+    // Timer sources own their timerfd and read its expiration count before
+    // calling `cb`.
+    int is_timer;
+    event_cb_t cb;
+    void *arg;
+    struct event_source *next;
+} event_source_t;
+
+typedef struct event_deferred {
+    event_defer_cb_t cb;
+    void *arg;
+} event_deferred_t;
+
+/**
+ * The event_loop_t multiplexes device work on one thread. Devices register
+ * fds and timers, whose callbacks run on the thread that calls
+ * event_loop_run, and any thread may queue a deferred callback to run on the
+ * loop thread with event_loop_defer.
+ *
+ * Sources may be added from any thread, but must only be removed on the
+ * loop thread or while the loop is not running. A source removed from
+ * within a callback is freed at the end of the current iteration, so
+ * pending events for it are dropped.
+ */
+typedef struct event_loop {
+    int epollfd;
+    // Signaled by event_loop_defer and event_loop_stop.
+    int eventfd;
+    _Atomic int stop;
+
+    // Called after every wakeup before any callback is dispatched.
+    event_defer_cb_t pre_dispatch;
+    void *pre_dispatch_arg;
+
+    pthread_mutex_t mu;
+    event_source_t *sources;
+    event_source_t *removed;
+    event_deferred_t *deferred;
+    size_t deferred_len;
+    size_t deferred_cap;
+
+    // Counters exported through metrics_t.
+    struct {
+        _Atomic uint64_t iterations;
+        _Atomic uint64_t events;
+        _Atomic uint64_t deferred;
+    } stats;
+} event_loop_t;
+
+int event_loop_init(event_loop_t *loop);
+
+/**
+ * event_loop_deinit closes every timer source and frees every source of
+ * `loop`. Fds added with event_loop_add_fd remain owned by the caller.
+ */
+void event_loop_deinit(event_loop_t *loop);
+
+/**
+ * event_loop_add_fd calls `cb` on the loop thread with the ready epoll
+ * events whenever `fd` is ready for `events`. Sources are level-triggered.
+ *
+ * \return On success, the source is returned. On error, NULL is returned
+ *         and errno is set to indicate the error.
+ */
+event_source_t* event_loop_add_fd(event_loop_t *loop, int fd, uint32_t events, event_cb_t cb, void *arg);
+
+/**
+ * event_loop_add_timer calls `cb` on the loop thread every `interval_ms`
+ * milliseconds.
+ *
+ * \return On success, the source is returned. On error, NULL is returned
+ *         and errno is set to indicate the error.
+ */
+event_source_t* event_loop_add_timer(event_loop_t *loop, unsigned interval_ms, event_cb_t cb, void *arg);
+
+/**
+ * event_loop_mod changes the events `source` is registered for.
+ */
+int event_loop_mod(event_loop_t *loop, event_source_t *source, uint32_t events);
+
+void event_loop_remove(event_loop_t *loop, event_source_t *source);
+
+/**
+ * event_loop_set_pre_dispatch makes `loop` call `cb` after every wakeup
+ * before dispatching any callback, e.g. to apply state that events may
+ * depend on. Must be called before the loop runs.
+ */
+void event_loop_set_pre_dispatch(event_loop_t *loop, event_defer_cb_t cb, void *arg);
+
+/**
+ * event_loop_defer queues `cb` to run once on the loop thread. It is safe
+ * to call from any thread.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int event_loop_defer(event_loop_t *loop, event_defer_cb_t cb, void *arg);
+
+/**
+ * event_loop_run_once waits up to `timeout_ms` milliseconds (-1 to wait
+ * indefinitely) for events and dispatches them and any deferred callbacks.
+ *
+ * \return On success, the number of callbacks dispatched is returned. On
+ *         error, -1 is returned and errno is set to indicate the error.
+ */
+int event_loop_run_once(event_loop_t *loop, int timeout_ms);
+
+/**
+ * event_loop_run dispatches events until event_loop_stop is called.
+ */
+int event_loop_run(event_loop_t *loop);
+
+/**
+ * event_loop_stop makes event_loop_run return. It is safe to call from any
+ * thread.
+ */
+void event_loop_stop(event_loop_t *loop);
+
+int event_loop_register_metrics(event_loop_t *loop, metrics_t *m, const char *labels);
+
+#endif /* EVENT_LOOP_H */
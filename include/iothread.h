@@ -0,0 +1,86 @@
+#ifndef IOTHREAD_H
+#define IOTHREAD_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include <event-loop.h>
+#include <metrics.h>
+
+/**
+ * The iothread_t runs an event_loop_t on a dedicated thread, optionally
+ * pinned to one host CPU.
+ */
+typedef struct iothread {
+    event_loop_t loop;
+    pthread_t thread;
+    int cpu;
+    int running;
+} iothread_t;
+
+/**
+ * The iothread_pool_t owns a set of iothreads. Device queues are assigned
+ * to iothreads with iothread_pool_loop, so a deployment either
+ * consolidates device work on a few cores or spreads it across many by
+ * changing the pool size and affinity.
+ */
+typedef struct iothread_pool {
+    iothread_t *threads;
+    size_t count;
+} iothread_pool_t;
+
+/**
+ * iothread_init initializes the event loop of `t`. Sources may be added to
+ * the loop before the thread is started with iothread_start.
+ *
+ * \param t the iothread.
+ * \param cpu the host CPU to pin the thread to, or -1.
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int iothread_init(iothread_t *t, int cpu);
+
+/**
+ * iothread_deinit stops the thread of `t` if it is running and
+ * deinitializes its event loop.
+ */
+void iothread_deinit(iothread_t *t);
+
+/**
+ * iothread_start starts a thread running the event loop of `t`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int iothread_start(iothread_t *t);
+
+/**
+ * iothread_stop stops and joins the thread of `t`. The event loop remains
+ * valid, so sources may be removed from it until it is deinitialized.
+ */
+void iothread_stop(iothread_t *t);
+
+/**
+ * iothread_pool_init initializes `count` iothreads. Iothread `i` is pinned
+ * to `cpus[i % cpu_count]` unless `cpu_count` is 0.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int iothread_pool_init(iothread_pool_t *pool, size_t count, const int *cpus, size_t cpu_count);
+
+void iothread_pool_deinit(iothread_pool_t *pool);
+
+int iothread_pool_start(iothread_pool_t *pool);
+
+void iothread_pool_stop(iothread_pool_t *pool);
+
+/**
+ * iothread_pool_loop returns the event loop that device queue `index` is
+ * assigned to. Queues are assigned round-robin.
+ */
+event_loop_t* iothread_pool_loop(iothread_pool_t *pool, size_t index);
+
+int iothread_pool_register_metrics(iothread_pool_t *pool, metrics_t *m, const char *labels);
+
+#endif /* IOTHREAD_H */
@@ -0,0 +1,64 @@
+#ifndef IRQMOD_H
+#define IRQMOD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// The period over which the completion rate of an adaptive irqmod_t is
+// measured.
+#define IRQMOD_WINDOW_NS 1000000
+// Below IRQMOD_RATE_LOW completions per second an adaptive irqmod_t signals
+// every completion at once, since the guest is latency-bound. From
+// IRQMOD_RATE_HIGH on it coalesces up to the configured limits, and scales
+// linearly in between.
+#define IRQMOD_RATE_LOW 10000
+#define IRQMOD_RATE_HIGH 200000
+
+/**
+ * The irqmod_config_t configures the interrupt moderation of a queue: the
+ * driver is interrupted once `frames` completions are pending or `usecs`
+ * microseconds after the first of them, whichever comes first. A zero
+ * `usecs` disables moderation, and a zero `frames` leaves only the delay.
+ */
+typedef struct irqmod_config {
+    uint32_t usecs;
+    uint32_t frames;
+    // Whether the limits are scaled to the observed completion rate.
+    int adaptive;
+} irqmod_config_t;
+
+/**
+ * The irqmod_t is the moderation policy of a queue. It is updated by a
+ * single thread at a time; the current limits may be read concurrently.
+ */
+typedef struct irqmod {
+    irqmod_config_t config;
+
+    // The current limits, exported as gauges.
+    _Atomic uint64_t usecs;
+    _Atomic uint64_t frames;
+
+    // The completions since window_start_ns.
+    uint64_t window_start_ns;
+    uint64_t window_completions;
+} irqmod_t;
+
+/**
+ * irqmod_config_parse parses a spec of comma-separated `usecs=N` and
+ * `frames=N` pairs and an optional `adaptive` flag into `config`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int irqmod_config_parse(irqmod_config_t *config, const char *spec);
+
+void irqmod_init(irqmod_t *mod, const irqmod_config_t *config);
+
+/**
+ * irqmod_sample accounts for `completions` more completions and, once per
+ * IRQMOD_WINDOW_NS, adapts the limits of an adaptive `mod` to their rate.
+ */
+void irqmod_sample(irqmod_t *mod, size_t completions);
+
+#endif /* IRQMOD_H */
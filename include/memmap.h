@@ -0,0 +1,138 @@
+#ifndef MEMMAP_H
+#define MEMMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include <metrics.h>
+
+/**
+ * The mem_slot_t maps the `size` bytes of guest physical memory at `gpa` to
+ * the host mapping at `hva`. If the mapping is shared, `fd` is the file
+ * backing it, with `gpa` at `fd_offset`, so another process can map it too.
+ */
+typedef struct mem_slot {
+    uint64_t gpa;
+    uint64_t size;
+    uint8_t *hva;
+    int fd;
+    uint64_t fd_offset;
+} mem_slot_t;
+
+/**
+ * The mem_table_t is an immutable snapshot of the slots of a mem_map_t,
+ * sorted by gpa. The bases are kept apart from the slots so that the binary
+ * search touches as few cache lines as possible.
+ */
+typedef struct mem_table {
+    size_t count;
+    uint64_t *bases;
+    mem_slot_t *slots;
+} mem_table_t;
+
+/**
+ * The mem_map_t translates guest physical addresses to host virtual
+ * addresses for device emulation, bounds-checking every access.
+ *
+ * Translation is lock-free: changing the slots publishes a new table, and
+ * frees the old one once every thread that may be searching it is done.
+ * Each thread remembers a copy of the slot of its last translation, tagged
+ * with the generation of the table it came from, so that accesses to the
+ * same slot, e.g. a virtqueue and its buffers, skip the search.
+ */
+typedef struct mem_map {
+    pthread_mutex_t mu;
+    _Atomic(mem_table_t*) table;
+    // Unique across all maps, and changed with every table published.
+    _Atomic uint64_t generation;
+
+    // Counters exported through metrics_t.
+    struct {
+        _Atomic uint64_t lookups;
+        _Atomic uint64_t faults;
+    } stats;
+} mem_map_t;
+
+/**
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int mem_map_init(mem_map_t *map);
+
+void mem_map_deinit(mem_map_t *map);
+
+/**
+ * mem_map_add maps the `size` bytes of guest physical memory at `gpa` to
+ * `hva`. The caller keeps `hva` mapped for the lifetime of the map.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ *
+ * \exception EEXIST - The range overlaps a slot.
+ */
+int mem_map_add(mem_map_t *map, uint64_t gpa, uint64_t size, void *hva);
+
+/**
+ * mem_map_add_fd is mem_map_add for a shared mapping of `fd` at
+ * `fd_offset`, e.g. a memfd, which mem_map_slots then reports so that guest
+ * memory can be handed to an out-of-process backend. The caller keeps `fd`
+ * open for the lifetime of the map.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ *
+ * \exception EEXIST - The range overlaps a slot.
+ */
+int mem_map_add_fd(mem_map_t *map, uint64_t gpa, uint64_t size, void *hva, int fd, uint64_t fd_offset);
+
+/**
+ * mem_map_remove removes the slot at `gpa`. Translations already returned
+ * stay valid as long as the caller keeps the host mapping. Like
+ * mem_map_add, it waits for the searches in flight on other threads before
+ * freeing the old table, which takes no longer than a binary search.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ *
+ * \exception ENOENT - No slot starts at `gpa`.
+ */
+int mem_map_remove(mem_map_t *map, uint64_t gpa);
+
+/**
+ * mem_map_translate returns the host address of the `len` bytes at `gpa`,
+ * which must lie within one slot, e.g. a ring or a structure the device
+ * accesses in place.
+ *
+ * \return On success, the host address is returned. On error, NULL is
+ *         returned and errno is set to indicate the error.
+ *
+ * \exception EFAULT - The range is not entirely backed by one slot.
+ */
+void* mem_map_translate(mem_map_t *map, uint64_t gpa, uint64_t len);
+
+/**
+ * mem_map_translate_iov translates the `len` bytes at `gpa` into at most
+ * `iov_len` iovecs, one per slot the range spans.
+ *
+ * \return On success, the number of iovecs is returned. On error, -1 is
+ *         returned and errno is set to indicate the error.
+ *
+ * \exception EFAULT - Part of the range is not backed by a slot.
+ * \exception ENOBUFS - The range spans more than `iov_len` slots.
+ */
+int mem_map_translate_iov(mem_map_t *map, uint64_t gpa, uint64_t len, struct iovec *iov, size_t iov_len);
+
+/**
+ * mem_map_slots copies up to `max` slots of `map`, sorted by gpa, into
+ * `slots`, e.g. to describe guest memory to an in-kernel backend.
+ *
+ * \return The number of slots of `map`, which may exceed `max`.
+ */
+size_t mem_map_slots(mem_map_t *map, mem_slot_t *slots, size_t max);
+
+int mem_map_register_metrics(mem_map_t *map, metrics_t *m, const char *labels);
+
+#endif /* MEMMAP_H */
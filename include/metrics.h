@@ -0,0 +1,146 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+typedef enum metric_type {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+} metric_type_t;
+
+/**
+ * A metric_t is a single VMM-side time series. The value is owned by the
+ * device that registered it and is updated with relaxed atomic increments on
+ * the hot path; the metrics registry only ever loads it.
+ */
+typedef struct metric {
+    char *name;
+    char *help;
+    char *labels;
+    metric_type_t type;
+    _Atomic uint64_t *value;
+} metric_t;
+
+/**
+ * A kvm_stats_t wraps a binary statistics fd returned by KVM_GET_STATS_FD on
+ * either a VM or a vCPU. The header and descriptors are read once when the
+ * source is added; only the data block is re-read on every scrape.
+ */
+typedef struct kvm_stats {
+    int fd;
+    char *prefix;
+    char *labels;
+    uint32_t num_desc;
+    uint32_t desc_size;
+    uint32_t data_offset;
+    uint8_t *desc;
+} kvm_stats_t;
+
+typedef void (*metrics_write_fn_t)(void *arg, FILE *f);
+
+/**
+ * A metrics_writer_t renders data the registry cannot load as single
+ * values, such as histograms, at scrape time. Writers without a `path` are
+ * appended to the exposition; the others serve requests for their path.
+ */
+typedef struct metrics_writer {
+    char *path;
+    metrics_write_fn_t fn;
+    void *arg;
+} metrics_writer_t;
+
+/**
+ * The metrics_t registry merges VMM counters and KVM binary statistics into a
+ * single Prometheus text exposition, optionally served on a unix socket.
+ */
+typedef struct metrics {
+    pthread_mutex_t mu;
+
+    metric_t *metrics;
+    size_t metrics_len;
+    size_t metrics_cap;
+
+    kvm_stats_t *sources;
+    size_t sources_len;
+    size_t sources_cap;
+
+    metrics_writer_t *writers;
+    size_t writers_len;
+    size_t writers_cap;
+
+    int listen_fd;
+    char *path;
+    pthread_t thread;
+} metrics_t;
+
+int metrics_init(metrics_t *m);
+
+void metrics_deinit(metrics_t *m);
+
+/**
+ * metrics_register adds the counter or gauge `value` to the registry `m`.
+ * Series with the same `name` but different `labels` are grouped together
+ * in the exposition, and series with the same `labels` too are added up,
+ * e.g. the per-thread shards of a counter.
+ *
+ * \param m the registry.
+ * \param name the metric name.
+ * \param help the metric description.
+ * \param labels the label set without braces, e.g. `queue="0"`, or NULL.
+ * \param type the metric type.
+ * \param value the metric value.
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int metrics_register(metrics_t *m, const char *name, const char *help, const char *labels,
+                     metric_type_t type, _Atomic uint64_t *value);
+
+/**
+ * metrics_add_kvm_stats adds the KVM binary statistics fd `fd` to the
+ * registry `m`. Ownership of `fd` is transferred to the registry.
+ *
+ * \param m the registry.
+ * \param fd the fd returned by the KVM_GET_STATS_FD ioctl.
+ * \param prefix the metric name prefix, e.g. `kvm_vcpu`.
+ * \param labels the label set without braces, or NULL.
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int metrics_add_kvm_stats(metrics_t *m, int fd, const char *prefix, const char *labels);
+
+/**
+ * metrics_add_writer adds `fn`, which writes its output to the FILE it is
+ * passed, to the registry `m`. If `path` is NULL, `fn` writes Prometheus
+ * text appended to the exposition. Otherwise it serves HTTP requests for
+ * `path` on the socket of metrics_serve.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int metrics_add_writer(metrics_t *m, const char *path, metrics_write_fn_t fn, void *arg);
+
+/**
+ * metrics_write writes the Prometheus text exposition of `m` to `f`.
+ */
+int metrics_write(metrics_t *m, FILE *f);
+
+/**
+ * metrics_serve starts a thread that serves the exposition of `m` to every
+ * client that connects to the unix socket at `path`. Clients that send an
+ * HTTP request receive an HTTP response so the socket can be scraped with
+ * `curl --unix-socket`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int metrics_serve(metrics_t *m, const char *path);
+
+static inline void metric_inc(_Atomic uint64_t *value, uint64_t n) {
+    atomic_fetch_add_explicit(value, n, memory_order_relaxed);
+}
+
+#endif /* METRICS_H */
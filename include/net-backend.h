@@ -0,0 +1,111 @@
+#ifndef NET_BACKEND_H
+#define NET_BACKEND_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <net/if.h>
+
+#define NET_BACKEND_MAX_QUEUES 8
+
+typedef enum net_backend_type {
+    // A tap interface opened with IFF_MULTI_QUEUE, one fd per queue.
+    NET_BACKEND_TAP,
+    // Connected unix SOCK_SEQPACKET sockets, one per queue, each message a
+    // frame. Both ends must use the same number of queues.
+    NET_BACKEND_SEQPACKET,
+} net_backend_type_t;
+
+/**
+ * The net_backend_t carries the frames of a virtio-net device to the host.
+ * Every frame is preceded by a struct virtio_net_hdr_v1, so checksum and
+ * segmentation offloads pass through unchanged: the tap driver consumes and
+ * produces the header itself, and a seqpacket peer is another virtio-net
+ * device.
+ *
+ * Queue `i` of the backend serves queue pair `i` of the device. Sends and
+ * receives never block; the device polls the queue fds instead.
+ */
+typedef struct net_backend {
+    net_backend_type_t type;
+    size_t queue_count;
+    int fds[NET_BACKEND_MAX_QUEUES];
+    // The name of the tap interface.
+    char ifname[IFNAMSIZ];
+    // Whether the device should try to hand the tap queues to vhost-net.
+    int vhost;
+} net_backend_t;
+
+/**
+ * net_backend_open_tap attaches `queue_count` queues to the tap interface
+ * `ifname`, creating it if needed.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int net_backend_open_tap(net_backend_t *backend, const char *ifname, size_t queue_count);
+
+/**
+ * net_backend_open_seqpacket connects `queue_count` times to the unix
+ * SOCK_SEQPACKET socket at `path` or, if `listen` is set, binds it and
+ * waits for the `queue_count` connections of the peer.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int net_backend_open_seqpacket(net_backend_t *backend, const char *path, int listen, size_t queue_count);
+
+/**
+ * net_backend_open_pair creates `queue_count` SOCK_SEQPACKET socket pairs,
+ * giving one end of each to `backend` and the other to `peer_fds`, e.g. for
+ * a host-side stand-in of the peer.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int net_backend_open_pair(net_backend_t *backend, int *peer_fds, size_t queue_count);
+
+/**
+ * net_backend_open_spec opens the backend described by `spec`, one of:
+ * - `tap:<ifname>[,queues=N][,novhost]`
+ * - `seqpacket:<path>[,queues=N][,listen]`
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int net_backend_open_spec(net_backend_t *backend, const char *spec);
+
+void net_backend_close(net_backend_t *backend);
+
+/**
+ * net_backend_set_offload tells the backend which offloads the guest can
+ * receive, as a mask of the VIRTIO_NET_F_GUEST_* features it negotiated,
+ * so that the host does not pass it frames it cannot handle.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int net_backend_set_offload(net_backend_t *backend, uint64_t features);
+
+/**
+ * net_backend_send sends the frame `iov` on queue `queue`.
+ *
+ * \return On success, the number of bytes sent is returned. On error, -1 is
+ *         returned and errno is set to indicate the error.
+ *
+ * \exception EAGAIN - The queue is full, e.g. the peer is behind.
+ */
+ssize_t net_backend_send(net_backend_t *backend, size_t queue, const struct iovec *iov, size_t iovcnt);
+
+/**
+ * net_backend_recv receives the next frame of queue `queue` into `iov`.
+ *
+ * \return On success, the length of the frame is returned. On error, -1 is
+ *         returned and errno is set to indicate the error.
+ *
+ * \exception EAGAIN - No frame is pending.
+ */
+ssize_t net_backend_recv(net_backend_t *backend, size_t queue, struct iovec *iov, size_t iovcnt);
+
+#endif /* NET_BACKEND_H */
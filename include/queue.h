@@ -3,21 +3,96 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdatomic.h>
 
+#include <sys/uio.h>
+
+#define QUEUE_CACHE_LINE 64
+
+/**
+ * The queue_t is a lock-free single-producer single-consumer byte ring. The
+ * capacity is rounded up to a power of two so that positions are computed
+ * with a mask, and `head` and `tail` are free-running indices on separate
+ * cache lines so that the producer and consumer do not false share.
+ *
+ * The producer publishes bytes with a release store of `tail` and the
+ * consumer frees space with a release store of `head`. Each side loads the
+ * other side's index with acquire semantics before touching the data.
+ */
 typedef struct queue {
-    size_t front;
-    size_t rear;
-    size_t size;
-    size_t capacity;
+    // Written by the consumer.
+    _Alignas(QUEUE_CACHE_LINE) _Atomic size_t head;
+
+    // Written by the producer.
+    _Alignas(QUEUE_CACHE_LINE) _Atomic size_t tail;
+
+    // Immutable after queue_init.
+    _Alignas(QUEUE_CACHE_LINE) size_t capacity;
+    size_t mask;
     uint8_t *data;
 } queue_t;
 
 int queue_init(queue_t *q, size_t capacity);
 void queue_deinit(queue_t *q);
+
+/**
+ * queue_push_bulk copies up to `count` bytes from `buf` into the queue `q`
+ * with at most two memcpy calls. Must only be called by the producer.
+ *
+ * \return The number of bytes pushed, which is less than `count` if the
+ *         queue has insufficient space.
+ */
+size_t queue_push_bulk(queue_t *q, const uint8_t *buf, size_t count);
+
+/**
+ * queue_pop_bulk copies up to `count` bytes from the queue `q` into `buf`
+ * with at most two memcpy calls. Must only be called by the consumer.
+ *
+ * \return The number of bytes popped, which is less than `count` if the
+ *         queue has insufficient data.
+ */
+size_t queue_pop_bulk(queue_t *q, uint8_t *buf, size_t count);
+
+/**
+ * queue_peek fills `iov` with up to two contiguous regions covering all the
+ * bytes currently in the queue `q` without consuming them. The bytes are
+ * consumed with queue_discard. Must only be called by the consumer.
+ *
+ * \return The number of iovecs filled, 0 if the queue is empty.
+ */
+int queue_peek(queue_t *q, struct iovec iov[2]);
+
+/**
+ * queue_discard consumes `count` bytes from the queue `q`, which must not
+ * exceed the number of bytes last returned by queue_peek. Must only be
+ * called by the consumer.
+ */
+void queue_discard(queue_t *q, size_t count);
+
 int queue_push(queue_t *q, uint8_t b);
 int queue_pop(queue_t *q, uint8_t *b);
 size_t queue_size(queue_t *q);
 size_t queue_capacity(queue_t *q);
+
+/**
+ * queue_clear discards all bytes in the queue. Must only be called by the
+ * consumer, a producer that needs the queue cleared records queue_tail and
+ * has the consumer call queue_discard_until.
+ */
 void queue_clear(queue_t *q);
 
+/**
+ * queue_tail returns the free-running position past the last byte pushed to
+ * the queue `q`. Must only be called by the producer.
+ */
+size_t queue_tail(queue_t *q);
+
+/**
+ * queue_discard_until consumes the bytes of the queue `q` before the
+ * position `tail`, previously returned by queue_tail. Bytes pushed after it
+ * are kept, and nothing is consumed if they already were. Must only be
+ * called by the consumer.
+ */
+void queue_discard_until(queue_t *q, size_t tail);
+
 #endif /* BYTE_QUEUE_H */
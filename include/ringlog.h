@@ -0,0 +1,105 @@
+#ifndef RINGLOG_H
+#define RINGLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define RINGLOG_MAGIC       "RINGLOG1"
+#define RINGLOG_VERSION     1
+#define RINGLOG_HEADER_SIZE 4096
+#define RINGLOG_DEFAULT_SIZE (1ULL << 20)
+
+#define RINGLOG_TIMESTAMPS  (1 << 0)
+
+// Set in the header of a file that has been rotated away. Readers holding
+// the old mapping should reopen `path`.
+#define RINGLOG_F_ROTATED   (1 << 0)
+
+/**
+ * The ringlog_header_t is stored at offset 0 of the log file and the log
+ * data follows at offset RINGLOG_HEADER_SIZE. `write_offset` is a
+ * free-running byte count; the byte at offset `o` is stored at data
+ * position `o % data_size`, so the valid window of the log is
+ * [max(0, write_offset - data_size), write_offset).
+ *
+ * A reader that maps the file tails it without syscalls:
+ * 1. Load `write_offset` with acquire semantics.
+ * 2. Copy the bytes in [start, write_offset) out of the data area.
+ * 3. Issue an acquire fence and load `write_begin`. If
+ *    `write_begin - data_size > start`, the writer may have overwritten the
+ *    oldest copied bytes and the reader must skip ahead.
+ */
+typedef struct ringlog_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t data_size;
+    _Atomic uint64_t flags;
+    // The offset up to which bytes may have been modified.
+    _Atomic uint64_t write_begin;
+    // The offset up to which bytes have been written.
+    _Atomic uint64_t write_offset;
+} ringlog_header_t;
+
+/**
+ * The ringlog_t appends bytes into a memory-mapped circular log file. When
+ * `rotate` is non-zero, a full log is renamed to `path.1` (shifting older
+ * logs up to `path.<rotate>`) and a fresh log is started instead of
+ * overwriting the oldest bytes.
+ *
+ * A ringlog_t must only be written by one thread at a time.
+ */
+typedef struct ringlog {
+    char *path;
+    int fd;
+    ringlog_header_t *header;
+    uint8_t *data;
+    size_t data_size;
+    unsigned rotate;
+    int flags;
+    int line_start;
+} ringlog_t;
+
+/**
+ * Open the log file at `path` with `size` bytes of log data, creating it if
+ * necessary. An existing log with the same size is appended to, otherwise it
+ * is reinitialized.
+ *
+ * \param log the log.
+ * \param path the log file path.
+ * \param size the number of log data bytes.
+ * \param rotate the number of rotated logs to keep, or 0 to overwrite.
+ * \param flags RINGLOG_TIMESTAMPS to prefix each line with a UTC timestamp.
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int ringlog_init(ringlog_t *log, const char *path, size_t size, unsigned rotate, int flags);
+
+/**
+ * Open the log described by `spec`, which has the form
+ * `<path>[,size=<bytes>][,rotate=<count>][,timestamps]`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ *
+ * \exception EINVAL - The spec is malformed.
+ */
+int ringlog_init_spec(ringlog_t *log, const char *spec);
+
+void ringlog_deinit(ringlog_t *log);
+
+/**
+ * Append the `iovcnt` buffers in `iov` to the log.
+ *
+ * \return On success, the number of bytes consumed from `iov` is returned,
+ *         which is less than the total only if a rotation failed after
+ *         some bytes were appended. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+ssize_t ringlog_writev(ringlog_t *log, const struct iovec *iov, int iovcnt);
+
+#endif /* RINGLOG_H */
@@ -3,11 +3,19 @@
 
 #include <stdint.h>
 #include <pthread.h>
+#include <stdatomic.h>
+
+#include <sys/uio.h>
 
 #include <queue.h>
 #include <irq.h>
+#include <metrics.h>
 
 #define SERIAL_FIFO_LEN 16
+#define SERIAL_IO_ADDR 0x3f8
+
+// The default size of the host-side tx buffer behind the 16550A FIFO.
+#define SERIAL_TX_BUFFER_LEN (64 * 1024)
 
 /**
  * The serial_t device emulates a 16550A UART device. This is a commonly used
@@ -35,10 +43,26 @@ typedef struct serial {
     irq_arg_t irq_arg;
     int irq_state;
 
-    // Writes to THR UART register push to FIFO queue.
+    // Writes to THR UART register push to FIFO queue. The vCPU is the
+    // producer and the serial_read caller is the lock-free consumer.
     queue_t tx_queue;
 
-    // Reads from RBR UART register pop from FIFO queue.
+    // Set by the consumer once it has drained the tx queue, cleared by the
+    // producer when it signals the eventfd. The eventfd is therefore only
+    // signaled on the empty to non-empty transition.
+    _Atomic int tx_armed;
+
+    // Set while the guest sees a full transmitter.
+    _Atomic int tx_blocked;
+
+    // A FIFO reset by the guest is only recorded by the producer, the
+    // consumer discards the tx queue up to `tx_clear_tail` once it sees
+    // `tx_clear` set, since only the consumer may move the head.
+    _Atomic int tx_clear;
+    _Atomic size_t tx_clear_tail;
+
+    // Reads from RBR UART register pop from FIFO queue. The vCPU is the
+    // consumer, producers (serial_write and loopback) hold `mu`.
     queue_t rx_queue;
 
     // UART registers.
@@ -54,11 +78,24 @@ typedef struct serial {
         uint8_t	msr;
         uint8_t scr;
     } regs;
+
+    // Counters exported through metrics_t.
+    struct {
+        _Atomic uint64_t tx_bytes;
+        _Atomic uint64_t rx_bytes;
+        _Atomic uint64_t pio_exits;
+    } stats;
 } serial_t;
 
 extern serial_t serial_16550a;
 
-int serial_init(serial_t *dev, irq_line_func irq_line, irq_arg_t irq_arg);
+/**
+ * serial_init initializes the serial device `dev` with a host-side tx buffer
+ * of `tx_buffer_len` bytes behind the 16-byte hardware FIFO. The guest only
+ * sees a full transmitter once the host buffer is nearly full, so a larger
+ * buffer lets the guest stream output without waiting on the console thread.
+ */
+int serial_init(serial_t *dev, size_t tx_buffer_len, irq_line_func irq_line, irq_arg_t irq_arg);
 
 void serial_deinit(serial_t *dev);
 
@@ -66,6 +103,11 @@ int serial_open(serial_t *dev);
 
 int serial_close(serial_t *dev, int fd);
 
+/**
+ * serial_register_metrics registers the counters of `dev` with `m`.
+ */
+int serial_register_metrics(serial_t *dev, metrics_t *m, const char *labels);
+
 /**
  * serial_read reads up to `count` bytes from the tx queue of the serial
  * device `dev` into `buf`. The number of bytes read may be less than `count`
@@ -77,10 +119,34 @@ int serial_close(serial_t *dev, int fd);
  * \return On success, the number of bytes read is returned. On error, -1
  *         is returned and errno is set to indicate the error.
  *
+ * The eventfd returned by serial_open is only signaled when the tx queue
+ * becomes non-empty, so the caller must read until EAGAIN before waiting on
+ * the eventfd again.
+ *
  * \exception EGAIN - The read would block.
  */
 int serial_read(serial_t *dev, uint8_t *buf, size_t count);
 
+/**
+ * serial_peek fills `iov` with the pending bytes of the tx queue of the
+ * serial device `dev` without consuming them, so that they can be written
+ * to a host fd with a single writev. Like serial_read, it must be called
+ * until it fails with EAGAIN before waiting on the eventfd again.
+ *
+ * \param dev the serial device.
+ * \param iov the iovecs.
+ * \return On success, the number of iovecs filled is returned. On error, -1
+ *         is returned and errno is set to indicate the error.
+ *
+ * \exception EGAIN - The read would block.
+ */
+int serial_peek(serial_t *dev, struct iovec iov[2]);
+
+/**
+ * serial_consume consumes `count` bytes previously returned by serial_peek.
+ */
+void serial_consume(serial_t *dev, size_t count);
+
 /**
  * serial_write writes up to `count` bytes from `buf` to the rx queue of the 
  * serial device `dev`. The number of bytes written may be less than `count`
@@ -97,12 +163,15 @@ int serial_read(serial_t *dev, uint8_t *buf, size_t count);
 int serial_write(serial_t *dev, uint8_t *buf, size_t count);
 
 /**
- * serial_write reads `count` bytes from the IO `port` to `buf`.
+ * serial_in performs `count` consecutive byte reads of the IO `port` to
+ * `buf`, e.g. for a `rep insb`, under a single lock acquisition.
  */
 void serial_in(serial_t *dev, uint16_t port, uint8_t *buf, size_t count);
 
 /**
- * serial_write writes `count` bytes from `buf` to the IO `port`.
+ * serial_out performs `count` consecutive byte writes of `buf` to the IO
+ * `port`, e.g. for a `rep outsb`, under a single lock acquisition. Writes to
+ * THR are pushed to the tx buffer in one batch.
  */
 void serial_out(serial_t *dev, uint16_t port, uint8_t *buf, size_t count);
 
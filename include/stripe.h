@@ -0,0 +1,86 @@
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define STRIPE_MAX_MEMBERS 16
+
+#define STRIPE_DEFAULT_CHUNK_SIZE (128 * 1024)
+#define STRIPE_MIN_CHUNK_BITS 12
+#define STRIPE_MAX_CHUNK_BITS 24
+
+// Members of a concatenation are used in multiples of this size.
+#define STRIPE_SECTOR_SIZE 512
+
+typedef enum stripe_mode {
+    // RAID-0: chunks are distributed round-robin across the members.
+    STRIPE_MODE_STRIPE,
+    // The members are laid out one after the other.
+    STRIPE_MODE_CONCAT,
+} stripe_mode_t;
+
+typedef struct stripe_member {
+    int fd;
+    // The bytes of the member used by the device.
+    uint64_t size;
+    // The offset of the member in a concatenation.
+    uint64_t start;
+} stripe_member_t;
+
+/**
+ * The stripe_extent_t is a range of the device stored contiguously at
+ * `offset` of the member open at `fd`.
+ */
+typedef struct stripe_extent {
+    int fd;
+    uint64_t offset;
+    uint64_t len;
+} stripe_extent_t;
+
+/**
+ * The stripe_t composes one device from several files or block devices,
+ * either striped in chunks of 1 << `chunk_bits` bytes or concatenated. Its
+ * layout is immutable once opened, so it is shared by all queues without
+ * locking.
+ */
+typedef struct stripe {
+    stripe_mode_t mode;
+    uint32_t chunk_bits;
+    stripe_member_t members[STRIPE_MAX_MEMBERS];
+    size_t member_count;
+    // The size of the device in bytes.
+    uint64_t size;
+} stripe_t;
+
+/**
+ * stripe_is_spec returns 1 if `path` is a spec for stripe_open_spec.
+ */
+int stripe_is_spec(const char *path);
+
+/**
+ * stripe_open_spec opens the members of a spec of the form
+ * `stripe:path,path...[,chunk=size]` or `concat:path,path...`, where `size`
+ * may have a K or M suffix. The members are opened with `flags`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int stripe_open_spec(stripe_t *stripe, const char *spec, int flags);
+
+void stripe_close(stripe_t *stripe);
+
+/**
+ * stripe_map maps the longest contiguous extent at the start of the `len`
+ * bytes at `offset`, which ends at the latest at the end of a chunk or
+ * member.
+ */
+void stripe_map(const stripe_t *stripe, uint64_t offset, uint64_t len, stripe_extent_t *extent);
+
+/**
+ * stripe_max_extents returns an upper bound of the extents the `len` bytes
+ * at `offset` are mapped to.
+ */
+size_t stripe_max_extents(const stripe_t *stripe, uint64_t offset, uint64_t len);
+
+#endif /* STRIPE_H */
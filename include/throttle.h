@@ -0,0 +1,84 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define THROTTLE_DEFAULT_BURST_MS 100
+
+typedef enum throttle_bucket_id {
+    THROTTLE_READ_IOPS,
+    THROTTLE_WRITE_IOPS,
+    THROTTLE_READ_BPS,
+    THROTTLE_WRITE_BPS,
+    THROTTLE_BUCKETS,
+} throttle_bucket_id_t;
+
+/**
+ * The throttle_limits_t holds the rate of each bucket, or 0 for no limit,
+ * and the burst every bucket may accumulate, in milliseconds of its rate.
+ */
+typedef struct throttle_limits {
+    uint64_t rate[THROTTLE_BUCKETS];
+    unsigned burst_ms;
+} throttle_limits_t;
+
+typedef struct throttle_bucket {
+    // Tokens per second, or 0 if the bucket is disabled.
+    double rate;
+    double burst;
+    // May be negative: a request is admitted while every bucket it draws
+    // from is positive, and then charged in full.
+    double tokens;
+} throttle_bucket_t;
+
+/**
+ * The throttle_t limits read and write IOPS and bytes per second with one
+ * token bucket each. It is not thread-safe.
+ */
+typedef struct throttle {
+    throttle_bucket_t buckets[THROTTLE_BUCKETS];
+    uint64_t last_ns;
+} throttle_t;
+
+/**
+ * throttle_limits_parse parses a spec of comma-separated `key=value` pairs
+ * into `limits`. The keys are `read-iops`, `write-iops`, `iops` (both),
+ * `read-bps`, `write-bps`, `bps` (both), where byte rates may have a K, M
+ * or G suffix, and `burst` in milliseconds.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int throttle_limits_parse(throttle_limits_t *limits, const char *spec);
+
+/**
+ * throttle_init initializes `throttle` with a `share` of `limits`, e.g. to
+ * split the limits of a device between its queues. The buckets start full.
+ */
+void throttle_init(throttle_t *throttle, const throttle_limits_t *limits, double share);
+
+uint64_t throttle_now(void);
+
+/**
+ * throttle_admit charges a request of `bytes` if its buckets have tokens.
+ * The buckets are only refilled, which reads the clock, once one of them
+ * runs dry.
+ *
+ * \return 1 if the request was admitted, 0 if it must wait.
+ */
+int throttle_admit(throttle_t *throttle, int write, size_t bytes);
+
+/**
+ * throttle_refund gives back what throttle_admit charged for a request of
+ * `bytes` that was then not submitted, e.g. because the submission failed.
+ */
+void throttle_refund(throttle_t *throttle, int write, size_t bytes);
+
+/**
+ * throttle_delay returns the nanoseconds until throttle_admit may admit a
+ * request of the given direction.
+ */
+uint64_t throttle_delay(throttle_t *throttle, int write, uint64_t now);
+
+#endif /* THROTTLE_H */
@@ -0,0 +1,100 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+// The number of events kept by a trace_t, a power of two.
+#define TRACE_RING_SIZE 1024
+
+// Histograms have 1 << TRACE_HIST_SUB_BITS buckets per power of two, i.e.
+// a relative error below 1 / (1 << TRACE_HIST_SUB_BITS), and record
+// latencies up to 1 << TRACE_HIST_MAX_BITS nanoseconds.
+#define TRACE_HIST_SUB_BITS 4
+#define TRACE_HIST_MAX_BITS 40
+#define TRACE_HIST_BUCKETS ((TRACE_HIST_MAX_BITS - TRACE_HIST_SUB_BITS + 1) << TRACE_HIST_SUB_BITS)
+
+/**
+ * The stages a request goes through, in order. A stage a request skipped,
+ * e.g. the submission of an invalid request, has a timestamp of 0.
+ */
+typedef enum trace_stage {
+    // Popped from the avail ring.
+    TRACE_POP,
+    // Submitted to the backend.
+    TRACE_SUBMIT,
+    // Completion reaped from the backend.
+    TRACE_REAP,
+    // Published in the used ring.
+    TRACE_PUBLISH,
+    // Interrupt injected.
+    TRACE_IRQ,
+    TRACE_STAGES,
+} trace_stage_t;
+
+typedef struct trace_event {
+    uint64_t ts[TRACE_STAGES];
+    uint32_t type;
+    uint32_t len;
+    uint16_t head;
+    uint8_t status;
+} trace_event_t;
+
+/**
+ * The trace_hist_t is a log-linear (HDR-style) histogram of nanoseconds.
+ * It has a single writer and may be read concurrently.
+ */
+typedef struct trace_hist {
+    _Atomic uint64_t counts[TRACE_HIST_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+} trace_hist_t;
+
+/**
+ * The trace_t keeps the last TRACE_RING_SIZE events of a queue in a ring,
+ * and a histogram of each stage: `hists[s]` holds the latency from stage
+ * s - 1 to stage s, and `hists[TRACE_POP]` the latency from the first to
+ * the last stage.
+ *
+ * Events have a single writer at a time. Readers never block it: they copy
+ * the ring and drop the events the writer may have overwritten meanwhile.
+ */
+typedef struct trace {
+    trace_event_t ring[TRACE_RING_SIZE];
+    // The number of events ever recorded.
+    _Atomic uint64_t head;
+    trace_hist_t hists[TRACE_STAGES];
+} trace_t;
+
+void trace_init(trace_t *trace);
+
+uint64_t trace_now(void);
+
+/**
+ * trace_record adds `event` to the ring of `trace` and its latencies to the
+ * histograms.
+ */
+void trace_record(trace_t *trace, const trace_event_t *event);
+
+/**
+ * trace_hist_quantile returns an upper bound of the `q` quantile of `hist`
+ * in nanoseconds, or 0 if it is empty.
+ */
+uint64_t trace_hist_quantile(trace_hist_t *hist, double q);
+
+/**
+ * trace_write_hists writes the histograms of `trace` to `f` as Prometheus
+ * histograms named `name`, in seconds, with a `stage` label besides
+ * `labels`. If `header` is set, the HELP and TYPE lines are written first.
+ */
+void trace_write_hists(trace_t *trace, FILE *f, const char *name, const char *labels, int header);
+
+/**
+ * trace_dump writes the quantiles of each stage of `trace` followed by the
+ * events of its ring, oldest first, as text to `f`.
+ */
+void trace_dump(trace_t *trace, FILE *f);
+
+#endif /* TRACE_H */
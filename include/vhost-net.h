@@ -0,0 +1,66 @@
+#ifndef VHOST_NET_H
+#define VHOST_NET_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <virtio-mmio.h>
+#include <memmap.h>
+#include <net-backend.h>
+
+// The most guest memory slots described to vhost-net, its default
+// max_mem_regions.
+#define VHOST_NET_MAX_REGIONS 64
+
+/**
+ * The vhost_net_t moves the frames of a virtio-net device between its
+ * virtqueues and a tap interface in the kernel, without waking the VMM.
+ * Each queue pair has its own /dev/vhost-net instance and kernel worker.
+ *
+ * The driver's kicks reach vhost through the queues' ioeventfds. vhost
+ * signals used buffers on one call eventfd per queue, which the device
+ * turns into virtio-mmio interrupts, since the interrupt status register
+ * lives in the VMM.
+ */
+typedef struct vhost_net {
+    size_t queue_count;
+    int fds[NET_BACKEND_MAX_QUEUES];
+    // The call eventfds of the receive and transmit queue of each pair.
+    int call_fds[NET_BACKEND_MAX_QUEUES][2];
+    // The virtio features vhost-net supports.
+    uint64_t features;
+    int running[NET_BACKEND_MAX_QUEUES];
+} vhost_net_t;
+
+/**
+ * vhost_net_open opens a vhost-net instance for each of `queue_count`
+ * queue pairs.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ *
+ * \exception ENOENT - The host has no /dev/vhost-net.
+ */
+int vhost_net_open(vhost_net_t *vhost, size_t queue_count);
+
+void vhost_net_close(vhost_net_t *vhost);
+
+/**
+ * vhost_net_start hands the queues `rx` and `tx` of pair `pair`, with the
+ * negotiated `features` and the guest memory `mem`, to vhost-net, which
+ * then serves them from `tap_fd`. Both queues must be attached without an
+ * event loop, so that their kick_fds are free.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int vhost_net_start(vhost_net_t *vhost, size_t pair, uint64_t features, mem_map_t *mem,
+                    virt_queue_t *rx, virt_queue_t *tx, int tap_fd);
+
+/**
+ * vhost_net_stop detaches pair `pair` from its tap queue and stops its
+ * rings, e.g. before the device is reset.
+ */
+void vhost_net_stop(vhost_net_t *vhost, size_t pair);
+
+#endif /* VHOST_NET_H */
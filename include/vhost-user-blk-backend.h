@@ -0,0 +1,111 @@
+#ifndef VHOST_USER_BLK_BACKEND_H
+#define VHOST_USER_BLK_BACKEND_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <virtio-blk.h>
+#include <vhost-user.h>
+#include <memmap.h>
+#include <bdev.h>
+#include <event-loop.h>
+#include <metrics.h>
+
+// vhost_user_blk_backend_init flags.
+// Serve the rings by polling them with vhost_user_blk_backend_poll, and ask
+// the driver not to kick them.
+#define VHOST_USER_BLK_POLL (1 << 0)
+
+// How long stopping the rings waits for the requests in flight.
+#define VHOST_USER_BLK_DRAIN_MS 5000
+
+// A region of guest memory mapped from the front-end.
+typedef struct vhost_user_blk_region {
+    uint64_t gpa;
+    uint64_t size;
+    uint64_t uaddr;
+    void *addr;
+    size_t len;
+} vhost_user_blk_region_t;
+
+/**
+ * The vhost_user_blk_backend_t serves a bdev_t to one front-end at a time,
+ * e.g. a VMM using vhost_user_blk_t, over the vhost-user protocol on a Unix
+ * socket. Many back-ends may share an event loop, so that one process, or
+ * one core, serves the disks of many VMs.
+ *
+ * The requests are processed by a virtio_blk_t, with merging, batching and
+ * barriers as in the VMM, which the back-end drives through its virtio-mmio
+ * registers as a driver would: the front-end's rings, translated through
+ * the guest memory it shares, are programmed into its queues and its kicks
+ * notify them. Its interrupts signal the call eventfds of the front-end.
+ *
+ * When the front-end disconnects, the rings are stopped once the requests
+ * in flight complete and the back-end waits for the next one.
+ */
+typedef struct vhost_user_blk_backend {
+    virtio_blk_t blk;
+    bdev_t *bdev;
+    event_loop_t *loop;
+    int flags;
+    char *path;
+    int listen_fd;
+    event_source_t *listen;
+
+    // The connected front-end, or -1.
+    int sock;
+    event_source_t *conn;
+    uint64_t features;
+    uint64_t protocol_features;
+
+    // The guest memory shared by the front-end, which blk translates
+    // through.
+    mem_map_t mem;
+    vhost_user_blk_region_t regions[VHOST_USER_MAX_REGIONS];
+    size_t region_count;
+
+    // The state of each ring set by the front-end.
+    int kick_fds[VIRTIO_BLK_QUEUE_COUNT];
+    event_source_t *kicks[VIRTIO_BLK_QUEUE_COUNT];
+    int call_fds[VIRTIO_BLK_QUEUE_COUNT];
+    uint16_t bases[VIRTIO_BLK_QUEUE_COUNT];
+    int enabled[VIRTIO_BLK_QUEUE_COUNT];
+
+    // Counters exported through metrics_t.
+    struct {
+        _Atomic uint64_t connections;
+        _Atomic uint64_t messages;
+        _Atomic uint64_t polls;
+    } stats;
+} vhost_user_blk_backend_t;
+
+/**
+ * vhost_user_blk_backend_init serves `bdev`, which must have at least
+ * VIRTIO_BLK_QUEUE_COUNT queues of depth VIRTIO_BLK_QUEUE_DEPTH, on the
+ * Unix socket `path`, replacing a stale socket file, and processes its
+ * requests on `loop`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int vhost_user_blk_backend_init(vhost_user_blk_backend_t *b, const char *path, bdev_t *bdev,
+                                event_loop_t *loop, int flags);
+
+/**
+ * vhost_user_blk_backend_deinit disconnects the front-end and removes the
+ * socket. The event loop must not be running.
+ */
+void vhost_user_blk_backend_deinit(vhost_user_blk_backend_t *b);
+
+/**
+ * vhost_user_blk_backend_poll processes the requests made available on the
+ * rings of a back-end initialized with VHOST_USER_BLK_POLL. It is called on
+ * the thread running the loop, between iterations.
+ *
+ * \return The number of rings that had requests.
+ */
+size_t vhost_user_blk_backend_poll(vhost_user_blk_backend_t *b);
+
+int vhost_user_blk_backend_register_metrics(vhost_user_blk_backend_t *b, metrics_t *m, const char *labels);
+
+#endif /* VHOST_USER_BLK_BACKEND_H */
@@ -0,0 +1,85 @@
+#ifndef VHOST_USER_BLK_H
+#define VHOST_USER_BLK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <linux/virtio_blk.h>
+
+#include <virtio-mmio.h>
+#include <event-loop.h>
+#include <metrics.h>
+
+/**
+ * The vhost_user_blk_t device exposes a virtio-blk device whose virtqueues
+ * are served by another process, the back-end, over the vhost-user
+ * protocol, e.g. bin/vhost-user-blk.
+ *
+ * The back-end maps guest memory from the fds of its memory slots, which
+ * must therefore be shared, and takes the driver's kicks from the queues'
+ * ioeventfds, so requests never reach the VMM. It signals used buffers on
+ * one call eventfd per queue, which the device turns into virtio-mmio
+ * interrupts, since the interrupt status register lives in the VMM.
+ *
+ * The rings are handed to the back-end once the driver sets DRIVER_OK and
+ * taken back on reset. Messages are synchronous, so a back-end that stops
+ * answering stalls the vCPU for up to VHOST_USER_BLK_TIMEOUT_MS.
+ */
+typedef struct vhost_user_blk {
+    virtio_mmio_config_t mmio;
+    struct virtio_blk_config config;
+    // The path of the back-end socket, set by vhost_user_blk_init.
+    char *path;
+    int sock;
+
+    // The virtio features of the back-end, and the protocol features both
+    // sides support.
+    uint64_t features;
+    uint64_t protocol_features;
+    int running;
+
+    // The call eventfd of each queue, and the loop it is relayed on.
+    int call_fds[VIRTIO_QUEUE_MAX];
+    event_loop_t *loops[VIRTIO_QUEUE_MAX];
+    event_source_t *calls[VIRTIO_QUEUE_MAX];
+} vhost_user_blk_t;
+
+// The size of each queue. vhost-user does not negotiate it, and the
+// back-end of tomu serves VIRTIO_BLK_QUEUE_DEPTH descriptors.
+#define VHOST_USER_BLK_QUEUE_NUM 128
+
+// How long a message may wait for the back-end.
+#define VHOST_USER_BLK_TIMEOUT_MS 5000
+
+/**
+ * vhost_user_blk_init connects `blk` to the back-end listening on the Unix
+ * socket `path` and reads the configuration of its disk.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ *
+ * \exception ENOTSUP - The back-end does not expose its configuration.
+ */
+int vhost_user_blk_init(vhost_user_blk_t *blk, uintptr_t base, uint32_t irq, mem_map_t *mem,
+                        irq_line_func irq_line, irq_arg_t irq_arg, const char *path);
+
+void vhost_user_blk_deinit(vhost_user_blk_t *blk);
+
+/**
+ * vhost_user_blk_attach_queue registers the ioeventfd of queue `queue` for
+ * the back-end and relays its interrupts on `loop`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int vhost_user_blk_attach_queue(vhost_user_blk_t *blk, uint32_t queue, int vm_fd, event_loop_t *loop);
+
+/**
+ * vhost_user_blk_detach undoes every vhost_user_blk_attach_queue. The
+ * event loops must not be running.
+ */
+void vhost_user_blk_detach(vhost_user_blk_t *blk);
+
+int vhost_user_blk_register_metrics(vhost_user_blk_t *blk, metrics_t *m, const char *labels);
+
+#endif /* VHOST_USER_BLK_H */
@@ -0,0 +1,124 @@
+#ifndef VHOST_USER_H
+#define VHOST_USER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <linux/vhost_types.h>
+
+// The requests of the vhost-user protocol used by tomu. Each is sent by the
+// front-end, the VMM, to the back-end, the process serving the virtqueues.
+#define VHOST_USER_GET_FEATURES 1
+#define VHOST_USER_SET_FEATURES 2
+#define VHOST_USER_SET_OWNER 3
+#define VHOST_USER_SET_MEM_TABLE 5
+#define VHOST_USER_SET_VRING_NUM 8
+#define VHOST_USER_SET_VRING_ADDR 9
+#define VHOST_USER_SET_VRING_BASE 10
+#define VHOST_USER_GET_VRING_BASE 11
+#define VHOST_USER_SET_VRING_KICK 12
+#define VHOST_USER_SET_VRING_CALL 13
+#define VHOST_USER_GET_PROTOCOL_FEATURES 15
+#define VHOST_USER_SET_PROTOCOL_FEATURES 16
+#define VHOST_USER_GET_QUEUE_NUM 17
+#define VHOST_USER_SET_VRING_ENABLE 18
+#define VHOST_USER_GET_CONFIG 24
+
+// The virtio feature bit announcing protocol features, and the protocol
+// features tomu knows.
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+#define VHOST_USER_PROTOCOL_F_MQ 0
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK 3
+#define VHOST_USER_PROTOCOL_F_CONFIG 9
+
+// Message flags.
+#define VHOST_USER_VERSION 0x1
+#define VHOST_USER_VERSION_MASK 0x3
+#define VHOST_USER_REPLY (1 << 2)
+#define VHOST_USER_NEED_REPLY (1 << 3)
+
+// Set in the payload of SET_VRING_KICK and SET_VRING_CALL when no fd is
+// passed, below the ring index.
+#define VHOST_USER_VRING_INDEX_MASK 0xff
+#define VHOST_USER_VRING_NOFD (1 << 8)
+
+#define VHOST_USER_MAX_REGIONS 8
+#define VHOST_USER_MAX_FDS VHOST_USER_MAX_REGIONS
+#define VHOST_USER_CONFIG_SIZE 256
+
+// The header precedes the payload on the wire without padding.
+#define VHOST_USER_HDR_SIZE 12
+
+typedef struct vhost_user_region {
+    uint64_t gpa;
+    uint64_t size;
+    // The address of the region in the front-end.
+    uint64_t uaddr;
+    // The offset of the region in the fd passed with it.
+    uint64_t mmap_offset;
+} vhost_user_region_t;
+
+typedef struct vhost_user_memory {
+    uint32_t nregions;
+    uint32_t padding;
+    vhost_user_region_t regions[VHOST_USER_MAX_REGIONS];
+} vhost_user_memory_t;
+
+typedef struct vhost_user_config {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[VHOST_USER_CONFIG_SIZE];
+} vhost_user_config_t;
+
+#define VHOST_USER_CONFIG_HDR_SIZE (3 * sizeof(uint32_t))
+
+/**
+ * The vhost_user_msg_t is a message of the vhost-user protocol. `size` is
+ * the number of bytes of `payload` sent.
+ */
+typedef struct vhost_user_msg {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;
+    union {
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        vhost_user_memory_t memory;
+        vhost_user_config_t config;
+    } payload;
+} vhost_user_msg_t;
+
+/**
+ * vhost_user_has_reply returns whether the back-end answers `request` with
+ * a payload, whether or not the front-end asked for a reply.
+ */
+int vhost_user_has_reply(uint32_t request);
+
+/**
+ * vhost_user_send sends `msg` with the `fd_count` fds of `fds` over the
+ * Unix socket `sock`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ *
+ * \exception EINVAL - The payload or the fds do not fit a message.
+ */
+int vhost_user_send(int sock, const vhost_user_msg_t *msg, const int *fds, size_t fd_count);
+
+/**
+ * vhost_user_recv receives the next message of `sock` into `msg`, and the
+ * fds passed with it into `fds`, which holds VHOST_USER_MAX_FDS fds. The
+ * caller owns the fds received.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ *
+ * \exception ECONNRESET - The peer closed the socket.
+ * \exception EPROTO - The message is malformed. Any fds passed with it are
+ *                     closed.
+ */
+int vhost_user_recv(int sock, vhost_user_msg_t *msg, int *fds, size_t *fd_count);
+
+#endif /* VHOST_USER_H */
@@ -0,0 +1,146 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include <linux/virtio_blk.h>
+
+#include <virtio-mmio.h>
+#include <bdev.h>
+#include <metrics.h>
+#include <trace.h>
+
+#define VIRTIO_BLK_QUEUE_COUNT 1
+#define VIRTIO_BLK_QUEUE_DEPTH 128
+#define VIRTIO_BLK_SECTOR_SIZE 512
+
+// Each request has a header and a status descriptor besides its data.
+#define VIRTIO_BLK_SEG_MAX (VIRTIO_BLK_QUEUE_DEPTH - 2)
+
+// Discard and write-zeroes limits, in sectors. The alignment matches the
+// host page size, the granularity at which holes are punched.
+#define VIRTIO_BLK_MAX_DISCARD_SECTORS (1 << 22)
+#define VIRTIO_BLK_DISCARD_ALIGNMENT 8
+
+// Upper bounds of a merged request.
+#define VIRTIO_BLK_MERGE_MAX_BYTES (1024 * 1024)
+#define VIRTIO_BLK_MERGE_MAX_SEGS VIRTIO_BLK_QUEUE_DEPTH
+
+typedef struct virtio_blk_req {
+    bdev_io_t io;
+    struct virtio_blk_queue *queue;
+    uint16_t head;
+    uint32_t type;
+    uint64_t sector;
+    uint8_t *status;
+    // The data buffers of the request, a slice of the queue's iov arena.
+    struct iovec *iov;
+    size_t iovcnt;
+    size_t len;
+    uint32_t generation;
+    // Set from the pop of the request until its completion. A request
+    // submitted before a reset keeps its slot until the bdev completes it,
+    // so a request reusing the head in the meantime is allocated instead.
+    _Atomic int inflight;
+    int allocated;
+
+    // Requests merged into this one, which completes them all.
+    struct virtio_blk_req *merged;
+    size_t merged_iovcnt;
+    size_t merged_len;
+
+    // The time the request reached each trace_stage_t.
+    uint64_t ts[TRACE_STAGES];
+} virtio_blk_req_t;
+
+typedef struct virtio_blk_queue {
+    struct virtio_blk *blk;
+    virt_queue_t *vq;
+    bdev_queue_t *bdev_queue;
+
+    // Requests are indexed by their head descriptor, which is unique among
+    // the requests in flight since the last reset.
+    virtio_blk_req_t reqs[VIRTIO_BLK_QUEUE_DEPTH];
+
+    // The chains popped from the avail ring at once.
+    virt_queue_batch_t batch;
+
+    // The data iovecs of the requests popped by one drain. Consecutive
+    // requests have adjacent iovecs, so merged requests are submitted from
+    // a contiguous slice.
+    struct iovec arena[VIRTIO_QUEUE_NUM_MAX];
+    size_t arena_len;
+
+    // Completed requests, recorded with blk->mu held.
+    trace_t trace;
+
+    // The events of the requests filled into the used ring but not yet
+    // published, flushed with blk->mu held.
+    trace_event_t done[VIRTIO_BLK_QUEUE_DEPTH];
+    size_t done_len;
+    // Whether a notify is draining the queue, which flushes when it returns.
+    int in_notify;
+    // Whether a flush is deferred to the loop of the queue.
+    int flush_pending;
+} virtio_blk_queue_t;
+
+/**
+ * The virtio_blk_t device exposes a bdev_t to the guest over the
+ * virtio-mmio transport. Virtqueue `i` submits to bdev queue `i`.
+ *
+ * Each notification drains the avail ring in batches with the bdev queue
+ * plugged.
+ * Reads and writes of adjacent sectors are merged into one vectored
+ * request, and its completion is split back to every descriptor head.
+ * Flush, discard and write-zeroes requests complete after every request
+ * popped before them. Completions are published and interrupt the driver
+ * once per batch.
+ */
+typedef struct virtio_blk {
+    virtio_mmio_config_t mmio;
+    struct virtio_blk_config config;
+    bdev_t *bdev;
+    virtio_blk_queue_t queues[VIRTIO_BLK_QUEUE_COUNT];
+
+    // Serializes completions with device reset. Completions of requests
+    // submitted before the last reset are dropped.
+    pthread_mutex_t mu;
+    uint32_t generation;
+
+    // Counters exported through metrics_t.
+    struct {
+        _Atomic uint64_t merged;
+        _Atomic uint64_t submitted;
+        _Atomic uint64_t invalid_chains;
+    } stats;
+    // The labels of the stage latency histograms.
+    char *trace_labels;
+} virtio_blk_t;
+
+/**
+ * virtio_blk_init initializes `blk` backed by `bdev`, which must have at
+ * least VIRTIO_BLK_QUEUE_COUNT queues of depth VIRTIO_BLK_QUEUE_DEPTH.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int virtio_blk_init(virtio_blk_t *blk, uintptr_t base, uint32_t irq, mem_map_t *mem,
+                    irq_line_func irq_line, irq_arg_t irq_arg, bdev_t *bdev);
+
+void virtio_blk_deinit(virtio_blk_t *blk);
+
+/**
+ * virtio_blk_register_metrics registers the counters of `blk`, and the
+ * latency histograms of each stage of its requests, with `m`.
+ */
+int virtio_blk_register_metrics(virtio_blk_t *blk, metrics_t *m, const char *labels);
+
+/**
+ * virtio_blk_register_trace serves the stage quantiles and the trace ring
+ * of each queue of `blk` on requests for `path` of the metrics socket.
+ */
+int virtio_blk_register_trace(virtio_blk_t *blk, metrics_t *m, const char *path);
+
+#endif /* VIRTIO_BLK_H */
@@ -0,0 +1,136 @@
+#ifndef VIRTIO_CONSOLE_H
+#define VIRTIO_CONSOLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include <linux/virtio_console.h>
+
+#include <virtio-mmio.h>
+#include <metrics.h>
+
+#define VIRTIO_CONSOLE_MAX_PORTS 7
+#define VIRTIO_CONSOLE_QUEUE_DEPTH 256
+#define VIRTIO_CONSOLE_PORT_NAME_LEN 64
+#define VIRTIO_CONSOLE_CTRL_PENDING 64
+
+typedef struct virtio_console_port {
+    char name[VIRTIO_CONSOLE_PORT_NAME_LEN];
+
+    // Host fds bridged to the port. Data read from `in_fd` is delivered to
+    // the guest, data written by the guest is written to `out_fd`. Either may
+    // be -1. Socket backends use the same fd for both directions.
+    int in_fd;
+    int out_fd;
+    int is_socket;
+
+    int guest_connected;
+    int host_connected;
+
+    // Whether `in_fd` is currently registered for EPOLLIN.
+    int polling;
+
+    // Set once `out_fd` would block, after `tx_offset` bytes of the chain at
+    // the head of the tx queue were written. The chain stays on the queue
+    // until `out_fd` is writable again.
+    int tx_blocked;
+    size_t tx_offset;
+
+    // Whether `out_fd` is currently registered for EPOLLOUT, and whether it
+    // was added to the epoll fd if it is not `in_fd`.
+    int out_polling;
+    int out_registered;
+} virtio_console_port_t;
+
+typedef struct virtio_console_ctrl {
+    struct virtio_console_control msg;
+    char name[VIRTIO_CONSOLE_PORT_NAME_LEN];
+    size_t name_len;
+} virtio_console_ctrl_t;
+
+/**
+ * The virtio_console_t device is a multiport virtio console. Unlike the
+ * serial_t device, the guest transfers whole buffers through virtqueues, so
+ * bulk output costs one exit per kick rather than one per byte.
+ *
+ * Port 0 is the console port and appears as /dev/hvc0 in the guest, other
+ * ports appear as /dev/vport0p<n> and /dev/virtio-ports/<name>.
+ *
+ * The device is driven by an event loop: queue kicks and host input are
+ * multiplexed on the epoll fd returned by virtio_console_fd, and the loop
+ * calls virtio_console_process whenever it is readable.
+ *
+ * ```
+ *   vCPU ── notify ──> eventfd ─╮
+ *                               ├─> epoll ──> virtio_console_process
+ *   in_fd (per port) ───────────╯               │
+ *                                               ╰──> writev(out_fd)
+ * ```
+ */
+typedef struct virtio_console {
+    virtio_mmio_config_t mmio;
+    struct virtio_console_config config;
+
+    pthread_mutex_t mu;
+    int epollfd;
+    int eventfd;
+
+    size_t port_count;
+    virtio_console_port_t ports[VIRTIO_CONSOLE_MAX_PORTS];
+
+    // Control messages waiting for control receiveq buffers.
+    virtio_console_ctrl_t pending[VIRTIO_CONSOLE_CTRL_PENDING];
+    size_t pending_head;
+    size_t pending_len;
+
+    // Counters exported through metrics_t.
+    struct {
+        _Atomic uint64_t tx_bytes;
+        _Atomic uint64_t rx_bytes;
+    } stats;
+} virtio_console_t;
+
+int virtio_console_init(virtio_console_t *con, uintptr_t base, uint32_t irq, mem_map_t *mem,
+                        irq_line_func irq_line, irq_arg_t irq_arg);
+
+void virtio_console_deinit(virtio_console_t *con);
+
+/**
+ * virtio_console_add_port adds a port named `name` bridged to the host fds
+ * `in_fd` and `out_fd`. Ports must be added before the guest boots. The
+ * first port is the console port.
+ *
+ * \return On success, the port id is returned. On error, -1 is returned and
+ *         errno is set to indicate the error.
+ */
+int virtio_console_add_port(virtio_console_t *con, const char *name, int in_fd, int out_fd, int is_socket);
+
+/**
+ * virtio_console_add_port_spec adds a port described by `spec`, which has
+ * the form `<name>=<backend>` where backend is one of:
+ * - `stdout`: guest output is written to stdout.
+ * - `file:<path>`: guest output is appended to the file at `path`.
+ * - `unix:<path>`: the port is bridged to a connection to the unix stream
+ *   socket at `path`.
+ */
+int virtio_console_add_port_spec(virtio_console_t *con, const char *spec);
+
+/**
+ * virtio_console_fd returns an fd that becomes readable whenever
+ * virtio_console_process has work to do.
+ */
+int virtio_console_fd(virtio_console_t *con);
+
+/**
+ * virtio_console_process transfers pending buffers between the virtqueues
+ * and the host fds of every port and handles control messages.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int virtio_console_process(virtio_console_t *con);
+
+int virtio_console_register_metrics(virtio_console_t *con, metrics_t *m, const char *labels);
+
+#endif /* VIRTIO_CONSOLE_H */
@@ -5,8 +5,14 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <linux/virtio_ring.h>
-#include <bdev.h>
+#include <metrics.h>
+#include <event-loop.h>
+#include <irqmod.h>
+#include <memmap.h>
 
 #define VIRTIO_MMIO_MAGIC 0x74726976
 #define VIRTIO_VERSION 0x2
@@ -17,11 +23,16 @@
 #define VIRTIO_DEVICE_ENTROPY_SOURCE 4
 #define VIRTIO_DEVICE_MEMORY_BALLOON 5
 
-#define VIRTIO_QUEUE_COUNT 1
-#define VIRTIO_BLK_QUEUE_DEPTH 128
+#define VIRTIO_QUEUE_MAX 32
+#define VIRTIO_QUEUE_NUM_MAX 256
+
 typedef struct virt_queue {
     struct vring vring;
     uint32_t last_avail_idx;
+    // The device's copy of used->idx, published by virt_queue_flush.
+    uint16_t used_idx;
+    // The used entries written since the last publish.
+    uint16_t used_pending;
     uint32_t num_max;
     uint32_t ready;
     uint32_t desc_lo;
@@ -30,16 +41,86 @@ typedef struct virt_queue {
     uint32_t avail_hi;
     uint32_t used_lo;
     uint32_t used_hi;
+
+    struct virtio_mmio_config *cfg;
+    uint32_t index;
+
+    // The ioeventfd signaled by KVM when the driver notifies the queue, set
+    // by virtio_mmio_attach_queue.
+    int kick_fd;
+    event_loop_t *loop;
+    event_source_t *kick;
+
+    // Interrupt moderation. Published completions wait in irq_pending for
+    // the moderation limits, or the timer armed on `loop`.
+    irqmod_t irqmod;
+    int irq_timer_fd;
+    event_source_t *irq_timer;
+    _Atomic uint32_t irq_pending;
+    _Atomic int irq_armed;
+
+    // Counters exported through metrics_t.
+    struct {
+        _Atomic uint64_t notifies;
+        _Atomic uint64_t requests;
+        _Atomic uint64_t interrupts;
+        _Atomic uint64_t irq_timeouts;
+    } stats;
 } virt_queue_t;
 
+/**
+ * The virt_queue_elem_t is a descriptor chain popped by virt_queue_pop_batch.
+ */
+typedef struct virt_queue_elem {
+    uint16_t head;
+    // The number of iovecs, or -1 if the chain is malformed and must be
+    // completed without being processed.
+    int iovcnt;
+    // The number of device-readable iovecs.
+    size_t out_num;
+    struct iovec *iov;
+} virt_queue_elem_t;
+
+/**
+ * The virt_queue_batch_t holds the chains popped by one virt_queue_pop_batch.
+ * A descriptor belongs to at most one available chain, so a batch never
+ * holds more than VIRTIO_QUEUE_NUM_MAX chains. A descriptor spanning
+ * several memory slots takes one iovec per slot, so the iovecs may run out
+ * first, in which case the batch ends before the chain that does not fit.
+ * It is large and meant to be preallocated by the device, one per queue.
+ */
+typedef struct virt_queue_batch {
+    size_t count;
+    virt_queue_elem_t elems[VIRTIO_QUEUE_NUM_MAX];
+    struct iovec iov[VIRTIO_QUEUE_NUM_MAX];
+} virt_queue_batch_t;
+
+/**
+ * The virtio_device_ops_t are implemented by each virtio device type and
+ * called by the virtio-mmio transport. `notify` is called when the driver
+ * kicks queue `queue`, on the vCPU thread or, once the queue is attached to
+ * an event loop, on the loop thread. The optional `status` is called when
+ * the driver sets a non-zero device status. `notify`, `status` and `reset`
+ * never run concurrently.
+ */
+typedef struct virtio_device_ops {
+    void (*config_read)(void *dev, uint32_t offset, void *data, size_t size);
+    void (*config_write)(void *dev, uint32_t offset, void *data, size_t size);
+    void (*notify)(void *dev, uint32_t queue);
+    void (*status)(void *dev, uint32_t status);
+    void (*reset)(void *dev);
+} virtio_device_ops_t;
+
 typedef struct virtio_mmio_config {
 	uint32_t device_features_sel;
     uint32_t driver_features_sel;
     uint32_t queue_sel;
     uint32_t queue_ready;
     uint32_t status;
-    virt_queue_t queues[VIRTIO_QUEUE_COUNT];
-    void *mem;
+    uint32_t queue_count;
+    virt_queue_t queues[VIRTIO_QUEUE_MAX];
+    mem_map_t *mem;
+    uintptr_t base;
 
     uint32_t device_id;
     uint32_t vendor_id;
@@ -47,18 +128,134 @@ typedef struct virtio_mmio_config {
     uint32_t device_features_len;
     uint32_t driver_features[2];
     uint32_t driver_features_len;
-    uint32_t interrupt_status;
+    _Atomic uint32_t interrupt_status;
 
     irq_line_func irq_line;
     irq_arg_t irq_arg;
     uint32_t irq;
-    bdev_t bdev;
+
+    const virtio_device_ops_t *ops;
+    void *dev;
+
+    // Serializes ops->notify with reset.
+    pthread_mutex_t mu;
+    int vm_fd;
 } virtio_mmio_config_t;
 
 #define VIRTIO_MMIO_IO_SIZE	512
 
-void virtio_mmio_config_init(virtio_mmio_config_t *cfg, void *mem, irq_line_func irq_line, irq_arg_t irq_arg);
+/**
+ * virtio_mmio_config_init initializes the virtio-mmio transport `cfg` for
+ * the device `dev` at guest physical address `base`, raising interrupts on
+ * `irq`. Guest addresses are translated through `mem`. The device sets its id, features and queues after this call.
+ */
+void virtio_mmio_config_init(virtio_mmio_config_t *cfg, uintptr_t base, uint32_t irq, mem_map_t *mem,
+                             irq_line_func irq_line, irq_arg_t irq_arg,
+                             const virtio_device_ops_t *ops, void *dev);
 void virtio_mmio_read(virtio_mmio_config_t *cfg, uintptr_t guest_phys_addr, void *data, size_t size);
 void virtio_mmio_write(virtio_mmio_config_t *cfg, uintptr_t guest_phys_addr, void *data, size_t size);
 void virtio_mmio_reset(virtio_mmio_config_t *cfg);
+int virtio_mmio_register_metrics(virtio_mmio_config_t *cfg, metrics_t *m, const char *labels);
+
+void virtio_mmio_add_feature(virtio_mmio_config_t *cfg, uint32_t flag);
+
+/**
+ * virtio_mmio_set_irqmod moderates the interrupts of every queue of `cfg`
+ * as configured by `config`. It must be called before the queues are
+ * attached, since the moderation timers run on their event loops; queues
+ * that are not attached interrupt on every flush.
+ */
+void virtio_mmio_set_irqmod(virtio_mmio_config_t *cfg, const irqmod_config_t *config);
+
+/**
+ * virtio_mmio_attach_queue registers an ioeventfd with KVM for notifications
+ * of queue `queue`, so the driver's kick completes in the kernel without an
+ * MMIO exit, and dispatches the notification to the device on `loop`. With
+ * a NULL `loop`, the ioeventfd is left to the device, e.g. to hand to an
+ * in-kernel backend, as queue->kick_fd.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int virtio_mmio_attach_queue(virtio_mmio_config_t *cfg, uint32_t queue, int vm_fd, event_loop_t *loop);
+
+/**
+ * virtio_mmio_detach removes the ioeventfds of every attached queue. The
+ * event loops must not be running.
+ */
+void virtio_mmio_detach(virtio_mmio_config_t *cfg);
+
+/**
+ * virtio_mmio_has_feature returns whether the driver accepted `flag`.
+ */
+int virtio_mmio_has_feature(virtio_mmio_config_t *cfg, uint32_t flag);
+
+/**
+ * virtio_mmio_interrupt signals used buffers to the driver.
+ */
+void virtio_mmio_interrupt(virtio_mmio_config_t *cfg, virt_queue_t *queue);
+
+/**
+ * virt_queue_pop pops the next available descriptor chain of `queue` and
+ * translates it into `iov`. Device-readable buffers always precede
+ * device-writable buffers in a chain. A buffer spanning several memory
+ * slots takes one iovec per slot.
+ *
+ * \param cfg the transport.
+ * \param queue the queue.
+ * \param head the head descriptor of the chain, used to complete it.
+ * \param iov the iovecs.
+ * \param iov_len the number of iovecs.
+ * \param out_num the number of device-readable iovecs.
+ * \return On success, the number of iovecs is returned, 0 if no chain is
+ *         available. If the chain is malformed or refers to memory outside
+ *         of the guest, -1 is returned.
+ */
+int virt_queue_pop(virtio_mmio_config_t *cfg, virt_queue_t *queue, uint16_t *head,
+                   struct iovec *iov, size_t iov_len, size_t *out_num);
+
+/**
+ * virt_queue_unpop returns the last popped chain to the available ring.
+ */
+void virt_queue_unpop(virt_queue_t *queue);
+
+/**
+ * virt_queue_pop_batch pops the available descriptor chains of `queue` into
+ * `batch`, as many as its iovecs hold. The available index is read once and
+ * the descriptors are prefetched before the chains are walked, so a burst of
+ * requests costs a single synchronization with the driver.
+ *
+ * \return The number of chains popped, 0 if none is available.
+ */
+size_t virt_queue_pop_batch(virtio_mmio_config_t *cfg, virt_queue_t *queue, virt_queue_batch_t *batch);
+
+/**
+ * virt_queue_fill writes the completion of the chain `head`, having written
+ * `len` bytes to its device-writable buffers, to the used ring without
+ * making it visible to the driver.
+ */
+void virt_queue_fill(virt_queue_t *queue, uint16_t head, uint32_t len);
+
+/**
+ * virt_queue_publish makes the filled completions of `queue` visible to the
+ * driver with a single store of used->idx, without interrupting it.
+ *
+ * \return The number of completions published.
+ */
+size_t virt_queue_publish(virt_queue_t *queue);
+
+/**
+ * virt_queue_flush publishes the filled completions of `queue` and, if there
+ * were any, raises one interrupt, or leaves it to the moderation timer.
+ *
+ * \return The number of completions published.
+ */
+size_t virt_queue_flush(virtio_mmio_config_t *cfg, virt_queue_t *queue);
+
+/**
+ * virt_queue_push completes the chain `head`, having written `len` bytes to
+ * its device-writable buffers. It is virt_queue_fill followed by
+ * virt_queue_publish; batches should fill and flush instead.
+ */
+void virt_queue_push(virt_queue_t *queue, uint16_t head, uint32_t len);
 #endif
@@ -0,0 +1,134 @@
+#ifndef VIRTIO_NET_H
+#define VIRTIO_NET_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <linux/virtio_net.h>
+
+#include <virtio-mmio.h>
+#include <net-backend.h>
+#include <vhost-net.h>
+#include <event-loop.h>
+#include <metrics.h>
+
+#define VIRTIO_NET_MAX_QUEUE_PAIRS NET_BACKEND_MAX_QUEUES
+#define VIRTIO_NET_QUEUE_DEPTH 256
+
+// The largest frames after their virtio-net header: a 64KiB segmentation
+// offload frame, and a 1500 byte MTU frame, both with their Ethernet and
+// VLAN headers.
+#define VIRTIO_NET_MAX_FRAME (sizeof(struct virtio_net_hdr_v1) + 65535 + 18)
+#define VIRTIO_NET_MAX_MTU_FRAME (sizeof(struct virtio_net_hdr_v1) + 1500 + 18)
+
+// The iovecs of the receive buffers gathered ahead of the next frame. Any
+// chain fits once less than half of them are taken.
+#define VIRTIO_NET_RX_IOV (2 * VIRTIO_QUEUE_NUM_MAX)
+
+// A receive buffer popped ahead of the frame it will hold.
+typedef struct virtio_net_rx_chain {
+    uint16_t head;
+    uint16_t iovcnt;
+    size_t len;
+} virtio_net_rx_chain_t;
+
+typedef struct virtio_net_pair {
+    struct virtio_net *net;
+    uint32_t index;
+    event_loop_t *loop;
+
+    // The backend queue, polled for frames while the driver has posted
+    // receive buffers and for room while a send would block, or the
+    // vhost-net call eventfds of the receive and transmit queues.
+    event_source_t *backend;
+    uint32_t events;
+    int rx_blocked;
+    int tx_blocked;
+    event_source_t *calls[2];
+
+    // The frames popped from the transmit queue at once.
+    virt_queue_batch_t batch;
+
+    // The receive buffers popped for the next frame, kept across wakeups.
+    // With merged buffers they hold the largest frame the driver accepts.
+    virtio_net_rx_chain_t rx_chains[VIRTIO_QUEUE_NUM_MAX];
+    size_t rx_chain_count;
+    struct iovec rx_iov[VIRTIO_NET_RX_IOV];
+    size_t rx_iovcnt;
+    size_t rx_space;
+} virtio_net_pair_t;
+
+/**
+ * The virtio_net_t device is a multiqueue virtio network card. Queue pair
+ * `i`, receive queue 2i and transmit queue 2i + 1, exchanges frames with
+ * queue `i` of a net_backend_t, followed by the control queue.
+ *
+ * Frames keep their virtio-net header end to end, so checksum and TSO
+ * offloads negotiated by the guest are carried out by the host stack or the
+ * peer. Receive buffers are merged when the driver accepts it, so that a
+ * large frame fills as many buffers as it needs.
+ *
+ * Backend queues are non-blocking: a transmit queue whose backend is full
+ * waits for it to drain, and a backend queue is only polled while its
+ * receive queue has buffers, so neither side drops frames under load.
+ *
+ * With a tap backend and /dev/vhost-net, each queue pair is served by
+ * vhost-net in the kernel and the device only relays its interrupts; the
+ * frame counters then stay at zero.
+ */
+typedef struct virtio_net {
+    virtio_mmio_config_t mmio;
+    struct virtio_net_config config;
+    net_backend_t *backend;
+
+    vhost_net_t vhost;
+    int vhost_enabled;
+
+    size_t queue_pairs;
+    // The queue pairs the driver uses, set through the control queue.
+    uint16_t curr_queue_pairs;
+    virtio_net_pair_t pairs[VIRTIO_NET_MAX_QUEUE_PAIRS];
+
+    // Counters exported through metrics_t.
+    struct {
+        _Atomic uint64_t rx_frames;
+        _Atomic uint64_t rx_bytes;
+        _Atomic uint64_t rx_dropped;
+        _Atomic uint64_t tx_frames;
+        _Atomic uint64_t tx_bytes;
+        _Atomic uint64_t tx_dropped;
+    } stats;
+} virtio_net_t;
+
+/**
+ * virtio_net_init initializes `net` with a queue pair per queue of
+ * `backend` and a random locally administered MAC address. A tap backend
+ * is served by vhost-net if the host has it, unless backend->vhost is
+ * cleared.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int virtio_net_init(virtio_net_t *net, uintptr_t base, uint32_t irq, mem_map_t *mem,
+                    irq_line_func irq_line, irq_arg_t irq_arg, net_backend_t *backend);
+
+void virtio_net_deinit(virtio_net_t *net);
+
+/**
+ * virtio_net_attach_pair serves queue pair `pair`, and the control queue
+ * with pair 0, on `loop`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+int virtio_net_attach_pair(virtio_net_t *net, uint32_t pair, int vm_fd, event_loop_t *loop);
+
+/**
+ * virtio_net_detach undoes every virtio_net_attach_pair. The event loops
+ * must not be running.
+ */
+void virtio_net_detach(virtio_net_t *net);
+
+int virtio_net_register_metrics(virtio_net_t *net, metrics_t *m, const char *labels);
+
+#endif /* VIRTIO_NET_H */
@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+
+#include <cow.h>
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s create [-c cluster-size] [-s size] <overlay> <base>\n"
+                    "       %s info <overlay>\n", argv0, argv0);
+}
+
+static int parse_size(const char *s, uint64_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(s, &end, 0);
+    if (errno != 0 || end == s) return -1;
+    switch (*end) {
+    case 'K': case 'k': value <<= 10; end++; break;
+    case 'M': case 'm': value <<= 20; end++; break;
+    case 'G': case 'g': value <<= 30; end++; break;
+    }
+    if (*end != '\0') return -1;
+    *size = value;
+    return 0;
+}
+
+static int cmd_create(int argc, char *argv[]) {
+    uint64_t cluster_size = COW_DEFAULT_CLUSTER_SIZE;
+    uint64_t size = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:s:")) != -1) {
+        switch (opt) {
+        case 'c':
+            if (parse_size(optarg, &cluster_size) < 0 || cluster_size > UINT32_MAX) {
+                fprintf(stderr, "invalid cluster size %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            if (parse_size(optarg, &size) < 0) {
+                fprintf(stderr, "invalid size %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            return 1;
+        }
+    }
+    if (argc - optind != 2) return 1;
+
+    if (cow_create(argv[optind], argv[optind + 1], size, cluster_size) < 0) {
+        fprintf(stderr, "failed to create %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static int cmd_info(int argc, char *argv[]) {
+    if (argc != 2) return 1;
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror("failed to open overlay");
+        return 1;
+    }
+
+    cow_header_t header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, COW_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s is not an overlay\n", argv[1]);
+        close(fd);
+        return 1;
+    }
+
+    uint64_t entries = le64toh(header.table_entries);
+    uint64_t allocated = 0;
+    for (uint64_t i = 0; i < entries; i++) {
+        uint64_t entry;
+        if (pread(fd, &entry, sizeof(entry), le64toh(header.table_offset) + i * sizeof(entry)) != sizeof(entry)) {
+            perror("failed to read table");
+            close(fd);
+            return 1;
+        }
+        if (entry != 0) allocated++;
+    }
+    close(fd);
+
+    header.base_path[COW_BASE_PATH_MAX - 1] = '\0';
+    printf("base: %s\n", header.base_path);
+    printf("size: %llu\n", (unsigned long long) le64toh(header.size));
+    printf("cluster size: %llu\n", 1ULL << le32toh(header.cluster_bits));
+    printf("allocated clusters: %llu/%llu\n", (unsigned long long) allocated, (unsigned long long) entries);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int res = 1;
+    if (strcmp(argv[1], "create") == 0) {
+        res = cmd_create(argc - 1, argv + 1);
+    } else if (strcmp(argv[1], "info") == 0) {
+        res = cmd_info(argc - 1, argv + 1);
+    }
+    if (res != 0) usage(argv[0]);
+    return res;
+}
@@ -20,12 +20,26 @@
 #include <assert.h>
 #include <signal.h>    /* signal name macros, and the signal() prototype */
 #include <sys/epoll.h>
+#include <sys/uio.h>
+#include <linux/serial_reg.h>
+#include <linux/virtio_mmio.h>
 
 #include <serial.h>
 #include <tty.h>
 #include <pci.h>
 #include <x86.h>
 #include <virtio-mmio.h>
+#include <virtio-blk.h>
+#include <vhost-user-blk.h>
+#include <virtio-console.h>
+#include <virtio-net.h>
+#include <ringlog.h>
+#include <iothread.h>
+#include <metrics.h>
+#include <coalesced.h>
+#include <boot.h>
+#include <cpu.h>
+#include <bus.h>
 
 volatile sig_atomic_t done = 0;
 
@@ -37,13 +51,36 @@ typedef struct guest_memory_region {
     uintptr_t guest_addr;
     void* host_addr;
     size_t size;
+    // The memfd backing the region, which out-of-process device back-ends
+    // map too.
+    int fd;
 } guest_memory_region_t;
 
 typedef struct guest {
   int kvm_fd;
   int vm_fd;
   int vcpu_fd;
+  struct kvm_run *run;
+  size_t run_size;
   guest_memory_region_t mem;
+  // The guest physical memory map the devices translate through.
+  mem_map_t mem_map;
+  cpu_model_t cpu;
+  // The port I/O and MMIO address spaces, with the last-hit caches of the
+  // vCPU.
+  bus_t pio_bus;
+  bus_t mmio_bus;
+  bus_cache_t pio_cache;
+  bus_cache_t mmio_cache;
+  // How the kernel is entered, reported with the boot time.
+  const char *boot_path;
+
+  // Userspace exit counters exported through metrics_t.
+  struct {
+    _Atomic uint64_t io;
+    _Atomic uint64_t mmio;
+    _Atomic uint64_t other;
+  } exits;
 } guest_t;
 
 void kvm_irq_line(uint16_t irq, int level, irq_arg_t irq_arg) {
@@ -60,6 +97,22 @@ void kvm_irq_line(uint16_t irq, int level, irq_arg_t irq_arg) {
 
 #define GUEST_MEMORY_SIZE (1ULL << 30)
 #define KERNEL_CMDLINE_ADDR 0x20000
+#define KERNEL_CMDLINE_LEN 512
+#define BOOT_PARAMS_ADDR 0x10000
+
+// The guest writes GUEST_BOOT_TIMER_MAGIC to the POST code port once it is
+// up, e.g. from /init, to report the time from VMM start to init. Other
+// writes, e.g. firmware POST codes or io_delay=0x80 delays, are ignored.
+#define GUEST_BOOT_TIMER_PORT 0x80
+#define GUEST_BOOT_TIMER_MAGIC 123
+
+static uint64_t start_ns;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 static int guest_error(guest_t *g, const char *fmt, ...) {
   va_list args;
@@ -123,26 +176,43 @@ static int guest_init_regs(guest_t *g) {
   return 0;
 }
 
-static int guest_init_cpu_id(guest_t *g) {
-  struct {
-    uint32_t nent;
-    uint32_t padding;
-    struct kvm_cpuid_entry2 entries[100];
-  } kvm_cpuid;
-  kvm_cpuid.nent = sizeof(kvm_cpuid.entries) / sizeof(kvm_cpuid.entries[0]);
-  ioctl(g->kvm_fd, KVM_GET_SUPPORTED_CPUID, &kvm_cpuid);
-
-  for (unsigned int i = 0; i < kvm_cpuid.nent; i++) {
-    struct kvm_cpuid_entry2 *entry = &kvm_cpuid.entries[i];
-    if (entry->function == KVM_CPUID_SIGNATURE) {
-      entry->eax = KVM_CPUID_FEATURES;
-      entry->ebx = 0x4b4d564b; // KVMK
-      entry->ecx = 0x564b4d56; // VMKV
-      entry->edx = 0x4d;       // M
+/**
+ * guest_init_cpu sets up the CPUID leaves and MSRs of the vCPU, and reports
+ * the timer and paravirtual features the guest can use instead of the PIT.
+ */
+static int guest_init_cpu(guest_t *g) {
+    if (cpu_model_init(&g->cpu, g->kvm_fd) < 0) {
+        return guest_error(g, "failed to get supported cpuid");
     }
-  }
-  ioctl(g->vcpu_fd, KVM_SET_CPUID2, &kvm_cpuid);
-  return 0;
+    if (cpu_model_apply(&g->cpu, g->vcpu_fd, 0) < 0) {
+        return guest_error(g, "failed to set cpuid and msrs");
+    }
+
+    static const struct {
+        const char *name;
+        uint32_t function;
+        uint32_t index;
+        int reg;
+        int bit;
+    } features[] = {
+        { "x2apic", 0x1, 0, CPUID_ECX, 21 },
+        { "tsc-deadline", 0x1, 0, CPUID_ECX, 24 },
+        { "avx2", 0x7, 0, CPUID_EBX, 5 },
+        { "avx512f", 0x7, 0, CPUID_EBX, 16 },
+        { "invtsc", 0x80000007, 0, CPUID_EDX, 8 },
+        { "kvmclock", KVM_CPUID_FEATURES, 0, CPUID_EAX, KVM_FEATURE_CLOCKSOURCE2 },
+        { "pv-eoi", KVM_CPUID_FEATURES, 0, CPUID_EAX, KVM_FEATURE_PV_EOI },
+        { "pv-tlb-flush", KVM_CPUID_FEATURES, 0, CPUID_EAX, KVM_FEATURE_PV_TLB_FLUSH },
+        { "pv-sched-yield", KVM_CPUID_FEATURES, 0, CPUID_EAX, KVM_FEATURE_PV_SCHED_YIELD },
+    };
+    fprintf(stderr, "cpu features:");
+    for (size_t i = 0; i < sizeof(features) / sizeof(features[0]); i++) {
+        if (cpu_model_has(&g->cpu, features[i].function, features[i].index, features[i].reg, features[i].bit)) {
+            fprintf(stderr, " %s", features[i].name);
+        }
+    }
+    fprintf(stderr, "\r\n");
+    return 0;
 }
 
 int guest_init(guest_t *g) {
@@ -150,6 +220,14 @@ int guest_init(guest_t *g) {
         return guest_error(g, "failed to open /dev/kvm");
     }
 
+    if (bus_init(&g->pio_bus) < 0 || bus_init(&g->mmio_bus) < 0) {
+        return guest_error(g, "failed to init buses");
+    }
+
+    if (mem_map_init(&g->mem_map) < 0) {
+        return guest_error(g, "failed to init memory map");
+    }
+
     if ((g->vm_fd = ioctl(g->kvm_fd, KVM_CREATE_VM, 0)) < 0) {
         return guest_error(g, "failed to create vm");
     }
@@ -174,8 +252,12 @@ int guest_init(guest_t *g) {
         return guest_error(g, "failed to create i8254 interval timer");
     }
 
-    g->mem.host_addr = mmap(NULL, GUEST_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (g->mem.host_addr == NULL) {
+    g->mem.fd = memfd_create("tomu-guest-memory", MFD_CLOEXEC);
+    if (g->mem.fd < 0 || ftruncate(g->mem.fd, GUEST_MEMORY_SIZE) < 0) {
+        return guest_error(g, "failed to create vm memory");
+    }
+    g->mem.host_addr = mmap(NULL, GUEST_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, g->mem.fd, 0);
+    if (g->mem.host_addr == MAP_FAILED) {
         return guest_error(g, "failed to mmap vm memory");
     }
     g->mem.guest_addr = 0;
@@ -191,24 +273,123 @@ int guest_init(guest_t *g) {
     if (ioctl(g->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
         return guest_error(g, "failed to set user memory region");
     }
+    if (mem_map_add_fd(&g->mem_map, g->mem.guest_addr, g->mem.size, g->mem.host_addr, g->mem.fd, 0) < 0) {
+        return guest_error(g, "failed to map guest memory");
+    }
 
     if ((g->vcpu_fd = ioctl(g->vm_fd, KVM_CREATE_VCPU, 0)) < 0) {
         return guest_error(g, "failed to create vcpu");
     }
 
-    guest_init_regs(g);
-    guest_init_cpu_id(g);
+    int run_size = ioctl(g->kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
+    if (run_size < 0) {
+        return guest_error(g, "failed to get vcpu mmap size");
+    }
+    g->run_size = run_size;
+    g->run = mmap(0, g->run_size, PROT_READ | PROT_WRITE, MAP_SHARED, g->vcpu_fd, 0);
+    if (g->run == MAP_FAILED) {
+        return guest_error(g, "failed to mmap vcpu");
+    }
+
+    // The CPUID must be set first: KVM validates e.g. EFER.LME against it.
+    if (guest_init_cpu(g) < 0 || guest_init_regs(g) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * guest_load_elf loads an uncompressed vmlinux and enters it directly: at
+ * its PVH entry point in 32-bit protected mode if it has one, or else at
+ * startup_64 in long mode. Either way the in-guest decompressor and the
+ * real/protected mode setup code of a bzImage are skipped.
+ */
+static int guest_load_elf(guest_t *g, int fd, const char *initrd_path, const char *cmdline_txt) {
+    boot_elf_t elf;
+    if (boot_elf_load(g->mem.host_addr, g->mem.size, fd, &elf) < 0) {
+        return guest_error(g, "failed to load kernel elf");
+    }
+
+    int initrd_fd = open(initrd_path, O_RDONLY);
+    if (initrd_fd < 0) {
+        return guest_error(g, "failed to open initramfs");
+    }
+    struct stat st;
+    fstat(initrd_fd, &st);
+    size_t initramfs_size = st.st_size;
+    size_t initramfs_addr = ((GUEST_MEMORY_SIZE - 1) - initramfs_size) & ~(0x0FFFULL);
+    if (initramfs_addr < elf.end) {
+        close(initrd_fd);
+        errno = ENOMEM;
+        return guest_error(g, "initramfs overlaps the kernel");
+    }
+    ssize_t res = read(initrd_fd, (uint8_t*) g->mem.host_addr + initramfs_addr, initramfs_size);
+    close(initrd_fd);
+    if (res != (ssize_t) initramfs_size) {
+        return guest_error(g, "failed to read initramfs");
+    }
 
+    char *cmdline = (char*) g->mem.host_addr + KERNEL_CMDLINE_ADDR;
+    memset(cmdline, 0, KERNEL_CMDLINE_LEN);
+    strncpy(cmdline, cmdline_txt, KERNEL_CMDLINE_LEN - 1);
+
+    struct kvm_sregs sregs;
+    struct kvm_regs regs;
+    if (ioctl(g->vcpu_fd, KVM_GET_SREGS, &sregs) < 0 || ioctl(g->vcpu_fd, KVM_GET_REGS, &regs) < 0) {
+        return guest_error(g, "failed to get registers");
+    }
+    memset(&regs, 0, sizeof(regs));
+    regs.rflags = 2;
+
+    if (elf.pvh_entry != 0) {
+        // guest_init_regs already set up flat 32-bit protected mode.
+        regs.rip = elf.pvh_entry;
+        regs.rbx = boot_setup_pvh(g->mem.host_addr, g->mem.size, KERNEL_CMDLINE_ADDR,
+                                  initramfs_addr, initramfs_size);
+        g->boot_path = "pvh";
+    } else {
+        struct boot_params *boot = (struct boot_params*) ((uint8_t*) g->mem.host_addr + BOOT_PARAMS_ADDR);
+        memset(boot, 0, sizeof(struct boot_params));
+        boot->hdr.boot_flag = 0xAA55;
+        boot->hdr.header = 0x53726448; // "HdrS"
+        boot->hdr.type_of_loader = 0xFF;
+        boot->hdr.vid_mode = 0xFFFF;
+        boot->hdr.kernel_alignment = 0x1000000;
+        boot->hdr.cmd_line_ptr = KERNEL_CMDLINE_ADDR;
+        boot->hdr.cmdline_size = KERNEL_CMDLINE_LEN;
+        boot->hdr.ramdisk_image = initramfs_addr;
+        boot->hdr.ramdisk_size = initramfs_size;
+        boot_setup_e820(boot, g->mem.size);
+
+        boot_setup_long_mode(g->mem.host_addr, &sregs);
+        regs.rip = elf.entry;
+        regs.rsi = BOOT_PARAMS_ADDR;
+        g->boot_path = "64-bit";
+    }
+
+    if (ioctl(g->vcpu_fd, KVM_SET_SREGS, &sregs) < 0 || ioctl(g->vcpu_fd, KVM_SET_REGS, &regs) < 0) {
+        return guest_error(g, "failed to set registers");
+    }
     return 0;
 }
 
-int guest_load(guest_t *g, const char *image_path, const char *initrd_path) {
+int guest_load(guest_t *g, const char *image_path, const char *initrd_path, const char *cmdline_txt) {
     size_t datasz;
     void *data;
     int fd = open(image_path, O_RDONLY);
     if (fd < 0) {
     return 1;
     }
+
+    char magic[4];
+    if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && boot_is_elf(magic, sizeof(magic))) {
+        int res = guest_load_elf(g, fd, initrd_path, cmdline_txt);
+        close(fd);
+        return res;
+    }
+    g->boot_path = "bzImage";
+
     struct stat st;
     fstat(fd, &st);
     data = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
@@ -245,9 +426,6 @@ int guest_load(guest_t *g, const char *image_path, const char *initrd_path) {
     void *cmdline = (void *)(((uint8_t *) g->mem.host_addr) + KERNEL_CMDLINE_ADDR);
     printf("command line size: %d\n",boot->hdr.cmdline_size);
     memset(cmdline, 0, boot->hdr.cmdline_size);
-    // virtio_mmio.device=4K@0xd0000000:5
-    // virtio_mmio.device=4096@<baseaddr>:<irq>[:<id>]
-    const char *cmdline_txt = "console=ttyS0,9600 virtio_mmio.device=512@0xc0000000:5";
     memcpy(cmdline, cmdline_txt, strlen(cmdline_txt));
 
     /* load initramfs to the highest 4k page-aligned address range */
@@ -261,38 +439,246 @@ int guest_load(guest_t *g, const char *image_path, const char *initrd_path) {
 }
 
 void guest_deinit(guest_t *g) {
+    munmap(g->run, g->run_size);
     close(g->kvm_fd);
     close(g->vm_fd);
     close(g->vcpu_fd);
     munmap(g->mem.host_addr, GUEST_MEMORY_SIZE);
+    close(g->mem.fd);
+    cpu_model_deinit(&g->cpu);
+    bus_deinit(&g->pio_bus);
+    bus_deinit(&g->mmio_bus);
+    mem_map_deinit(&g->mem_map);
+}
+
+#define VIRTIO_BLK_MMIO_BASE        (X86_VIRTIO_MMIO_AREA + 0 * VIRTIO_MMIO_IO_SIZE)
+#define VIRTIO_BLK_IRQ              5
+#define VIRTIO_CONSOLE_MMIO_BASE    (X86_VIRTIO_MMIO_AREA + 1 * VIRTIO_MMIO_IO_SIZE)
+#define VIRTIO_CONSOLE_IRQ          6
+#define VIRTIO_NET_MMIO_BASE        (X86_VIRTIO_MMIO_AREA + 2 * VIRTIO_MMIO_IO_SIZE)
+#define VIRTIO_NET_IRQ              7
+
+// The virtio-blk device is only exposed when a disk is configured, in which
+// case virtio_blk.bdev is set.
+virtio_blk_t virtio_blk;
+bdev_t disk;
+// The host block cache of the disk, set with -k.
+bcache_t *disk_cache = NULL;
+// A disk served by a vhost-user back-end replaces virtio-blk at the same
+// address, in which case vhost_user_blk.path is set.
+vhost_user_blk_t vhost_user_blk;
+
+virtio_console_t virtio_console;
+
+// The virtio-net device is only exposed when a backend is configured with
+// -n, in which case virtio_net.backend is set.
+virtio_net_t virtio_net;
+net_backend_t net_backend;
+
+metrics_t metrics;
+
+/**
+ * guest_register_metrics registers the userspace exit counters and the KVM
+ * binary statistics of the VM and its vCPU with `m`.
+ */
+int guest_register_metrics(guest_t *g, metrics_t *m) {
+    if (metrics_register(m, "tomu_vcpu_exits_total", "Exits handled in userspace.",
+                         "vcpu=\"0\",reason=\"io\"", METRIC_COUNTER, &g->exits.io) < 0) return -1;
+    if (metrics_register(m, "tomu_vcpu_exits_total", "Exits handled in userspace.",
+                         "vcpu=\"0\",reason=\"mmio\"", METRIC_COUNTER, &g->exits.mmio) < 0) return -1;
+    if (metrics_register(m, "tomu_vcpu_exits_total", "Exits handled in userspace.",
+                         "vcpu=\"0\",reason=\"other\"", METRIC_COUNTER, &g->exits.other) < 0) return -1;
+
+    // Binary stats are optional, older kernels do not support KVM_CAP_BINARY_STATS_FD.
+    if (ioctl(g->kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_BINARY_STATS_FD) <= 0) {
+        return 0;
+    }
+
+    int fd = ioctl(g->vm_fd, KVM_GET_STATS_FD, 0);
+    if (fd < 0) {
+        return guest_error(g, "failed to get vm stats fd");
+    }
+    if (metrics_add_kvm_stats(m, fd, "kvm_vm", NULL) < 0) {
+        close(fd);
+        return guest_error(g, "failed to read vm stats");
+    }
+
+    fd = ioctl(g->vcpu_fd, KVM_GET_STATS_FD, 0);
+    if (fd < 0) {
+        return guest_error(g, "failed to get vcpu stats fd");
+    }
+    if (metrics_add_kvm_stats(m, fd, "kvm_vcpu", "vcpu=\"0\"") < 0) {
+        close(fd);
+        return guest_error(g, "failed to read vcpu stats");
+    }
+
+    return 0;
 }
 
-virtio_mmio_config_t virtio_config;
+coalesced_t coalesced;
+
+/**
+ * guest_boot_timer_out reports the time since the VMM started when the
+ * guest writes GUEST_BOOT_TIMER_MAGIC to GUEST_BOOT_TIMER_PORT.
+ */
+static void guest_boot_timer_out(void *arg, uint64_t port, uint8_t *data, size_t len) {
+    guest_t *g = (guest_t*) arg;
+    if (len >= 1 && data[0] == GUEST_BOOT_TIMER_MAGIC) {
+        fprintf(stderr, "guest booted in %.3f ms (%s)\r\n", (monotonic_ns() - start_ns) / 1e6, g->boot_path);
+    }
+}
+
+static void guest_phb_in(void *arg, uint64_t port, uint8_t *data, size_t len) {
+    phb_in(port, data, len);
+}
+
+static void guest_phb_out(void *arg, uint64_t port, uint8_t *data, size_t len) {
+    phb_out(port, data, len);
+}
+
+// The serial registers are a byte wide. serial_in and serial_out treat
+// `len` as that many accesses to the register, so only `rep insb`/`rep
+// outsb` bursts are handed to them whole. Wider accesses use the low byte,
+// and the bytes above it read as zero.
+static void guest_serial_in(void *arg, uint64_t port, uint8_t *data, size_t len) {
+    memset(data, 0, len);
+    serial_in((serial_t*) arg, port, data, 1);
+}
+
+static void guest_serial_out(void *arg, uint64_t port, uint8_t *data, size_t len) {
+    serial_out((serial_t*) arg, port, data, 1);
+}
+
+static void guest_serial_in_string(void *arg, uint64_t port, uint8_t *data, size_t size, size_t count) {
+    if (size == 1) {
+        serial_in((serial_t*) arg, port, data, count);
+        return;
+    }
+    memset(data, 0, size * count);
+    for (size_t i = 0; i < count; i++) serial_in((serial_t*) arg, port, data + i * size, 1);
+}
+
+static void guest_serial_out_string(void *arg, uint64_t port, uint8_t *data, size_t size, size_t count) {
+    if (size == 1) {
+        serial_out((serial_t*) arg, port, data, count);
+        return;
+    }
+    for (size_t i = 0; i < count; i++) serial_out((serial_t*) arg, port, data + i * size, 1);
+}
+
+static void guest_virtio_mmio_read(void *arg, uint64_t addr, uint8_t *data, size_t len) {
+    virtio_mmio_read((virtio_mmio_config_t*) arg, addr, data, len);
+}
+
+static void guest_virtio_mmio_write(void *arg, uint64_t addr, uint8_t *data, size_t len) {
+    virtio_mmio_write((virtio_mmio_config_t*) arg, addr, data, len);
+}
+
+/**
+ * guest_init_bus registers the devices with the PIO and MMIO buses. The
+ * handlers are lockless: they run on the single vCPU thread, or from a
+ * coalesced ring drain, which is serialized with it.
+ */
+static int guest_init_bus(guest_t *g) {
+    const bus_ops_t boot_timer_ops = { .write = guest_boot_timer_out };
+    const bus_ops_t phb_ops = { .read = guest_phb_in, .write = guest_phb_out };
+    const bus_ops_t serial_ops = {
+        .read = guest_serial_in,
+        .write = guest_serial_out,
+        .read_string = guest_serial_in_string,
+        .write_string = guest_serial_out_string,
+    };
+    const bus_ops_t virtio_mmio_ops = { .read = guest_virtio_mmio_read, .write = guest_virtio_mmio_write };
+
+    if (bus_register(&g->pio_bus, GUEST_BOOT_TIMER_PORT, 1, &boot_timer_ops, g, BUS_LOCKLESS) < 0 ||
+        bus_register(&g->pio_bus, PCI_CONFIG_ADDRESS, 4, &phb_ops, NULL, BUS_LOCKLESS) < 0 ||
+        bus_register(&g->pio_bus, PCI_CONFIG_DATA, 4, &phb_ops, NULL, BUS_LOCKLESS) < 0 ||
+        bus_register(&g->pio_bus, SERIAL_IO_ADDR, 8, &serial_ops, &serial_16550a, BUS_LOCKLESS) < 0) {
+        return guest_error(g, "failed to register pio devices");
+    }
+    if (virtio_blk.bdev != NULL &&
+        bus_register(&g->mmio_bus, VIRTIO_BLK_MMIO_BASE, VIRTIO_MMIO_IO_SIZE, &virtio_mmio_ops,
+                     &virtio_blk.mmio, BUS_LOCKLESS) < 0) {
+        return guest_error(g, "failed to register virtio-blk");
+    }
+    if (vhost_user_blk.path != NULL &&
+        bus_register(&g->mmio_bus, VIRTIO_BLK_MMIO_BASE, VIRTIO_MMIO_IO_SIZE, &virtio_mmio_ops,
+                     &vhost_user_blk.mmio, BUS_LOCKLESS) < 0) {
+        return guest_error(g, "failed to register vhost-user-blk");
+    }
+    if (virtio_console.port_count > 0 &&
+        bus_register(&g->mmio_bus, VIRTIO_CONSOLE_MMIO_BASE, VIRTIO_MMIO_IO_SIZE, &virtio_mmio_ops,
+                     &virtio_console.mmio, BUS_LOCKLESS) < 0) {
+        return guest_error(g, "failed to register virtio-console");
+    }
+    if (virtio_net.backend != NULL &&
+        bus_register(&g->mmio_bus, VIRTIO_NET_MMIO_BASE, VIRTIO_MMIO_IO_SIZE, &virtio_mmio_ops,
+                     &virtio_net.mmio, BUS_LOCKLESS) < 0) {
+        return guest_error(g, "failed to register virtio-net");
+    }
+    return 0;
+}
+
+static void guest_coalesced_write(void *arg, uint64_t addr, uint8_t *data, uint32_t len, int pio) {
+    guest_t *g = (guest_t*) arg;
+    // Drains may run on device threads, so the vCPU caches are not used.
+    bus_dispatch(pio ? &g->pio_bus : &g->mmio_bus, NULL, addr, 1, data, len);
+}
+
+/**
+ * guest_init_coalesced coalesces writes to device registers that have no
+ * synchronous side effects. Their effects are only observable through later
+ * register reads, which exit and drain the ring first. Coalescing is best
+ * effort and silently disabled if KVM does not support it.
+ */
+static int guest_init_coalesced(guest_t *g) {
+    if (coalesced_init(&coalesced, g->kvm_fd, g->vm_fd, g->run, guest_coalesced_write, g) < 0) {
+        return errno == ENOTSUP ? 0 : guest_error(g, "failed to init coalesced mmio");
+    }
+
+    // The 16550A THR (and DLL while DLAB is set).
+    if (coalesced_add_pio(&coalesced, SERIAL_IO_ADDR + UART_TX, 1) < 0 && errno != ENOTSUP) {
+        return guest_error(g, "failed to coalesce serial thr");
+    }
+
+    // The virtio-mmio selector and queue configuration registers. The queue
+    // notify and interrupt ack registers are deliberately excluded.
+    const struct { uint32_t offset; uint32_t len; } zones[] = {
+        { VIRTIO_MMIO_DEVICE_FEATURES_SEL, 4 },
+        { VIRTIO_MMIO_DRIVER_FEATURES, 8 },
+        { VIRTIO_MMIO_QUEUE_SEL, VIRTIO_MMIO_QUEUE_READY + 4 - VIRTIO_MMIO_QUEUE_SEL },
+        { VIRTIO_MMIO_STATUS, 4 },
+        { VIRTIO_MMIO_QUEUE_DESC_LOW, VIRTIO_MMIO_QUEUE_USED_HIGH + 4 - VIRTIO_MMIO_QUEUE_DESC_LOW },
+    };
+    const uintptr_t bases[] = { VIRTIO_BLK_MMIO_BASE, VIRTIO_CONSOLE_MMIO_BASE, VIRTIO_NET_MMIO_BASE };
+    for (size_t j = 0; j < sizeof(bases) / sizeof(bases[0]); j++) {
+        for (size_t i = 0; i < sizeof(zones) / sizeof(zones[0]); i++) {
+            if (coalesced_add_mmio(&coalesced, bases[j] + zones[i].offset, zones[i].len) < 0) {
+                return guest_error(g, "failed to coalesce virtio-mmio registers");
+            }
+        }
+    }
+
+    return 0;
+}
 
 int guest_run(guest_t *g) {
-    int run_size = ioctl(g->kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
-    struct kvm_run *run = mmap(0, run_size, PROT_READ | PROT_WRITE, MAP_SHARED, g->vcpu_fd, 0);
+    struct kvm_run *run = g->run;
     while (!done) {
         if (ioctl(g->vcpu_fd, KVM_RUN, 0) < 0) {
             return guest_error(g, "kvm_run failed");
         }
-        
+
+        // Apply coalesced writes that precede this exit.
+        coalesced_drain(&coalesced);
+
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
             {
+                metric_inc(&g->exits.io, 1);
                 uint8_t *data = (uint8_t *) run + run->io.data_offset;
-                size_t len = (size_t) run->io.count * run->io.size;
-                if (run->io.direction == KVM_EXIT_IO_OUT) {
-                    if (run->io.port == PCI_CONFIG_ADDRESS || (run->io.port >= PCI_CONFIG_DATA && run->io.port < PCI_CONFIG_DATA + 4)) {
-                        phb_out(run->io.port, data, len);
-                    }
-                    else serial_out(&serial_16550a, run->io.port, data, len);
-                } else if (run->io.direction == KVM_EXIT_IO_IN) {
-                    if (run->io.port == PCI_CONFIG_ADDRESS || (run->io.port >= PCI_CONFIG_DATA && run->io.port < PCI_CONFIG_DATA + 4)) {
-                        phb_in(run->io.port, data, len);
-                    }
-                    else serial_in(&serial_16550a, run->io.port, data, len);
-                }
+                bus_dispatch_string(&g->pio_bus, &g->pio_cache, run->io.port, run->io.direction == KVM_EXIT_IO_OUT,
+                                    data, run->io.size, run->io.count);
                 break;
             }
         case KVM_EXIT_SHUTDOWN:
@@ -300,16 +686,13 @@ int guest_run(guest_t *g) {
             return 0;
         case KVM_EXIT_MMIO:
             {
-                printf("mmio %d %08llx %08x\r\n", run->mmio.is_write, run->mmio.phys_addr, run->mmio.len);
-                fflush(stdout);
-                if (run->mmio.is_write) {
-                    virtio_mmio_write(&virtio_config, run->mmio.phys_addr, run->mmio.data, run->mmio.len);
-                } else {
-                    virtio_mmio_read(&virtio_config, run->mmio.phys_addr, run->mmio.data, run->mmio.len);
-                }
+                metric_inc(&g->exits.mmio, 1);
+                bus_dispatch(&g->mmio_bus, &g->mmio_cache, run->mmio.phys_addr, run->mmio.is_write,
+                             run->mmio.data, run->mmio.len);
                 break;
             }
         default:
+            metric_inc(&g->exits.other, 1);
             printf("guest exited: reason: %d\n", run->exit_reason);
             return -1;
         }
@@ -318,140 +701,619 @@ int guest_run(guest_t *g) {
     return 0;
 }
 
-void* thread1_func(void* arg) {
-    serial_t *serial = (serial_t*) arg;
+#define COALESCED_DRAIN_INTERVAL_MS 10
+
+// When set, serial output is appended to the log instead of stdout.
+ringlog_t *console_log = NULL;
 
+/**
+ * The console_t bridges the serial_t device to stdin and stdout (or the
+ * console log) on an event loop.
+ */
+typedef struct console {
+    serial_t *serial;
+    event_loop_t *loop;
+    int eventfd;
+    int is_tty;
     tty_state_t tty_state;
-    if (tty_make_raw(STDIN_FILENO, &tty_state) < 0) {
-        perror("failed to enable tty raw mode");
+    event_source_t *serial_source;
+    event_source_t *stdin_source;
+    // Registered for EPOLLOUT while stdout would block.
+    event_source_t *stdout_source;
+    event_source_t *timer;
+    // Set while output is dropped, so that the error is reported once.
+    int write_failed;
+} console_t;
+
+console_t console;
+
+static void console_stdout_event(void *arg, uint32_t events);
+
+/**
+ * console_flush writes all pending serial output to stdout or the console
+ * log, at most two iovecs per write, until the tx queue is drained and the
+ * eventfd is re-armed. If stdout would block, it returns and resumes once
+ * stdout is writable, so that the devices sharing the loop keep running.
+ * Output that cannot be written, e.g. to a full disk, is dropped.
+ */
+static void console_flush(console_t *c) {
+    struct iovec iov[2];
+    int iovcnt;
+    while ((iovcnt = serial_peek(c->serial, iov)) > 0) {
+        ssize_t res = console_log != NULL ? ringlog_writev(console_log, iov, iovcnt) : writev(STDOUT_FILENO, iov, iovcnt);
+        if (res < 0 && errno == EINTR) continue;
+        // stdout shares the O_NONBLOCK file status flag with stdin when
+        // both refer to the same tty.
+        if (res < 0 && errno == EAGAIN && console_log == NULL) {
+            if (c->stdout_source == NULL) {
+                c->stdout_source = event_loop_add_fd(c->loop, STDOUT_FILENO, EPOLLOUT, console_stdout_event, c);
+            }
+            if (c->stdout_source != NULL) return;
+        }
+        if (res < 0) {
+            if (!c->write_failed) perror("failed to write console output");
+            c->write_failed = 1;
+            res = iov[0].iov_len + (iovcnt > 1 ? iov[1].iov_len : 0);
+        } else {
+            c->write_failed = 0;
+        }
+        serial_consume(c->serial, res);
+    }
+    if (c->stdout_source != NULL) {
+        event_loop_remove(c->loop, c->stdout_source);
+        c->stdout_source = NULL;
+    }
+}
+
+static void console_stdout_event(void *arg, uint32_t events) {
+    console_flush(arg);
+}
+
+static void console_serial_event(void *arg, uint32_t events) {
+    console_t *c = arg;
+    uint64_t count;
+    if (read(c->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("failed to read serial eventfd");
         exit(1);
     }
+    console_flush(c);
+}
+
+static void console_stdin_event(void *arg, uint32_t events) {
+    console_t *c = arg;
+    uint8_t buf[SERIAL_FIFO_LEN];
+    int res = read(STDIN_FILENO, buf, SERIAL_FIFO_LEN);
+    if (res == 0) {
+        // Keep draining guest output after stdin is closed.
+        event_loop_remove(c->loop, c->stdin_source);
+        c->stdin_source = NULL;
+        return;
+    }
+    if (res > 0) {
+        serial_write(c->serial, buf, res);
+    }
+    if (res < 0) {
+        if (errno != EAGAIN) {
+            perror("failed to read stdin");
+            exit(1);
+        }
+    }
+}
+
+// Coalesced console writes are applied before every dispatch, so the timer
+// only has to wake the loop while the vCPU is halted in the kernel.
+static void console_timer_event(void *arg, uint32_t events) {}
+
+static void guest_coalesced_drain(void *arg) {
+    coalesced_drain(&coalesced);
+}
+
+static int console_attach(console_t *c, serial_t *serial, event_loop_t *loop) {
+    c->serial = serial;
+    c->loop = loop;
+
+    // A headless VMM has no controlling tty for stdin.
+    c->is_tty = isatty(STDIN_FILENO);
+    if (c->is_tty && tty_make_raw(STDIN_FILENO, &c->tty_state) < 0) {
+        goto error0;
+    }
 
     int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
     if (fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK) < 0) {
         perror("failed to set O_NONBLOCK flag on stdin");
     }
 
-    int eventfd = serial_open(serial);
-    if (eventfd < 0) {
-        perror("failed to open serial console");
+    c->eventfd = serial_open(serial);
+    if (c->eventfd < 0) goto error1;
+
+    // Output pushed before the eventfd was opened is not signaled.
+    console_flush(c);
+
+    c->serial_source = event_loop_add_fd(loop, c->eventfd, EPOLLIN, console_serial_event, c);
+    if (c->serial_source == NULL) goto error2;
+
+    c->stdin_source = event_loop_add_fd(loop, STDIN_FILENO, EPOLLIN, console_stdin_event, c);
+    if (c->stdin_source == NULL) goto error3;
+
+    c->timer = event_loop_add_timer(loop, COALESCED_DRAIN_INTERVAL_MS, console_timer_event, c);
+    if (c->timer == NULL) goto error4;
+
+    return 0;
+
+error4:
+    event_loop_remove(loop, c->stdin_source);
+error3:
+    event_loop_remove(loop, c->serial_source);
+error2:
+    if (c->stdout_source != NULL) event_loop_remove(loop, c->stdout_source);
+    c->stdout_source = NULL;
+    serial_close(serial, c->eventfd);
+error1:
+    if (c->is_tty) tty_restore(STDIN_FILENO, c->tty_state);
+error0:
+    return -1;
+}
+
+/**
+ * console_detach removes the console from its event loop, which must not be
+ * running, and restores the tty.
+ */
+static void console_detach(console_t *c) {
+    event_loop_remove(c->loop, c->timer);
+    if (c->stdin_source != NULL) event_loop_remove(c->loop, c->stdin_source);
+    if (c->stdout_source != NULL) event_loop_remove(c->loop, c->stdout_source);
+    c->stdout_source = NULL;
+    event_loop_remove(c->loop, c->serial_source);
+    serial_close(c->serial, c->eventfd);
+    if (c->is_tty) tty_restore(STDIN_FILENO, c->tty_state);
+}
+
+// The source of the virtio-console port fds, and the loop it was added to.
+event_loop_t *virtio_console_loop = NULL;
+event_source_t *virtio_console_source = NULL;
+
+static void virtio_console_event(void *arg, uint32_t events) {
+    if (virtio_console_process((virtio_console_t*) arg) < 0) {
+        perror("failed to process virtio-console");
         exit(1);
     }
+}
 
-    int epollfd = epoll_create1(0);
-    if (epollfd < 0) {
-        perror("epoll_create1");
-        exit(1);
+iothread_pool_t iothreads;
+
+/**
+ * guest_attach_devices assigns the console, every virtio-blk or
+ * vhost-user-blk queue, the virtio-console and every virtio-net queue pair to
+ * the iothreads of `pool` round-robin.
+ */
+static int guest_attach_devices(guest_t *g, iothread_pool_t *pool) {
+    size_t next = 0;
+    if (console_attach(&console, &serial_16550a, iothread_pool_loop(pool, next++)) < 0) {
+        return -1;
     }
 
-    struct epoll_event event;
+    // Completions of a virtio-blk queue are reaped on the loop it is
+    // notified on.
+    for (uint32_t i = 0; virtio_blk.bdev != NULL && i < virtio_blk.mmio.queue_count; i++) {
+        event_loop_t *loop = iothread_pool_loop(pool, next++);
+        if (virtio_mmio_attach_queue(&virtio_blk.mmio, i, g->vm_fd, loop) < 0) return -1;
+        if (bdev_queue_attach(virtio_blk.queues[i].bdev_queue, loop) < 0) return -1;
+    }
+    // Only the interrupts of a vhost-user disk are relayed by the VMM.
+    for (uint32_t i = 0; vhost_user_blk.path != NULL && i < vhost_user_blk.mmio.queue_count; i++) {
+        if (vhost_user_blk_attach_queue(&vhost_user_blk, i, g->vm_fd, iothread_pool_loop(pool, next++)) < 0) {
+            return -1;
+        }
+    }
 
-    event.events = EPOLLIN;
-    event.data.fd = eventfd;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, eventfd, &event) == -1) {
-        perror("epoll_ctl: eventfd");
-        exit(EXIT_FAILURE);
+    if (virtio_console.port_count > 0) {
+        // The console queues share one loop with the port fds.
+        event_loop_t *loop = iothread_pool_loop(pool, next++);
+        virtio_console_source = event_loop_add_fd(loop, virtio_console_fd(&virtio_console), EPOLLIN,
+                                                  virtio_console_event, &virtio_console);
+        if (virtio_console_source == NULL) return -1;
+        virtio_console_loop = loop;
+        for (uint32_t i = 0; i < virtio_console.mmio.queue_count; i++) {
+            if (virtio_mmio_attach_queue(&virtio_console.mmio, i, g->vm_fd, loop) < 0) return -1;
+        }
     }
 
-    event.events = EPOLLIN;
-    event.data.fd = STDIN_FILENO;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == -1) {
-        perror("epoll_ctl: stdin");
-        exit(EXIT_FAILURE);
+    // A queue pair is served on one loop with its backend queue.
+    for (uint32_t i = 0; virtio_net.backend != NULL && i < virtio_net.queue_pairs; i++) {
+        if (virtio_net_attach_pair(&virtio_net, i, g->vm_fd, iothread_pool_loop(pool, next++)) < 0) return -1;
     }
-  
-    const size_t MAX_EVENTS = 8;
-    struct epoll_event events[MAX_EVENTS];
-    while (!done) {
-        int n = epoll_wait(epollfd, events, MAX_EVENTS, -1);
-        if (n == -1) {
-            perror("epoll_wait");
-            exit(1);
-        }
-        
-        for (int i = 0; i < n; i++) {
-
-            if (events[i].data.fd == eventfd) {
-                uint8_t buf[SERIAL_FIFO_LEN];
-                int res = serial_read(serial, buf, SERIAL_FIFO_LEN);
-                if (res == 0) return NULL;
-                if (res > 0) {
-                   write(STDOUT_FILENO, buf, res);
-                }
-                if (res < 0) {
-                    if (errno != EAGAIN) {
-                        perror("failed to read stdin");
-                        exit(1);
-                    }
-                }
-            }
 
-            if (events[i].data.fd == STDIN_FILENO) {
-                uint8_t buf[SERIAL_FIFO_LEN];
-                int res = read(STDIN_FILENO, buf, SERIAL_FIFO_LEN);
-                if (res == 0) return NULL;
-                if (res > 0) {
-                    serial_write(serial, buf, res);
-                }
-                if (res < 0) {
-                    if (errno != EAGAIN) {
-                        perror("failed to read stdin");
-                        exit(1);
-                    }
-                }
-            }
+    return 0;
+}
+
+/**
+ * guest_detach_devices undoes guest_attach_devices. The iothreads must not
+ * be running.
+ */
+static void guest_detach_devices(guest_t *g) {
+    if (console.serial != NULL) {
+        console_detach(&console);
+        console.serial = NULL;
+    }
+    virtio_mmio_detach(&virtio_blk.mmio);
+    for (uint32_t i = 0; virtio_blk.bdev != NULL && i < virtio_blk.mmio.queue_count; i++) {
+        bdev_queue_detach(virtio_blk.queues[i].bdev_queue);
+    }
+    vhost_user_blk_detach(&vhost_user_blk);
+    virtio_mmio_detach(&virtio_console.mmio);
+    if (virtio_console_source != NULL) {
+        event_loop_remove(virtio_console_loop, virtio_console_source);
+        virtio_console_source = NULL;
+    }
+    virtio_net_detach(&virtio_net);
+}
+
+#define IOTHREAD_MAX 64
+
+/**
+ * parse_cpu_list parses a list of cpus such as `0,2-3` into `cpus`.
+ */
+static int parse_cpu_list(const char *s, int *cpus, size_t max, size_t *count) {
+    *count = 0;
+    while (*s != '\0') {
+        char *end;
+        long first = strtol(s, &end, 10);
+        long last = first;
+        if (end == s || first < 0) return -1;
+        if (*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first) return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (*count == max) return -1;
+            cpus[(*count)++] = cpu;
         }
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        s = end;
     }
+    return *count > 0 ? 0 : -1;
+}
 
-    tty_restore(STDIN_FILENO, tty_state);
-    close(epollfd);
-    serial_close(serial, eventfd);
-    
-    return NULL;
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-m metrics.sock] [-b serial-buffer-bytes] [-C name=backend]... "
+                    "[-l console.log[,size=N][,rotate=N][,timestamps]] [-t iothreads] [-a cpu-list] [-d disk|vhost-user:socket] "
+                    "[-k cache-size[,writeback][,hugepages]] [-q disk-limits] [-u bounce-slots[,hugepages]] [-i vda|hvc|eth:usecs=N[,frames=N][,adaptive]]... "
+                    "[-n tap:ifname[,queues=N][,novhost]|seqpacket:path[,queues=N][,listen]] "
+                    "<bzImage|vmlinux> <initramfs>\n", prog);
 }
 
 int main(int argc, char *argv[]) {
-    guest_t guest;
-    
+    start_ns = monotonic_ns();
+    guest_t guest = {0};
+    const char *metrics_path = NULL;
+    size_t serial_buffer_len = SERIAL_TX_BUFFER_LEN;
+    const char *console_specs[VIRTIO_CONSOLE_MAX_PORTS];
+    size_t console_spec_count = 0;
+    const char *console_log_spec = NULL;
+    const char *disk_path = NULL;
+    const char *disk_cache_spec = NULL;
+    throttle_limits_t disk_limits = {0};
+    size_t bounce_slots = BDEV_BOUNCE_SLOTS;
+    int bounce_flags = 0;
+    bcache_t bcache;
+    ringlog_t ringlog;
+    size_t iothread_count = 1;
+    int iothread_cpus[IOTHREAD_MAX];
+    size_t iothread_cpu_count = 0;
+    irqmod_config_t disk_irqmod = {0};
+    irqmod_config_t console_irqmod = {0};
+    irqmod_config_t net_irqmod = {0};
+    const char *net_spec = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:b:C:l:t:a:d:k:q:u:i:n:")) != -1) {
+        switch (opt) {
+        case 'm':
+            metrics_path = optarg;
+            break;
+        case 'b':
+            serial_buffer_len = strtoull(optarg, NULL, 0);
+            break;
+        case 'C':
+            if (console_spec_count == VIRTIO_CONSOLE_MAX_PORTS) {
+                fprintf(stderr, "too many console ports (max %d)\n", VIRTIO_CONSOLE_MAX_PORTS);
+                return 1;
+            }
+            console_specs[console_spec_count++] = optarg;
+            break;
+        case 'l':
+            console_log_spec = optarg;
+            break;
+        case 'd':
+            disk_path = optarg;
+            break;
+        case 'k':
+            disk_cache_spec = optarg;
+            break;
+        case 'u': {
+            char *end;
+            bounce_slots = strtoull(optarg, &end, 0);
+            if (strcmp(end, ",hugepages") == 0) {
+                bounce_flags |= BOUNCE_HUGEPAGES;
+            } else if (*end != '\0' || bounce_slots == 0) {
+                fprintf(stderr, "invalid bounce pool: %s\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'q':
+            if (throttle_limits_parse(&disk_limits, optarg) < 0) {
+                fprintf(stderr, "invalid disk limits: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'i': {
+            irqmod_config_t *config = strncmp(optarg, "vda:", 4) == 0 ? &disk_irqmod :
+                                      strncmp(optarg, "hvc:", 4) == 0 ? &console_irqmod :
+                                      strncmp(optarg, "eth:", 4) == 0 ? &net_irqmod : NULL;
+            if (config == NULL || irqmod_config_parse(config, optarg + 4) < 0) {
+                fprintf(stderr, "invalid interrupt moderation: %s\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'n':
+            net_spec = optarg;
+            break;
+        case 't':
+            iothread_count = strtoull(optarg, NULL, 0);
+            if (iothread_count == 0 || iothread_count > IOTHREAD_MAX) {
+                fprintf(stderr, "iothread count must be between 1 and %d\n", IOTHREAD_MAX);
+                return 1;
+            }
+            break;
+        case 'a':
+            if (parse_cpu_list(optarg, iothread_cpus, IOTHREAD_MAX, &iothread_cpu_count) < 0) {
+                fprintf(stderr, "invalid cpu list: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 2) {
+        usage(argv[0]);
+        return 1;
+    }
 
     signal(SIGTERM, handle_sigterm);
 
+    if (console_log_spec != NULL) {
+        if (ringlog_init_spec(&ringlog, console_log_spec) < 0) {
+            fprintf(stderr, "failed to open console log %s: %s\n", console_log_spec, strerror(errno));
+            return 1;
+        }
+        console_log = &ringlog;
+    }
+
     if (guest_init(&guest) < 0) {
         perror("failed to initialize guest");
         goto error0;
     }
 
     pbh_init();
-    virtio_mmio_config_init(&virtio_config, guest.mem.host_addr, kvm_irq_line, &guest);
 
-    if (serial_init(&serial_16550a, kvm_irq_line, &guest) < 0) {
+    if (serial_init(&serial_16550a, serial_buffer_len, kvm_irq_line, &guest) < 0) {
         perror("failed to initialize serial device");
         goto error1;
     }
 
-    if (guest_load(&guest, argv[1], argv[2]) < 0) {
-        perror("failed to load guest");
+    if (virtio_console_init(&virtio_console, VIRTIO_CONSOLE_MMIO_BASE, VIRTIO_CONSOLE_IRQ,
+                            &guest.mem_map, kvm_irq_line, &guest) < 0) {
+        perror("failed to initialize virtio-console");
         goto error2;
     }
+    virtio_mmio_set_irqmod(&virtio_console.mmio, &console_irqmod);
+    for (size_t i = 0; i < console_spec_count; i++) {
+        if (virtio_console_add_port_spec(&virtio_console, console_specs[i]) < 0) {
+            fprintf(stderr, "failed to add console port %s: %s\n", console_specs[i], strerror(errno));
+            goto error3;
+        }
+    }
 
-    pthread_t thread1;
-    if (pthread_create(&thread1, NULL, thread1_func, &serial_16550a) != 0) {
-        perror("failed to create thread");
-        goto error2;
+    if (disk_path != NULL && strncmp(disk_path, "vhost-user:", 11) == 0) {
+        // The disk and its cache, limits and bounce buffers belong to the
+        // back-end.
+        if (vhost_user_blk_init(&vhost_user_blk, VIRTIO_BLK_MMIO_BASE, VIRTIO_BLK_IRQ, &guest.mem_map,
+                                kvm_irq_line, &guest, disk_path + 11) < 0) {
+            fprintf(stderr, "failed to connect to vhost-user-blk %s: %s\n", disk_path + 11, strerror(errno));
+            goto error3;
+        }
+        virtio_mmio_set_irqmod(&vhost_user_blk.mmio, &disk_irqmod);
+    } else if (disk_path != NULL) {
+        if (bdev_init(&disk, disk_path, VIRTIO_BLK_QUEUE_COUNT, VIRTIO_BLK_QUEUE_DEPTH) < 0) {
+            fprintf(stderr, "failed to open disk %s: %s\n", disk_path, strerror(errno));
+            goto error3;
+        }
+        if ((bounce_slots != BDEV_BOUNCE_SLOTS || bounce_flags != 0) &&
+            bdev_set_bounce(&disk, bounce_slots, bounce_flags) < 0) {
+            perror("failed to allocate disk bounce buffers");
+            bdev_deinit(&disk);
+            goto error3;
+        }
+        if (bdev_set_limits(&disk, &disk_limits) < 0) {
+            perror("failed to set disk limits");
+            bdev_deinit(&disk);
+            goto error3;
+        }
+        if (disk_cache_spec != NULL) {
+            if (bcache_init_spec(&bcache, disk_cache_spec) < 0) {
+                fprintf(stderr, "failed to initialize disk cache %s: %s\n", disk_cache_spec, strerror(errno));
+                bdev_deinit(&disk);
+                goto error3;
+            }
+            disk_cache = &bcache;
+            bdev_set_cache(&disk, disk_cache);
+        }
+        if (virtio_blk_init(&virtio_blk, VIRTIO_BLK_MMIO_BASE, VIRTIO_BLK_IRQ, &guest.mem_map,
+                            kvm_irq_line, &guest, &disk) < 0) {
+            perror("failed to initialize virtio-blk");
+            bdev_deinit(&disk);
+            if (disk_cache != NULL) bcache_deinit(disk_cache);
+            goto error3;
+        }
+        virtio_mmio_set_irqmod(&virtio_blk.mmio, &disk_irqmod);
+    }
+
+    if (net_spec != NULL) {
+        // A listening seqpacket backend waits here for its peer.
+        if (net_backend_open_spec(&net_backend, net_spec) < 0) {
+            fprintf(stderr, "failed to open network backend %s: %s\n", net_spec, strerror(errno));
+            goto error3;
+        }
+        if (virtio_net_init(&virtio_net, VIRTIO_NET_MMIO_BASE, VIRTIO_NET_IRQ, &guest.mem_map,
+                            kvm_irq_line, &guest, &net_backend) < 0) {
+            perror("failed to initialize virtio-net");
+            net_backend_close(&net_backend);
+            goto error3;
+        }
+        virtio_mmio_set_irqmod(&virtio_net.mmio, &net_irqmod);
+    }
+
+    if (guest_init_bus(&guest) < 0) {
+        perror("failed to initialize buses");
+        goto error3;
+    }
+
+    if (guest_init_coalesced(&guest) < 0) {
+        perror("failed to initialize coalesced mmio");
+        goto error3;
+    }
+
+    char cmdline[KERNEL_CMDLINE_LEN];
+    int cmdline_len = snprintf(cmdline, sizeof(cmdline), "console=ttyS0,9600");
+    if (virtio_blk.bdev != NULL || vhost_user_blk.path != NULL) {
+        cmdline_len += snprintf(cmdline + cmdline_len, sizeof(cmdline) - cmdline_len,
+            " virtio_mmio.device=%d@0x%lx:%d",
+            VIRTIO_MMIO_IO_SIZE, (unsigned long)VIRTIO_BLK_MMIO_BASE, VIRTIO_BLK_IRQ);
+    }
+    if (virtio_console.port_count > 0) {
+        cmdline_len += snprintf(cmdline + cmdline_len, sizeof(cmdline) - cmdline_len,
+            " virtio_mmio.device=%d@0x%lx:%d",
+            VIRTIO_MMIO_IO_SIZE, (unsigned long)VIRTIO_CONSOLE_MMIO_BASE, VIRTIO_CONSOLE_IRQ);
+    }
+    if (virtio_net.backend != NULL) {
+        snprintf(cmdline + cmdline_len, sizeof(cmdline) - cmdline_len,
+            " virtio_mmio.device=%d@0x%lx:%d",
+            VIRTIO_MMIO_IO_SIZE, (unsigned long)VIRTIO_NET_MMIO_BASE, VIRTIO_NET_IRQ);
+    }
+
+    if (guest_load(&guest, argv[optind], argv[optind + 1], cmdline) < 0) {
+        perror("failed to load guest");
+        goto error3;
+    }
+
+    if (iothread_pool_init(&iothreads, iothread_count, iothread_cpus, iothread_cpu_count) < 0) {
+        perror("failed to initialize iothreads");
+        goto error3;
+    }
+    for (size_t i = 0; i < iothreads.count; i++) {
+        event_loop_set_pre_dispatch(&iothreads.threads[i].loop, guest_coalesced_drain, NULL);
+    }
+
+    if (guest_attach_devices(&guest, &iothreads) < 0) {
+        perror("failed to attach devices to iothreads");
+        goto error4;
+    }
+
+    if (metrics_path != NULL) {
+        if (metrics_init(&metrics) < 0 ||
+            guest_register_metrics(&guest, &metrics) < 0 ||
+            bus_register_metrics(&guest.pio_bus, &metrics, "space=\"pio\"") < 0 ||
+            bus_register_metrics(&guest.mmio_bus, &metrics, "space=\"mmio\"") < 0 ||
+            bus_cache_register_metrics(&guest.pio_cache, &metrics, "space=\"pio\"") < 0 ||
+            bus_cache_register_metrics(&guest.mmio_cache, &metrics, "space=\"mmio\"") < 0 ||
+            mem_map_register_metrics(&guest.mem_map, &metrics, NULL) < 0 ||
+            serial_register_metrics(&serial_16550a, &metrics, "port=\"ttyS0\"") < 0 ||
+            (virtio_blk.bdev != NULL && (
+                virtio_blk_register_metrics(&virtio_blk, &metrics, "dev=\"vda\"") < 0 ||
+                virtio_blk_register_trace(&virtio_blk, &metrics, "/trace/vda") < 0 ||
+                bdev_register_metrics(&disk, &metrics, "dev=\"vda\"") < 0)) ||
+            (vhost_user_blk.path != NULL &&
+                vhost_user_blk_register_metrics(&vhost_user_blk, &metrics, "dev=\"vda\"") < 0) ||
+            (disk_cache != NULL && bcache_register_metrics(disk_cache, &metrics, "dev=\"vda\"") < 0) ||
+            virtio_console_register_metrics(&virtio_console, &metrics, "dev=\"hvc\"") < 0 ||
+            (virtio_net.backend != NULL &&
+                virtio_net_register_metrics(&virtio_net, &metrics, "dev=\"eth0\"") < 0) ||
+            coalesced_register_metrics(&coalesced, &metrics, NULL) < 0 ||
+            iothread_pool_register_metrics(&iothreads, &metrics, NULL) < 0) {
+            perror("failed to register metrics");
+            goto error4;
+        }
+        if (metrics_serve(&metrics, metrics_path) < 0) {
+            perror("failed to serve metrics");
+            goto error4;
+        }
+    }
+
+    if (iothread_pool_start(&iothreads) < 0) {
+        perror("failed to start iothreads");
+        goto error4;
     }
 
     guest_run(&guest);
 
-    pthread_join(thread1, NULL);
+    iothread_pool_stop(&iothreads);
+    if (metrics_path != NULL) {
+        metrics_deinit(&metrics);
+    }
+    guest_detach_devices(&guest);
+    iothread_pool_deinit(&iothreads);
+    coalesced_deinit(&coalesced);
+    if (virtio_blk.bdev != NULL) {
+        virtio_blk_deinit(&virtio_blk);
+        bdev_deinit(&disk);
+        if (disk_cache != NULL) bcache_deinit(disk_cache);
+    }
+    if (vhost_user_blk.path != NULL) {
+        vhost_user_blk_deinit(&vhost_user_blk);
+    }
+    if (virtio_net.backend != NULL) {
+        virtio_net_deinit(&virtio_net);
+        net_backend_close(&net_backend);
+    }
+    virtio_console_deinit(&virtio_console);
     serial_deinit(&serial_16550a);
     guest_deinit(&guest);
+    if (console_log != NULL) {
+        ringlog_deinit(console_log);
+    }
 
     return 0;
 
+error4:
+    guest_detach_devices(&guest);
+    iothread_pool_deinit(&iothreads);
+error3:
+    if (virtio_blk.bdev != NULL) {
+        virtio_blk_deinit(&virtio_blk);
+        bdev_deinit(&disk);
+        if (disk_cache != NULL) bcache_deinit(disk_cache);
+    }
+    if (vhost_user_blk.path != NULL) {
+        vhost_user_blk_deinit(&vhost_user_blk);
+    }
+    if (virtio_net.backend != NULL) {
+        virtio_net_deinit(&virtio_net);
+        net_backend_close(&net_backend);
+    }
+    virtio_console_deinit(&virtio_console);
 error2:
     serial_deinit(&serial_16550a);
 error1:
     guest_deinit(&guest);
 error0:
+    if (console_log != NULL) {
+        ringlog_deinit(console_log);
+    }
     return 1;
 }
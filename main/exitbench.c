@@ -0,0 +1,443 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <linux/kvm.h>
+
+#include <coalesced.h>
+
+// The layout of bin/guest0, see main/guest0.S.
+#define GUEST0_LOAD_ADDR 0x10000
+#define GUEST0_ENTRY_SIZE 0x100
+#define GUEST0_STACK 0x7000
+#define GUEST0_IRQ_COUNT 0x500
+#define GUEST0_IRQ 5
+#define GUEST0_IRQ_VECTOR 0x25
+
+#define BENCH_MEMORY_SIZE 0x80000
+#define BENCH_PIO_PORT 0x10
+#define BENCH_COALESCED_PORT 0x12
+#define BENCH_IOEVENTFD_PORT 0x14
+
+#define BENCH_DEFAULT_SECONDS 1.0
+// A wakeup not observed within this time counts as lost.
+#define BENCH_IRQ_TIMEOUT_NS 100000000ULL
+
+typedef enum bench_kind {
+    BENCH_EXITS,
+    BENCH_COALESCED,
+    BENCH_IOEVENTFD,
+    BENCH_IRQ,
+} bench_kind_t;
+
+typedef struct bench_spec {
+    const char *name;
+    // The index of the guest0 entry.
+    int entry;
+    bench_kind_t kind;
+} bench_spec_t;
+
+static const bench_spec_t benches[] = {
+    { "pio_out", 0, BENCH_EXITS },
+    { "pio_in", 1, BENCH_EXITS },
+    { "mmio_write", 2, BENCH_EXITS },
+    { "mmio_read", 3, BENCH_EXITS },
+    { "coalesced_pio", 4, BENCH_COALESCED },
+    { "ioeventfd", 5, BENCH_IOEVENTFD },
+    { "hlt_wakeup", 6, BENCH_IRQ },
+    { "irq_inject", 7, BENCH_IRQ },
+};
+
+#define BENCH_COUNT (sizeof(benches) / sizeof(benches[0]))
+
+typedef struct bench_vm {
+    int kvm_fd;
+    int vm_fd;
+    int vcpu_fd;
+    struct kvm_run *run;
+    size_t run_size;
+    uint8_t *mem;
+
+    coalesced_t coalesced;
+    int coalesced_enabled;
+    int eventfd;
+
+    pthread_t thread;
+    _Atomic int stop;
+    // Userspace exits handled by the vCPU thread, and coalesced writes
+    // drained from the ring.
+    uint64_t exits;
+    uint64_t coalesced_writes;
+    int error;
+} bench_vm_t;
+
+typedef struct bench_result {
+    uint64_t ops;
+    uint64_t exits;
+    double seconds;
+} bench_result_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_signal(int sig) {
+    (void) sig;
+}
+
+static void bench_coalesced_write(void *arg, uint64_t addr, uint8_t *data, uint32_t len, int pio) {
+    bench_vm_t *vm = (bench_vm_t*) arg;
+    vm->coalesced_writes++;
+}
+
+static int bench_vm_set_regs(bench_vm_t *vm, int entry) {
+    struct kvm_sregs sregs;
+    if (ioctl(vm->vcpu_fd, KVM_GET_SREGS, &sregs) < 0) return -1;
+    sregs.cs.selector = GUEST0_LOAD_ADDR >> 4;
+    sregs.cs.base = GUEST0_LOAD_ADDR;
+    struct kvm_segment *segs[] = { &sregs.ds, &sregs.es, &sregs.fs, &sregs.gs, &sregs.ss };
+    for (size_t i = 0; i < sizeof(segs) / sizeof(segs[0]); i++) {
+        segs[i]->selector = 0;
+        segs[i]->base = 0;
+    }
+    if (ioctl(vm->vcpu_fd, KVM_SET_SREGS, &sregs) < 0) return -1;
+
+    struct kvm_regs regs = {
+        .rip = entry * GUEST0_ENTRY_SIZE,
+        .rsp = GUEST0_STACK,
+        .rflags = 2,
+    };
+    return ioctl(vm->vcpu_fd, KVM_SET_REGS, &regs);
+}
+
+static int bench_vm_init(bench_vm_t *vm, const bench_spec_t *spec, const void *image, size_t image_size) {
+    memset(vm, 0, sizeof(bench_vm_t));
+    vm->eventfd = -1;
+    if ((vm->kvm_fd = open("/dev/kvm", O_RDWR)) < 0) return -1;
+    if ((vm->vm_fd = ioctl(vm->kvm_fd, KVM_CREATE_VM, 0)) < 0) goto error0;
+    if (ioctl(vm->vm_fd, KVM_CREATE_IRQCHIP, 0) < 0) goto error1;
+
+    vm->mem = mmap(NULL, BENCH_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (vm->mem == MAP_FAILED) goto error1;
+    memcpy(vm->mem + GUEST0_LOAD_ADDR, image, image_size);
+    struct kvm_userspace_memory_region region = {
+        .slot = 0,
+        .guest_phys_addr = 0,
+        .memory_size = BENCH_MEMORY_SIZE,
+        .userspace_addr = (uintptr_t) vm->mem,
+    };
+    if (ioctl(vm->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0) goto error2;
+
+    if ((vm->vcpu_fd = ioctl(vm->vm_fd, KVM_CREATE_VCPU, 0)) < 0) goto error2;
+    int run_size = ioctl(vm->kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
+    if (run_size < 0) goto error3;
+    vm->run_size = run_size;
+    vm->run = mmap(NULL, vm->run_size, PROT_READ | PROT_WRITE, MAP_SHARED, vm->vcpu_fd, 0);
+    if (vm->run == MAP_FAILED) goto error3;
+    if (bench_vm_set_regs(vm, spec->entry) < 0) goto error4;
+
+    if (spec->kind == BENCH_COALESCED) {
+        if (coalesced_init(&vm->coalesced, vm->kvm_fd, vm->vm_fd, vm->run, bench_coalesced_write, vm) < 0) goto error4;
+        vm->coalesced_enabled = 1;
+        if (coalesced_add_pio(&vm->coalesced, BENCH_COALESCED_PORT, 1) < 0) goto error5;
+    }
+    if (spec->kind == BENCH_IOEVENTFD) {
+        if ((vm->eventfd = eventfd(0, EFD_CLOEXEC)) < 0) goto error4;
+        struct kvm_ioeventfd ioeventfd = {
+            .addr = BENCH_IOEVENTFD_PORT,
+            .len = 2,
+            .fd = vm->eventfd,
+            .flags = KVM_IOEVENTFD_FLAG_PIO,
+        };
+        if (ioctl(vm->vm_fd, KVM_IOEVENTFD, &ioeventfd) < 0) goto error5;
+    }
+    return 0;
+
+error5:
+    if (vm->eventfd >= 0) close(vm->eventfd);
+    if (vm->coalesced_enabled) coalesced_deinit(&vm->coalesced);
+error4:
+    munmap(vm->run, vm->run_size);
+error3:
+    close(vm->vcpu_fd);
+error2:
+    munmap(vm->mem, BENCH_MEMORY_SIZE);
+error1:
+    close(vm->vm_fd);
+error0:
+    close(vm->kvm_fd);
+    return -1;
+}
+
+static void bench_vm_deinit(bench_vm_t *vm) {
+    if (vm->eventfd >= 0) close(vm->eventfd);
+    if (vm->coalesced_enabled) coalesced_deinit(&vm->coalesced);
+    munmap(vm->run, vm->run_size);
+    close(vm->vcpu_fd);
+    munmap(vm->mem, BENCH_MEMORY_SIZE);
+    close(vm->vm_fd);
+    close(vm->kvm_fd);
+}
+
+/**
+ * bench_vcpu_func runs the vCPU until bench_vm_stop, handling every exit
+ * with the least possible work so that only the exit itself is measured.
+ */
+static void* bench_vcpu_func(void *arg) {
+    bench_vm_t *vm = (bench_vm_t*) arg;
+    struct kvm_run *run = vm->run;
+    while (!atomic_load(&vm->stop)) {
+        if (ioctl(vm->vcpu_fd, KVM_RUN, 0) < 0) {
+            if (errno == EINTR) continue;
+            vm->error = errno;
+            break;
+        }
+        if (vm->coalesced_enabled) coalesced_drain(&vm->coalesced);
+
+        switch (run->exit_reason) {
+        case KVM_EXIT_IO:
+            if (run->io.direction == KVM_EXIT_IO_IN) {
+                memset((uint8_t*) run + run->io.data_offset, 0, (size_t) run->io.size * run->io.count);
+            }
+            vm->exits++;
+            break;
+        case KVM_EXIT_MMIO:
+            if (!run->mmio.is_write) memset(run->mmio.data, 0, sizeof(run->mmio.data));
+            vm->exits++;
+            break;
+        default:
+            fprintf(stderr, "unexpected exit reason %d\n", run->exit_reason);
+            vm->error = EINVAL;
+            atomic_store(&vm->stop, 1);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int bench_vm_start(bench_vm_t *vm) {
+    int err = pthread_create(&vm->thread, NULL, bench_vcpu_func, vm);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * bench_vm_stop kicks the vCPU out of KVM_RUN, even if it never exits on
+ * its own, and waits for its thread.
+ */
+static int bench_vm_stop(bench_vm_t *vm) {
+    atomic_store(&vm->stop, 1);
+    vm->run->immediate_exit = 1;
+    pthread_kill(vm->thread, SIGUSR1);
+    pthread_join(vm->thread, NULL);
+    if (vm->error != 0) {
+        errno = vm->error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * bench_irq injects IRQ 5 and waits for the guest handler to count it
+ * before injecting the next one, measuring the round trip from
+ * KVM_IRQ_LINE to the guest handler.
+ */
+static int bench_irq(bench_vm_t *vm, uint64_t deadline, uint64_t *ops) {
+    volatile _Atomic uint32_t *count = (_Atomic uint32_t*) (vm->mem + GUEST0_IRQ_COUNT);
+    uint32_t seen = 0;
+
+    // Wait for the guest to install its handler, then give it time to
+    // program the PIC: ICW1 drops edges latched before it.
+    for (uint64_t start = now_ns(); *(volatile uint16_t*) (vm->mem + GUEST0_IRQ_VECTOR * 4) == 0;) {
+        if (now_ns() - start > BENCH_IRQ_TIMEOUT_NS) goto timeout;
+    }
+    usleep(1000);
+
+    while (now_ns() < deadline) {
+        struct kvm_irq_level irq = { .irq = GUEST0_IRQ, .level = 1 };
+        if (ioctl(vm->vm_fd, KVM_IRQ_LINE, &irq) < 0) return -1;
+        irq.level = 0;
+        if (ioctl(vm->vm_fd, KVM_IRQ_LINE, &irq) < 0) return -1;
+
+        uint64_t start = now_ns();
+        while (atomic_load(count) == seen) {
+            if (now_ns() - start > BENCH_IRQ_TIMEOUT_NS) goto timeout;
+        }
+        seen = atomic_load(count);
+        (*ops)++;
+    }
+    return 0;
+
+timeout:
+    fprintf(stderr, "guest did not handle irq %d\n", GUEST0_IRQ);
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+static int bench_run(const bench_spec_t *spec, const void *image, size_t image_size, double seconds,
+                     bench_result_t *result) {
+    bench_vm_t vm;
+    if (bench_vm_init(&vm, spec, image, image_size) < 0) return -1;
+
+    memset(result, 0, sizeof(bench_result_t));
+    uint64_t start = now_ns();
+    uint64_t deadline = start + (uint64_t) (seconds * 1e9);
+    if (bench_vm_start(&vm) < 0) goto error0;
+
+    int res = 0;
+    if (spec->kind == BENCH_IRQ) {
+        res = bench_irq(&vm, deadline, &result->ops);
+    } else {
+        uint64_t now;
+        while ((now = now_ns()) < deadline) {
+            struct timespec ts = { 0, deadline - now < 10000000 ? deadline - now : 10000000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+    if (bench_vm_stop(&vm) < 0 || res < 0) goto error0;
+    result->seconds = (now_ns() - start) / 1e9;
+    result->exits = vm.exits;
+
+    switch (spec->kind) {
+    case BENCH_EXITS:
+        result->ops = vm.exits;
+        break;
+    case BENCH_COALESCED:
+        coalesced_drain(&vm.coalesced);
+        result->ops = vm.coalesced_writes;
+        break;
+    case BENCH_IOEVENTFD:
+        if (read(vm.eventfd, &result->ops, sizeof(result->ops)) != sizeof(result->ops)) goto error0;
+        break;
+    case BENCH_IRQ:
+        break;
+    }
+
+    bench_vm_deinit(&vm);
+    return 0;
+
+error0:
+    bench_vm_deinit(&vm);
+    return -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-t seconds] [-b benchmark]... <guest0>\n", prog);
+    fprintf(stderr, "benchmarks:");
+    for (size_t i = 0; i < BENCH_COUNT; i++) fprintf(stderr, " %s", benches[i].name);
+    fprintf(stderr, "\n");
+}
+
+/**
+ * exitbench measures the round trip of each kind of VM exit, and of the
+ * exit-less paths that replace them, with the guests of bin/guest0, and
+ * writes the results as JSON to stdout.
+ */
+int main(int argc, char *argv[]) {
+    double seconds = BENCH_DEFAULT_SECONDS;
+    int selected[BENCH_COUNT] = {0};
+    int any_selected = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:b:")) != -1) {
+        switch (opt) {
+        case 't':
+            seconds = atof(optarg);
+            if (seconds <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'b':
+            {
+                size_t i = 0;
+                while (i < BENCH_COUNT && strcmp(benches[i].name, optarg) != 0) i++;
+                if (i == BENCH_COUNT) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                selected[i] = 1;
+                any_selected = 1;
+                break;
+            }
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0) {
+        perror("failed to open guest");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0 || GUEST0_LOAD_ADDR + st.st_size > BENCH_MEMORY_SIZE) {
+        fprintf(stderr, "invalid guest image\n");
+        close(fd);
+        return 1;
+    }
+    void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        perror("failed to map guest");
+        return 1;
+    }
+
+    // SIGUSR1 interrupts KVM_RUN to stop a vCPU, so it must not restart.
+    struct sigaction sa = { .sa_handler = bench_signal };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    struct utsname uts;
+    uname(&uts);
+    // irq_inject needs a CPU for the spinning vCPU and one for the injector.
+    printf("{\n  \"kernel\": \"%s\",\n  \"machine\": \"%s\",\n  \"cpus\": %ld,\n  \"seconds\": %g,\n"
+           "  \"benchmarks\": [", uts.release, uts.machine, sysconf(_SC_NPROCESSORS_ONLN), seconds);
+
+    int rc = 0;
+    int first = 1;
+    for (size_t i = 0; i < BENCH_COUNT; i++) {
+        if (any_selected && !selected[i]) continue;
+        bench_result_t result;
+        if (bench_run(&benches[i], image, st.st_size, seconds, &result) < 0) {
+            fprintf(stderr, "%s: %s\n", benches[i].name, strerror(errno));
+            rc = 1;
+            continue;
+        }
+        double per_sec = result.ops / result.seconds;
+        double ns_per_op = result.ops ? result.seconds * 1e9 / result.ops : 0;
+        printf("%s\n    {\"name\": \"%s\", \"ops\": %llu, \"exits\": %llu, \"ops_per_sec\": %.0f, "
+               "\"ns_per_op\": %.1f}", first ? "" : ",", benches[i].name, (unsigned long long) result.ops,
+               (unsigned long long) result.exits, per_sec, ns_per_op);
+        first = 0;
+    }
+    printf("\n  ]\n}\n");
+
+    munmap(image, st.st_size);
+    return rc;
+}
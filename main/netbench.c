@@ -0,0 +1,616 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#include <linux/kvm.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_mmio.h>
+
+#include <virtio-net.h>
+
+#define BENCH_MMIO_BASE 0xd0000000
+#define BENCH_IRQ 5
+
+#define BENCH_QUEUE_NUM 256
+// Each queue's region holds its rings, then its buffers.
+#define BENCH_DESC_OFFSET 0x0000
+#define BENCH_AVAIL_OFFSET 0x1000
+#define BENCH_USED_OFFSET 0x2000
+#define BENCH_BUFFERS_OFFSET 0x4000
+// The size of the receive buffers the driver posts, as the Linux driver
+// does with merged buffers.
+#define BENCH_RX_BUFFER_SIZE 4096
+
+#define BENCH_DEFAULT_SECONDS 1.0
+#define BENCH_DEFAULT_FRAME_SIZE 1514
+#define BENCH_MAX_FRAME_SIZE 65535
+#define BENCH_POLL_MS 10
+#define BENCH_CTRL_TIMEOUT_NS 1000000000ULL
+
+#define BENCH_HDR_LEN sizeof(struct virtio_net_hdr_v1)
+
+typedef enum bench_kind {
+    // The driver sends, the stand-in peer receives.
+    BENCH_TX,
+    // The stand-in peer sends, the driver receives.
+    BENCH_RX,
+} bench_kind_t;
+
+static const char *bench_names[] = { "tx", "rx" };
+
+#define BENCH_COUNT (sizeof(bench_names) / sizeof(bench_names[0]))
+
+// The driver's view of a virtqueue.
+typedef struct bench_queue {
+    uint64_t gpa;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    uint16_t avail_idx;
+    uint16_t used_idx;
+    // The ioeventfd KVM would signal for the driver's notifications.
+    int kick_fd;
+} bench_queue_t;
+
+typedef struct bench_pair {
+    struct bench *bench;
+    uint32_t index;
+    bench_queue_t rx;
+    bench_queue_t tx;
+    event_loop_t loop;
+    int peer_fd;
+    pthread_t loop_thread;
+    pthread_t driver_thread;
+    pthread_t peer_thread;
+
+    // The frames that reached their receiver, the driver or the peer.
+    uint64_t frames;
+    uint64_t bytes;
+    int error;
+} bench_pair_t;
+
+/**
+ * The bench_t drives a virtio_net_t from the host. Guest memory is plain
+ * memory, a driver thread per queue pair stands in for the guest driver,
+ * kicking the queues through their ioeventfds and polling the used rings,
+ * and a peer thread per queue pair stands in for the other end of the
+ * seqpacket backend.
+ */
+typedef struct bench {
+    int kvm_fd;
+    int vm_fd;
+    uint8_t *mem;
+    size_t mem_size;
+    mem_map_t mem_map;
+    net_backend_t backend;
+    virtio_net_t net;
+
+    bench_kind_t kind;
+    size_t pair_count;
+    size_t frame_size;
+    size_t tx_buffer_size;
+    bench_pair_t pairs[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    bench_queue_t ctrl;
+
+    _Atomic int stop;
+    _Atomic uint64_t interrupts;
+} bench_t;
+
+typedef struct bench_result {
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t interrupts;
+    double seconds;
+} bench_result_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_irq_line(uint16_t irq, int level, irq_arg_t arg) {
+    bench_t *bench = (bench_t*) arg;
+    if (level) atomic_fetch_add_explicit(&bench->interrupts, 1, memory_order_relaxed);
+}
+
+static void bench_write(bench_t *bench, uint32_t offset, uint32_t value) {
+    virtio_mmio_write(&bench->net.mmio, BENCH_MMIO_BASE + offset, &value, sizeof(value));
+}
+
+static uint32_t bench_read(bench_t *bench, uint32_t offset) {
+    uint32_t value = 0;
+    virtio_mmio_read(&bench->net.mmio, BENCH_MMIO_BASE + offset, &value, sizeof(value));
+    return value;
+}
+
+static void bench_queue_setup(bench_t *bench, bench_queue_t *queue, uint32_t index, uint64_t gpa) {
+    queue->gpa = gpa;
+    queue->desc = (struct vring_desc*) (bench->mem + gpa + BENCH_DESC_OFFSET);
+    queue->avail = (struct vring_avail*) (bench->mem + gpa + BENCH_AVAIL_OFFSET);
+    queue->used = (struct vring_used*) (bench->mem + gpa + BENCH_USED_OFFSET);
+    queue->kick_fd = bench->net.mmio.queues[index].kick_fd;
+
+    bench_write(bench, VIRTIO_MMIO_QUEUE_SEL, index);
+    bench_write(bench, VIRTIO_MMIO_QUEUE_NUM, BENCH_QUEUE_NUM);
+    bench_write(bench, VIRTIO_MMIO_QUEUE_DESC_LOW, gpa + BENCH_DESC_OFFSET);
+    bench_write(bench, VIRTIO_MMIO_QUEUE_AVAIL_LOW, gpa + BENCH_AVAIL_OFFSET);
+    bench_write(bench, VIRTIO_MMIO_QUEUE_USED_LOW, gpa + BENCH_USED_OFFSET);
+    bench_write(bench, VIRTIO_MMIO_QUEUE_READY, 1);
+}
+
+static void bench_queue_post(bench_queue_t *queue, uint16_t head) {
+    queue->avail->ring[queue->avail_idx++ % BENCH_QUEUE_NUM] = head;
+}
+
+// bench_queue_kick makes the posted chains available and notifies the
+// device, as the guest's write to QueueNotify would through KVM.
+static void bench_queue_kick(bench_queue_t *queue) {
+    atomic_thread_fence(memory_order_release);
+    *(volatile uint16_t*) &queue->avail->idx = queue->avail_idx;
+    uint64_t one = 1;
+    if (write(queue->kick_fd, &one, sizeof(one)) < 0) return;
+}
+
+// bench_queue_used returns the next used entry, or NULL if there is none.
+static struct vring_used_elem* bench_queue_used(bench_queue_t *queue) {
+    if (*(volatile uint16_t*) &queue->used->idx == queue->used_idx) return NULL;
+    atomic_thread_fence(memory_order_acquire);
+    return &queue->used->ring[queue->used_idx++ % BENCH_QUEUE_NUM];
+}
+
+/**
+ * bench_tx_driver keeps every transmit descriptor posted with a frame,
+ * reposting each as soon as the device completes it.
+ */
+static void bench_tx_driver(bench_pair_t *pair) {
+    bench_t *bench = pair->bench;
+    bench_queue_t *queue = &pair->tx;
+    for (uint16_t i = 0; i < BENCH_QUEUE_NUM; i++) {
+        uint64_t gpa = queue->gpa + BENCH_BUFFERS_OFFSET + (uint64_t) i * bench->tx_buffer_size;
+        memset(bench->mem + gpa, 0, BENCH_HDR_LEN);
+        memset(bench->mem + gpa + BENCH_HDR_LEN, 0x5a, bench->frame_size);
+        queue->desc[i] = (struct vring_desc) { .addr = gpa, .len = BENCH_HDR_LEN + bench->frame_size };
+        bench_queue_post(queue, i);
+    }
+    bench_queue_kick(queue);
+
+    while (!atomic_load_explicit(&bench->stop, memory_order_relaxed)) {
+        struct vring_used_elem *elem;
+        size_t count = 0;
+        while ((elem = bench_queue_used(queue)) != NULL) {
+            bench_queue_post(queue, elem->id);
+            count++;
+        }
+        if (count == 0) {
+            sched_yield();
+            continue;
+        }
+        bench_queue_kick(queue);
+    }
+}
+
+/**
+ * bench_rx_driver keeps every receive descriptor posted with a merged
+ * buffer, counting the frames the device fills them with.
+ */
+static void bench_rx_driver(bench_pair_t *pair) {
+    bench_t *bench = pair->bench;
+    bench_queue_t *queue = &pair->rx;
+    for (uint16_t i = 0; i < BENCH_QUEUE_NUM; i++) {
+        uint64_t gpa = queue->gpa + BENCH_BUFFERS_OFFSET + (uint64_t) i * BENCH_RX_BUFFER_SIZE;
+        queue->desc[i] = (struct vring_desc) {
+            .addr = gpa,
+            .len = BENCH_RX_BUFFER_SIZE,
+            .flags = VRING_DESC_F_WRITE,
+        };
+        bench_queue_post(queue, i);
+    }
+    bench_queue_kick(queue);
+
+    // The buffers left of the frame being received.
+    uint16_t buffers = 0;
+    while (!atomic_load_explicit(&bench->stop, memory_order_relaxed)) {
+        struct vring_used_elem *elem;
+        size_t count = 0;
+        while ((elem = bench_queue_used(queue)) != NULL) {
+            if (buffers == 0) {
+                struct virtio_net_hdr_v1 *hdr = (struct virtio_net_hdr_v1*) (bench->mem + queue->desc[elem->id].addr);
+                buffers = hdr->num_buffers;
+                pair->frames++;
+                pair->bytes -= BENCH_HDR_LEN;
+            }
+            pair->bytes += elem->len;
+            buffers--;
+            bench_queue_post(queue, elem->id);
+            count++;
+        }
+        if (count == 0) {
+            sched_yield();
+            continue;
+        }
+        bench_queue_kick(queue);
+    }
+}
+
+static void* bench_driver_func(void *arg) {
+    bench_pair_t *pair = (bench_pair_t*) arg;
+    if (pair->bench->kind == BENCH_TX) {
+        bench_tx_driver(pair);
+    } else {
+        bench_rx_driver(pair);
+    }
+    return NULL;
+}
+
+static void* bench_peer_func(void *arg) {
+    bench_pair_t *pair = (bench_pair_t*) arg;
+    bench_t *bench = pair->bench;
+    size_t size = BENCH_HDR_LEN + BENCH_MAX_FRAME_SIZE;
+    uint8_t *frame = calloc(1, size);
+    if (frame == NULL) {
+        pair->error = errno;
+        return NULL;
+    }
+    memset(frame + BENCH_HDR_LEN, 0xa5, bench->frame_size);
+
+    while (!atomic_load_explicit(&bench->stop, memory_order_relaxed)) {
+        ssize_t res;
+        if (bench->kind == BENCH_TX) {
+            res = recv(pair->peer_fd, frame, size, MSG_DONTWAIT);
+            if (res > 0) {
+                pair->frames++;
+                pair->bytes += res - BENCH_HDR_LEN;
+                continue;
+            }
+        } else {
+            res = send(pair->peer_fd, frame, BENCH_HDR_LEN + bench->frame_size, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (res > 0) continue;
+        }
+        if (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            pair->error = errno;
+            break;
+        }
+        struct pollfd pfd = { .fd = pair->peer_fd, .events = bench->kind == BENCH_TX ? POLLIN : POLLOUT };
+        poll(&pfd, 1, BENCH_POLL_MS);
+    }
+    free(frame);
+    return NULL;
+}
+
+static void* bench_loop_func(void *arg) {
+    bench_pair_t *pair = (bench_pair_t*) arg;
+    event_loop_run(&pair->loop);
+    return NULL;
+}
+
+/**
+ * bench_negotiate brings the device up as a driver would: it accepts the
+ * features it needs, sets up every queue and selects every queue pair
+ * through the control queue.
+ */
+static int bench_negotiate(bench_t *bench) {
+    uint64_t wanted = (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_NET_F_MRG_RXBUF) |
+                      (1ULL << VIRTIO_NET_F_CTRL_VQ) | (1ULL << VIRTIO_NET_F_MQ) |
+                      (1ULL << VIRTIO_NET_F_GUEST_CSUM) | (1ULL << VIRTIO_NET_F_GUEST_TSO4) |
+                      (1ULL << VIRTIO_NET_F_GUEST_TSO6);
+    bench_write(bench, VIRTIO_MMIO_STATUS, VIRTIO_CONFIG_S_ACKNOWLEDGE);
+    bench_write(bench, VIRTIO_MMIO_STATUS, VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER);
+    for (uint32_t sel = 0; sel < 2; sel++) {
+        bench_write(bench, VIRTIO_MMIO_DEVICE_FEATURES_SEL, sel);
+        uint32_t features = bench_read(bench, VIRTIO_MMIO_DEVICE_FEATURES) & (wanted >> (32 * sel));
+        bench_write(bench, VIRTIO_MMIO_DRIVER_FEATURES_SEL, sel);
+        bench_write(bench, VIRTIO_MMIO_DRIVER_FEATURES, features);
+    }
+    uint32_t status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER | VIRTIO_CONFIG_S_FEATURES_OK;
+    bench_write(bench, VIRTIO_MMIO_STATUS, status);
+    if (!(bench_read(bench, VIRTIO_MMIO_STATUS) & VIRTIO_CONFIG_S_FEATURES_OK)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    uint64_t region = BENCH_BUFFERS_OFFSET + BENCH_QUEUE_NUM * bench->tx_buffer_size;
+    for (size_t i = 0; i < bench->pair_count; i++) {
+        bench_queue_setup(bench, &bench->pairs[i].rx, 2 * i, (2 * i) * region);
+        bench_queue_setup(bench, &bench->pairs[i].tx, 2 * i + 1, (2 * i + 1) * region);
+    }
+    uint32_t ctrl_index = virtio_mmio_has_feature(&bench->net.mmio, VIRTIO_NET_F_MQ) ? 2 * bench->pair_count : 2;
+    bench_queue_setup(bench, &bench->ctrl, ctrl_index, 2 * bench->pair_count * region);
+    bench_write(bench, VIRTIO_MMIO_STATUS, status | VIRTIO_CONFIG_S_DRIVER_OK);
+    if (bench->pair_count == 1) return 0;
+
+    // The command, then its ack, in the ctrl queue's buffers.
+    bench_queue_t *ctrl = &bench->ctrl;
+    uint64_t gpa = ctrl->gpa + BENCH_BUFFERS_OFFSET;
+    uint8_t *cmd = bench->mem + gpa;
+    struct virtio_net_ctrl_hdr hdr = { .class = VIRTIO_NET_CTRL_MQ, .cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET };
+    struct virtio_net_ctrl_mq mq = { .virtqueue_pairs = bench->pair_count };
+    memcpy(cmd, &hdr, sizeof(hdr));
+    memcpy(cmd + sizeof(hdr), &mq, sizeof(mq));
+    cmd[64] = VIRTIO_NET_ERR;
+    ctrl->desc[0] = (struct vring_desc) { .addr = gpa, .len = sizeof(hdr), .flags = VRING_DESC_F_NEXT, .next = 1 };
+    ctrl->desc[1] = (struct vring_desc) {
+        .addr = gpa + sizeof(hdr),
+        .len = sizeof(mq),
+        .flags = VRING_DESC_F_NEXT,
+        .next = 2,
+    };
+    ctrl->desc[2] = (struct vring_desc) { .addr = gpa + 64, .len = 1, .flags = VRING_DESC_F_WRITE };
+    bench_queue_post(ctrl, 0);
+    bench_queue_kick(ctrl);
+    for (uint64_t start = now_ns(); bench_queue_used(ctrl) == NULL;) {
+        if (now_ns() - start > BENCH_CTRL_TIMEOUT_NS) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        sched_yield();
+    }
+    if (cmd[64] != VIRTIO_NET_OK) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+static int bench_init(bench_t *bench, bench_kind_t kind, size_t pair_count, size_t frame_size) {
+    memset(bench, 0, sizeof(bench_t));
+    bench->kind = kind;
+    bench->pair_count = pair_count;
+    bench->frame_size = frame_size;
+    bench->tx_buffer_size = (BENCH_HDR_LEN + frame_size + 4095) & ~4095UL;
+    if (bench->tx_buffer_size < BENCH_RX_BUFFER_SIZE) bench->tx_buffer_size = BENCH_RX_BUFFER_SIZE;
+    // Every queue pair and the control queue.
+    bench->mem_size = (2 * pair_count + 1) * (BENCH_BUFFERS_OFFSET + BENCH_QUEUE_NUM * bench->tx_buffer_size);
+
+    // The queues are kicked through ioeventfds, which need a VM.
+    if ((bench->kvm_fd = open("/dev/kvm", O_RDWR | O_CLOEXEC)) < 0) return -1;
+    if ((bench->vm_fd = ioctl(bench->kvm_fd, KVM_CREATE_VM, 0)) < 0) goto error0;
+    bench->mem = mmap(NULL, bench->mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bench->mem == MAP_FAILED) goto error1;
+    if (mem_map_init(&bench->mem_map) < 0) goto error2;
+    if (mem_map_add(&bench->mem_map, 0, bench->mem_size, bench->mem) < 0) goto error3;
+
+    int peer_fds[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    if (net_backend_open_pair(&bench->backend, peer_fds, pair_count) < 0) goto error3;
+    if (virtio_net_init(&bench->net, BENCH_MMIO_BASE, BENCH_IRQ, &bench->mem_map, bench_irq_line, bench,
+                        &bench->backend) < 0) goto error4;
+
+    size_t loops = 0;
+    for (size_t i = 0; i < pair_count; i++) {
+        bench_pair_t *pair = &bench->pairs[i];
+        pair->bench = bench;
+        pair->index = i;
+        pair->peer_fd = peer_fds[i];
+        if (event_loop_init(&pair->loop) < 0) goto error5;
+        loops++;
+        if (virtio_net_attach_pair(&bench->net, i, bench->vm_fd, &pair->loop) < 0) goto error5;
+    }
+    return 0;
+
+error5:
+    virtio_net_detach(&bench->net);
+    for (size_t i = 0; i < loops; i++) {
+        event_loop_deinit(&bench->pairs[i].loop);
+    }
+    virtio_net_deinit(&bench->net);
+error4:
+    for (size_t i = 0; i < pair_count; i++) {
+        close(peer_fds[i]);
+    }
+    net_backend_close(&bench->backend);
+error3:
+    mem_map_deinit(&bench->mem_map);
+error2:
+    munmap(bench->mem, bench->mem_size);
+error1:
+    close(bench->vm_fd);
+error0:
+    close(bench->kvm_fd);
+    return -1;
+}
+
+static void bench_deinit(bench_t *bench) {
+    virtio_net_detach(&bench->net);
+    for (size_t i = 0; i < bench->pair_count; i++) {
+        event_loop_deinit(&bench->pairs[i].loop);
+        close(bench->pairs[i].peer_fd);
+    }
+    virtio_net_deinit(&bench->net);
+    net_backend_close(&bench->backend);
+    mem_map_deinit(&bench->mem_map);
+    munmap(bench->mem, bench->mem_size);
+    close(bench->vm_fd);
+    close(bench->kvm_fd);
+}
+
+// bench_stop stops the threads of the first `count` queue pairs.
+static void bench_stop(bench_t *bench, size_t count, int drivers) {
+    atomic_store(&bench->stop, 1);
+    for (size_t i = 0; i < count; i++) {
+        bench_pair_t *pair = &bench->pairs[i];
+        if (drivers) {
+            pthread_join(pair->driver_thread, NULL);
+            pthread_join(pair->peer_thread, NULL);
+        }
+        event_loop_stop(&pair->loop);
+        pthread_join(pair->loop_thread, NULL);
+    }
+}
+
+static int bench_run(bench_kind_t kind, size_t pair_count, size_t frame_size, double seconds,
+                     bench_result_t *result) {
+    bench_t *bench = malloc(sizeof(bench_t));
+    if (bench == NULL) return -1;
+    if (bench_init(bench, kind, pair_count, frame_size) < 0) goto error0;
+
+    size_t started = 0;
+    for (; started < pair_count; started++) {
+        bench_pair_t *pair = &bench->pairs[started];
+        int err = pthread_create(&pair->loop_thread, NULL, bench_loop_func, pair);
+        if (err != 0) {
+            errno = err;
+            bench_stop(bench, started, 0);
+            goto error1;
+        }
+    }
+    if (bench_negotiate(bench) < 0) {
+        bench_stop(bench, pair_count, 0);
+        goto error1;
+    }
+
+    memset(result, 0, sizeof(bench_result_t));
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < pair_count; i++) {
+        bench_pair_t *pair = &bench->pairs[i];
+        int err = pthread_create(&pair->driver_thread, NULL, bench_driver_func, pair);
+        if (err == 0) {
+            err = pthread_create(&pair->peer_thread, NULL, bench_peer_func, pair);
+            if (err != 0) {
+                atomic_store(&bench->stop, 1);
+                pthread_join(pair->driver_thread, NULL);
+            }
+        }
+        if (err != 0) {
+            errno = err;
+            bench_stop(bench, i, 1);
+            for (size_t j = i; j < pair_count; j++) {
+                event_loop_stop(&bench->pairs[j].loop);
+                pthread_join(bench->pairs[j].loop_thread, NULL);
+            }
+            goto error1;
+        }
+    }
+
+    struct timespec ts = { (time_t) seconds, (long) ((seconds - (time_t) seconds) * 1e9) };
+    nanosleep(&ts, NULL);
+    bench_stop(bench, pair_count, 1);
+    result->seconds = (now_ns() - start) / 1e9;
+
+    int error = 0;
+    for (size_t i = 0; i < pair_count; i++) {
+        result->frames += bench->pairs[i].frames;
+        result->bytes += bench->pairs[i].bytes;
+        if (bench->pairs[i].error != 0) error = bench->pairs[i].error;
+    }
+    result->interrupts = atomic_load(&bench->interrupts);
+    bench_deinit(bench);
+    free(bench);
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+
+error1:
+    bench_deinit(bench);
+error0:
+    free(bench);
+    return -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-t seconds] [-q queue pairs] [-s frame size] [-b tx|rx]...\n", prog);
+}
+
+/**
+ * netbench measures the frame rate of the virtio-net device against a
+ * host-side stand-in of its peer, from the driver to the peer (tx) and
+ * back (rx), and writes the results as JSON to stdout. The device runs as
+ * in the VMM, one event loop thread per queue pair, but the guest driver
+ * is replaced by a thread that recycles buffers as fast as they complete,
+ * so the result is the ceiling the device and the backend allow.
+ */
+int main(int argc, char *argv[]) {
+    double seconds = BENCH_DEFAULT_SECONDS;
+    size_t pair_count = 1;
+    size_t frame_size = BENCH_DEFAULT_FRAME_SIZE;
+    int selected[BENCH_COUNT] = {0};
+    int any_selected = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:q:s:b:")) != -1) {
+        switch (opt) {
+        case 't':
+            seconds = atof(optarg);
+            if (seconds <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'q':
+            pair_count = strtoull(optarg, NULL, 0);
+            if (pair_count == 0 || pair_count > VIRTIO_NET_MAX_QUEUE_PAIRS) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            frame_size = strtoull(optarg, NULL, 0);
+            if (frame_size < 60 || frame_size > BENCH_MAX_FRAME_SIZE) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'b':
+            {
+                size_t i = 0;
+                while (i < BENCH_COUNT && strcmp(bench_names[i], optarg) != 0) i++;
+                if (i == BENCH_COUNT) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                selected[i] = 1;
+                any_selected = 1;
+                break;
+            }
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct utsname uts;
+    uname(&uts);
+    printf("{\n  \"kernel\": \"%s\",\n  \"machine\": \"%s\",\n  \"cpus\": %ld,\n  \"seconds\": %g,\n"
+           "  \"queue_pairs\": %zu,\n  \"frame_size\": %zu,\n  \"benchmarks\": [", uts.release, uts.machine,
+           sysconf(_SC_NPROCESSORS_ONLN), seconds, pair_count, frame_size);
+
+    int rc = 0;
+    int first = 1;
+    for (size_t i = 0; i < BENCH_COUNT; i++) {
+        if (any_selected && !selected[i]) continue;
+        bench_result_t result;
+        if (bench_run((bench_kind_t) i, pair_count, frame_size, seconds, &result) < 0) {
+            fprintf(stderr, "%s: %s\n", bench_names[i], strerror(errno));
+            rc = 1;
+            continue;
+        }
+        printf("%s\n    {\"name\": \"%s\", \"frames\": %llu, \"bytes\": %llu, \"interrupts\": %llu, "
+               "\"frames_per_sec\": %.0f, \"gbit_per_sec\": %.3f}", first ? "" : ",", bench_names[i],
+               (unsigned long long) result.frames, (unsigned long long) result.bytes,
+               (unsigned long long) result.interrupts, result.frames / result.seconds,
+               result.bytes * 8 / result.seconds / 1e9);
+        first = 0;
+    }
+    printf("\n  ]\n}\n");
+    return rc;
+}
@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+
+#include <queue.h>
+
+#define QUEUE_CAPACITY 4096
+#define DEFAULT_TOTAL_MIB 64
+#define CHUNK_MAX 1024
+
+typedef struct bench {
+    queue_t q;
+    size_t chunk;
+    unsigned long long total;
+    unsigned long long errors;
+} bench_t;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The producer pushes an incrementing byte sequence in chunks of pseudo-random
+// size so that pushes straddle the end of the ring at every possible offset.
+void* producer_func(void *arg) {
+    bench_t *b = (bench_t*) arg;
+    uint8_t buf[CHUNK_MAX];
+    unsigned int seed = 1;
+    uint8_t next = 0;
+    unsigned long long sent = 0;
+    while (sent < b->total) {
+        size_t n = b->chunk ? b->chunk : 1 + rand_r(&seed) % CHUNK_MAX;
+        if (n > b->total - sent) n = b->total - sent;
+        for (size_t i = 0; i < n; i++) buf[i] = next + i;
+
+        size_t off = 0;
+        while (off < n) {
+            size_t res;
+            if (b->chunk == 1) {
+                res = queue_push(&b->q, buf[off]) == 0;
+            } else {
+                res = queue_push_bulk(&b->q, buf + off, n - off);
+            }
+            if (res == 0) sched_yield();
+            off += res;
+        }
+        next += n;
+        sent += n;
+    }
+    return NULL;
+}
+
+// The consumer verifies that every byte arrives exactly once and in order.
+void* consumer_func(void *arg) {
+    bench_t *b = (bench_t*) arg;
+    uint8_t buf[CHUNK_MAX];
+    unsigned int seed = 2;
+    uint8_t expect = 0;
+    unsigned long long received = 0;
+    while (received < b->total) {
+        size_t n;
+        if (b->chunk == 1) {
+            n = queue_pop(&b->q, buf) == 0;
+        } else {
+            n = queue_pop_bulk(&b->q, buf, b->chunk ? b->chunk : 1 + rand_r(&seed) % CHUNK_MAX);
+        }
+        if (n == 0) sched_yield();
+        for (size_t i = 0; i < n; i++) {
+            if (buf[i] != expect++) b->errors++;
+        }
+        received += n;
+    }
+    return NULL;
+}
+
+int run(const char *name, size_t chunk, unsigned long long total) {
+    bench_t b = { .chunk = chunk, .total = total };
+    if (queue_init(&b.q, QUEUE_CAPACITY) < 0) {
+        perror("failed to init queue");
+        return -1;
+    }
+
+    pthread_t producer, consumer;
+    double start = now();
+    if (pthread_create(&producer, NULL, producer_func, &b) != 0 ||
+        pthread_create(&consumer, NULL, consumer_func, &b) != 0) {
+        perror("failed to create thread");
+        exit(1);
+    }
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+    double elapsed = now() - start;
+
+    printf("%-12s %8.1f MiB/s %8.2f ns/byte errors: %llu\n", name,
+           b.total / elapsed / (1 << 20), elapsed * 1e9 / b.total, b.errors);
+    queue_deinit(&b.q);
+    return b.errors ? -1 : 0;
+}
+
+/**
+ * queue_bench streams `argv[1]` MiB (default 64) through a queue_t between a
+ * producer and a consumer thread, once per access pattern, and verifies the
+ * byte sequence on the consumer side. It exits non-zero on corruption.
+ */
+int main(int argc, char *argv[]) {
+    unsigned long long total = (argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_TOTAL_MIB) << 20;
+    int failed = 0;
+    failed |= run("byte", 1, total) < 0;
+    failed |= run("bulk-16", 16, total) < 0;
+    failed |= run("bulk-512", 512, total) < 0;
+    failed |= run("bulk-random", 0, total) < 0;
+    return failed;
+}
@@ -0,0 +1,149 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vhost-user-blk-backend.h>
+#include <metrics.h>
+
+// Each export serves one disk to one VM.
+#define EXPORT_MAX 64
+
+volatile sig_atomic_t done = 0;
+
+void handle_sigterm(int sig_num) {
+    done = 1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-a cpu] [-p] [-m metrics.sock] socket=disk...\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int cpu = -1;
+    int flags = 0;
+    const char *metrics_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:pm:")) != -1) {
+        switch (opt) {
+        case 'a':
+            cpu = atoi(optarg);
+            break;
+        case 'p':
+            flags |= VHOST_USER_BLK_POLL;
+            break;
+        case 'm':
+            metrics_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    size_t export_count = argc - optind;
+    if (export_count == 0 || export_count > EXPORT_MAX) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGTERM, handle_sigterm);
+    signal(SIGINT, handle_sigterm);
+
+    // Every export is served from this thread, so pinning it dedicates one
+    // core to the storage of every VM.
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            perror("failed to pin to cpu");
+            return 1;
+        }
+    }
+
+    event_loop_t loop;
+    if (event_loop_init(&loop) < 0) {
+        perror("failed to init event loop");
+        return 1;
+    }
+
+    static bdev_t disks[EXPORT_MAX];
+    static vhost_user_blk_backend_t backends[EXPORT_MAX];
+    size_t count = 0;
+    for (; count < export_count; count++) {
+        char *spec = argv[optind + count];
+        char *disk = strchr(spec, '=');
+        if (disk == NULL) {
+            fprintf(stderr, "invalid export: %s\n", spec);
+            goto error0;
+        }
+        *disk++ = '\0';
+        if (bdev_init(&disks[count], disk, VIRTIO_BLK_QUEUE_COUNT, VIRTIO_BLK_QUEUE_DEPTH) < 0) {
+            fprintf(stderr, "failed to open disk %s: %s\n", disk, strerror(errno));
+            goto error0;
+        }
+        if (vhost_user_blk_backend_init(&backends[count], spec, &disks[count], &loop, flags) < 0) {
+            fprintf(stderr, "failed to serve %s: %s\n", spec, strerror(errno));
+            bdev_deinit(&disks[count]);
+            goto error0;
+        }
+    }
+
+    metrics_t metrics;
+    if (metrics_path != NULL) {
+        if (metrics_init(&metrics) < 0) {
+            perror("failed to init metrics");
+            goto error0;
+        }
+        for (size_t i = 0; i < count; i++) {
+            char labels[256];
+            snprintf(labels, sizeof(labels), "socket=\"%s\"", backends[i].path);
+            if (vhost_user_blk_backend_register_metrics(&backends[i], &metrics, labels) < 0 ||
+                bdev_register_metrics(&disks[i], &metrics, labels) < 0) {
+                perror("failed to register metrics");
+                goto error1;
+            }
+        }
+        if (metrics_serve(&metrics, metrics_path) < 0) {
+            perror("failed to serve metrics");
+            goto error1;
+        }
+    }
+
+    // Polling spins on the rings of every export between loop iterations
+    // that never block, trading the core for the latency of a wakeup.
+    int timeout_ms = (flags & VHOST_USER_BLK_POLL) ? 0 : 100;
+    while (!done) {
+        if (event_loop_run_once(&loop, timeout_ms) < 0 && errno != EINTR) {
+            perror("failed to run event loop");
+            break;
+        }
+        for (size_t i = 0; timeout_ms == 0 && i < count; i++) {
+            vhost_user_blk_backend_poll(&backends[i]);
+        }
+    }
+
+    if (metrics_path != NULL) metrics_deinit(&metrics);
+    for (size_t i = 0; i < count; i++) {
+        vhost_user_blk_backend_deinit(&backends[i]);
+        bdev_deinit(&disks[i]);
+    }
+    event_loop_deinit(&loop);
+    return 0;
+
+error1:
+    metrics_deinit(&metrics);
+error0:
+    for (size_t i = 0; i < count; i++) {
+        vhost_user_blk_backend_deinit(&backends[i]);
+        bdev_deinit(&disks[i]);
+    }
+    event_loop_deinit(&loop);
+    return 1;
+}
@@ -0,0 +1,450 @@
+#define _GNU_SOURCE
+
+#include <bcache.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#define BCACHE_NONE UINT32_MAX
+#define BCACHE_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+static uint64_t bcache_hash(bcache_dev_t *dev, uint64_t block) {
+    uint64_t h = (uint64_t) (uintptr_t) dev ^ (block * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 29;
+    return h;
+}
+
+static bcache_shard_t* bcache_shard(bcache_t *cache, bcache_dev_t *dev, uint64_t block) {
+    return &cache->shards[bcache_hash(dev, block) % BCACHE_SHARDS];
+}
+
+static uint8_t* bcache_data(bcache_shard_t *shard, uint32_t i) {
+    return shard->data + (size_t) i * BCACHE_BLOCK_SIZE;
+}
+
+static void* bcache_map(size_t size, int flags) {
+    if (flags & BCACHE_HUGEPAGES) {
+        void *pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (pool != MAP_FAILED) return pool;
+    }
+    void *pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) return NULL;
+    // Fall back to transparent hugepages if no hugetlb pages are reserved.
+    if (flags & BCACHE_HUGEPAGES) madvise(pool, size, MADV_HUGEPAGE);
+    return pool;
+}
+
+static void bcache_shard_deinit(bcache_shard_t *shard) {
+    pthread_mutex_destroy(&shard->mu);
+    free(shard->entries);
+    free(shard->buckets);
+}
+
+static int bcache_shard_init(bcache_shard_t *shard, uint8_t *data, size_t capacity) {
+    memset(shard, 0, sizeof(bcache_shard_t));
+    shard->data = data;
+    shard->capacity = capacity;
+    shard->free = BCACHE_NONE;
+
+    size_t buckets = 1;
+    while (buckets < capacity) buckets <<= 1;
+    shard->bucket_mask = buckets - 1;
+
+    shard->entries = calloc(capacity, sizeof(bcache_entry_t));
+    shard->buckets = malloc(buckets * sizeof(uint32_t));
+    if (shard->entries == NULL || shard->buckets == NULL) goto error0;
+    memset(shard->buckets, 0xff, buckets * sizeof(uint32_t));
+
+    if (pthread_mutex_init(&shard->mu, NULL) != 0) goto error0;
+
+    return 0;
+
+error0:
+    free(shard->entries);
+    free(shard->buckets);
+    return -1;
+}
+
+int bcache_init(bcache_t *cache, size_t size, int flags) {
+    size_t capacity = size / BCACHE_BLOCK_SIZE / BCACHE_SHARDS;
+    if (capacity == 0 || capacity >= BCACHE_NONE) {
+        errno = EINVAL;
+        goto error0;
+    }
+
+    memset(cache, 0, sizeof(bcache_t));
+    cache->flags = flags;
+    cache->pool_size = capacity * BCACHE_SHARDS * BCACHE_BLOCK_SIZE;
+    if (flags & BCACHE_HUGEPAGES) {
+        cache->pool_size = (cache->pool_size + BCACHE_HUGEPAGE_SIZE - 1) / BCACHE_HUGEPAGE_SIZE *
+                           BCACHE_HUGEPAGE_SIZE;
+    }
+    cache->pool = bcache_map(cache->pool_size, flags);
+    if (cache->pool == NULL) goto error0;
+
+    size_t i;
+    for (i = 0; i < BCACHE_SHARDS; i++) {
+        uint8_t *data = cache->pool + i * capacity * BCACHE_BLOCK_SIZE;
+        if (bcache_shard_init(&cache->shards[i], data, capacity) < 0) goto error1;
+    }
+
+    atomic_init(&cache->epoch, 0);
+    atomic_init(&cache->stats.hits, 0);
+    atomic_init(&cache->stats.misses, 0);
+    atomic_init(&cache->stats.evictions, 0);
+    atomic_init(&cache->stats.writebacks, 0);
+    atomic_init(&cache->stats.absorbed, 0);
+
+    return 0;
+
+error1:
+    while (i-- > 0) bcache_shard_deinit(&cache->shards[i]);
+    munmap(cache->pool, cache->pool_size);
+error0:
+    return -1;
+}
+
+static int bcache_parse_size(const char *s, size_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(s, &end, 0);
+    if (errno != 0 || end == s) return -1;
+    switch (*end) {
+    case 'K': case 'k': value <<= 10; end++; break;
+    case 'M': case 'm': value <<= 20; end++; break;
+    case 'G': case 'g': value <<= 30; end++; break;
+    }
+    if (*end != '\0') return -1;
+    *size = value;
+    return 0;
+}
+
+int bcache_init_spec(bcache_t *cache, const char *spec) {
+    char *buf = strdup(spec);
+    if (buf == NULL) return -1;
+
+    size_t size;
+    int flags = 0;
+
+    char *save;
+    char *opt = strtok_r(buf, ",", &save);
+    if (opt == NULL || bcache_parse_size(opt, &size) < 0) goto einval;
+    while ((opt = strtok_r(NULL, ",", &save)) != NULL) {
+        if (strcmp(opt, "writeback") == 0) {
+            flags |= BCACHE_WRITEBACK;
+        } else if (strcmp(opt, "hugepages") == 0) {
+            flags |= BCACHE_HUGEPAGES;
+        } else {
+            goto einval;
+        }
+    }
+
+    free(buf);
+    return bcache_init(cache, size, flags);
+
+einval:
+    free(buf);
+    errno = EINVAL;
+    return -1;
+}
+
+void bcache_deinit(bcache_t *cache) {
+    for (size_t i = 0; i < BCACHE_SHARDS; i++) {
+        bcache_shard_deinit(&cache->shards[i]);
+    }
+    munmap(cache->pool, cache->pool_size);
+}
+
+static uint32_t* bcache_bucket(bcache_shard_t *shard, bcache_dev_t *dev, uint64_t block) {
+    return &shard->buckets[(bcache_hash(dev, block) / BCACHE_SHARDS) & shard->bucket_mask];
+}
+
+static uint32_t bcache_lookup(bcache_shard_t *shard, bcache_dev_t *dev, uint64_t block) {
+    uint32_t i = *bcache_bucket(shard, dev, block);
+    while (i != BCACHE_NONE && (shard->entries[i].dev != dev || shard->entries[i].block != block)) {
+        i = shard->entries[i].next;
+    }
+    return i;
+}
+
+static void bcache_link(bcache_shard_t *shard, uint32_t i, bcache_dev_t *dev, uint64_t block) {
+    bcache_entry_t *entry = &shard->entries[i];
+    uint32_t *bucket = bcache_bucket(shard, dev, block);
+    entry->dev = dev;
+    entry->block = block;
+    entry->valid = 1;
+    entry->dirty = 0;
+    entry->referenced = 0;
+    entry->next = *bucket;
+    *bucket = i;
+}
+
+static void bcache_unlink(bcache_shard_t *shard, uint32_t i) {
+    bcache_entry_t *entry = &shard->entries[i];
+    uint32_t *iter = bcache_bucket(shard, entry->dev, entry->block);
+    while (*iter != i) iter = &shard->entries[*iter].next;
+    *iter = entry->next;
+    entry->valid = 0;
+}
+
+static void bcache_release(bcache_shard_t *shard, uint32_t i) {
+    bcache_unlink(shard, i);
+    shard->entries[i].next = shard->free;
+    shard->free = i;
+}
+
+/**
+ * bcache_alloc returns an unlinked entry of `shard`, evicting a clean entry
+ * whose reference bit is clear if the shard is full. Must be called with
+ * shard->mu held.
+ */
+static uint32_t bcache_alloc(bcache_t *cache, bcache_shard_t *shard) {
+    if (shard->free != BCACHE_NONE) {
+        uint32_t i = shard->free;
+        shard->free = shard->entries[i].next;
+        return i;
+    }
+    if (shard->used < shard->capacity) return shard->used++;
+
+    // Two sweeps clear every reference bit, so a clean entry is found unless
+    // every entry is dirty.
+    for (size_t n = 0; n < 2 * shard->capacity; n++) {
+        uint32_t i = shard->hand;
+        shard->hand = (shard->hand + 1) % shard->capacity;
+        bcache_entry_t *entry = &shard->entries[i];
+        if (entry->dirty) continue;
+        if (entry->referenced) {
+            entry->referenced = 0;
+            continue;
+        }
+        bcache_unlink(shard, i);
+        metric_inc(&cache->stats.evictions, 1);
+        return i;
+    }
+    return BCACHE_NONE;
+}
+
+/**
+ * iov_copy copies `len` bytes between `buf` and `iov`, starting `skip` bytes
+ * into `iov`.
+ */
+static void iov_copy(const struct iovec *iov, int iovcnt, size_t skip, void *buf, size_t len, int to_iov) {
+    uint8_t *p = buf;
+    for (int i = 0; i < iovcnt && len > 0; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        size_t n = iov[i].iov_len - skip;
+        if (n > len) n = len;
+        if (to_iov) {
+            memcpy((uint8_t*) iov[i].iov_base + skip, p, n);
+        } else {
+            memcpy(p, (uint8_t*) iov[i].iov_base + skip, n);
+        }
+        p += n;
+        len -= n;
+        skip = 0;
+    }
+}
+
+static size_t iov_len(const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+    return len;
+}
+
+int bcache_read(bcache_t *cache, bcache_dev_t *dev, uint64_t offset, const struct iovec *iov, int iovcnt) {
+    size_t len = iov_len(iov, iovcnt);
+    if (len == 0 || offset % BCACHE_BLOCK_SIZE != 0 || len % BCACHE_BLOCK_SIZE != 0) {
+        metric_inc(&cache->stats.misses, 1);
+        return 0;
+    }
+
+    uint64_t first = offset / BCACHE_BLOCK_SIZE;
+    for (uint64_t n = 0; n < len / BCACHE_BLOCK_SIZE; n++) {
+        bcache_shard_t *shard = bcache_shard(cache, dev, first + n);
+        pthread_mutex_lock(&shard->mu);
+        uint32_t i = bcache_lookup(shard, dev, first + n);
+        if (i == BCACHE_NONE) {
+            pthread_mutex_unlock(&shard->mu);
+            metric_inc(&cache->stats.misses, 1);
+            return 0;
+        }
+        iov_copy(iov, iovcnt, n * BCACHE_BLOCK_SIZE, bcache_data(shard, i), BCACHE_BLOCK_SIZE, 1);
+        shard->entries[i].referenced = 1;
+        pthread_mutex_unlock(&shard->mu);
+    }
+    metric_inc(&cache->stats.hits, 1);
+    return 1;
+}
+
+uint64_t bcache_epoch(bcache_t *cache) {
+    return atomic_load(&cache->epoch);
+}
+
+void bcache_fill(bcache_t *cache, bcache_dev_t *dev, uint64_t offset, const struct iovec *iov, int iovcnt,
+                 uint64_t epoch) {
+    size_t len = iov_len(iov, iovcnt);
+    if (len == 0) return;
+
+    uint64_t end = offset + len;
+    for (uint64_t block = offset / BCACHE_BLOCK_SIZE; block * BCACHE_BLOCK_SIZE < end; block++) {
+        uint64_t begin = block * BCACHE_BLOCK_SIZE;
+        // The overlap of the block with the read.
+        uint64_t lo = begin > offset ? begin : offset;
+        uint64_t hi = begin + BCACHE_BLOCK_SIZE < end ? begin + BCACHE_BLOCK_SIZE : end;
+
+        bcache_shard_t *shard = bcache_shard(cache, dev, block);
+        pthread_mutex_lock(&shard->mu);
+        uint32_t i = bcache_lookup(shard, dev, block);
+        if (i != BCACHE_NONE) {
+            if (shard->entries[i].dirty) {
+                iov_copy(iov, iovcnt, lo - offset, bcache_data(shard, i) + (lo - begin), hi - lo, 1);
+            }
+        } else if (lo == begin && hi == begin + BCACHE_BLOCK_SIZE &&
+                   atomic_load(&cache->epoch) == epoch) {
+            // The epoch is checked with the shard locked, so an invalidation
+            // either precedes the check or drops the inserted block.
+            i = bcache_alloc(cache, shard);
+            if (i != BCACHE_NONE) {
+                bcache_link(shard, i, dev, block);
+                iov_copy(iov, iovcnt, lo - offset, bcache_data(shard, i), BCACHE_BLOCK_SIZE, 0);
+            }
+        }
+        pthread_mutex_unlock(&shard->mu);
+    }
+}
+
+int bcache_write(bcache_t *cache, bcache_dev_t *dev, uint64_t offset, const struct iovec *iov, int iovcnt) {
+    size_t len = iov_len(iov, iovcnt);
+    if (!(cache->flags & BCACHE_WRITEBACK) || len == 0 ||
+        offset % BCACHE_BLOCK_SIZE != 0 || len % BCACHE_BLOCK_SIZE != 0) {
+        return 0;
+    }
+
+    uint64_t first = offset / BCACHE_BLOCK_SIZE;
+    for (uint64_t n = 0; n < len / BCACHE_BLOCK_SIZE; n++) {
+        bcache_shard_t *shard = bcache_shard(cache, dev, first + n);
+        pthread_mutex_lock(&shard->mu);
+        uint32_t i = bcache_lookup(shard, dev, first + n);
+        int dirty = i != BCACHE_NONE && shard->entries[i].dirty;
+        if (!dirty && shard->dirty >= shard->capacity / 2) {
+            pthread_mutex_unlock(&shard->mu);
+            return 0;
+        }
+        if (i == BCACHE_NONE) {
+            i = bcache_alloc(cache, shard);
+            if (i == BCACHE_NONE) {
+                pthread_mutex_unlock(&shard->mu);
+                return 0;
+            }
+            bcache_link(shard, i, dev, first + n);
+        }
+        iov_copy(iov, iovcnt, n * BCACHE_BLOCK_SIZE, bcache_data(shard, i), BCACHE_BLOCK_SIZE, 0);
+        if (!dirty) {
+            shard->entries[i].dirty = 1;
+            shard->dirty++;
+        }
+        shard->entries[i].referenced = 1;
+        pthread_mutex_unlock(&shard->mu);
+    }
+    metric_inc(&cache->stats.absorbed, 1);
+    return 1;
+}
+
+/**
+ * bcache_drop drops entry `i` of `shard`, first writing it back if it is
+ * dirty and only partially overwritten by the range being invalidated.
+ * Must be called with shard->mu held.
+ */
+static int bcache_drop(bcache_t *cache, bcache_shard_t *shard, uint32_t i, uint64_t offset, uint64_t end) {
+    bcache_entry_t *entry = &shard->entries[i];
+    if (entry->dirty) {
+        uint64_t begin = entry->block * BCACHE_BLOCK_SIZE;
+        if (begin < offset || begin + BCACHE_BLOCK_SIZE > end) {
+            if (entry->dev->writeback(entry->dev, bcache_data(shard, i), BCACHE_BLOCK_SIZE, begin) < 0) return -1;
+            metric_inc(&cache->stats.writebacks, 1);
+        }
+        shard->dirty--;
+    }
+    bcache_release(shard, i);
+    return 0;
+}
+
+int bcache_invalidate(bcache_t *cache, bcache_dev_t *dev, uint64_t offset, uint64_t len) {
+    if (len == 0) return 0;
+    atomic_fetch_add(&cache->epoch, 1);
+
+    uint64_t end = offset + len;
+    uint64_t first = offset / BCACHE_BLOCK_SIZE;
+    uint64_t last = (end - 1) / BCACHE_BLOCK_SIZE;
+    uint64_t capacity = cache->shards[0].capacity * BCACHE_SHARDS;
+
+    // Ranges larger than the cache are invalidated by scanning the entries.
+    if (last - first >= capacity) {
+        for (size_t s = 0; s < BCACHE_SHARDS; s++) {
+            bcache_shard_t *shard = &cache->shards[s];
+            pthread_mutex_lock(&shard->mu);
+            for (uint32_t i = 0; i < shard->used; i++) {
+                bcache_entry_t *entry = &shard->entries[i];
+                if (!entry->valid || entry->dev != dev || entry->block < first || entry->block > last) continue;
+                if (bcache_drop(cache, shard, i, offset, end) < 0) {
+                    pthread_mutex_unlock(&shard->mu);
+                    return -1;
+                }
+            }
+            pthread_mutex_unlock(&shard->mu);
+        }
+        return 0;
+    }
+
+    for (uint64_t block = first; block <= last; block++) {
+        bcache_shard_t *shard = bcache_shard(cache, dev, block);
+        pthread_mutex_lock(&shard->mu);
+        uint32_t i = bcache_lookup(shard, dev, block);
+        int res = i != BCACHE_NONE ? bcache_drop(cache, shard, i, offset, end) : 0;
+        pthread_mutex_unlock(&shard->mu);
+        if (res < 0) return -1;
+    }
+    return 0;
+}
+
+int bcache_writeback(bcache_t *cache, bcache_dev_t *dev) {
+    for (size_t s = 0; s < BCACHE_SHARDS; s++) {
+        bcache_shard_t *shard = &cache->shards[s];
+        pthread_mutex_lock(&shard->mu);
+        for (uint32_t i = 0; i < shard->used && shard->dirty > 0; i++) {
+            bcache_entry_t *entry = &shard->entries[i];
+            if (!entry->valid || !entry->dirty || entry->dev != dev) continue;
+            if (dev->writeback(dev, bcache_data(shard, i), BCACHE_BLOCK_SIZE, entry->block * BCACHE_BLOCK_SIZE) < 0) {
+                pthread_mutex_unlock(&shard->mu);
+                return -1;
+            }
+            entry->dirty = 0;
+            shard->dirty--;
+            metric_inc(&cache->stats.writebacks, 1);
+        }
+        pthread_mutex_unlock(&shard->mu);
+    }
+    return 0;
+}
+
+int bcache_register_metrics(bcache_t *cache, metrics_t *m, const char *labels) {
+    if (metrics_register(m, "tomu_bcache_hits_total", "Reads served from the block cache.",
+                         labels, METRIC_COUNTER, &cache->stats.hits) < 0) return -1;
+    if (metrics_register(m, "tomu_bcache_misses_total", "Reads submitted to the device.",
+                         labels, METRIC_COUNTER, &cache->stats.misses) < 0) return -1;
+    if (metrics_register(m, "tomu_bcache_evictions_total", "Blocks evicted from the block cache.",
+                         labels, METRIC_COUNTER, &cache->stats.evictions) < 0) return -1;
+    if (metrics_register(m, "tomu_bcache_writebacks_total", "Dirty blocks written back to the device.",
+                         labels, METRIC_COUNTER, &cache->stats.writebacks) < 0) return -1;
+    if (metrics_register(m, "tomu_bcache_absorbed_writes_total", "Writes absorbed by the write-back cache.",
+                         labels, METRIC_COUNTER, &cache->stats.absorbed) < 0) return -1;
+    return 0;
+}
@@ -7,45 +7,194 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
 
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
 
 #include <libaio.h>
 
+// The alignment of bounce buffers allocated outside the pool.
+#define BDEV_BOUNCE_ALIGN 4096
+
+// The backlog is resubmitted in batches of this many iocbs.
+#define BDEV_BACKLOG_BATCH 64
+
+/**
+ * bdev_fd_align raises the O_DIRECT alignment of `bdev` to what the file
+ * or block device open at `fd` requires.
+ */
+static void bdev_fd_align(bdev_t *bdev, int fd) {
+    size_t mem_align = 0;
+    size_t block_size = 0;
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN) &&
+        stx.stx_dio_offset_align != 0) {
+        mem_align = stx.stx_dio_mem_align;
+        block_size = stx.stx_dio_offset_align;
+    }
+#endif
+    int sector_size;
+    if (block_size == 0 && ioctl(fd, BLKSSZGET, &sector_size) == 0 && sector_size > 0) {
+        mem_align = block_size = sector_size;
+    }
+    if (mem_align > bdev->mem_align) bdev->mem_align = mem_align;
+    if (block_size > bdev->block_size) bdev->block_size = block_size;
+}
+
+static int bdev_init_stripe(bdev_t *bdev, const char *spec) {
+    bdev->stripe = malloc(sizeof(stripe_t));
+    if (bdev->stripe == NULL) {
+        return -1;
+    }
+    if (stripe_open_spec(bdev->stripe, spec, O_DIRECT | O_RDWR) < 0) {
+        free(bdev->stripe);
+        bdev->stripe = NULL;
+        return -1;
+    }
+    bdev->fd = -1;
+    bdev->size = bdev->stripe->size;
+    for (size_t i = 0; i < bdev->stripe->member_count; i++) {
+        bdev_fd_align(bdev, bdev->stripe->members[i].fd);
+    }
+    return 0;
+}
+
 int bdev_init(bdev_t *bdev, const char *path, size_t queue_count, size_t queue_depth) {
+    bdev->queue_depth = queue_depth;
+    bdev->cow = NULL;
+    bdev->stripe = NULL;
+    bdev->cache = NULL;
+    bdev->mem_align = bdev->block_size = 512;
+
+    if (stripe_is_spec(path)) {
+        if (bdev_init_stripe(bdev, path) < 0) {
+            goto error0;
+        }
+        goto queues;
+    }
+
     int res = open(path, O_DIRECT | O_RDWR);
     if (res < 0) {
         goto error0;
     }
     bdev->fd = res;
-    bdev->queue_depth = queue_depth;
+
+    struct stat st;
+    if (fstat(bdev->fd, &st) < 0) {
+        goto error1;
+    }
+    bdev->size = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(bdev->fd, BLKGETSIZE64, &bdev->size) < 0) {
+        goto error1;
+    }
+    bdev_fd_align(bdev, bdev->fd);
+
+    res = cow_probe(bdev->fd);
+    if (res < 0) {
+        goto error1;
+    }
+    if (res == 1) {
+        bdev->cow = malloc(sizeof(cow_t));
+        if (bdev->cow == NULL) {
+            goto error1;
+        }
+        if (cow_open(bdev->cow, path, bdev->fd) < 0) {
+            free(bdev->cow);
+            goto error1;
+        }
+        bdev->size = bdev->cow->size;
+    }
+
+queues:
     bdev->queues = (bdev_queue_t*) calloc(queue_count, sizeof(bdev_queue_t));
     if (bdev->queues == NULL) {
-        goto error1;
+        goto error2;
     }
 
     for (bdev->queue_count = 0; bdev->queue_count < queue_count; bdev->queue_count++) {
         if (bdev_queue_init(&bdev->queues[bdev->queue_count], bdev) < 0) {
-            goto error2;
+            goto error3;
         }
     }
 
     return 0;
 
-error2:
+error3:
     for (size_t i = 0; i < bdev->queue_count; i++) {
         bdev_queue_deinit(&bdev->queues[i]);
     }
     free(bdev->queues);
+error2:
+    if (bdev->cow != NULL) {
+        cow_close(bdev->cow);
+        free(bdev->cow);
+    }
 error1:
-    close(bdev->fd);
+    if (bdev->stripe != NULL) {
+        stripe_close(bdev->stripe);
+        free(bdev->stripe);
+    } else {
+        close(bdev->fd);
+    }
 error0:
     return -1;
 }
 
+/**
+ * The bdev_held_t is a request held back by the throttle of its queue.
+ */
+typedef struct bdev_held {
+    struct bdev_held *next;
+    bdev_io_t *req;
+    int write;
+    int barrier;
+    off_t offset;
+    int flags;
+    uint64_t since;
+    int iovcnt;
+    struct iovec iov[];
+} bdev_held_t;
+
+/**
+ * The bdev_backlog_t is an iocb the aio context had no slot for. A vectored
+ * iocb points to the copy of its iovecs, since those of the caller only
+ * remain valid until the request is submitted.
+ */
+typedef struct bdev_backlog {
+    struct bdev_backlog *next;
+    struct iocb io;
+    struct iovec iov[];
+} bdev_backlog_t;
+
 void bdev_queue_deinit(bdev_queue_t *queue) {
+    while (queue->backlog_head != NULL) {
+        bdev_backlog_t *entry = queue->backlog_head;
+        queue->backlog_head = entry->next;
+        free(entry);
+    }
+    while (queue->held_head != NULL) {
+        bdev_held_t *held = queue->held_head;
+        queue->held_head = held->next;
+        free(held);
+    }
+    if (queue->throttle != NULL) {
+        close(queue->timerfd);
+        free(queue->throttle);
+    }
+    bounce_pool_deinit(&queue->bounce);
     close(queue->eventfd);
     io_destroy(queue->ctx);
+    free(queue->plug);
+    free(queue->plug_list);
+    free(queue->inflight);
 }
 
 int bdev_queue_init(bdev_queue_t *queue, bdev_t *bdev) {
@@ -60,10 +209,53 @@ int bdev_queue_init(bdev_queue_t *queue, bdev_t *bdev) {
         goto error1;
     }
 
+    queue->plugged = 0;
+    queue->plug_len = 0;
+    queue->plug = calloc(bdev->queue_depth, sizeof(struct iocb));
+    queue->plug_list = calloc(bdev->queue_depth, sizeof(struct iocb*));
+    // At most queue_depth barriers are pending, so tags of in-flight
+    // requests never alias modulo queue_depth + 1.
+    queue->inflight = calloc(bdev->queue_depth + 1, sizeof(uint32_t));
+    if (queue->plug == NULL || queue->plug_list == NULL || queue->inflight == NULL) {
+        goto error2;
+    }
+    if (bounce_pool_init(&queue->bounce, BDEV_BOUNCE_SLOT_SIZE, BDEV_BOUNCE_SLOTS, 0) < 0) {
+        goto error2;
+    }
+    queue->tag = 0;
+    queue->barrier_head = queue->barrier_tail = NULL;
+    queue->barrier_len = 0;
+    queue->sync_flush = 0;
+    queue->backlog_head = queue->backlog_tail = NULL;
+    queue->throttle = NULL;
+    queue->timerfd = -1;
+    queue->timer_source = NULL;
+    queue->held_head = queue->held_tail = NULL;
+
     queue->bdev = bdev;
+    atomic_init(&queue->stats.reads, 0);
+    atomic_init(&queue->stats.writes, 0);
+    atomic_init(&queue->stats.read_bytes, 0);
+    atomic_init(&queue->stats.write_bytes, 0);
+    atomic_init(&queue->stats.completions, 0);
+    atomic_init(&queue->stats.errors, 0);
+    atomic_init(&queue->stats.flushes, 0);
+    atomic_init(&queue->stats.discards, 0);
+    atomic_init(&queue->stats.write_zeroes, 0);
+    atomic_init(&queue->stats.throttled, 0);
+    atomic_init(&queue->stats.throttled_ns, 0);
+    atomic_init(&queue->stats.bounced, 0);
+    atomic_init(&queue->stats.bounce_bytes, 0);
+    atomic_init(&queue->stats.bounce_allocs, 0);
+    atomic_init(&queue->stats.backlogged, 0);
 
     return 0;
 
+error2:
+    free(queue->plug);
+    free(queue->plug_list);
+    free(queue->inflight);
+    close(queue->eventfd);
 error1:
     io_destroy(queue->ctx);
 error0:
@@ -71,10 +263,98 @@ error0:
 }
 
 void bdev_deinit(bdev_t *bdev) {
-    close(bdev->fd);
+    if (bdev->cache != NULL) {
+        if (bcache_writeback(bdev->cache, &bdev->cache_dev) < 0) {
+            perror("failed to write back cached blocks");
+        }
+        bcache_invalidate(bdev->cache, &bdev->cache_dev, 0, bdev->size);
+        bdev->cache = NULL;
+    }
+    for (size_t i = 0; i < bdev->queue_count; i++) {
+        bdev_queue_deinit(&bdev->queues[i]);
+    }
+    free(bdev->queues);
+    bdev->queues = NULL;
+    bdev->queue_count = 0;
+    if (bdev->cow != NULL) {
+        cow_close(bdev->cow);
+        free(bdev->cow);
+        bdev->cow = NULL;
+    }
+    if (bdev->stripe != NULL) {
+        stripe_close(bdev->stripe);
+        free(bdev->stripe);
+        bdev->stripe = NULL;
+    } else {
+        close(bdev->fd);
+    }
     bdev->fd = -1;
 }
 
+/**
+ * bdev_map maps the longest contiguous extent at the start of the `len`
+ * bytes at `offset` to the file storing it.
+ */
+static int bdev_map(bdev_t *bdev, uint64_t offset, uint64_t len, cow_map_mode_t mode, cow_extent_t *extent) {
+    if (bdev->cow != NULL) return cow_map(bdev->cow, offset, len, mode, extent);
+    if (bdev->stripe != NULL) {
+        stripe_extent_t piece;
+        stripe_map(bdev->stripe, offset, len, &piece);
+        *extent = (cow_extent_t) { piece.fd, piece.offset, piece.len };
+        return 0;
+    }
+    *extent = (cow_extent_t) { bdev->fd, offset, len };
+    return 0;
+}
+
+/**
+ * bdev_max_extents returns an upper bound of the extents bdev_map maps the
+ * `len` bytes at `offset` to.
+ */
+static size_t bdev_max_extents(bdev_t *bdev, uint64_t offset, uint64_t len) {
+    if (bdev->stripe != NULL) return stripe_max_extents(bdev->stripe, offset, len);
+    if (bdev->cow == NULL) return 1;
+    // Extents end at cluster boundaries, or where the base ends.
+    uint32_t bits = bdev->cow->cluster_bits;
+    return ((offset + len - 1) >> bits) - (offset >> bits) + 2;
+}
+
+static int bdev_cache_writeback(bcache_dev_t *dev, const void *buf, size_t len, uint64_t offset) {
+    bdev_t *bdev = (bdev_t*) ((uint8_t*) dev - offsetof(bdev_t, cache_dev));
+    while (len > 0) {
+        cow_extent_t extent;
+        if (bdev_map(bdev, offset, len, COW_MAP_WRITE, &extent) < 0) return -1;
+        ssize_t res = pwrite(extent.fd, buf, extent.len, extent.offset);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf = (const uint8_t*) buf + res;
+        offset += res;
+        len -= res;
+    }
+    return 0;
+}
+
+int bdev_set_bounce(bdev_t *bdev, size_t slots, int flags) {
+    if (slots == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (size_t i = 0; i < bdev->queue_count; i++) {
+        bounce_pool_t pool;
+        if (bounce_pool_init(&pool, BDEV_BOUNCE_SLOT_SIZE, slots, flags) < 0) return -1;
+        bounce_pool_deinit(&bdev->queues[i].bounce);
+        bdev->queues[i].bounce = pool;
+    }
+    return 0;
+}
+
+void bdev_set_cache(bdev_t *bdev, bcache_t *cache) {
+    bdev->cache_dev.writeback = bdev_cache_writeback;
+    bdev->cache = cache;
+}
+
 bdev_queue_t* bdev_get_queue(bdev_t *bdev, size_t i) {
     return &bdev->queues[i];
 }
@@ -83,53 +363,1114 @@ int bdev_queue_eventfd(bdev_queue_t *queue) {
     return queue->eventfd;
 }
 
-int bdev_queue_read(bdev_queue_t *queue, void *buf, size_t count, off_t offset, bdev_cb_t cb) {
-    struct iocb io = {0};
-    io_prep_pread(&io, queue->bdev->fd, buf, count, offset);
-    io_set_eventfd(&io, queue->eventfd);
-    io_set_callback(&io, cb);
+/**
+ * bdev_queue_defer appends `io` to the backlog of `queue`.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ */
+static int bdev_queue_defer(bdev_queue_t *queue, const struct iocb *io) {
+    int vectored = io->aio_lio_opcode == IO_CMD_PREADV || io->aio_lio_opcode == IO_CMD_PWRITEV;
+    size_t iovcnt = vectored ? io->u.c.nbytes : 0;
+    bdev_backlog_t *entry = malloc(sizeof(bdev_backlog_t) + iovcnt * sizeof(struct iovec));
+    if (entry == NULL) return -1;
+    entry->next = NULL;
+    entry->io = *io;
+    if (vectored) {
+        memcpy(entry->iov, io->u.c.buf, iovcnt * sizeof(struct iovec));
+        entry->io.u.c.buf = entry->iov;
+    }
+
+    if (queue->backlog_tail != NULL) {
+        queue->backlog_tail->next = entry;
+    } else {
+        queue->backlog_head = entry;
+    }
+    queue->backlog_tail = entry;
+    metric_inc(&queue->stats.backlogged, 1);
+    return 0;
+}
+
+static void bdev_queue_complete(bdev_queue_t *queue, bdev_io_t *req, ssize_t res);
+
+/**
+ * bdev_queue_resubmit submits the backlog of `queue` until the aio context
+ * is full again. Requests the kernel rejects otherwise are completed with
+ * the error, except for flushes of files without IOCB_CMD_FDSYNC, which
+ * fall back to a synchronous fdatasync as in bdev_queue_fdsync.
+ */
+static void bdev_queue_resubmit(bdev_queue_t *queue) {
+    while (queue->backlog_head != NULL) {
+        struct iocb *ios[BDEV_BACKLOG_BATCH];
+        size_t count = 0;
+        for (bdev_backlog_t *iter = queue->backlog_head; iter != NULL && count < BDEV_BACKLOG_BATCH;
+             iter = iter->next) {
+            ios[count++] = &iter->io;
+        }
+
+        int res = io_submit(queue->ctx, count, ios);
+        if (res == -EINTR) continue;
+        if (res == -EAGAIN) return;
+        // The first request was rejected, so it is completed instead.
+        size_t done = res > 0 ? (size_t) res : 1;
+        for (size_t i = 0; i < done; i++) {
+            bdev_backlog_t *entry = queue->backlog_head;
+            queue->backlog_head = entry->next;
+            if (queue->backlog_head == NULL) queue->backlog_tail = NULL;
+            if (res == -EINVAL && entry->io.aio_lio_opcode == IO_CMD_FDSYNC) {
+                queue->sync_flush = 1;
+                bdev_queue_complete(queue, entry->io.data, fdatasync(entry->io.aio_fildes) < 0 ? -errno : 0);
+            } else if (res <= 0) {
+                bdev_queue_complete(queue, entry->io.data, res < 0 ? res : -EIO);
+            }
+            free(entry);
+        }
+    }
+}
+
+/**
+ * bdev_queue_submit submits the prepared `io` immediately, or batches it
+ * while the queue is plugged. Requests that find the aio context full are
+ * held in the backlog.
+ */
+static int bdev_queue_submit(bdev_queue_t *queue, struct iocb *io) {
+    if (queue->plugged) {
+        // Submit a full batch early.
+        if (queue->plug_len == queue->bdev->queue_depth) {
+            bdev_queue_unplug(queue);
+            queue->plugged = 1;
+        }
+        queue->plug[queue->plug_len] = *io;
+        queue->plug_list[queue->plug_len] = &queue->plug[queue->plug_len];
+        queue->plug_len++;
+        return 0;
+    }
+
+    // Requests are submitted in order once a backlog exists.
+    if (queue->backlog_head != NULL) return bdev_queue_defer(queue, io);
 
-    struct iocb *ios[1] = {&io};
-    int res = io_submit(queue->ctx, 1, ios);
+    struct iocb *ios[1] = {io};
+    int res;
+    while ((res = io_submit(queue->ctx, 1, ios)) == -EINTR);
+    if (res == -EAGAIN) return bdev_queue_defer(queue, io);
     if (res < 0) {
         errno = -res;
         return -1;
     }
+    return 0;
+}
+
+static uint32_t* bdev_queue_inflight(bdev_queue_t *queue, uint32_t tag) {
+    return &queue->inflight[tag % (queue->bdev->queue_depth + 1)];
+}
+
+/**
+ * bdev_queue_prep tags `req` as a read or write issued after every barrier
+ * queued so far.
+ */
+static void bdev_queue_prep(bdev_queue_t *queue, struct iocb *io, bdev_io_t *req) {
+    io_set_eventfd(io, queue->eventfd);
+    io->data = req;
+    req->op = BDEV_OP_RW;
+    req->tag = queue->tag;
+    (*bdev_queue_inflight(queue, req->tag))++;
+}
+
+static void bdev_queue_dispatch(bdev_queue_t *queue);
 
+/**
+ * bdev_queue_complete calls the callback of `req` with `res`. Callers run
+ * bdev_queue_dispatch afterwards, since the completion may unblock a
+ * barrier.
+ */
+static void bdev_queue_complete(bdev_queue_t *queue, bdev_io_t *req, ssize_t res) {
+    if (res < 0) metric_inc(&queue->stats.errors, 1);
+    if (req->op == BDEV_OP_RW) (*bdev_queue_inflight(queue, req->tag))--;
+    req->cb(req, res);
+}
+
+/**
+ * bdev_queue_submit_rw submits a read or write prepared by bdev_queue_prep.
+ */
+static int bdev_queue_submit_rw(bdev_queue_t *queue, struct iocb *io) {
+    if (bdev_queue_submit(queue, io) < 0) {
+        bdev_io_t *req = io->data;
+        (*bdev_queue_inflight(queue, req->tag))--;
+        bdev_queue_dispatch(queue);
+        return -1;
+    }
     return 0;
 }
 
-int bdev_queue_write(bdev_queue_t *queue, void *buf, size_t count, off_t offset, bdev_cb_t cb) {
+static size_t iov_length(const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+    return len;
+}
+
+/**
+ * bdev_queue_direct_rwv submits a single vectored read or write of `fd`
+ * with the buffers of `iov`.
+ */
+static int bdev_queue_direct_rwv(bdev_queue_t *queue, bdev_io_t *req, int write, int fd,
+                                 const struct iovec *iov, int iovcnt, off_t offset, int flags) {
     struct iocb io = {0};
-    io_prep_pwrite(&io, queue->bdev->fd, buf, count, offset);
-    io_set_eventfd(&io, queue->eventfd);
-    io_set_callback(&io, cb);
+    // Single buffers are not referenced through `iov`, which callers may
+    // free before a plugged request is submitted.
+    if (iovcnt == 1) {
+        if (write) {
+            io_prep_pwrite(&io, fd, iov[0].iov_base, iov[0].iov_len, offset);
+        } else {
+            io_prep_pread(&io, fd, iov[0].iov_base, iov[0].iov_len, offset);
+        }
+    } else if (write) {
+        io_prep_pwritev(&io, fd, iov, iovcnt, offset);
+    } else {
+        io_prep_preadv(&io, fd, iov, iovcnt, offset);
+    }
+    if (flags & BDEV_WRITE_FUA) {
+        io.aio_rw_flags = RWF_DSYNC;
+    }
+    bdev_queue_prep(queue, &io, req);
+    return bdev_queue_submit_rw(queue, &io);
+}
+
+/**
+ * The bdev_bounce_io_t stages a read or write through an aligned buffer
+ * holding the blocks the request covers, from `start`. The request's bytes
+ * are `pad` bytes into it. Reads and partial writes keep `iov`: reads copy
+ * the buffer back into it when they complete, and partial writes copy it
+ * into the buffer once the blocks were read.
+ */
+typedef struct bdev_bounce_io {
+    bdev_io_t io;
+    bdev_io_t *parent;
+    bdev_queue_t *queue;
+    void *buf;
+    int fd;
+    int flags;
+    off_t start;
+    size_t pad;
+    size_t len;
+    size_t window;
+    int iovcnt;
+    struct iovec iov[];
+} bdev_bounce_io_t;
 
-    struct iocb *ios[1] = {&io};
-    int res = io_submit(queue->ctx, 1, ios);
+static void bdev_bounce_release(bdev_queue_t *queue, void *buf) {
+    if (!bounce_pool_put(&queue->bounce, buf)) free(buf);
+}
+
+/**
+ * bdev_bounce_finish completes the parent of `bio` with the bytes of the
+ * request among the `res` bytes transferred from `start`.
+ */
+static void bdev_bounce_finish(bdev_bounce_io_t *bio, ssize_t res) {
+    if (res >= 0) {
+        res = (size_t) res > bio->pad ? (ssize_t) (res - bio->pad) : 0;
+        if ((size_t) res > bio->len) res = bio->len;
+    }
+    bdev_bounce_release(bio->queue, bio->buf);
+
+    bdev_io_t *parent = bio->parent;
+    free(bio);
+    parent->cb(parent, res);
+}
+
+static void bdev_bounce_done(bdev_io_t *io, ssize_t res) {
+    bdev_bounce_io_t *bio = (bdev_bounce_io_t*) io;
+    if (res > 0 && (size_t) res > bio->pad) {
+        const uint8_t *buf = (const uint8_t*) bio->buf + bio->pad;
+        size_t left = (size_t) res - bio->pad;
+        for (int i = 0; i < bio->iovcnt && left > 0; i++) {
+            size_t n = left < bio->iov[i].iov_len ? left : bio->iov[i].iov_len;
+            memcpy(bio->iov[i].iov_base, buf, n);
+            buf += n;
+            left -= n;
+        }
+    }
+    bdev_bounce_finish(bio, res);
+}
+
+static void bdev_bounce_write_done(bdev_io_t *io, ssize_t res) {
+    bdev_bounce_finish((bdev_bounce_io_t*) io, res);
+}
+
+/**
+ * bdev_bounce_rmw_done writes the blocks of a partial write back once they
+ * were read, with the request's bytes copied over them. The write keeps
+ * the tag of the read, so that the barriers queued since still wait for
+ * it.
+ */
+static void bdev_bounce_rmw_done(bdev_io_t *io, ssize_t res) {
+    bdev_bounce_io_t *bio = (bdev_bounce_io_t*) io;
+    bdev_queue_t *queue = bio->queue;
     if (res < 0) {
-        errno = -res;
+        bdev_bounce_finish(bio, res);
+        return;
+    }
+    // Past the end of the file, the blocks read as zeros.
+    uint8_t *buf = bio->buf;
+    if ((size_t) res < bio->window) memset(buf + res, 0, bio->window - res);
+    buf += bio->pad;
+    for (int i = 0; i < bio->iovcnt; i++) {
+        memcpy(buf, bio->iov[i].iov_base, bio->iov[i].iov_len);
+        buf += bio->iov[i].iov_len;
+    }
+
+    struct iocb iocb = {0};
+    io_prep_pwrite(&iocb, bio->fd, bio->buf, bio->window, bio->start);
+    if (bio->flags & BDEV_WRITE_FUA) {
+        iocb.aio_rw_flags = RWF_DSYNC;
+    }
+    io_set_eventfd(&iocb, queue->eventfd);
+    iocb.data = &bio->io;
+    bio->io.cb = bdev_bounce_write_done;
+    (*bdev_queue_inflight(queue, bio->io.tag))++;
+    if (bdev_queue_submit(queue, &iocb) < 0) {
+        (*bdev_queue_inflight(queue, bio->io.tag))--;
+        bdev_bounce_finish(bio, -errno);
+    }
+}
+
+/**
+ * bdev_queue_bounce_rwv submits a request that O_DIRECT would reject
+ * through a buffer of the queue's bounce pool, or a freshly allocated one
+ * if the pool is exhausted or the request too large. The buffer covers the
+ * blocks the request touches. A write that covers part of a block reads
+ * the blocks first; it is not atomic with a concurrent write to the rest
+ * of the block.
+ */
+static int bdev_queue_bounce_rwv(bdev_queue_t *queue, bdev_io_t *req, int write, int fd,
+                                 const struct iovec *iov, int iovcnt, off_t offset, int flags) {
+    size_t block_size = queue->bdev->block_size;
+    size_t len = iov_length(iov, iovcnt);
+    off_t start = offset & ~(off_t) (block_size - 1);
+    size_t pad = offset - start;
+    size_t window = (pad + len + block_size - 1) & ~(block_size - 1);
+    int rmw = write && window != len;
+    // Only reads and partial writes need their iovecs after submission.
+    int copy = !write || rmw ? iovcnt : 0;
+    bdev_bounce_io_t *bio = malloc(sizeof(bdev_bounce_io_t) + copy * sizeof(struct iovec));
+    if (bio == NULL) return -1;
+
+    bio->buf = bounce_pool_get(&queue->bounce, window);
+    if (bio->buf == NULL) {
+        if (posix_memalign(&bio->buf, BDEV_BOUNCE_ALIGN, window) != 0) {
+            free(bio);
+            errno = ENOMEM;
+            return -1;
+        }
+        metric_inc(&queue->stats.bounce_allocs, 1);
+    }
+    bio->io.cb = write ? bdev_bounce_write_done : bdev_bounce_done;
+    bio->parent = req;
+    bio->queue = queue;
+    bio->fd = fd;
+    bio->flags = flags;
+    bio->start = start;
+    bio->pad = pad;
+    bio->len = len;
+    bio->window = window;
+    bio->iovcnt = copy;
+    memcpy(bio->iov, iov, copy * sizeof(struct iovec));
+    if (write && !rmw) {
+        uint8_t *buf = bio->buf;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+            buf += iov[i].iov_len;
+        }
+    }
+
+    struct iovec staged = { bio->buf, window };
+    int res;
+    if (rmw) {
+        bio->io.cb = bdev_bounce_rmw_done;
+        res = bdev_queue_direct_rwv(queue, &bio->io, 0, fd, &staged, 1, start, 0);
+    } else {
+        res = bdev_queue_direct_rwv(queue, &bio->io, write, fd, &staged, 1, start, flags);
+    }
+    if (res < 0) {
+        bdev_bounce_release(queue, bio->buf);
+        free(bio);
         return -1;
     }
+    metric_inc(&queue->stats.bounced, 1);
+    metric_inc(&queue->stats.bounce_bytes, window);
+    return 0;
+}
+
+/**
+ * bdev_queue_rwv submits a single vectored read or write of `fd`, staged
+ * through a bounce buffer unless its offset and every buffer of `iov` are
+ * aligned as O_DIRECT requires.
+ */
+static int bdev_queue_rwv(bdev_queue_t *queue, bdev_io_t *req, int write, int fd,
+                          const struct iovec *iov, int iovcnt, off_t offset, int flags) {
+    bdev_t *bdev = queue->bdev;
+    uintptr_t addrs = 0;
+    size_t lens = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        addrs |= (uintptr_t) iov[i].iov_base;
+        lens |= iov[i].iov_len;
+    }
+    if ((addrs & (bdev->mem_align - 1)) != 0 || ((lens | offset) & (bdev->block_size - 1)) != 0) {
+        return bdev_queue_bounce_rwv(queue, req, write, fd, iov, iovcnt, offset, flags);
+    }
+    return bdev_queue_direct_rwv(queue, req, write, fd, iov, iovcnt, offset, flags);
+}
+
+/**
+ * The bdev_split_t completes a request of a copy-on-write or striped bdev
+ * that spans several extents once the requests of all its extents have
+ * completed.
+ */
+typedef struct bdev_split_io {
+    bdev_io_t io;
+    struct bdev_split *split;
+    size_t len;
+} bdev_split_io_t;
+
+typedef struct bdev_split {
+    bdev_io_t *parent;
+    size_t pending;
+    ssize_t res;
+    bdev_split_io_t *ios;
+    struct iovec *iov;
+} bdev_split_t;
+
+static void bdev_split_put(bdev_split_t *split, ssize_t res) {
+    if (res < 0 && split->res >= 0) split->res = res;
+    if (--split->pending > 0) return;
+
+    bdev_io_t *parent = split->parent;
+    ssize_t total = split->res;
+    free(split);
+    parent->cb(parent, total);
+}
+
+static void bdev_split_done(bdev_io_t *io, ssize_t res) {
+    bdev_split_io_t *child = (bdev_split_io_t*) io;
+    if (res >= 0 && (size_t) res != child->len) res = -EIO;
+    bdev_split_put(child->split, res);
+}
+
+/**
+ * bdev_queue_split_rwv maps a request of a copy-on-write or striped bdev to
+ * extents of its files. A request within one extent is submitted as is,
+ * otherwise one request is submitted per extent.
+ */
+static int bdev_queue_split_rwv(bdev_queue_t *queue, bdev_io_t *req, int write,
+                                const struct iovec *iov, int iovcnt, off_t offset, int flags) {
+    bdev_t *bdev = queue->bdev;
+    size_t len = iov_length(iov, iovcnt);
+    cow_map_mode_t mode = write ? COW_MAP_WRITE : COW_MAP_READ;
+
+    cow_extent_t extent;
+    if (bdev_map(bdev, offset, len, mode, &extent) < 0) return -1;
+    if (extent.len == len && extent.fd >= 0) {
+        return bdev_queue_rwv(queue, req, write, extent.fd, iov, iovcnt, extent.offset, flags);
+    }
 
+    size_t max_extents = bdev_max_extents(bdev, offset, len);
+    bdev_split_t *split = malloc(sizeof(bdev_split_t) + max_extents * sizeof(bdev_split_io_t) +
+                                 (iovcnt + max_extents) * sizeof(struct iovec));
+    if (split == NULL) return -1;
+    split->parent = req;
+    split->res = len;
+    split->ios = (bdev_split_io_t*) (split + 1);
+    split->iov = (struct iovec*) (split->ios + max_extents);
+    // The reference held by the submission keeps the split alive until all
+    // extents were submitted.
+    split->pending = 1;
+
+    size_t done = 0;
+    size_t children = 0;
+    size_t iov_used = 0;
+    int i = 0;
+    size_t iov_offset = 0;
+    while (done < len) {
+        if (done > 0 && bdev_map(bdev, offset + done, len - done, mode, &extent) < 0) {
+            split->res = -errno;
+            break;
+        }
+
+        // Slice the iovecs covering the extent.
+        struct iovec *slice = &split->iov[iov_used];
+        int slice_cnt = 0;
+        for (size_t remaining = extent.len; remaining > 0; slice_cnt++) {
+            size_t n = iov[i].iov_len - iov_offset;
+            if (n > remaining) n = remaining;
+            slice[slice_cnt] = (struct iovec) { (uint8_t*) iov[i].iov_base + iov_offset, n };
+            remaining -= n;
+            iov_offset += n;
+            if (iov_offset == iov[i].iov_len) {
+                i++;
+                iov_offset = 0;
+            }
+        }
+        iov_used += slice_cnt;
+        done += extent.len;
+
+        if (extent.fd < 0) {
+            for (int j = 0; j < slice_cnt; j++) memset(slice[j].iov_base, 0, slice[j].iov_len);
+            continue;
+        }
+
+        bdev_split_io_t *child = &split->ios[children++];
+        child->io.cb = bdev_split_done;
+        child->split = split;
+        child->len = extent.len;
+        split->pending++;
+        if (bdev_queue_rwv(queue, &child->io, write, extent.fd, slice, slice_cnt, extent.offset, flags) < 0) {
+            split->pending--;
+            split->res = -errno;
+            break;
+        }
+    }
+
+    bdev_split_put(split, 0);
     return 0;
 }
 
-int bdev_queue_poll(bdev_queue_t *queue) {
-    struct io_event cqe[128];
-    struct timespec timeout = (struct timespec) {
-        .tv_sec = 0,
-        .tv_nsec = 100000000
+static int bdev_queue_submitv(bdev_queue_t *queue, bdev_io_t *req, int write,
+                              const struct iovec *iov, int iovcnt, off_t offset, int flags) {
+    if (queue->bdev->cow != NULL || queue->bdev->stripe != NULL) {
+        return bdev_queue_split_rwv(queue, req, write, iov, iovcnt, offset, flags);
+    }
+    return bdev_queue_rwv(queue, req, write, queue->bdev->fd, iov, iovcnt, offset, flags);
+}
+
+/**
+ * The bdev_cache_io_t wraps a read or write of a cached bdev that missed
+ * the cache, to fill or invalidate the cache when it completes.
+ */
+typedef struct bdev_cache_io {
+    bdev_io_t io;
+    bdev_io_t *parent;
+    bdev_t *bdev;
+    int write;
+    uint64_t offset;
+    uint64_t epoch;
+    int iovcnt;
+    struct iovec iov[];
+} bdev_cache_io_t;
+
+static void bdev_cache_done(bdev_io_t *io, ssize_t res) {
+    bdev_cache_io_t *cio = (bdev_cache_io_t*) io;
+    bcache_t *cache = cio->bdev->cache;
+    if (cio->write) {
+        // Reads submitted while the write was in flight may have filled the
+        // cache with the data it replaced.
+        if (bcache_invalidate(cache, &cio->bdev->cache_dev, cio->offset, iov_length(cio->iov, cio->iovcnt)) < 0 &&
+            res >= 0) {
+            res = -errno;
+        }
+    } else if (res == (ssize_t) iov_length(cio->iov, cio->iovcnt)) {
+        bcache_fill(cache, &cio->bdev->cache_dev, cio->offset, cio->iov, cio->iovcnt, cio->epoch);
+    }
+
+    bdev_io_t *parent = cio->parent;
+    free(cio);
+    parent->cb(parent, res);
+}
+
+/**
+ * bdev_queue_cached_rwv completes reads from the cache, or absorbs writes
+ * into it in write-back mode, and otherwise submits the request.
+ */
+static int bdev_queue_cached_rwv(bdev_queue_t *queue, bdev_io_t *req, int write,
+                                 const struct iovec *iov, int iovcnt, off_t offset, int flags) {
+    bdev_t *bdev = queue->bdev;
+    size_t len = iov_length(iov, iovcnt);
+    if (!write && bcache_read(bdev->cache, &bdev->cache_dev, offset, iov, iovcnt)) {
+        req->cb(req, len);
+        return 0;
+    }
+    // FUA writes must reach the device before they complete.
+    if (write && !(flags & BDEV_WRITE_FUA) && bcache_write(bdev->cache, &bdev->cache_dev, offset, iov, iovcnt)) {
+        req->cb(req, len);
+        return 0;
+    }
+
+    uint64_t epoch = bcache_epoch(bdev->cache);
+    if (write && bcache_invalidate(bdev->cache, &bdev->cache_dev, offset, len) < 0) return -1;
+
+    bdev_cache_io_t *cio = malloc(sizeof(bdev_cache_io_t) + iovcnt * sizeof(struct iovec));
+    if (cio == NULL) return -1;
+    cio->io.cb = bdev_cache_done;
+    cio->parent = req;
+    cio->bdev = bdev;
+    cio->write = write;
+    cio->offset = offset;
+    cio->epoch = epoch;
+    cio->iovcnt = iovcnt;
+    memcpy(cio->iov, iov, iovcnt * sizeof(struct iovec));
+
+    if (bdev_queue_submitv(queue, &cio->io, write, cio->iov, iovcnt, offset, flags) < 0) {
+        free(cio);
+        return -1;
+    }
+    return 0;
+}
+
+static int bdev_queue_iov(bdev_queue_t *queue, bdev_io_t *req, int write,
+                          const struct iovec *iov, int iovcnt, off_t offset, int flags) {
+    if (queue->bdev->cache != NULL) return bdev_queue_cached_rwv(queue, req, write, iov, iovcnt, offset, flags);
+    return bdev_queue_submitv(queue, req, write, iov, iovcnt, offset, flags);
+}
+
+static int bdev_queue_hold(bdev_queue_t *queue, bdev_io_t *req, int write, int barrier,
+                           const struct iovec *iov, int iovcnt, off_t offset, int flags);
+
+/**
+ * bdev_queue_start submits a read or write, unless the throttle of the
+ * queue holds it.
+ */
+static int bdev_queue_start(bdev_queue_t *queue, bdev_io_t *req, int write,
+                            const struct iovec *iov, int iovcnt, off_t offset, int flags) {
+    if (queue->throttle == NULL) return bdev_queue_iov(queue, req, write, iov, iovcnt, offset, flags);
+
+    size_t len = iov_length(iov, iovcnt);
+    if (queue->held_head != NULL || !throttle_admit(queue->throttle, write, len)) {
+        return bdev_queue_hold(queue, req, write, 0, iov, iovcnt, offset, flags);
+    }
+    if (bdev_queue_iov(queue, req, write, iov, iovcnt, offset, flags) < 0) {
+        // A request that was not submitted does not count against the limits.
+        throttle_refund(queue->throttle, write, len);
+        return -1;
+    }
+    return 0;
+}
+
+int bdev_queue_read(bdev_queue_t *queue, bdev_io_t *req, void *buf, size_t count, off_t offset) {
+    struct iovec iov = { buf, count };
+    if (bdev_queue_start(queue, req, 0, &iov, 1, offset, 0) < 0) {
+        return -1;
+    }
+
+    metric_inc(&queue->stats.reads, 1);
+    metric_inc(&queue->stats.read_bytes, count);
+    return 0;
+}
+
+int bdev_queue_write(bdev_queue_t *queue, bdev_io_t *req, void *buf, size_t count, off_t offset) {
+    struct iovec iov = { buf, count };
+    if (bdev_queue_start(queue, req, 1, &iov, 1, offset, 0) < 0) {
+        return -1;
+    }
+
+    metric_inc(&queue->stats.writes, 1);
+    metric_inc(&queue->stats.write_bytes, count);
+    return 0;
+}
+
+int bdev_queue_readv(bdev_queue_t *queue, bdev_io_t *req, const struct iovec *iov, int iovcnt, off_t offset) {
+    if (bdev_queue_start(queue, req, 0, iov, iovcnt, offset, 0) < 0) {
+        return -1;
+    }
+
+    metric_inc(&queue->stats.reads, 1);
+    metric_inc(&queue->stats.read_bytes, iov_length(iov, iovcnt));
+    return 0;
+}
+
+int bdev_queue_writev(bdev_queue_t *queue, bdev_io_t *req, const struct iovec *iov, int iovcnt, off_t offset,
+                      int flags) {
+    if (bdev_queue_start(queue, req, 1, iov, iovcnt, offset, flags) < 0) {
+        return -1;
+    }
+
+    metric_inc(&queue->stats.writes, 1);
+    metric_inc(&queue->stats.write_bytes, iov_length(iov, iovcnt));
+    return 0;
+}
+
+/**
+ * bdev_queue_fallocate deallocates or zeroes a range with the first of the
+ * `count` fallocate modes the backing file supports.
+ *
+ * \return On success, 0 is returned. On error, -errno is returned.
+ */
+static ssize_t bdev_fallocate(int fd, off_t offset, off_t len, const int *modes, size_t count) {
+    int error = EOPNOTSUPP;
+    for (size_t i = 0; i < count; i++) {
+        if (fallocate(fd, modes[i], offset, len) == 0) return 0;
+        error = errno;
+        if (error != EOPNOTSUPP) break;
+    }
+    return -error;
+}
+
+static ssize_t bdev_queue_fallocate(bdev_queue_t *queue, bdev_io_t *req, const int *modes, size_t count) {
+    bdev_t *bdev = queue->bdev;
+    cow_t *cow = bdev->cow;
+    if (cow == NULL && bdev->stripe == NULL) return bdev_fallocate(bdev->fd, req->offset, req->len, modes, count);
+
+    // The base is never modified: discards only deallocate clusters of the
+    // overlay, and write-zeroes allocates the range in the overlay first.
+    cow_map_mode_t mode = req->op == BDEV_OP_DISCARD ? COW_MAP_READ : COW_MAP_ZERO;
+    for (off_t done = 0; done < req->len;) {
+        cow_extent_t extent;
+        if (bdev_map(bdev, req->offset + done, req->len - done, mode, &extent) < 0) return -errno;
+        if (cow == NULL || extent.fd == cow->fd) {
+            ssize_t res = bdev_fallocate(extent.fd, extent.offset, extent.len, modes, count);
+            if (res < 0) return res;
+        }
+        done += extent.len;
+    }
+    return 0;
+}
+
+/**
+ * bdev_queue_fdsync completes `req` with an asynchronous fdatasync of `fd`,
+ * or a synchronous one if the kernel rejects IOCB_CMD_FDSYNC for it.
+ */
+static void bdev_queue_fdsync(bdev_queue_t *queue, bdev_io_t *req, int fd) {
+    ssize_t res;
+    if (!queue->sync_flush) {
+        struct iocb io;
+        io_prep_fdsync(&io, fd);
+        io_set_eventfd(&io, queue->eventfd);
+        io.data = req;
+
+        if (queue->backlog_head != NULL) {
+            if (bdev_queue_defer(queue, &io) == 0) return;
+            bdev_queue_complete(queue, req, -errno);
+            return;
+        }
+
+        struct iocb *ios[1] = {&io};
+        int err;
+        while ((err = io_submit(queue->ctx, 1, ios)) == -EINTR);
+        if (err == 1) return;
+        if (err == -EAGAIN) {
+            if (bdev_queue_defer(queue, &io) == 0) return;
+            bdev_queue_complete(queue, req, -errno);
+            return;
+        }
+        if (err != -EINVAL) {
+            bdev_queue_complete(queue, req, err < 0 ? err : -EIO);
+            return;
+        }
+        queue->sync_flush = 1;
+    }
+    res = fdatasync(fd) < 0 ? -errno : 0;
+    bdev_queue_complete(queue, req, res);
+}
+
+/**
+ * bdev_queue_flush_members flushes every member of a striped bdev, and
+ * completes `req` once all of them are durable.
+ */
+static void bdev_queue_flush_members(bdev_queue_t *queue, bdev_io_t *req) {
+    stripe_t *stripe = queue->bdev->stripe;
+    bdev_split_t *split = malloc(sizeof(bdev_split_t) + stripe->member_count * sizeof(bdev_split_io_t));
+    if (split == NULL) {
+        bdev_queue_complete(queue, req, -ENOMEM);
+        return;
+    }
+    split->parent = req;
+    split->res = 0;
+    split->ios = (bdev_split_io_t*) (split + 1);
+    split->pending = 1 + stripe->member_count;
+
+    for (size_t i = 0; i < stripe->member_count; i++) {
+        bdev_split_io_t *child = &split->ios[i];
+        child->io.cb = bdev_split_done;
+        child->io.op = BDEV_OP_FLUSH;
+        child->split = split;
+        child->len = 0;
+        bdev_queue_fdsync(queue, &child->io, stripe->members[i].fd);
+    }
+    bdev_split_put(split, 0);
+}
+
+/**
+ * bdev_queue_run_barrier runs `req`, whose preceding reads and writes have
+ * all completed. Flushes complete through the aio context unless the
+ * backing file does not support IOCB_CMD_FDSYNC; discards and write-zeroes
+ * run synchronously since fallocate has no aio command.
+ */
+static void bdev_queue_run_barrier(bdev_queue_t *queue, bdev_io_t *req) {
+    static const int discard_modes[] = { FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE };
+    static const int zero_modes[] = { FALLOC_FL_ZERO_RANGE, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE };
+    static const int unmap_modes[] = { FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, FALLOC_FL_ZERO_RANGE };
+
+    ssize_t res = 0;
+    switch (req->op) {
+    case BDEV_OP_FLUSH:
+        if (queue->bdev->stripe != NULL) {
+            bdev_queue_flush_members(queue, req);
+        } else {
+            bdev_queue_fdsync(queue, req, queue->bdev->fd);
+        }
+        return;
+    case BDEV_OP_DISCARD:
+        res = bdev_queue_fallocate(queue, req, discard_modes, 1);
+        // Discard is a hint, so backends that cannot deallocate ignore it.
+        if (res == -EOPNOTSUPP) res = 0;
+        break;
+    case BDEV_OP_WRITE_ZEROES:
+        res = req->unmap ? bdev_queue_fallocate(queue, req, unmap_modes, 2)
+                         : bdev_queue_fallocate(queue, req, zero_modes, 2);
+        break;
+    default:
+        res = -EINVAL;
+        break;
+    }
+    bdev_queue_complete(queue, req, res);
+}
+
+/**
+ * bdev_queue_dispatch runs the barriers at the head of the FIFO whose
+ * preceding reads and writes have all completed.
+ */
+static void bdev_queue_dispatch(bdev_queue_t *queue) {
+    while (queue->barrier_head != NULL && *bdev_queue_inflight(queue, queue->barrier_head->tag) == 0) {
+        bdev_io_t *req = queue->barrier_head;
+        queue->barrier_head = req->next;
+        if (queue->barrier_head == NULL) queue->barrier_tail = NULL;
+        queue->barrier_len--;
+        bdev_queue_run_barrier(queue, req);
+    }
+}
+
+static int bdev_queue_enqueue_barrier(bdev_queue_t *queue, bdev_io_t *req) {
+    if (queue->barrier_len == queue->bdev->queue_depth) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    req->next = NULL;
+    req->tag = queue->tag++;
+
+    if (queue->barrier_tail != NULL) {
+        queue->barrier_tail->next = req;
+    } else {
+        queue->barrier_head = req;
+    }
+    queue->barrier_tail = req;
+    queue->barrier_len++;
+
+    bdev_queue_dispatch(queue);
+    return 0;
+}
+
+static int bdev_queue_barrier(bdev_queue_t *queue, bdev_io_t *req, bdev_op_t op, off_t offset, off_t len) {
+    req->op = op;
+    req->offset = offset;
+    req->len = len;
+    // Barriers are not charged, but must follow the requests held before
+    // them.
+    if (queue->held_head != NULL) {
+        return bdev_queue_hold(queue, req, 0, 1, NULL, 0, offset, 0);
+    }
+    return bdev_queue_enqueue_barrier(queue, req);
+}
+
+static void bdev_queue_arm(bdev_queue_t *queue, uint64_t delay_ns) {
+    struct itimerspec spec = {
+        .it_value = { .tv_sec = delay_ns / 1000000000ULL, .tv_nsec = delay_ns % 1000000000ULL },
     };
-    int res = io_getevents(queue->ctx, 1, 128, cqe, &timeout);
+    if (timerfd_settime(queue->timerfd, 0, &spec, NULL) < 0) {
+        perror("failed to arm bdev throttle timer");
+    }
+}
+
+static int bdev_queue_hold(bdev_queue_t *queue, bdev_io_t *req, int write, int barrier,
+                           const struct iovec *iov, int iovcnt, off_t offset, int flags) {
+    bdev_held_t *held = malloc(sizeof(bdev_held_t) + iovcnt * sizeof(struct iovec));
+    if (held == NULL) return -1;
+    held->next = NULL;
+    held->req = req;
+    held->write = write;
+    held->barrier = barrier;
+    held->offset = offset;
+    held->flags = flags;
+    held->since = throttle_now();
+    held->iovcnt = iovcnt;
+    memcpy(held->iov, iov, iovcnt * sizeof(struct iovec));
+
+    if (queue->held_tail != NULL) {
+        queue->held_tail->next = held;
+    } else {
+        queue->held_head = held;
+        bdev_queue_arm(queue, throttle_delay(queue->throttle, write, held->since));
+    }
+    queue->held_tail = held;
+    metric_inc(&queue->stats.throttled, 1);
+    return 0;
+}
+
+/**
+ * bdev_queue_release submits the held requests the throttle admits, in
+ * order, and re-arms the timer for the first request still held.
+ */
+static void bdev_queue_release(bdev_queue_t *queue) {
+    uint64_t now = throttle_now();
+    // Released requests are freed after the unplug submitted their iovecs.
+    bdev_held_t *released = NULL;
+
+    bdev_queue_plug(queue);
+    while (queue->held_head != NULL) {
+        bdev_held_t *held = queue->held_head;
+        size_t len = iov_length(held->iov, held->iovcnt);
+        if (!held->barrier && !throttle_admit(queue->throttle, held->write, len)) {
+            break;
+        }
+        queue->held_head = held->next;
+        if (queue->held_head == NULL) queue->held_tail = NULL;
+        held->next = released;
+        released = held;
+        metric_inc(&queue->stats.throttled_ns, now - held->since);
+
+        int res = held->barrier ? bdev_queue_enqueue_barrier(queue, held->req)
+                                : bdev_queue_iov(queue, held->req, held->write, held->iov, held->iovcnt,
+                                                 held->offset, held->flags);
+        if (res < 0) {
+            if (!held->barrier) throttle_refund(queue->throttle, held->write, len);
+            metric_inc(&queue->stats.errors, 1);
+            held->req->cb(held->req, -errno);
+        }
+    }
+    bdev_queue_unplug(queue);
+
+    while (released != NULL) {
+        bdev_held_t *held = released;
+        released = held->next;
+        free(held);
+    }
+    if (queue->held_head != NULL) {
+        bdev_queue_arm(queue, throttle_delay(queue->throttle, queue->held_head->write, now));
+    }
+}
+
+static void bdev_queue_throttle_event(void *arg, uint32_t events) {
+    bdev_queue_t *queue = arg;
+    uint64_t expirations;
+    if (read(queue->timerfd, &expirations, sizeof(expirations)) < 0) {
+        return;
+    }
+    bdev_queue_release(queue);
+}
+
+int bdev_set_limits(bdev_t *bdev, const throttle_limits_t *limits) {
+    int limited = 0;
+    for (int i = 0; i < THROTTLE_BUCKETS; i++) limited |= limits->rate[i] != 0;
+    if (!limited) return 0;
+
+    if (bdev->queue_count > 0 && bdev->queues[0].throttle != NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+    for (size_t i = 0; i < bdev->queue_count; i++) {
+        bdev_queue_t *queue = &bdev->queues[i];
+        queue->throttle = malloc(sizeof(throttle_t));
+        if (queue->throttle == NULL) goto error0;
+        queue->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (queue->timerfd < 0) {
+            free(queue->throttle);
+            queue->throttle = NULL;
+            goto error0;
+        }
+        throttle_init(queue->throttle, limits, 1.0 / bdev->queue_count);
+    }
+    return 0;
+
+error0:
+    for (size_t i = 0; i < bdev->queue_count; i++) {
+        bdev_queue_t *queue = &bdev->queues[i];
+        if (queue->throttle == NULL) continue;
+        close(queue->timerfd);
+        free(queue->throttle);
+        queue->throttle = NULL;
+        queue->timerfd = -1;
+    }
+    return -1;
+}
+
+int bdev_queue_flush(bdev_queue_t *queue, bdev_io_t *req) {
+    bdev_t *bdev = queue->bdev;
+    if (bdev->cache != NULL && bcache_writeback(bdev->cache, &bdev->cache_dev) < 0) {
+        return -1;
+    }
+    if (bdev_queue_barrier(queue, req, BDEV_OP_FLUSH, 0, 0) < 0) {
+        return -1;
+    }
+    metric_inc(&queue->stats.flushes, 1);
+    return 0;
+}
+
+int bdev_queue_discard(bdev_queue_t *queue, bdev_io_t *req, off_t offset, off_t len) {
+    bdev_t *bdev = queue->bdev;
+    if (bdev->cache != NULL && bcache_invalidate(bdev->cache, &bdev->cache_dev, offset, len) < 0) {
+        return -1;
+    }
+    if (bdev_queue_barrier(queue, req, BDEV_OP_DISCARD, offset, len) < 0) {
+        return -1;
+    }
+    metric_inc(&queue->stats.discards, 1);
+    return 0;
+}
+
+int bdev_queue_write_zeroes(bdev_queue_t *queue, bdev_io_t *req, off_t offset, off_t len, int unmap) {
+    bdev_t *bdev = queue->bdev;
+    if (bdev->cache != NULL && bcache_invalidate(bdev->cache, &bdev->cache_dev, offset, len) < 0) {
+        return -1;
+    }
+    req->unmap = unmap;
+    if (bdev_queue_barrier(queue, req, BDEV_OP_WRITE_ZEROES, offset, len) < 0) {
+        return -1;
+    }
+    metric_inc(&queue->stats.write_zeroes, 1);
+    return 0;
+}
+
+void bdev_queue_plug(bdev_queue_t *queue) {
+    queue->plugged = 1;
+}
+
+void bdev_queue_unplug(bdev_queue_t *queue) {
+    queue->plugged = 0;
+
+    size_t submitted = 0;
+    while (submitted < queue->plug_len) {
+        int res = queue->backlog_head != NULL ? -EAGAIN :
+                  io_submit(queue->ctx, queue->plug_len - submitted, queue->plug_list + submitted);
+        if (res > 0) {
+            submitted += res;
+            continue;
+        }
+        if (res == -EINTR) continue;
+
+        // Hold the requests the aio context has no slots for, and fail
+        // those that were not submitted otherwise.
+        for (size_t i = submitted; i < queue->plug_len; i++) {
+            if (res == -EAGAIN && bdev_queue_defer(queue, queue->plug_list[i]) == 0) continue;
+            bdev_queue_complete(queue, queue->plug_list[i]->data, res == -EAGAIN ? -ENOMEM :
+                                                                  res < 0 ? res : -EIO);
+        }
+        break;
+    }
+    queue->plug_len = 0;
+    bdev_queue_dispatch(queue);
+}
+
+#define BDEV_REAP_BATCH 128
+
+// bdev_queue_reap reaps up to one batch of completions of `queue`, waiting
+// for at least `min_nr` of them until `timeout`, and calls their callbacks.
+static int bdev_queue_reap(bdev_queue_t *queue, long min_nr, struct timespec *timeout) {
+    struct io_event cqe[BDEV_REAP_BATCH];
+    int res = io_getevents(queue->ctx, min_nr, BDEV_REAP_BATCH, cqe, timeout);
     if (res < 0) {
         errno = -res;
         return -1;
     }
 
     for (int j = 0; j < res; j++) {
-        ((bdev_cb_t) cqe[j].data)(cqe[j].res);
+        bdev_queue_complete(queue, cqe[j].data, (long) cqe[j].res);
+    }
+    metric_inc(&queue->stats.completions, res);
+    if (res > 0) bdev_queue_resubmit(queue);
+    bdev_queue_dispatch(queue);
+
+    return res;
+}
+
+int bdev_queue_poll(bdev_queue_t *queue) {
+    struct timespec timeout = (struct timespec) {
+        .tv_sec = 0,
+        .tv_nsec = 100000000
+    };
+    return bdev_queue_reap(queue, 1, &timeout);
+}
+
+static void bdev_queue_event(void *arg, uint32_t events) {
+    bdev_queue_t *queue = arg;
+    uint64_t count;
+    if (read(queue->eventfd, &count, sizeof(count)) < 0) {
+        // Spurious wakeup, no completions are pending.
+        return;
+    }
+    // The eventfd count is stale if an earlier poll already reaped the
+    // completions it signaled, so the loop thread never waits for
+    // completions, it reaps whatever is there until the ring is empty.
+    struct timespec timeout = {0};
+    int res;
+    do {
+        res = bdev_queue_reap(queue, 0, &timeout);
+        if (res < 0) {
+            perror("failed to poll bdev queue");
+            return;
+        }
+    } while (res == BDEV_REAP_BATCH);
+}
+
+int bdev_queue_attach(bdev_queue_t *queue, event_loop_t *loop) {
+    queue->source = event_loop_add_fd(loop, queue->eventfd, EPOLLIN, bdev_queue_event, queue);
+    if (queue->source == NULL) return -1;
+    if (queue->throttle != NULL) {
+        queue->timer_source = event_loop_add_fd(loop, queue->timerfd, EPOLLIN, bdev_queue_throttle_event, queue);
+        if (queue->timer_source == NULL) {
+            event_loop_remove(loop, queue->source);
+            queue->source = NULL;
+            return -1;
+        }
     }
+    return 0;
+}
 
+void bdev_queue_detach(bdev_queue_t *queue) {
+    if (queue->timer_source != NULL) {
+        event_loop_remove(queue->timer_source->loop, queue->timer_source);
+        queue->timer_source = NULL;
+    }
+    if (queue->source == NULL) return;
+    event_loop_remove(queue->source->loop, queue->source);
+    queue->source = NULL;
+}
+
+int bdev_register_metrics(bdev_t *bdev, metrics_t *m, const char *labels) {
+    for (size_t i = 0; i < bdev->queue_count; i++) {
+        bdev_queue_t *queue = &bdev->queues[i];
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%s%squeue=\"%zu\"", labels ? labels : "", labels && *labels ? "," : "", i);
+
+        if (metrics_register(m, "tomu_bdev_reads_total", "Read requests submitted.",
+                             buf, METRIC_COUNTER, &queue->stats.reads) < 0) return -1;
+        if (metrics_register(m, "tomu_bdev_writes_total", "Write requests submitted.",
+                             buf, METRIC_COUNTER, &queue->stats.writes) < 0) return -1;
+        if (metrics_register(m, "tomu_bdev_read_bytes_total", "Bytes requested by read submissions.",
+                             buf, METRIC_COUNTER, &queue->stats.read_bytes) < 0) return -1;
+        if (metrics_register(m, "tomu_bdev_write_bytes_total", "Bytes requested by write submissions.",
+                             buf, METRIC_COUNTER, &queue->stats.write_bytes) < 0) return -1;
+        if (metrics_register(m, "tomu_bdev_completions_total", "Requests reaped from the completion queue.",
+                             buf, METRIC_COUNTER, &queue->stats.completions) < 0) return -1;
+        if (metrics_register(m, "tomu_bdev_errors_total", "Requests completed with an error.",
+                             buf, METRIC_COUNTER, &queue->stats.errors) < 0) return -1;
+        if (metrics_register(m, "tomu_bdev_flushes_total", "Flush requests queued.",
+                             buf, METRIC_COUNTER, &queue->stats.flushes) < 0) return -1;
+        if (metrics_register(m, "tomu_bdev_discards_total", "Discard requests queued.",
+                             buf, METRIC_COUNTER, &queue->stats.discards) < 0) return -1;
+        if (metrics_register(m, "tomu_bdev_write_zeroes_total", "Write-zeroes requests queued.",
+                             buf, METRIC_COUNTER, &queue->stats.write_zeroes) < 0) return -1;
+        if (metrics_register(m, "tomu_bdev_throttled_total", "Requests held by the throttle.",
+                             buf, METRIC_COUNTER, &queue->stats.throttled) < 0) return -1;
+        if (metrics_register(m, "tomu_bdev_throttled_nanoseconds_total", "Time requests were held by the throttle.",
+                             buf, METRIC_COUNTER, &queue->stats.throttled_ns) < 0) return -1;
+        if (metrics_register(m, "tomu_bdev_bounced_total", "Requests staged through a bounce buffer.",
+                             buf, METRIC_COUNTER, &queue->stats.bounced) < 0) return -1;
+        if (metrics_register(m, "tomu_bdev_bounce_bytes_total", "Bytes staged through bounce buffers.",
+                             buf, METRIC_COUNTER, &queue->stats.bounce_bytes) < 0) return -1;
+        if (metrics_register(m, "tomu_bdev_backlogged_total",
+                             "Requests held because the aio context was full.",
+                             buf, METRIC_COUNTER, &queue->stats.backlogged) < 0) return -1;
+        if (metrics_register(m, "tomu_bdev_bounce_allocs_total",
+                             "Bounce buffers allocated because the pool was exhausted.",
+                             buf, METRIC_COUNTER, &queue->stats.bounce_allocs) < 0) return -1;
+    }
+    if (bdev->cow != NULL && cow_register_metrics(bdev->cow, m, labels) < 0) return -1;
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+
+#include <boot.h>
+
+#include <elf.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// GDT selectors required by the 64-bit boot protocol (__BOOT_CS and
+// __BOOT_DS), followed by a TSS for KVM.
+#define BOOT_GDT_CS  0x10
+#define BOOT_GDT_DS  0x18
+#define BOOT_GDT_TSS 0x20
+#define BOOT_GDT_ENTRIES 5
+
+#define X86_CR0_PE   (1ULL << 0)
+#define X86_CR0_PG   (1ULL << 31)
+#define X86_CR4_PAE  (1ULL << 5)
+#define X86_EFER_LME (1ULL << 8)
+#define X86_EFER_LMA (1ULL << 10)
+
+// e820 entry types.
+#define BOOT_E820_RAM      1
+#define BOOT_E820_RESERVED 2
+
+// Page table entry flags.
+#define PTE_PRESENT (1ULL << 0)
+#define PTE_WRITE   (1ULL << 1)
+#define PTE_HUGE    (1ULL << 7)
+
+int boot_is_elf(const void *data, size_t len) {
+    return len >= SELFMAG && memcmp(data, ELFMAG, SELFMAG) == 0;
+}
+
+static int boot_pread(int fd, void *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t res = pread(fd, buf, len, offset);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (res == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        buf = (uint8_t*) buf + res;
+        offset += res;
+        len -= res;
+    }
+    return 0;
+}
+
+/**
+ * boot_elf_note finds the PVH entry point in the notes of a PT_NOTE
+ * segment.
+ */
+static int boot_elf_note(int fd, const Elf64_Phdr *phdr, boot_elf_t *elf) {
+    uint8_t *notes = malloc(phdr->p_filesz);
+    if (notes == NULL) return -1;
+    if (boot_pread(fd, notes, phdr->p_filesz, phdr->p_offset) < 0) {
+        free(notes);
+        return -1;
+    }
+
+    size_t offset = 0;
+    while (offset + sizeof(Elf64_Nhdr) <= phdr->p_filesz) {
+        Elf64_Nhdr *note = (Elf64_Nhdr*) (notes + offset);
+        size_t name = offset + sizeof(Elf64_Nhdr);
+        size_t desc = name + ((note->n_namesz + 3) & ~3);
+        size_t next = desc + ((note->n_descsz + 3) & ~3);
+        if (next > phdr->p_filesz) break;
+
+        if (note->n_type == XEN_ELFNOTE_PHYS32_ENTRY && note->n_namesz == 4 &&
+            memcmp(notes + name, "Xen", 4) == 0 && note->n_descsz >= sizeof(uint32_t)) {
+            uint32_t entry;
+            memcpy(&entry, notes + desc, sizeof(entry));
+            elf->pvh_entry = entry;
+        }
+        offset = next;
+    }
+    free(notes);
+    return 0;
+}
+
+int boot_elf_load(void *mem, size_t mem_size, int fd, boot_elf_t *elf) {
+    Elf64_Ehdr ehdr;
+    if (boot_pread(fd, &ehdr, sizeof(ehdr), 0) < 0) return -1;
+    if (!boot_is_elf(&ehdr, sizeof(ehdr)) || ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr.e_machine != EM_X86_64 || ehdr.e_phentsize != sizeof(Elf64_Phdr)) {
+        errno = ENOEXEC;
+        return -1;
+    }
+
+    Elf64_Phdr *phdrs = calloc(ehdr.e_phnum, sizeof(Elf64_Phdr));
+    if (phdrs == NULL) return -1;
+    if (boot_pread(fd, phdrs, ehdr.e_phnum * sizeof(Elf64_Phdr), ehdr.e_phoff) < 0) goto error0;
+
+    memset(elf, 0, sizeof(boot_elf_t));
+    elf->entry = ehdr.e_entry;
+    elf->start = UINT64_MAX;
+    for (size_t i = 0; i < ehdr.e_phnum; i++) {
+        Elf64_Phdr *phdr = &phdrs[i];
+        if (phdr->p_type == PT_NOTE) {
+            if (boot_elf_note(fd, phdr, elf) < 0) goto error0;
+            continue;
+        }
+        if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) continue;
+
+        if (phdr->p_filesz > phdr->p_memsz || phdr->p_paddr < BOOT_HIGH_RAM_START ||
+            phdr->p_paddr > mem_size || phdr->p_memsz > mem_size - phdr->p_paddr) {
+            errno = ENOEXEC;
+            goto error0;
+        }
+        uint8_t *dst = (uint8_t*) mem + phdr->p_paddr;
+        if (boot_pread(fd, dst, phdr->p_filesz, phdr->p_offset) < 0) goto error0;
+        memset(dst + phdr->p_filesz, 0, phdr->p_memsz - phdr->p_filesz);
+
+        if (phdr->p_paddr < elf->start) elf->start = phdr->p_paddr;
+        if (phdr->p_paddr + phdr->p_memsz > elf->end) elf->end = phdr->p_paddr + phdr->p_memsz;
+    }
+    if (elf->end == 0) {
+        errno = ENOEXEC;
+        goto error0;
+    }
+
+    free(phdrs);
+    return 0;
+
+error0:
+    free(phdrs);
+    return -1;
+}
+
+uint64_t boot_setup_pvh(void *mem, size_t mem_size, uint64_t cmdline_addr, uint64_t initrd_addr,
+                        uint64_t initrd_size) {
+    struct hvm_start_info *info = (struct hvm_start_info*) ((uint8_t*) mem + BOOT_PVH_INFO_ADDR);
+    struct hvm_modlist_entry *module = (struct hvm_modlist_entry*) (info + 1);
+    struct hvm_memmap_table_entry *memmap = (struct hvm_memmap_table_entry*) (module + 1);
+
+    memset(info, 0, sizeof(*info));
+    info->magic = HVM_START_MAGIC_VALUE;
+    info->version = HVM_START_INFO_VERSION;
+    info->cmdline_paddr = cmdline_addr;
+
+    if (initrd_size != 0) {
+        *module = (struct hvm_modlist_entry) { .paddr = initrd_addr, .size = initrd_size };
+        info->nr_modules = 1;
+        info->modlist_paddr = BOOT_PVH_INFO_ADDR + ((uint8_t*) module - (uint8_t*) info);
+    }
+
+    memmap[0] = (struct hvm_memmap_table_entry) { 0, BOOT_LOW_RAM_END, HVM_MEMMAP_TYPE_RAM, 0 };
+    memmap[1] = (struct hvm_memmap_table_entry) {
+        BOOT_LOW_RAM_END, BOOT_HIGH_RAM_START - BOOT_LOW_RAM_END, HVM_MEMMAP_TYPE_RESERVED, 0
+    };
+    memmap[2] = (struct hvm_memmap_table_entry) {
+        BOOT_HIGH_RAM_START, mem_size - BOOT_HIGH_RAM_START, HVM_MEMMAP_TYPE_RAM, 0
+    };
+    info->memmap_paddr = BOOT_PVH_INFO_ADDR + ((uint8_t*) memmap - (uint8_t*) info);
+    info->memmap_entries = 3;
+
+    return BOOT_PVH_INFO_ADDR;
+}
+
+void boot_setup_e820(struct boot_params *params, size_t mem_size) {
+    params->e820_table[0] = (struct boot_e820_entry) { 0, BOOT_LOW_RAM_END, BOOT_E820_RAM };
+    params->e820_table[1] = (struct boot_e820_entry) {
+        BOOT_LOW_RAM_END, BOOT_HIGH_RAM_START - BOOT_LOW_RAM_END, BOOT_E820_RESERVED
+    };
+    params->e820_table[2] = (struct boot_e820_entry) {
+        BOOT_HIGH_RAM_START, mem_size - BOOT_HIGH_RAM_START, BOOT_E820_RAM
+    };
+    params->e820_entries = 3;
+}
+
+static uint64_t boot_gdt_entry(uint16_t flags, uint32_t base, uint32_t limit) {
+    return ((uint64_t) (base & 0xff000000) << 32) | ((uint64_t) (flags & 0xf0ff) << 40) |
+           ((uint64_t) (limit & 0x000f0000) << 32) | ((uint64_t) (base & 0x00ffffff) << 16) |
+           (limit & 0x0000ffff);
+}
+
+/**
+ * boot_segment decodes the GDT entry `entry` into a KVM segment.
+ */
+static struct kvm_segment boot_segment(uint64_t entry, uint16_t selector) {
+    uint32_t limit = (entry & 0xffff) | ((entry >> 32) & 0xf0000);
+    return (struct kvm_segment) {
+        .base = ((entry >> 16) & 0xffffff) | ((entry >> 32) & 0xff000000),
+        .limit = (entry >> 55) & 1 ? (limit << 12) | 0xfff : limit,
+        .selector = selector,
+        .type = (entry >> 40) & 0xf,
+        .present = (entry >> 47) & 1,
+        .dpl = (entry >> 45) & 3,
+        .db = (entry >> 54) & 1,
+        .s = (entry >> 44) & 1,
+        .l = (entry >> 53) & 1,
+        .g = (entry >> 55) & 1,
+        .avl = (entry >> 52) & 1,
+    };
+}
+
+void boot_setup_long_mode(void *mem, struct kvm_sregs *sregs) {
+    uint64_t *gdt = (uint64_t*) ((uint8_t*) mem + BOOT_GDT_ADDR);
+    memset(gdt, 0, BOOT_GDT_ENTRIES * sizeof(uint64_t));
+    gdt[BOOT_GDT_CS / 8] = boot_gdt_entry(0xa09b, 0, 0xfffff);
+    gdt[BOOT_GDT_DS / 8] = boot_gdt_entry(0xc093, 0, 0xfffff);
+    gdt[BOOT_GDT_TSS / 8] = boot_gdt_entry(0x808b, 0, 0xfffff);
+
+    struct kvm_segment code = boot_segment(gdt[BOOT_GDT_CS / 8], BOOT_GDT_CS);
+    struct kvm_segment data = boot_segment(gdt[BOOT_GDT_DS / 8], BOOT_GDT_DS);
+    sregs->gdt.base = BOOT_GDT_ADDR;
+    sregs->gdt.limit = BOOT_GDT_ENTRIES * sizeof(uint64_t) - 1;
+    sregs->idt.base = 0;
+    sregs->idt.limit = 0;
+    sregs->cs = code;
+    sregs->ds = sregs->es = sregs->fs = sregs->gs = sregs->ss = data;
+    sregs->tr = boot_segment(gdt[BOOT_GDT_TSS / 8], BOOT_GDT_TSS);
+
+    // Identity map the first 1GiB with 2MiB pages.
+    uint64_t *pml4 = (uint64_t*) ((uint8_t*) mem + BOOT_PML4_ADDR);
+    uint64_t *pdpt = (uint64_t*) ((uint8_t*) mem + BOOT_PDPT_ADDR);
+    uint64_t *pd = (uint64_t*) ((uint8_t*) mem + BOOT_PD_ADDR);
+    memset(pml4, 0, 4096);
+    memset(pdpt, 0, 4096);
+    pml4[0] = BOOT_PDPT_ADDR | PTE_PRESENT | PTE_WRITE;
+    pdpt[0] = BOOT_PD_ADDR | PTE_PRESENT | PTE_WRITE;
+    for (uint64_t i = 0; i < 512; i++) {
+        pd[i] = (i << 21) | PTE_PRESENT | PTE_WRITE | PTE_HUGE;
+    }
+
+    sregs->cr3 = BOOT_PML4_ADDR;
+    sregs->cr4 |= X86_CR4_PAE;
+    sregs->cr0 |= X86_CR0_PE | X86_CR0_PG;
+    sregs->efer |= X86_EFER_LME | X86_EFER_LMA;
+}
@@ -0,0 +1,64 @@
+#define _GNU_SOURCE
+
+#include <bounce.h>
+
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#define BOUNCE_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+static void* bounce_map(size_t size, int flags) {
+    if (flags & BOUNCE_HUGEPAGES) {
+        void *pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (pool != MAP_FAILED) return pool;
+    }
+    void *pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) return NULL;
+    // Fall back to transparent hugepages if no hugetlb pages are reserved.
+    if (flags & BOUNCE_HUGEPAGES) madvise(pool, size, MADV_HUGEPAGE);
+    return pool;
+}
+
+int bounce_pool_init(bounce_pool_t *pool, size_t slot_size, size_t slots, int flags) {
+    pool->slot_size = slot_size;
+    pool->slots = slots;
+    pool->pool_size = slot_size * slots;
+    if (flags & BOUNCE_HUGEPAGES) {
+        pool->pool_size = (pool->pool_size + BOUNCE_HUGEPAGE_SIZE - 1) / BOUNCE_HUGEPAGE_SIZE *
+                          BOUNCE_HUGEPAGE_SIZE;
+    }
+
+    pool->free = calloc(slots, sizeof(uint32_t));
+    if (pool->free == NULL) goto error0;
+    pool->pool = bounce_map(pool->pool_size, flags);
+    if (pool->pool == NULL) goto error1;
+
+    // Hand out the lowest slots first, so a lightly used pool stays warm.
+    for (pool->free_len = 0; pool->free_len < slots; pool->free_len++) {
+        pool->free[pool->free_len] = slots - 1 - pool->free_len;
+    }
+    return 0;
+
+error1:
+    free(pool->free);
+error0:
+    return -1;
+}
+
+void bounce_pool_deinit(bounce_pool_t *pool) {
+    munmap(pool->pool, pool->pool_size);
+    free(pool->free);
+}
+
+void* bounce_pool_get(bounce_pool_t *pool, size_t len) {
+    if (len > pool->slot_size || pool->free_len == 0) return NULL;
+    return pool->pool + pool->free[--pool->free_len] * pool->slot_size;
+}
+
+int bounce_pool_put(bounce_pool_t *pool, void *buf) {
+    uint8_t *p = buf;
+    if (p < pool->pool || p >= pool->pool + pool->slot_size * pool->slots) return 0;
+    pool->free[pool->free_len++] = (p - pool->pool) / pool->slot_size;
+    return 1;
+}
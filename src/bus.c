@@ -0,0 +1,193 @@
+#include <bus.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bus_table_t *bus_table_alloc(size_t count) {
+    bus_table_t *table = calloc(1, sizeof(bus_table_t));
+    if (table == NULL) return NULL;
+    table->count = count;
+    table->bases = calloc(count ? count : 1, sizeof(uint64_t));
+    table->devices = calloc(count ? count : 1, sizeof(bus_device_t*));
+    if (table->bases == NULL || table->devices == NULL) {
+        free(table->bases);
+        free(table->devices);
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+static void bus_table_free(bus_table_t *table) {
+    free(table->bases);
+    free(table->devices);
+    free(table);
+}
+
+int bus_init(bus_t *bus) {
+    memset(bus, 0, sizeof(bus_t));
+    bus_table_t *table = bus_table_alloc(0);
+    if (table == NULL) return -1;
+    if (pthread_mutex_init(&bus->mu, NULL) != 0) {
+        bus_table_free(table);
+        errno = ENOMEM;
+        return -1;
+    }
+    atomic_store(&bus->table, table);
+    return 0;
+}
+
+void bus_deinit(bus_t *bus) {
+    bus_table_t *table = atomic_load(&bus->table);
+    for (size_t i = 0; i < table->count; i++) {
+        pthread_mutex_destroy(&table->devices[i]->mu);
+        free(table->devices[i]);
+    }
+    while (table != NULL) {
+        bus_table_t *retired = table->retired;
+        bus_table_free(table);
+        table = retired;
+    }
+    pthread_mutex_destroy(&bus->mu);
+}
+
+/**
+ * bus_search returns the index of the last range of `table` with a base
+ * not above `addr`, or table->count if there is none.
+ */
+static size_t bus_search(const bus_table_t *table, uint64_t addr) {
+    size_t lo = 0;
+    size_t hi = table->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (table->bases[mid] <= addr) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo == 0 ? table->count : lo - 1;
+}
+
+int bus_register(bus_t *bus, uint64_t base, uint64_t len, const bus_ops_t *ops, void *arg, int flags) {
+    if (len == 0 || base + len - 1 < base) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bus_device_t *device = calloc(1, sizeof(bus_device_t));
+    if (device == NULL) return -1;
+    *device = (bus_device_t) { .base = base, .len = len, .ops = *ops, .arg = arg, .flags = flags };
+    if (pthread_mutex_init(&device->mu, NULL) != 0) {
+        free(device);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pthread_mutex_lock(&bus->mu);
+    bus_table_t *old = atomic_load(&bus->table);
+    size_t i = bus_search(old, base);
+    size_t pos = i == old->count ? 0 : i + 1;
+    if ((i != old->count && old->bases[i] + old->devices[i]->len > base) ||
+        (pos < old->count && old->bases[pos] < base + len)) {
+        errno = EEXIST;
+        goto error0;
+    }
+
+    bus_table_t *table = bus_table_alloc(old->count + 1);
+    if (table == NULL) goto error0;
+    memcpy(table->bases, old->bases, pos * sizeof(uint64_t));
+    memcpy(table->devices, old->devices, pos * sizeof(bus_device_t*));
+    table->bases[pos] = base;
+    table->devices[pos] = device;
+    memcpy(table->bases + pos + 1, old->bases + pos, (old->count - pos) * sizeof(uint64_t));
+    memcpy(table->devices + pos + 1, old->devices + pos, (old->count - pos) * sizeof(bus_device_t*));
+    table->retired = old;
+    atomic_store(&bus->table, table);
+    pthread_mutex_unlock(&bus->mu);
+    return 0;
+
+error0:
+    pthread_mutex_unlock(&bus->mu);
+    pthread_mutex_destroy(&device->mu);
+    free(device);
+    return -1;
+}
+
+static void bus_call(const bus_device_t *device, uint64_t addr, int is_write, uint8_t *data, size_t size,
+                     size_t count) {
+    if (count > 1 && (is_write ? device->ops.write_string : device->ops.read_string) != NULL) {
+        if (is_write) device->ops.write_string(device->arg, addr, data, size, count);
+        else device->ops.read_string(device->arg, addr, data, size, count);
+        return;
+    }
+
+    void (*fn)(void *, uint64_t, uint8_t *, size_t) = is_write ? device->ops.write : device->ops.read;
+    if (fn == NULL) {
+        if (!is_write) memset(data, 0xff, size * count);
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        fn(device->arg, addr, data + i * size, size);
+    }
+}
+
+int bus_dispatch_string(bus_t *bus, bus_cache_t *cache, uint64_t addr, int is_write, uint8_t *data,
+                        size_t size, size_t count) {
+    metric_inc(cache != NULL ? &cache->stats.dispatches : &bus->stats.dispatches, 1);
+    const bus_table_t *table = atomic_load_explicit(&bus->table, memory_order_acquire);
+
+    const bus_device_t *device = NULL;
+    if (cache != NULL && cache->table == table && cache->device != NULL &&
+        addr - cache->device->base < cache->device->len) {
+        metric_inc(&cache->stats.cache_hits, 1);
+        device = cache->device;
+    } else {
+        size_t i = bus_search(table, addr);
+        if (i != table->count && addr - table->bases[i] < table->devices[i]->len) {
+            device = table->devices[i];
+        }
+        if (cache != NULL) {
+            cache->table = table;
+            cache->device = device;
+        }
+    }
+
+    if (device == NULL) {
+        metric_inc(&bus->stats.unhandled, 1);
+        if (!is_write) memset(data, 0xff, size * count);
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (device->flags & BUS_LOCKLESS) {
+        bus_call(device, addr, is_write, data, size, count);
+    } else {
+        pthread_mutex_t *mu = (pthread_mutex_t*) &device->mu;
+        pthread_mutex_lock(mu);
+        bus_call(device, addr, is_write, data, size, count);
+        pthread_mutex_unlock(mu);
+    }
+    return 0;
+}
+
+int bus_dispatch(bus_t *bus, bus_cache_t *cache, uint64_t addr, int is_write, uint8_t *data, size_t len) {
+    return bus_dispatch_string(bus, cache, addr, is_write, data, len, 1);
+}
+
+#define BUS_DISPATCHES_HELP "Accesses dispatched by the bus."
+#define BUS_CACHE_HITS_HELP "Accesses dispatched from the per-vCPU last-hit cache."
+
+int bus_register_metrics(bus_t *bus, metrics_t *m, const char *labels) {
+    if (metrics_register(m, "tomu_bus_dispatches_total", BUS_DISPATCHES_HELP,
+                         labels, METRIC_COUNTER, &bus->stats.dispatches) < 0) return -1;
+    if (metrics_register(m, "tomu_bus_unhandled_total", "Accesses to addresses without a registered range.",
+                         labels, METRIC_COUNTER, &bus->stats.unhandled) < 0) return -1;
+    return 0;
+}
+
+int bus_cache_register_metrics(bus_cache_t *cache, metrics_t *m, const char *labels) {
+    if (metrics_register(m, "tomu_bus_dispatches_total", BUS_DISPATCHES_HELP,
+                         labels, METRIC_COUNTER, &cache->stats.dispatches) < 0) return -1;
+    if (metrics_register(m, "tomu_bus_cache_hits_total", BUS_CACHE_HITS_HELP,
+                         labels, METRIC_COUNTER, &cache->stats.cache_hits) < 0) return -1;
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <coalesced.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+
+int coalesced_init(coalesced_t *c, int kvm_fd, int vm_fd, struct kvm_run *run,
+                   coalesced_handler_t handler, void *arg) {
+    memset(c, 0, sizeof(coalesced_t));
+
+    // KVM_CAP_COALESCED_MMIO returns the page offset of the ring in the vCPU
+    // mmap area.
+    int offset = ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_MMIO);
+    if (offset <= 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    c->ring = (struct kvm_coalesced_mmio_ring*) ((uint8_t*) run + offset * page_size);
+    c->max = (page_size - sizeof(struct kvm_coalesced_mmio_ring)) / sizeof(struct kvm_coalesced_mmio);
+    c->pio_supported = ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_PIO) > 0;
+    c->vm_fd = vm_fd;
+    c->handler = handler;
+    c->arg = arg;
+
+    if (pthread_mutex_init(&c->mu, NULL) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void coalesced_deinit(coalesced_t *c) {
+    pthread_mutex_destroy(&c->mu);
+    c->ring = NULL;
+}
+
+int coalesced_add_mmio(coalesced_t *c, uint64_t addr, uint32_t len) {
+    struct kvm_coalesced_mmio_zone zone = {
+        .addr = addr,
+        .size = len,
+        .pio = 0,
+    };
+    return ioctl(c->vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone);
+}
+
+int coalesced_add_pio(coalesced_t *c, uint16_t port, uint32_t len) {
+    if (!c->pio_supported) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    struct kvm_coalesced_mmio_zone zone = {
+        .addr = port,
+        .size = len,
+        .pio = 1,
+    };
+    return ioctl(c->vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone);
+}
+
+size_t coalesced_drain(coalesced_t *c) {
+    volatile struct kvm_coalesced_mmio_ring *ring = c->ring;
+    if (ring == NULL) return 0;
+
+    // Fast path: avoid the lock when the ring is empty.
+    if (ring->first == ring->last) return 0;
+
+    pthread_mutex_lock(&c->mu);
+
+    // KVM publishes an entry before advancing `last`, and reuses an entry
+    // only after we advance `first`.
+    //
+    //           KVM              |           VMM
+    //                            |
+    // ring[last] = entry         | while(first != last) {
+    // fence(release)             |     fence(acquire)
+    // last = last + 1            |     handle(ring[first])
+    //                            |     fence(release)
+    //                            |     first = first + 1
+    //                            | }
+    size_t n = 0;
+    while (ring->first != ring->last) {
+        atomic_thread_fence(memory_order_acquire);
+        struct kvm_coalesced_mmio *entry = &c->ring->coalesced_mmio[ring->first];
+        c->handler(c->arg, entry->phys_addr, entry->data, entry->len, entry->pio);
+        atomic_thread_fence(memory_order_release);
+        ring->first = (ring->first + 1) % c->max;
+        n++;
+    }
+
+    pthread_mutex_unlock(&c->mu);
+
+    metric_inc(&c->stats.writes, n);
+    metric_inc(&c->stats.drains, 1);
+    return n;
+}
+
+int coalesced_register_metrics(coalesced_t *c, metrics_t *m, const char *labels) {
+    if (metrics_register(m, "tomu_coalesced_writes_total", "Coalesced writes applied from the ring.",
+                         labels, METRIC_COUNTER, &c->stats.writes) < 0) return -1;
+    if (metrics_register(m, "tomu_coalesced_drains_total", "Non-empty coalesced ring drains.",
+                         labels, METRIC_COUNTER, &c->stats.drains) < 0) return -1;
+    return 0;
+}
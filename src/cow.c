@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+
+#include <cow.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+static uint64_t round_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) / align * align;
+}
+
+static uint64_t cow_table_size(uint64_t entries) {
+    return round_up(entries * sizeof(uint64_t), COW_TABLE_BLOCK_SIZE);
+}
+
+static int fd_size(int fd, uint64_t *size) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return -1;
+    *size = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, size) < 0) return -1;
+    return 0;
+}
+
+static int pread_full(int fd, void *buf, size_t count, off_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t res = pread(fd, (uint8_t*) buf + done, count - done, offset + done);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        // Reads past the end of the file are zeros.
+        if (res == 0) {
+            memset((uint8_t*) buf + done, 0, count - done);
+            break;
+        }
+        done += res;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t count, off_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t res = pwrite(fd, (const uint8_t*) buf + done, count - done, offset + done);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += res;
+    }
+    return 0;
+}
+
+/**
+ * cow_resolve resolves a relative `base_path` against the directory of the
+ * overlay `path` into `buf`.
+ */
+static const char* cow_resolve(const char *path, const char *base_path, char *buf, size_t size) {
+    if (base_path[0] == '/') return base_path;
+    char *dir = strdup(path);
+    if (dir == NULL) return NULL;
+    snprintf(buf, size, "%s/%s", dirname(dir), base_path);
+    free(dir);
+    return buf;
+}
+
+int cow_create(const char *path, const char *base_path, uint64_t size, uint32_t cluster_size) {
+    // __builtin_ctz is undefined for 0.
+    if (cluster_size == 0 || (cluster_size & (cluster_size - 1)) != 0 ||
+        __builtin_ctz(cluster_size) < COW_MIN_CLUSTER_BITS ||
+        __builtin_ctz(cluster_size) > COW_MAX_CLUSTER_BITS ||
+        strlen(base_path) >= COW_BASE_PATH_MAX) {
+        errno = EINVAL;
+        goto error0;
+    }
+    int bits = __builtin_ctz(cluster_size);
+
+    if (size == 0) {
+        char resolved[PATH_MAX];
+        const char *open_path = cow_resolve(path, base_path, resolved, sizeof(resolved));
+        if (open_path == NULL) goto error0;
+        int base_fd = open(open_path, O_RDONLY | O_CLOEXEC);
+        if (base_fd < 0) goto error0;
+        int res = fd_size(base_fd, &size);
+        close(base_fd);
+        if (res < 0) goto error0;
+    }
+
+    cow_header_t *header = calloc(1, COW_HEADER_SIZE);
+    if (header == NULL) goto error0;
+    memcpy(header->magic, COW_MAGIC, sizeof(header->magic));
+    header->version = htole32(COW_VERSION);
+    header->cluster_bits = htole32(bits);
+    header->size = htole64(size);
+    header->table_offset = htole64(COW_HEADER_SIZE);
+    uint64_t entries = (size + cluster_size - 1) / cluster_size;
+    header->table_entries = htole64(entries);
+    strcpy(header->base_path, base_path);
+
+    int fd = open(path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0) goto error1;
+    if (pwrite_full(fd, header, COW_HEADER_SIZE, 0) < 0) goto error2;
+    // The table starts out zeroed, i.e. every cluster is read from the base.
+    if (ftruncate(fd, COW_HEADER_SIZE + cow_table_size(entries)) < 0) goto error2;
+    if (fsync(fd) < 0) goto error2;
+
+    close(fd);
+    free(header);
+    return 0;
+
+error2:
+    close(fd);
+    unlink(path);
+error1:
+    free(header);
+error0:
+    return -1;
+}
+
+int cow_probe(int fd) {
+    // The buffer is aligned for files opened with O_DIRECT.
+    void *buf;
+    if (posix_memalign(&buf, COW_HEADER_SIZE, COW_HEADER_SIZE) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int res = pread_full(fd, buf, COW_HEADER_SIZE, 0);
+    if (res == 0) res = memcmp(buf, COW_MAGIC, sizeof(((cow_header_t*) 0)->magic)) == 0;
+    free(buf);
+    return res;
+}
+
+static int cow_open_base(cow_t *cow, const char *path, const char *base_path) {
+    char resolved[PATH_MAX];
+    base_path = cow_resolve(path, base_path, resolved, sizeof(resolved));
+    if (base_path == NULL) return -1;
+
+    // The base is shared by every overlay built on it and never written.
+    cow->base_fd = open(base_path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if (cow->base_fd < 0) return -1;
+    if (fd_size(cow->base_fd, &cow->base_size) < 0) {
+        close(cow->base_fd);
+        return -1;
+    }
+    return 0;
+}
+
+int cow_open(cow_t *cow, const char *path, int fd) {
+    memset(cow, 0, sizeof(cow_t));
+    cow->fd = fd;
+
+    cow_header_t *header;
+    if (posix_memalign((void**) &header, COW_HEADER_SIZE, COW_HEADER_SIZE) != 0) {
+        errno = ENOMEM;
+        goto error0;
+    }
+    if (pread_full(fd, header, COW_HEADER_SIZE, 0) < 0) goto error1;
+
+    cow->cluster_bits = le32toh(header->cluster_bits);
+    cow->size = le64toh(header->size);
+    cow->table_offset = le64toh(header->table_offset);
+    cow->table_entries = le64toh(header->table_entries);
+    header->base_path[COW_BASE_PATH_MAX - 1] = '\0';
+    if (memcmp(header->magic, COW_MAGIC, sizeof(header->magic)) != 0 ||
+        le32toh(header->version) != COW_VERSION ||
+        cow->cluster_bits < COW_MIN_CLUSTER_BITS || cow->cluster_bits > COW_MAX_CLUSTER_BITS ||
+        cow->table_offset % COW_TABLE_BLOCK_SIZE != 0 ||
+        cow->table_entries != (cow->size + (1ULL << cow->cluster_bits) - 1) >> cow->cluster_bits) {
+        errno = EINVAL;
+        goto error1;
+    }
+
+    uint64_t table_size = cow_table_size(cow->table_entries);
+    if (posix_memalign((void**) &cow->table, COW_TABLE_BLOCK_SIZE, table_size) != 0) {
+        errno = ENOMEM;
+        goto error1;
+    }
+    if (pread_full(fd, cow->table, table_size, cow->table_offset) < 0) goto error2;
+
+    uint64_t cluster_size = 1ULL << cow->cluster_bits;
+    if (posix_memalign(&cow->buf, COW_TABLE_BLOCK_SIZE, cluster_size) != 0) {
+        errno = ENOMEM;
+        goto error2;
+    }
+
+    // Clusters are appended past the end of the file. A crash between
+    // copying a cluster and writing its table entry leaks the cluster.
+    uint64_t file_size;
+    if (fd_size(fd, &file_size) < 0) goto error3;
+    uint64_t table_end = cow->table_offset + table_size;
+    cow->next_cluster = round_up(file_size > table_end ? file_size : table_end, cluster_size);
+
+    if (cow_open_base(cow, path, header->base_path) < 0) goto error3;
+
+    if (pthread_mutex_init(&cow->mu, NULL) != 0) goto error4;
+
+    atomic_init(&cow->stats.allocated, 0);
+    atomic_init(&cow->stats.base_reads, 0);
+
+    free(header);
+    return 0;
+
+error4:
+    close(cow->base_fd);
+error3:
+    free(cow->buf);
+error2:
+    free(cow->table);
+error1:
+    free(header);
+error0:
+    return -1;
+}
+
+void cow_close(cow_t *cow) {
+    pthread_mutex_destroy(&cow->mu);
+    close(cow->base_fd);
+    free(cow->buf);
+    free(cow->table);
+}
+
+/**
+ * cow_alloc allocates the `count` clusters starting at `first`, which are
+ * all read from the base, at consecutive overlay offsets. Clusters entirely
+ * within [zero_begin, zero_end) are left as holes instead of being copied.
+ * Must be called with cow->mu held.
+ */
+static int cow_alloc(cow_t *cow, uint64_t first, uint64_t count, uint64_t zero_begin, uint64_t zero_end) {
+    uint64_t cluster_size = 1ULL << cow->cluster_bits;
+    uint64_t offset = cow->next_cluster;
+
+    int skipped = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t begin = (first + i) << cow->cluster_bits;
+        if (begin >= zero_begin && begin + cluster_size <= zero_end) {
+            skipped = 1;
+            continue;
+        }
+        if (begin < cow->base_size) {
+            if (pread_full(cow->base_fd, cow->buf, cluster_size, begin) < 0) return -1;
+        } else {
+            memset(cow->buf, 0, cluster_size);
+        }
+        if (pwrite_full(cow->fd, cow->buf, cluster_size, offset + (i << cow->cluster_bits)) < 0) return -1;
+    }
+    cow->next_cluster += count << cow->cluster_bits;
+    // Holes must still extend the file, since allocation resumes at its end
+    // when the overlay is reopened.
+    if (skipped && ftruncate(cow->fd, cow->next_cluster) < 0) return -1;
+    // The data must be durable before the table entries point at it.
+    if (fdatasync(cow->fd) < 0) return -1;
+
+    for (uint64_t i = 0; i < count; i++) {
+        cow->table[first + i] = htole64(offset + (i << cow->cluster_bits));
+    }
+    uint64_t block_begin = first * sizeof(uint64_t) / COW_TABLE_BLOCK_SIZE * COW_TABLE_BLOCK_SIZE;
+    uint64_t block_end = round_up((first + count) * sizeof(uint64_t), COW_TABLE_BLOCK_SIZE);
+    if (pwrite_full(cow->fd, (uint8_t*) cow->table + block_begin, block_end - block_begin,
+                    cow->table_offset + block_begin) < 0) {
+        for (uint64_t i = 0; i < count; i++) cow->table[first + i] = 0;
+        return -1;
+    }
+
+    metric_inc(&cow->stats.allocated, count);
+    return 0;
+}
+
+int cow_map(cow_t *cow, uint64_t offset, uint64_t len, cow_map_mode_t mode, cow_extent_t *extent) {
+    if (len == 0 || offset >= cow->size || len > cow->size - offset) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint64_t cluster_size = 1ULL << cow->cluster_bits;
+    uint64_t first = offset >> cow->cluster_bits;
+    uint64_t last = (offset + len - 1) >> cow->cluster_bits;
+
+    pthread_mutex_lock(&cow->mu);
+    if (mode != COW_MAP_READ && cow->table[first] == 0) {
+        uint64_t count = 1;
+        while (count < COW_ALLOC_MAX && first + count <= last && cow->table[first + count] == 0) count++;
+        uint64_t zero_end = mode == COW_MAP_ZERO ? offset + len : 0;
+        if (cow_alloc(cow, first, count, offset, zero_end) < 0) {
+            pthread_mutex_unlock(&cow->mu);
+            return -1;
+        }
+    }
+
+    // Extend the extent over clusters stored contiguously after the first.
+    uint64_t entry = le64toh(cow->table[first]);
+    uint64_t end = first + 1;
+    while (end <= last) {
+        uint64_t next = le64toh(cow->table[end]);
+        if (entry != 0 ? next != entry + ((end - first) << cow->cluster_bits) : next != 0) break;
+        end++;
+    }
+    pthread_mutex_unlock(&cow->mu);
+
+    uint64_t extent_end = end << cow->cluster_bits;
+    if (extent_end > offset + len) extent_end = offset + len;
+    extent->len = extent_end - offset;
+
+    if (entry != 0) {
+        extent->fd = cow->fd;
+        extent->offset = entry + (offset & (cluster_size - 1));
+    } else if (offset < cow->base_size) {
+        extent->fd = cow->base_fd;
+        extent->offset = offset;
+        if (extent->len > cow->base_size - offset) extent->len = cow->base_size - offset;
+        metric_inc(&cow->stats.base_reads, 1);
+    } else {
+        // The overlay is larger than its base.
+        extent->fd = -1;
+        extent->offset = 0;
+    }
+    return 0;
+}
+
+int cow_register_metrics(cow_t *cow, metrics_t *m, const char *labels) {
+    if (metrics_register(m, "tomu_cow_allocated_clusters_total", "Clusters allocated in the overlay.",
+                         labels, METRIC_COUNTER, &cow->stats.allocated) < 0) return -1;
+    if (metrics_register(m, "tomu_cow_base_reads_total", "Extents read from the base image.",
+                         labels, METRIC_COUNTER, &cow->stats.base_reads) < 0) return -1;
+    return 0;
+}
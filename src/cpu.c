@@ -0,0 +1,168 @@
+#include <cpu.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/ioctl.h>
+#include <asm/kvm_para.h>
+
+#define CPUID_1_ECX_X2APIC       (1U << 21)
+#define CPUID_1_ECX_TSC_DEADLINE (1U << 24)
+#define CPUID_1_ECX_HYPERVISOR   (1U << 31)
+
+// KVM features that need support from the VMM beyond the in-kernel irqchip:
+// extended MSI destination IDs are ignored by the in-kernel IOAPIC, and
+// the others exit to userspace for confidential guests and migration.
+#define CPU_KVM_FEATURES_UNSUPPORTED ((1U << KVM_FEATURE_MSI_EXT_DEST_ID) | \
+                                      (1U << KVM_FEATURE_HC_MAP_GPA_RANGE) | \
+                                      (1U << KVM_FEATURE_MIGRATION_CONTROL))
+
+#define MSR_IA32_TSC            0x00000010
+#define MSR_IA32_SYSENTER_CS    0x00000174
+#define MSR_IA32_SYSENTER_ESP   0x00000175
+#define MSR_IA32_SYSENTER_EIP   0x00000176
+#define MSR_IA32_MISC_ENABLE    0x000001a0
+#define MSR_MTRR_DEF_TYPE       0x000002ff
+#define MSR_IA32_TSC_DEADLINE   0x000006e0
+#define MSR_STAR                0xc0000081
+#define MSR_LSTAR               0xc0000082
+#define MSR_CSTAR               0xc0000083
+#define MSR_SYSCALL_MASK        0xc0000084
+#define MSR_KERNEL_GS_BASE      0xc0000102
+
+#define MISC_ENABLE_FAST_STRING (1ULL << 0)
+#define MTRR_DEF_TYPE_E         (1ULL << 11)
+#define MTRR_TYPE_WRBACK        6
+
+#define CPU_MAX_MSRS 16
+
+static uint32_t *cpu_entry_reg(struct kvm_cpuid_entry2 *entry, int reg) {
+    switch (reg) {
+    case CPUID_EAX: return &entry->eax;
+    case CPUID_EBX: return &entry->ebx;
+    case CPUID_ECX: return &entry->ecx;
+    default: return &entry->edx;
+    }
+}
+
+static struct kvm_cpuid2 *cpu_get_supported(int kvm_fd) {
+    for (uint32_t nent = CPU_CPUID_INITIAL_ENTRIES; nent <= CPU_CPUID_MAX_ENTRIES; nent *= 2) {
+        struct kvm_cpuid2 *cpuid = calloc(1, sizeof(struct kvm_cpuid2) + nent * sizeof(struct kvm_cpuid_entry2));
+        if (cpuid == NULL) return NULL;
+        cpuid->nent = nent;
+        if (ioctl(kvm_fd, KVM_GET_SUPPORTED_CPUID, cpuid) == 0) return cpuid;
+        int err = errno;
+        free(cpuid);
+        if (err != E2BIG) {
+            errno = err;
+            return NULL;
+        }
+    }
+    errno = E2BIG;
+    return NULL;
+}
+
+int cpu_model_init(cpu_model_t *model, int kvm_fd) {
+    memset(model, 0, sizeof(cpu_model_t));
+    model->cpuid = cpu_get_supported(kvm_fd);
+    if (model->cpuid == NULL) return -1;
+    model->tsc_deadline = ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_TSC_DEADLINE_TIMER) > 0;
+
+    // The supported leaves already mirror the host features KVM can
+    // virtualize, e.g. AVX2, AVX-512 and the invariant TSC, so only the
+    // features KVM leaves to the VMM are adjusted.
+    for (uint32_t i = 0; i < model->cpuid->nent; i++) {
+        struct kvm_cpuid_entry2 *entry = &model->cpuid->entries[i];
+        switch (entry->function) {
+        case 0x1:
+            // The in-kernel local APIC emulates x2APIC mode, whose ICR
+            // writes are a single MSR write instead of two MMIO exits.
+            entry->ecx |= CPUID_1_ECX_X2APIC | CPUID_1_ECX_HYPERVISOR;
+            if (model->tsc_deadline) entry->ecx |= CPUID_1_ECX_TSC_DEADLINE;
+            break;
+        case KVM_CPUID_SIGNATURE:
+            entry->eax = KVM_CPUID_FEATURES;
+            entry->ebx = 0x4b4d564b; // KVMK
+            entry->ecx = 0x564b4d56; // VMKV
+            entry->edx = 0x4d;       // M
+            break;
+        case KVM_CPUID_FEATURES:
+            // kvmclock, PV EOI, PV TLB flush, PV sched yield and friends
+            // are handled by KVM itself.
+            entry->eax &= ~CPU_KVM_FEATURES_UNSUPPORTED;
+            entry->edx = 0;
+            break;
+        }
+    }
+    return 0;
+}
+
+void cpu_model_deinit(cpu_model_t *model) {
+    free(model->cpuid);
+    model->cpuid = NULL;
+}
+
+static int cpu_set_msrs(cpu_model_t *model, int vcpu_fd) {
+    struct {
+        uint32_t nmsrs;
+        uint32_t pad;
+        struct kvm_msr_entry entries[CPU_MAX_MSRS];
+    } msrs = {0};
+
+    struct kvm_msr_entry *entry = msrs.entries;
+    *entry++ = (struct kvm_msr_entry) { .index = MSR_IA32_TSC, .data = 0 };
+    *entry++ = (struct kvm_msr_entry) { .index = MSR_IA32_SYSENTER_CS, .data = 0 };
+    *entry++ = (struct kvm_msr_entry) { .index = MSR_IA32_SYSENTER_ESP, .data = 0 };
+    *entry++ = (struct kvm_msr_entry) { .index = MSR_IA32_SYSENTER_EIP, .data = 0 };
+    *entry++ = (struct kvm_msr_entry) { .index = MSR_STAR, .data = 0 };
+    *entry++ = (struct kvm_msr_entry) { .index = MSR_LSTAR, .data = 0 };
+    *entry++ = (struct kvm_msr_entry) { .index = MSR_CSTAR, .data = 0 };
+    *entry++ = (struct kvm_msr_entry) { .index = MSR_SYSCALL_MASK, .data = 0 };
+    *entry++ = (struct kvm_msr_entry) { .index = MSR_KERNEL_GS_BASE, .data = 0 };
+    // Fast string operations make rep movs/stos copy whole cache lines.
+    *entry++ = (struct kvm_msr_entry) { .index = MSR_IA32_MISC_ENABLE, .data = MISC_ENABLE_FAST_STRING };
+    // All of memory is write-back unless the guest reprograms the MTRRs.
+    *entry++ = (struct kvm_msr_entry) { .index = MSR_MTRR_DEF_TYPE, .data = MTRR_DEF_TYPE_E | MTRR_TYPE_WRBACK };
+    if (model->tsc_deadline) {
+        *entry++ = (struct kvm_msr_entry) { .index = MSR_IA32_TSC_DEADLINE, .data = 0 };
+    }
+    msrs.nmsrs = entry - msrs.entries;
+
+    // KVM_SET_MSRS stops at the first MSR it rejects.
+    int res = ioctl(vcpu_fd, KVM_SET_MSRS, &msrs);
+    if (res < 0) return -1;
+    if ((uint32_t) res != msrs.nmsrs) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int cpu_model_apply(cpu_model_t *model, int vcpu_fd, uint32_t vcpu_id) {
+    for (uint32_t i = 0; i < model->cpuid->nent; i++) {
+        struct kvm_cpuid_entry2 *entry = &model->cpuid->entries[i];
+        switch (entry->function) {
+        case 0x1:
+            entry->ebx = (entry->ebx & 0x00ffffff) | ((vcpu_id & 0xff) << 24);
+            break;
+        case 0xb:
+        case 0x1f:
+            // The x2APIC ID of the extended topology leaves.
+            entry->edx = vcpu_id;
+            break;
+        }
+    }
+    if (ioctl(vcpu_fd, KVM_SET_CPUID2, model->cpuid) < 0) return -1;
+    return cpu_set_msrs(model, vcpu_fd);
+}
+
+int cpu_model_has(const cpu_model_t *model, uint32_t function, uint32_t index, int reg, int bit) {
+    for (uint32_t i = 0; i < model->cpuid->nent; i++) {
+        struct kvm_cpuid_entry2 *entry = &model->cpuid->entries[i];
+        if (entry->function != function) continue;
+        if ((entry->flags & KVM_CPUID_FLAG_SIGNIFCANT_INDEX) && entry->index != index) continue;
+        return (*cpu_entry_reg(entry, reg) >> bit) & 1;
+    }
+    return 0;
+}
@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+
+#include <event-loop.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#define EVENT_LOOP_MAX_EVENTS 32
+
+int event_loop_init(event_loop_t *loop) {
+    memset(loop, 0, sizeof(event_loop_t));
+
+    loop->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epollfd < 0) goto error0;
+
+    loop->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->eventfd < 0) goto error1;
+
+    // The wakeup eventfd is the only epoll entry without a source.
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, loop->eventfd, &event) < 0) goto error2;
+
+    if (pthread_mutex_init(&loop->mu, NULL) != 0) goto error2;
+
+    return 0;
+
+error2:
+    close(loop->eventfd);
+error1:
+    close(loop->epollfd);
+error0:
+    return -1;
+}
+
+static void event_source_free(event_source_t *source) {
+    if (source->is_timer) close(source->fd);
+    free(source);
+}
+
+static void event_loop_free_removed(event_loop_t *loop) {
+    pthread_mutex_lock(&loop->mu);
+    event_source_t *removed = loop->removed;
+    loop->removed = NULL;
+    pthread_mutex_unlock(&loop->mu);
+
+    while (removed != NULL) {
+        event_source_t *source = removed;
+        removed = source->next;
+        event_source_free(source);
+    }
+}
+
+void event_loop_deinit(event_loop_t *loop) {
+    event_loop_free_removed(loop);
+    while (loop->sources != NULL) {
+        event_source_t *source = loop->sources;
+        loop->sources = source->next;
+        event_source_free(source);
+    }
+    free(loop->deferred);
+    pthread_mutex_destroy(&loop->mu);
+    close(loop->eventfd);
+    close(loop->epollfd);
+}
+
+static event_source_t* event_loop_add(event_loop_t *loop, int fd, int is_timer, uint32_t events,
+                                      event_cb_t cb, void *arg) {
+    event_source_t *source = calloc(1, sizeof(event_source_t));
+    if (source == NULL) return NULL;
+    source->loop = loop;
+    source->fd = fd;
+    source->is_timer = is_timer;
+    source->cb = cb;
+    source->arg = arg;
+
+    struct epoll_event event = { .events = events, .data.ptr = source };
+    if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        free(source);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&loop->mu);
+    source->next = loop->sources;
+    loop->sources = source;
+    pthread_mutex_unlock(&loop->mu);
+    return source;
+}
+
+event_source_t* event_loop_add_fd(event_loop_t *loop, int fd, uint32_t events, event_cb_t cb, void *arg) {
+    return event_loop_add(loop, fd, 0, events, cb, arg);
+}
+
+event_source_t* event_loop_add_timer(event_loop_t *loop, unsigned interval_ms, event_cb_t cb, void *arg) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) goto error0;
+
+    struct timespec interval = {
+        .tv_sec = interval_ms / 1000,
+        .tv_nsec = (long) (interval_ms % 1000) * 1000000,
+    };
+    struct itimerspec spec = { .it_interval = interval, .it_value = interval };
+    if (timerfd_settime(fd, 0, &spec, NULL) < 0) goto error1;
+
+    event_source_t *source = event_loop_add(loop, fd, 1, EPOLLIN, cb, arg);
+    if (source == NULL) goto error1;
+
+    return source;
+
+error1:
+    close(fd);
+error0:
+    return NULL;
+}
+
+int event_loop_mod(event_loop_t *loop, event_source_t *source, uint32_t events) {
+    struct epoll_event event = { .events = events, .data.ptr = source };
+    return epoll_ctl(loop->epollfd, EPOLL_CTL_MOD, source->fd, &event);
+}
+
+void event_loop_remove(event_loop_t *loop, event_source_t *source) {
+    epoll_ctl(loop->epollfd, EPOLL_CTL_DEL, source->fd, NULL);
+
+    pthread_mutex_lock(&loop->mu);
+    event_source_t **iter = &loop->sources;
+    while (*iter != source) iter = &(*iter)->next;
+    *iter = source->next;
+
+    // Events for the source may still be pending in the current iteration.
+    source->cb = NULL;
+    source->next = loop->removed;
+    loop->removed = source;
+    pthread_mutex_unlock(&loop->mu);
+}
+
+void event_loop_set_pre_dispatch(event_loop_t *loop, event_defer_cb_t cb, void *arg) {
+    loop->pre_dispatch = cb;
+    loop->pre_dispatch_arg = arg;
+}
+
+static void event_loop_wake(event_loop_t *loop) {
+    if (write(loop->eventfd, &(uint64_t){1}, sizeof(uint64_t)) < 0) {
+        // The counter can only overflow if the loop thread is stuck, in which
+        // case it is already signaled.
+    }
+}
+
+int event_loop_defer(event_loop_t *loop, event_defer_cb_t cb, void *arg) {
+    pthread_mutex_lock(&loop->mu);
+    if (loop->deferred_len == loop->deferred_cap) {
+        size_t cap = loop->deferred_cap ? loop->deferred_cap * 2 : 16;
+        event_deferred_t *deferred = realloc(loop->deferred, cap * sizeof(event_deferred_t));
+        if (deferred == NULL) {
+            pthread_mutex_unlock(&loop->mu);
+            return -1;
+        }
+        loop->deferred = deferred;
+        loop->deferred_cap = cap;
+    }
+    loop->deferred[loop->deferred_len++] = (event_deferred_t) { .cb = cb, .arg = arg };
+    pthread_mutex_unlock(&loop->mu);
+
+    event_loop_wake(loop);
+    return 0;
+}
+
+static int event_loop_run_deferred(event_loop_t *loop) {
+    int dispatched = 0;
+    while (1) {
+        event_deferred_t batch[EVENT_LOOP_MAX_EVENTS];
+        pthread_mutex_lock(&loop->mu);
+        size_t n = loop->deferred_len < EVENT_LOOP_MAX_EVENTS ? loop->deferred_len : EVENT_LOOP_MAX_EVENTS;
+        memcpy(batch, loop->deferred, n * sizeof(event_deferred_t));
+        memmove(loop->deferred, loop->deferred + n, (loop->deferred_len - n) * sizeof(event_deferred_t));
+        loop->deferred_len -= n;
+        pthread_mutex_unlock(&loop->mu);
+
+        if (n == 0) break;
+        for (size_t i = 0; i < n; i++) {
+            batch[i].cb(batch[i].arg);
+        }
+        dispatched += n;
+    }
+    metric_inc(&loop->stats.deferred, dispatched);
+    return dispatched;
+}
+
+int event_loop_run_once(event_loop_t *loop, int timeout_ms) {
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    int n = epoll_wait(loop->epollfd, events, EVENT_LOOP_MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) return 0;
+        return -1;
+    }
+    metric_inc(&loop->stats.iterations, 1);
+
+    if (loop->pre_dispatch != NULL) {
+        loop->pre_dispatch(loop->pre_dispatch_arg);
+    }
+
+    int dispatched = 0;
+    for (int i = 0; i < n; i++) {
+        event_source_t *source = events[i].data.ptr;
+        if (source == NULL) {
+            uint64_t count;
+            if (read(loop->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN) return -1;
+            continue;
+        }
+        if (source->cb == NULL) continue;
+
+        if (source->is_timer) {
+            uint64_t expirations;
+            if (read(source->fd, &expirations, sizeof(expirations)) < 0) {
+                if (errno == EAGAIN) continue;
+                return -1;
+            }
+        }
+        source->cb(source->arg, events[i].events);
+        dispatched++;
+    }
+    metric_inc(&loop->stats.events, dispatched);
+
+    // Deferred callbacks are checked on every iteration so that callbacks
+    // queued by the loop thread itself do not wait for the next wakeup.
+    dispatched += event_loop_run_deferred(loop);
+    event_loop_free_removed(loop);
+
+    return dispatched;
+}
+
+int event_loop_run(event_loop_t *loop) {
+    while (!atomic_load_explicit(&loop->stop, memory_order_acquire)) {
+        if (event_loop_run_once(loop, -1) < 0) return -1;
+    }
+    return 0;
+}
+
+void event_loop_stop(event_loop_t *loop) {
+    atomic_store_explicit(&loop->stop, 1, memory_order_release);
+    event_loop_wake(loop);
+}
+
+int event_loop_register_metrics(event_loop_t *loop, metrics_t *m, const char *labels) {
+    if (metrics_register(m, "tomu_event_loop_iterations_total", "Event loop wakeups.",
+                         labels, METRIC_COUNTER, &loop->stats.iterations) < 0) return -1;
+    if (metrics_register(m, "tomu_event_loop_events_total", "Fd and timer callbacks dispatched.",
+                         labels, METRIC_COUNTER, &loop->stats.events) < 0) return -1;
+    if (metrics_register(m, "tomu_event_loop_deferred_total", "Deferred callbacks dispatched.",
+                         labels, METRIC_COUNTER, &loop->stats.deferred) < 0) return -1;
+    return 0;
+}
@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+
+#include <iothread.h>
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static void* iothread_func(void *arg) {
+    iothread_t *t = arg;
+    if (event_loop_run(&t->loop) < 0) {
+        perror("iothread event loop failed");
+        exit(1);
+    }
+    return NULL;
+}
+
+int iothread_init(iothread_t *t, int cpu) {
+    if (event_loop_init(&t->loop) < 0) return -1;
+    t->cpu = cpu;
+    t->running = 0;
+    return 0;
+}
+
+void iothread_deinit(iothread_t *t) {
+    iothread_stop(t);
+    event_loop_deinit(&t->loop);
+}
+
+int iothread_start(iothread_t *t) {
+    pthread_attr_t attr;
+    int res = pthread_attr_init(&attr);
+    if (res != 0) goto error0;
+
+    if (t->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(t->cpu, &set);
+        res = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        if (res != 0) goto error1;
+    }
+
+    res = pthread_create(&t->thread, &attr, iothread_func, t);
+    if (res != 0) goto error1;
+    pthread_attr_destroy(&attr);
+    t->running = 1;
+
+    return 0;
+
+error1:
+    pthread_attr_destroy(&attr);
+error0:
+    errno = res;
+    return -1;
+}
+
+void iothread_stop(iothread_t *t) {
+    if (!t->running) return;
+    event_loop_stop(&t->loop);
+    pthread_join(t->thread, NULL);
+    t->running = 0;
+}
+
+int iothread_pool_init(iothread_pool_t *pool, size_t count, const int *cpus, size_t cpu_count) {
+    pool->threads = calloc(count, sizeof(iothread_t));
+    if (pool->threads == NULL) return -1;
+
+    for (pool->count = 0; pool->count < count; pool->count++) {
+        int cpu = cpu_count > 0 ? cpus[pool->count % cpu_count] : -1;
+        if (iothread_init(&pool->threads[pool->count], cpu) < 0) {
+            iothread_pool_deinit(pool);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void iothread_pool_deinit(iothread_pool_t *pool) {
+    for (size_t i = 0; i < pool->count; i++) {
+        iothread_deinit(&pool->threads[i]);
+    }
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->count = 0;
+}
+
+int iothread_pool_start(iothread_pool_t *pool) {
+    for (size_t i = 0; i < pool->count; i++) {
+        if (iothread_start(&pool->threads[i]) < 0) {
+            iothread_pool_stop(pool);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void iothread_pool_stop(iothread_pool_t *pool) {
+    for (size_t i = 0; i < pool->count; i++) {
+        iothread_stop(&pool->threads[i]);
+    }
+}
+
+event_loop_t* iothread_pool_loop(iothread_pool_t *pool, size_t index) {
+    return &pool->threads[index % pool->count].loop;
+}
+
+int iothread_pool_register_metrics(iothread_pool_t *pool, metrics_t *m, const char *labels) {
+    for (size_t i = 0; i < pool->count; i++) {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%s%siothread=\"%zu\"", labels ? labels : "", labels && *labels ? "," : "", i);
+        if (event_loop_register_metrics(&pool->threads[i].loop, m, buf) < 0) return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,93 @@
+#define _GNU_SOURCE
+
+#include <irqmod.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int irqmod_config_parse(irqmod_config_t *config, const char *spec) {
+    memset(config, 0, sizeof(irqmod_config_t));
+
+    char *buf = strdup(spec);
+    if (buf == NULL) return -1;
+
+    char *save;
+    char *opt;
+    for (opt = strtok_r(buf, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save)) {
+        if (strcmp(opt, "adaptive") == 0) {
+            config->adaptive = 1;
+            continue;
+        }
+
+        char *value = strchr(opt, '=');
+        if (value == NULL) goto einval;
+        *value++ = '\0';
+
+        char *end;
+        unsigned long long n = strtoull(value, &end, 0);
+        if (*value == '\0' || *end != '\0' || n > UINT32_MAX) goto einval;
+        if (strcmp(opt, "usecs") == 0) {
+            config->usecs = n;
+        } else if (strcmp(opt, "frames") == 0) {
+            config->frames = n;
+        } else {
+            goto einval;
+        }
+    }
+
+    free(buf);
+    return 0;
+
+einval:
+    free(buf);
+    errno = EINVAL;
+    return -1;
+}
+
+static uint64_t irqmod_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void irqmod_init(irqmod_t *mod, const irqmod_config_t *config) {
+    memset(mod, 0, sizeof(irqmod_t));
+    mod->config = *config;
+    // An adaptive queue starts out signaling every completion, until its
+    // rate is known.
+    if (!config->adaptive) {
+        atomic_store(&mod->usecs, config->usecs);
+        atomic_store(&mod->frames, config->frames);
+    }
+    mod->window_start_ns = irqmod_now();
+}
+
+void irqmod_sample(irqmod_t *mod, size_t completions) {
+    if (!mod->config.adaptive) return;
+    mod->window_completions += completions;
+
+    uint64_t now = irqmod_now();
+    uint64_t elapsed = now - mod->window_start_ns;
+    if (elapsed < IRQMOD_WINDOW_NS) return;
+    uint64_t rate = mod->window_completions * 1000000000 / elapsed;
+    mod->window_start_ns = now;
+    mod->window_completions = 0;
+
+    uint64_t usecs = mod->config.usecs;
+    if (rate < IRQMOD_RATE_LOW) {
+        usecs = 0;
+    } else if (rate < IRQMOD_RATE_HIGH) {
+        usecs = usecs * (rate - IRQMOD_RATE_LOW) / (IRQMOD_RATE_HIGH - IRQMOD_RATE_LOW);
+    }
+
+    // Expect as many completions as arrive at this rate within the delay,
+    // so that the count fires about when the timer would.
+    uint64_t frames = rate * usecs / 1000000;
+    if (frames == 0) frames = 1;
+    if (mod->config.frames != 0 && frames > mod->config.frames) frames = mod->config.frames;
+
+    atomic_store_explicit(&mod->usecs, usecs, memory_order_relaxed);
+    atomic_store_explicit(&mod->frames, frames, memory_order_relaxed);
+}
@@ -0,0 +1,326 @@
+#include <memmap.h>
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * The mem_cache_t holds a copy of the slot of the last translation of a
+ * thread. It is only used while `generation` is still the generation of a
+ * map, so it never refers to a removed slot, nor to another map allocated
+ * at the same address.
+ */
+typedef struct mem_cache {
+    uint64_t generation;
+    mem_slot_t slot;
+} mem_cache_t;
+
+/**
+ * The mem_reader_t tells the writers whether a thread is searching a table:
+ * `seq` is odd while it is. A writer that replaced a table waits for every
+ * reader with an odd `seq` to move on before freeing the old table, as in
+ * the quiescent-state flavour of RCU.
+ */
+typedef struct mem_reader {
+    _Atomic uint64_t seq;
+    struct mem_reader *next;
+} mem_reader_t;
+
+static _Thread_local mem_cache_t mem_cache;
+static _Thread_local mem_reader_t *mem_reader;
+
+// Generation 0 is never used, so that a zeroed cache never hits.
+static _Atomic uint64_t mem_generations;
+
+static pthread_mutex_t mem_readers_mu = PTHREAD_MUTEX_INITIALIZER;
+static mem_reader_t *mem_readers;
+static pthread_once_t mem_readers_once = PTHREAD_ONCE_INIT;
+static pthread_key_t mem_readers_key;
+static int mem_readers_key_ok;
+
+static void mem_reader_free(void *arg) {
+    mem_reader_t *reader = (mem_reader_t*) arg;
+    pthread_mutex_lock(&mem_readers_mu);
+    mem_reader_t **p = &mem_readers;
+    while (*p != reader) p = &(*p)->next;
+    *p = reader->next;
+    pthread_mutex_unlock(&mem_readers_mu);
+    free(reader);
+}
+
+static void mem_readers_init(void) {
+    mem_readers_key_ok = pthread_key_create(&mem_readers_key, mem_reader_free) == 0;
+}
+
+/**
+ * mem_reader_get returns the reader of the calling thread, registering it
+ * on first use, or NULL if it cannot be registered.
+ */
+static mem_reader_t *mem_reader_get(void) {
+    if (mem_reader != NULL) return mem_reader;
+    pthread_once(&mem_readers_once, mem_readers_init);
+    if (!mem_readers_key_ok) return NULL;
+    mem_reader_t *reader = calloc(1, sizeof(mem_reader_t));
+    if (reader == NULL) return NULL;
+    atomic_init(&reader->seq, 0);
+    if (pthread_setspecific(mem_readers_key, reader) != 0) {
+        free(reader);
+        return NULL;
+    }
+    pthread_mutex_lock(&mem_readers_mu);
+    reader->next = mem_readers;
+    mem_readers = reader;
+    pthread_mutex_unlock(&mem_readers_mu);
+    mem_reader = reader;
+    return reader;
+}
+
+/**
+ * mem_read_lock starts a search of the tables of `map`, which are not freed
+ * until mem_read_unlock. A thread that cannot be registered as a reader
+ * takes the lock of `map` instead.
+ */
+static mem_reader_t *mem_read_lock(mem_map_t *map) {
+    mem_reader_t *reader = mem_reader_get();
+    if (reader == NULL) {
+        pthread_mutex_lock(&map->mu);
+        return NULL;
+    }
+    uint64_t seq = atomic_load_explicit(&reader->seq, memory_order_relaxed);
+    atomic_store_explicit(&reader->seq, seq + 1, memory_order_relaxed);
+    // Orders the store above before the load of the table, against the
+    // store of the table and the load of `seq` in mem_map_publish.
+    atomic_thread_fence(memory_order_seq_cst);
+    return reader;
+}
+
+static void mem_read_unlock(mem_map_t *map, mem_reader_t *reader) {
+    if (reader == NULL) {
+        pthread_mutex_unlock(&map->mu);
+        return;
+    }
+    uint64_t seq = atomic_load_explicit(&reader->seq, memory_order_relaxed);
+    atomic_store_explicit(&reader->seq, seq + 1, memory_order_release);
+}
+
+static mem_table_t *mem_table_alloc(size_t count) {
+    mem_table_t *table = calloc(1, sizeof(mem_table_t));
+    if (table == NULL) return NULL;
+    table->count = count;
+    table->bases = calloc(count ? count : 1, sizeof(uint64_t));
+    table->slots = calloc(count ? count : 1, sizeof(mem_slot_t));
+    if (table->bases == NULL || table->slots == NULL) {
+        free(table->bases);
+        free(table->slots);
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+static void mem_table_free(mem_table_t *table) {
+    free(table->bases);
+    free(table->slots);
+    free(table);
+}
+
+int mem_map_init(mem_map_t *map) {
+    memset(map, 0, sizeof(mem_map_t));
+    mem_table_t *table = mem_table_alloc(0);
+    if (table == NULL) return -1;
+    if (pthread_mutex_init(&map->mu, NULL) != 0) {
+        mem_table_free(table);
+        errno = ENOMEM;
+        return -1;
+    }
+    atomic_store(&map->table, table);
+    atomic_store(&map->generation, atomic_fetch_add(&mem_generations, 1) + 1);
+    return 0;
+}
+
+void mem_map_deinit(mem_map_t *map) {
+    mem_table_free(atomic_load(&map->table));
+    pthread_mutex_destroy(&map->mu);
+}
+
+/**
+ * mem_table_search returns the index of the last slot of `table` with a
+ * base not above `gpa`, or table->count if there is none.
+ */
+static size_t mem_table_search(const mem_table_t *table, uint64_t gpa) {
+    size_t lo = 0;
+    size_t hi = table->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (table->bases[mid] <= gpa) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo == 0 ? table->count : lo - 1;
+}
+
+/**
+ * mem_map_publish replaces the table of `map` with `table` and frees the old
+ * one once no thread is searching it. Must be called with map->mu held.
+ */
+static void mem_map_publish(mem_map_t *map, mem_table_t *table) {
+    mem_table_t *old = atomic_load(&map->table);
+    atomic_store(&map->table, table);
+    // Stored after the table, so that a thread reading the new generation
+    // then the table finds the new table.
+    atomic_store_explicit(&map->generation, atomic_fetch_add(&mem_generations, 1) + 1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // A reader that started its search before the fence may still see the
+    // old table, and one that starts after it sees the new one.
+    pthread_mutex_lock(&mem_readers_mu);
+    for (mem_reader_t *reader = mem_readers; reader != NULL; reader = reader->next) {
+        uint64_t seq = atomic_load_explicit(&reader->seq, memory_order_acquire);
+        if (seq % 2 == 0) continue;
+        while (atomic_load_explicit(&reader->seq, memory_order_acquire) == seq) sched_yield();
+    }
+    pthread_mutex_unlock(&mem_readers_mu);
+    mem_table_free(old);
+}
+
+int mem_map_add(mem_map_t *map, uint64_t gpa, uint64_t size, void *hva) {
+    return mem_map_add_fd(map, gpa, size, hva, -1, 0);
+}
+
+int mem_map_add_fd(mem_map_t *map, uint64_t gpa, uint64_t size, void *hva, int fd, uint64_t fd_offset) {
+    if (size == 0 || gpa + size - 1 < gpa) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&map->mu);
+    mem_table_t *old = atomic_load(&map->table);
+    size_t i = mem_table_search(old, gpa);
+    size_t pos = i == old->count ? 0 : i + 1;
+    if ((i != old->count && old->bases[i] + old->slots[i].size > gpa) ||
+        (pos < old->count && old->bases[pos] < gpa + size)) {
+        errno = EEXIST;
+        goto error0;
+    }
+
+    mem_table_t *table = mem_table_alloc(old->count + 1);
+    if (table == NULL) goto error0;
+    memcpy(table->bases, old->bases, pos * sizeof(uint64_t));
+    memcpy(table->slots, old->slots, pos * sizeof(mem_slot_t));
+    table->bases[pos] = gpa;
+    table->slots[pos] = (mem_slot_t) {
+        .gpa = gpa,
+        .size = size,
+        .hva = hva,
+        .fd = fd,
+        .fd_offset = fd_offset,
+    };
+    memcpy(table->bases + pos + 1, old->bases + pos, (old->count - pos) * sizeof(uint64_t));
+    memcpy(table->slots + pos + 1, old->slots + pos, (old->count - pos) * sizeof(mem_slot_t));
+    mem_map_publish(map, table);
+    pthread_mutex_unlock(&map->mu);
+    return 0;
+
+error0:
+    pthread_mutex_unlock(&map->mu);
+    return -1;
+}
+
+int mem_map_remove(mem_map_t *map, uint64_t gpa) {
+    pthread_mutex_lock(&map->mu);
+    mem_table_t *old = atomic_load(&map->table);
+    size_t pos = mem_table_search(old, gpa);
+    if (pos == old->count || old->bases[pos] != gpa) {
+        errno = ENOENT;
+        goto error0;
+    }
+
+    mem_table_t *table = mem_table_alloc(old->count - 1);
+    if (table == NULL) goto error0;
+    memcpy(table->bases, old->bases, pos * sizeof(uint64_t));
+    memcpy(table->slots, old->slots, pos * sizeof(mem_slot_t));
+    memcpy(table->bases + pos, old->bases + pos + 1, (old->count - pos - 1) * sizeof(uint64_t));
+    memcpy(table->slots + pos, old->slots + pos + 1, (old->count - pos - 1) * sizeof(mem_slot_t));
+    mem_map_publish(map, table);
+    pthread_mutex_unlock(&map->mu);
+    return 0;
+
+error0:
+    pthread_mutex_unlock(&map->mu);
+    return -1;
+}
+
+/**
+ * mem_map_lookup returns the slot containing `gpa`, or NULL if there is
+ * none. The slot is a copy owned by the calling thread, valid until its
+ * next lookup.
+ */
+static const mem_slot_t* mem_map_lookup(mem_map_t *map, uint64_t gpa) {
+    mem_cache_t *cache = &mem_cache;
+    uint64_t generation = atomic_load_explicit(&map->generation, memory_order_acquire);
+    if (cache->generation == generation && gpa - cache->slot.gpa < cache->slot.size) return &cache->slot;
+
+    metric_inc(&map->stats.lookups, 1);
+    mem_reader_t *reader = mem_read_lock(map);
+    const mem_table_t *table = atomic_load(&map->table);
+    size_t i = mem_table_search(table, gpa);
+    if (i == table->count || gpa - table->bases[i] >= table->slots[i].size) {
+        mem_read_unlock(map, reader);
+        return NULL;
+    }
+    cache->generation = generation;
+    cache->slot = table->slots[i];
+    mem_read_unlock(map, reader);
+    return &cache->slot;
+}
+
+void* mem_map_translate(mem_map_t *map, uint64_t gpa, uint64_t len) {
+    const mem_slot_t *slot = mem_map_lookup(map, gpa);
+    if (slot == NULL || len > slot->size - (gpa - slot->gpa)) {
+        metric_inc(&map->stats.faults, 1);
+        errno = EFAULT;
+        return NULL;
+    }
+    return slot->hva + (gpa - slot->gpa);
+}
+
+int mem_map_translate_iov(mem_map_t *map, uint64_t gpa, uint64_t len, struct iovec *iov, size_t iov_len) {
+    size_t n = 0;
+    while (len > 0) {
+        const mem_slot_t *slot = mem_map_lookup(map, gpa);
+        if (slot == NULL) {
+            metric_inc(&map->stats.faults, 1);
+            errno = EFAULT;
+            return -1;
+        }
+        if (n == iov_len) {
+            errno = ENOBUFS;
+            return -1;
+        }
+
+        uint64_t offset = gpa - slot->gpa;
+        uint64_t count = len < slot->size - offset ? len : slot->size - offset;
+        iov[n++] = (struct iovec) { .iov_base = slot->hva + offset, .iov_len = count };
+        gpa += count;
+        len -= count;
+    }
+    return n;
+}
+
+size_t mem_map_slots(mem_map_t *map, mem_slot_t *slots, size_t max) {
+    mem_reader_t *reader = mem_read_lock(map);
+    const mem_table_t *table = atomic_load(&map->table);
+    size_t count = table->count < max ? table->count : max;
+    memcpy(slots, table->slots, count * sizeof(mem_slot_t));
+    count = table->count;
+    mem_read_unlock(map, reader);
+    return count;
+}
+
+int mem_map_register_metrics(mem_map_t *map, metrics_t *m, const char *labels) {
+    if (metrics_register(m, "tomu_mem_lookups_total", "Guest address translations that searched the slot table.",
+                         labels, METRIC_COUNTER, &map->stats.lookups) < 0) return -1;
+    if (metrics_register(m, "tomu_mem_faults_total", "Guest address translations outside of any slot.",
+                         labels, METRIC_COUNTER, &map->stats.faults) < 0) return -1;
+    return 0;
+}
@@ -0,0 +1,495 @@
+#define _GNU_SOURCE
+
+#include <metrics.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/kvm.h>
+
+#define METRICS_REQUEST_TIMEOUT_MS 100
+
+int metrics_init(metrics_t *m) {
+    memset(m, 0, sizeof(metrics_t));
+    m->listen_fd = -1;
+    if (pthread_mutex_init(&m->mu, NULL) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_deinit(metrics_t *m) {
+    if (m->listen_fd >= 0) {
+        // Wake the server thread from accept.
+        shutdown(m->listen_fd, SHUT_RDWR);
+        pthread_join(m->thread, NULL);
+        close(m->listen_fd);
+        unlink(m->path);
+        free(m->path);
+        m->listen_fd = -1;
+    }
+
+    for (size_t i = 0; i < m->metrics_len; i++) {
+        free(m->metrics[i].name);
+        free(m->metrics[i].help);
+        free(m->metrics[i].labels);
+    }
+    free(m->metrics);
+
+    for (size_t i = 0; i < m->sources_len; i++) {
+        close(m->sources[i].fd);
+        free(m->sources[i].prefix);
+        free(m->sources[i].labels);
+        free(m->sources[i].desc);
+    }
+    free(m->sources);
+
+    for (size_t i = 0; i < m->writers_len; i++) {
+        free(m->writers[i].path);
+    }
+    free(m->writers);
+
+    pthread_mutex_destroy(&m->mu);
+}
+
+static char* metrics_strdup(const char *s) {
+    return strdup(s != NULL ? s : "");
+}
+
+int metrics_register(metrics_t *m, const char *name, const char *help, const char *labels,
+                     metric_type_t type, _Atomic uint64_t *value) {
+    pthread_mutex_lock(&m->mu);
+    if (m->metrics_len == m->metrics_cap) {
+        size_t cap = m->metrics_cap ? m->metrics_cap * 2 : 32;
+        metric_t *metrics = realloc(m->metrics, cap * sizeof(metric_t));
+        if (metrics == NULL) goto error0;
+        m->metrics = metrics;
+        m->metrics_cap = cap;
+    }
+
+    metric_t *metric = &m->metrics[m->metrics_len];
+    metric->name = metrics_strdup(name);
+    metric->help = metrics_strdup(help);
+    metric->labels = metrics_strdup(labels);
+    if (metric->name == NULL || metric->help == NULL || metric->labels == NULL) {
+        free(metric->name);
+        free(metric->help);
+        free(metric->labels);
+        errno = ENOMEM;
+        goto error0;
+    }
+    metric->type = type;
+    metric->value = value;
+    m->metrics_len++;
+
+    pthread_mutex_unlock(&m->mu);
+    return 0;
+
+error0:
+    pthread_mutex_unlock(&m->mu);
+    return -1;
+}
+
+int metrics_add_kvm_stats(metrics_t *m, int fd, const char *prefix, const char *labels) {
+    struct kvm_stats_header hdr;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        if (errno == 0) errno = EIO;
+        return -1;
+    }
+
+    kvm_stats_t src = {
+        .fd = fd,
+        .num_desc = hdr.num_desc,
+        .desc_size = sizeof(struct kvm_stats_desc) + hdr.name_size,
+        .data_offset = hdr.data_offset,
+    };
+
+    // The descriptor block is immutable for the lifetime of the fd.
+    size_t desc_len = (size_t) src.num_desc * src.desc_size;
+    src.desc = malloc(desc_len);
+    if (src.desc == NULL) return -1;
+    if (pread(fd, src.desc, desc_len, hdr.desc_offset) != (ssize_t) desc_len) {
+        if (errno == 0) errno = EIO;
+        goto error0;
+    }
+
+    src.prefix = metrics_strdup(prefix);
+    src.labels = metrics_strdup(labels);
+    if (src.prefix == NULL || src.labels == NULL) {
+        errno = ENOMEM;
+        goto error1;
+    }
+
+    pthread_mutex_lock(&m->mu);
+    if (m->sources_len == m->sources_cap) {
+        size_t cap = m->sources_cap ? m->sources_cap * 2 : 4;
+        kvm_stats_t *sources = realloc(m->sources, cap * sizeof(kvm_stats_t));
+        if (sources == NULL) {
+            pthread_mutex_unlock(&m->mu);
+            goto error1;
+        }
+        m->sources = sources;
+        m->sources_cap = cap;
+    }
+    m->sources[m->sources_len++] = src;
+    pthread_mutex_unlock(&m->mu);
+    return 0;
+
+error1:
+    free(src.prefix);
+    free(src.labels);
+error0:
+    free(src.desc);
+    return -1;
+}
+
+int metrics_add_writer(metrics_t *m, const char *path, metrics_write_fn_t fn, void *arg) {
+    metrics_writer_t writer = { .fn = fn, .arg = arg };
+    if (path != NULL) {
+        writer.path = strdup(path);
+        if (writer.path == NULL) return -1;
+    }
+
+    pthread_mutex_lock(&m->mu);
+    if (m->writers_len == m->writers_cap) {
+        size_t cap = m->writers_cap ? m->writers_cap * 2 : 4;
+        metrics_writer_t *writers = realloc(m->writers, cap * sizeof(metrics_writer_t));
+        if (writers == NULL) {
+            pthread_mutex_unlock(&m->mu);
+            free(writer.path);
+            return -1;
+        }
+        m->writers = writers;
+        m->writers_cap = cap;
+    }
+    m->writers[m->writers_len++] = writer;
+    pthread_mutex_unlock(&m->mu);
+    return 0;
+}
+
+static const char* metric_type_name(metric_type_t type) {
+    return type == METRIC_COUNTER ? "counter": "gauge";
+}
+
+static void metrics_write_labels(FILE *f, const char *a, const char *b) {
+    int has_a = a != NULL && *a;
+    int has_b = b != NULL && *b;
+    if (!has_a && !has_b) return;
+    fprintf(f, "{%s%s%s}", has_a ? a : "", has_a && has_b ? "," : "", has_b ? b : "");
+}
+
+static void metrics_write_vmm(metrics_t *m, FILE *f) {
+    for (size_t i = 0; i < m->metrics_len; i++) {
+        // Emit every series of a metric family under a single HELP/TYPE
+        // header, at the position of its first registration.
+        int seen = 0;
+        for (size_t j = 0; j < i && !seen; j++) {
+            seen = strcmp(m->metrics[i].name, m->metrics[j].name) == 0;
+        }
+        if (seen) continue;
+
+        fprintf(f, "# HELP %s %s\n", m->metrics[i].name, m->metrics[i].help);
+        fprintf(f, "# TYPE %s %s\n", m->metrics[i].name, metric_type_name(m->metrics[i].type));
+        for (size_t j = i; j < m->metrics_len; j++) {
+            metric_t *metric = &m->metrics[j];
+            if (strcmp(metric->name, m->metrics[i].name) != 0) continue;
+            // Series with the same labels were written with the first one.
+            int shard = 0;
+            for (size_t k = i; k < j && !shard; k++) {
+                shard = strcmp(m->metrics[k].name, metric->name) == 0 &&
+                        strcmp(m->metrics[k].labels, metric->labels) == 0;
+            }
+            if (shard) continue;
+
+            uint64_t value = 0;
+            for (size_t k = j; k < m->metrics_len; k++) {
+                if (strcmp(m->metrics[k].name, metric->name) != 0 ||
+                    strcmp(m->metrics[k].labels, metric->labels) != 0) continue;
+                value += atomic_load_explicit(m->metrics[k].value, memory_order_relaxed);
+            }
+            fprintf(f, "%s", metric->name);
+            metrics_write_labels(f, metric->labels, NULL);
+            fprintf(f, " %llu\n", (unsigned long long) value);
+        }
+    }
+}
+
+static struct kvm_stats_desc* kvm_stats_desc_at(kvm_stats_t *src, uint32_t i) {
+    return (struct kvm_stats_desc*) (src->desc + (size_t) i * src->desc_size);
+}
+
+static struct kvm_stats_desc* kvm_stats_find(kvm_stats_t *src, const char *name) {
+    for (uint32_t i = 0; i < src->num_desc; i++) {
+        struct kvm_stats_desc *desc = kvm_stats_desc_at(src, i);
+        if (strcmp(desc->name, name) == 0) return desc;
+    }
+    return NULL;
+}
+
+/**
+ * kvm_stats_unit returns the suffix of the base unit of `desc`, e.g.
+ * `_seconds` for a time in nanoseconds, or "" if it has none.
+ */
+static const char* kvm_stats_unit(const struct kvm_stats_desc *desc) {
+    switch (desc->flags & KVM_STATS_UNIT_MASK) {
+    case KVM_STATS_UNIT_BYTES: return "_bytes";
+    case KVM_STATS_UNIT_SECONDS: return "_seconds";
+    case KVM_STATS_UNIT_CYCLES: return "_cycles";
+    default: return "";
+    }
+}
+
+/**
+ * kvm_stats_format formats `value` scaled by the exponent of `desc` to its
+ * base unit into `buf`. Negative powers of ten, e.g. nanoseconds, are
+ * written as exact decimals.
+ */
+static void kvm_stats_format(char *buf, size_t len, const struct kvm_stats_desc *desc, uint64_t value) {
+    int pow2 = (desc->flags & KVM_STATS_BASE_MASK) == KVM_STATS_BASE_POW2;
+    int exponent = desc->exponent;
+    if (exponent == 0) {
+        snprintf(buf, len, "%llu", (unsigned long long) value);
+    } else if (!pow2 && exponent < 0 && exponent >= -19) {
+        uint64_t divisor = 1;
+        for (int i = 0; i < -exponent; i++) divisor *= 10;
+        snprintf(buf, len, "%llu.%0*llu", (unsigned long long) (value / divisor), -exponent,
+                 (unsigned long long) (value % divisor));
+    } else {
+        double scaled = value;
+        double base = pow2 ? 2.0 : 10.0;
+        for (int i = 0; i < (exponent < 0 ? -exponent : exponent); i++) {
+            scaled = exponent < 0 ? scaled / base : scaled * base;
+        }
+        snprintf(buf, len, "%.17g", scaled);
+    }
+}
+
+/**
+ * kvm_stats_write_series writes the series of the statistic `desc` of
+ * `src`. A histogram is written as cumulative `le` buckets and a count, in
+ * the unit of the statistic. KVM does not record the sum of the samples,
+ * so there is no `_sum`.
+ */
+static void kvm_stats_write_series(kvm_stats_t *src, const struct kvm_stats_desc *desc, const char *name,
+                                   FILE *f) {
+    uint64_t values[desc->size ? desc->size : 1];
+    size_t len = (size_t) desc->size * sizeof(uint64_t);
+    if (desc->size == 0 || pread(src->fd, values, len, src->data_offset + desc->offset) != (ssize_t) len) {
+        return;
+    }
+
+    uint32_t type = desc->flags & KVM_STATS_TYPE_MASK;
+    if (type != KVM_STATS_TYPE_LINEAR_HIST && type != KVM_STATS_TYPE_LOG_HIST) {
+        for (uint16_t j = 0; j < desc->size; j++) {
+            char value[64];
+            kvm_stats_format(value, sizeof(value), desc, values[j]);
+            // The elements of an array are told apart by their index.
+            char index[32];
+            snprintf(index, sizeof(index), "index=\"%u\"", j);
+            fprintf(f, "%s", name);
+            metrics_write_labels(f, src->labels, desc->size > 1 ? index : NULL);
+            fprintf(f, " %s\n", value);
+        }
+        return;
+    }
+
+    // Bucket j of a linear histogram holds the samples in
+    // [j * bucket_size, (j + 1) * bucket_size), and of a logarithmic one
+    // those in [2^(j - 1), 2^j), with 0 in bucket 0. The last bucket also
+    // holds every larger sample.
+    uint64_t count = 0;
+    for (uint16_t j = 0; j < desc->size; j++) {
+        count += values[j];
+        char bound[64];
+        if (j + 1 == desc->size) {
+            snprintf(bound, sizeof(bound), "+Inf");
+        } else {
+            kvm_stats_format(bound, sizeof(bound), desc,
+                             type == KVM_STATS_TYPE_LINEAR_HIST ? (uint64_t) (j + 1) * desc->bucket_size - 1
+                                                                : (1ULL << j) - 1);
+        }
+        char le[80];
+        snprintf(le, sizeof(le), "le=\"%s\"", bound);
+        fprintf(f, "%s_bucket", name);
+        metrics_write_labels(f, src->labels, le);
+        fprintf(f, " %llu\n", (unsigned long long) count);
+    }
+    fprintf(f, "%s_count", name);
+    metrics_write_labels(f, src->labels, NULL);
+    fprintf(f, " %llu\n", (unsigned long long) count);
+}
+
+/**
+ * metrics_write_kvm writes the statistics of every source. The series of
+ * a statistic in several sources with the same prefix, e.g. one per vCPU,
+ * are written under a single HELP/TYPE header, at the position of the
+ * first source.
+ */
+static void metrics_write_kvm(metrics_t *m, FILE *f) {
+    for (size_t i = 0; i < m->sources_len; i++) {
+        kvm_stats_t *src = &m->sources[i];
+        for (uint32_t d = 0; d < src->num_desc; d++) {
+            struct kvm_stats_desc *desc = kvm_stats_desc_at(src, d);
+            int seen = 0;
+            for (size_t j = 0; j < i && !seen; j++) {
+                seen = strcmp(m->sources[j].prefix, src->prefix) == 0 &&
+                       kvm_stats_find(&m->sources[j], desc->name) != NULL;
+            }
+            if (seen) continue;
+
+            // A statistic in nanoseconds, e.g. halt_wait_ns, is exported in
+            // seconds without its `_ns`.
+            char name[256];
+            int len = strlen(desc->name);
+            const char *unit = kvm_stats_unit(desc);
+            if (strcmp(unit, "_seconds") == 0 && len > 3 && strcmp(desc->name + len - 3, "_ns") == 0) len -= 3;
+            snprintf(name, sizeof(name), "%s_%.*s%s", src->prefix, len, desc->name, unit);
+            uint32_t type = desc->flags & KVM_STATS_TYPE_MASK;
+            const char *type_name = type == KVM_STATS_TYPE_CUMULATIVE ? "counter" :
+                                    type == KVM_STATS_TYPE_LINEAR_HIST || type == KVM_STATS_TYPE_LOG_HIST ?
+                                    "histogram" : "gauge";
+            fprintf(f, "# HELP %s KVM binary statistic %s.\n", name, desc->name);
+            fprintf(f, "# TYPE %s %s\n", name, type_name);
+            kvm_stats_write_series(src, desc, name, f);
+            for (size_t j = i + 1; j < m->sources_len; j++) {
+                if (strcmp(m->sources[j].prefix, src->prefix) != 0) continue;
+                struct kvm_stats_desc *other = kvm_stats_find(&m->sources[j], desc->name);
+                if (other != NULL) kvm_stats_write_series(&m->sources[j], other, name, f);
+            }
+        }
+    }
+}
+
+int metrics_write(metrics_t *m, FILE *f) {
+    pthread_mutex_lock(&m->mu);
+    metrics_write_vmm(m, f);
+    for (size_t i = 0; i < m->writers_len; i++) {
+        if (m->writers[i].path == NULL) m->writers[i].fn(m->writers[i].arg, f);
+    }
+    metrics_write_kvm(m, f);
+    pthread_mutex_unlock(&m->mu);
+    return ferror(f) ? -1 : 0;
+}
+
+/**
+ * metrics_write_path writes the output of the writer serving `path` to
+ * `f`, or the exposition if there is none.
+ */
+static int metrics_write_path(metrics_t *m, const char *path, size_t path_len, FILE *f) {
+    pthread_mutex_lock(&m->mu);
+    for (size_t i = 0; i < m->writers_len; i++) {
+        metrics_writer_t *writer = &m->writers[i];
+        if (writer->path != NULL && strlen(writer->path) == path_len &&
+            memcmp(writer->path, path, path_len) == 0) {
+            writer->fn(writer->arg, f);
+            pthread_mutex_unlock(&m->mu);
+            return ferror(f) ? -1 : 0;
+        }
+    }
+    pthread_mutex_unlock(&m->mu);
+    return metrics_write(m, f);
+}
+
+static int metrics_write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t res = write(fd, buf, len);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += res;
+        len -= res;
+    }
+    return 0;
+}
+
+static void metrics_handle(metrics_t *m, int fd) {
+    // Peek at the request, if any, to decide whether to wrap the exposition
+    // in an HTTP response.
+    char req[512];
+    ssize_t req_len = 0;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (poll(&pfd, 1, METRICS_REQUEST_TIMEOUT_MS) > 0) {
+        req_len = read(fd, req, sizeof(req));
+    }
+    int http = req_len >= 4 && memcmp(req, "GET ", 4) == 0;
+    const char *path = http ? req + 4 : "";
+    size_t path_len = 0;
+    while (http && 4 + path_len < (size_t) req_len && path[path_len] != ' ' && path[path_len] != '\r') {
+        path_len++;
+    }
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *f = open_memstream(&body, &body_len);
+    if (f == NULL) return;
+    metrics_write_path(m, path, path_len, f);
+    fclose(f);
+
+    if (http) {
+        char hdr[128];
+        int hdr_len = snprintf(hdr, sizeof(hdr),
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\n\r\n", body_len);
+        metrics_write_all(fd, hdr, hdr_len);
+    }
+    metrics_write_all(fd, body, body_len);
+    free(body);
+}
+
+static void* metrics_thread_func(void *arg) {
+    metrics_t *m = (metrics_t*) arg;
+    while (1) {
+        int fd = accept(m->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        metrics_handle(m, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_serve(metrics_t *m, const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        goto error0;
+    }
+    strcpy(addr.sun_path, path);
+
+    m->path = strdup(path);
+    if (m->path == NULL) goto error0;
+
+    m->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m->listen_fd < 0) goto error1;
+
+    unlink(path);
+    if (bind(m->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) goto error2;
+    if (listen(m->listen_fd, 16) < 0) goto error3;
+
+    int res = pthread_create(&m->thread, NULL, metrics_thread_func, m);
+    if (res != 0) {
+        errno = res;
+        goto error3;
+    }
+    return 0;
+
+error3:
+    unlink(path);
+error2:
+    close(m->listen_fd);
+    m->listen_fd = -1;
+error1:
+    free(m->path);
+    m->path = NULL;
+error0:
+    return -1;
+}
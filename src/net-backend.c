@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+
+#include <net-backend.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/if_tun.h>
+#include <linux/virtio_net.h>
+
+// Socket buffers fit several of the largest (64KiB) segmentation offload
+// frames.
+#define NET_BACKEND_SOCKET_BUFFER (1 << 20)
+
+static void net_backend_reset(net_backend_t *backend, net_backend_type_t type) {
+    memset(backend, 0, sizeof(net_backend_t));
+    backend->type = type;
+    for (size_t i = 0; i < NET_BACKEND_MAX_QUEUES; i++) {
+        backend->fds[i] = -1;
+    }
+}
+
+void net_backend_close(net_backend_t *backend) {
+    for (size_t i = 0; i < backend->queue_count; i++) {
+        if (backend->fds[i] >= 0) close(backend->fds[i]);
+        backend->fds[i] = -1;
+    }
+    backend->queue_count = 0;
+}
+
+int net_backend_open_tap(net_backend_t *backend, const char *ifname, size_t queue_count) {
+    net_backend_reset(backend, NET_BACKEND_TAP);
+    if (queue_count == 0 || queue_count > NET_BACKEND_MAX_QUEUES || strlen(ifname) >= IFNAMSIZ) {
+        errno = EINVAL;
+        return -1;
+    }
+    snprintf(backend->ifname, sizeof(backend->ifname), "%s", ifname);
+    backend->vhost = 1;
+
+    for (size_t i = 0; i < queue_count; i++) {
+        int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) goto error0;
+        backend->fds[backend->queue_count++] = fd;
+
+        struct ifreq ifr = {0};
+        ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR | (queue_count > 1 ? IFF_MULTI_QUEUE : 0);
+        memcpy(ifr.ifr_name, backend->ifname, sizeof(backend->ifname));
+        if (ioctl(fd, TUNSETIFF, &ifr) < 0) goto error0;
+
+        int hdr_len = sizeof(struct virtio_net_hdr_v1);
+        if (ioctl(fd, TUNSETVNETHDRSZ, &hdr_len) < 0) goto error0;
+    }
+    return 0;
+
+error0:
+    net_backend_close(backend);
+    return -1;
+}
+
+static void net_backend_socket_buffers(int fd) {
+    int size = NET_BACKEND_SOCKET_BUFFER;
+    // Larger buffers are an optimization, the defaults still fit a frame.
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+int net_backend_open_seqpacket(net_backend_t *backend, const char *path, int listen_, size_t queue_count) {
+    net_backend_reset(backend, NET_BACKEND_SEQPACKET);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (queue_count == 0 || queue_count > NET_BACKEND_MAX_QUEUES) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int listen_fd = -1;
+    if (listen_) {
+        listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) goto error0;
+        unlink(path);
+        if (bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) goto error1;
+        if (listen(listen_fd, queue_count) < 0) goto error2;
+    }
+
+    for (size_t i = 0; i < queue_count; i++) {
+        int fd;
+        if (listen_) {
+            fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0) goto error2;
+        } else {
+            fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+            if (fd < 0) goto error2;
+            if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+                close(fd);
+                goto error2;
+            }
+        }
+        net_backend_socket_buffers(fd);
+        backend->fds[backend->queue_count++] = fd;
+    }
+
+    if (listen_) {
+        unlink(path);
+        close(listen_fd);
+    }
+    return 0;
+
+error2:
+    if (listen_) unlink(path);
+error1:
+    if (listen_fd >= 0) close(listen_fd);
+error0:
+    net_backend_close(backend);
+    return -1;
+}
+
+int net_backend_open_pair(net_backend_t *backend, int *peer_fds, size_t queue_count) {
+    net_backend_reset(backend, NET_BACKEND_SEQPACKET);
+    if (queue_count == 0 || queue_count > NET_BACKEND_MAX_QUEUES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t i = 0; i < queue_count; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) goto error0;
+        net_backend_socket_buffers(fds[0]);
+        net_backend_socket_buffers(fds[1]);
+        backend->fds[backend->queue_count++] = fds[0];
+        peer_fds[i] = fds[1];
+    }
+    return 0;
+
+error0:
+    for (size_t i = 0; i < backend->queue_count; i++) {
+        close(peer_fds[i]);
+    }
+    net_backend_close(backend);
+    return -1;
+}
+
+int net_backend_open_spec(net_backend_t *backend, const char *spec) {
+    int is_tap = strncmp(spec, "tap:", 4) == 0;
+    int is_seqpacket = strncmp(spec, "seqpacket:", 10) == 0;
+    if (!is_tap && !is_seqpacket) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char *buf = strdup(spec + (is_tap ? 4 : 10));
+    if (buf == NULL) return -1;
+
+    size_t queue_count = 1;
+    int listen_ = 0;
+    int vhost = 1;
+    char *save;
+    char *name = strtok_r(buf, ",", &save);
+    if (name == NULL) goto einval;
+    char *opt;
+    while ((opt = strtok_r(NULL, ",", &save)) != NULL) {
+        if (strncmp(opt, "queues=", 7) == 0) {
+            char *end;
+            queue_count = strtoull(opt + 7, &end, 0);
+            if (*end != '\0') goto einval;
+        } else if (is_seqpacket && strcmp(opt, "listen") == 0) {
+            listen_ = 1;
+        } else if (is_tap && strcmp(opt, "novhost") == 0) {
+            vhost = 0;
+        } else {
+            goto einval;
+        }
+    }
+
+    int res = is_tap ? net_backend_open_tap(backend, name, queue_count)
+                     : net_backend_open_seqpacket(backend, name, listen_, queue_count);
+    if (res == 0 && is_tap) backend->vhost = vhost;
+    free(buf);
+    return res;
+
+einval:
+    free(buf);
+    errno = EINVAL;
+    return -1;
+}
+
+int net_backend_set_offload(net_backend_t *backend, uint64_t features) {
+    if (backend->type != NET_BACKEND_TAP) return 0;
+
+    unsigned offload = 0;
+    if (features & (1ULL << VIRTIO_NET_F_GUEST_CSUM)) {
+        offload |= TUN_F_CSUM;
+        if (features & (1ULL << VIRTIO_NET_F_GUEST_TSO4)) offload |= TUN_F_TSO4;
+        if (features & (1ULL << VIRTIO_NET_F_GUEST_TSO6)) offload |= TUN_F_TSO6;
+        if (features & (1ULL << VIRTIO_NET_F_GUEST_ECN)) offload |= TUN_F_TSO_ECN;
+    }
+    for (size_t i = 0; i < backend->queue_count; i++) {
+        if (ioctl(backend->fds[i], TUNSETOFFLOAD, offload) < 0) return -1;
+    }
+    return 0;
+}
+
+ssize_t net_backend_send(net_backend_t *backend, size_t queue, const struct iovec *iov, size_t iovcnt) {
+    if (backend->type == NET_BACKEND_TAP) {
+        return writev(backend->fds[queue], iov, iovcnt);
+    }
+    struct msghdr msg = { .msg_iov = (struct iovec*) iov, .msg_iovlen = iovcnt };
+    return sendmsg(backend->fds[queue], &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+ssize_t net_backend_recv(net_backend_t *backend, size_t queue, struct iovec *iov, size_t iovcnt) {
+    if (backend->type == NET_BACKEND_TAP) {
+        return readv(backend->fds[queue], iov, iovcnt);
+    }
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+    ssize_t res = recvmsg(backend->fds[queue], &msg, MSG_DONTWAIT);
+    // The rest of a truncated frame is lost.
+    if (res >= 0 && (msg.msg_flags & MSG_TRUNC)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return res;
+}
@@ -1,51 +1,115 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include <queue.h>
 
+static size_t queue_round_up(size_t n) {
+    size_t res = 1;
+    while (res < n) res <<= 1;
+    return res;
+}
+
 int queue_init(queue_t *q, size_t capacity) {
-    q->front = 0;
-    q->rear = 0;
-    q->size = 0;
-    q->capacity = capacity;
-    q->data = calloc(1, capacity);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    q->capacity = capacity ? queue_round_up(capacity) : 0;
+    q->mask = q->capacity ? q->capacity - 1 : 0;
+    q->data = calloc(1, q->capacity ? q->capacity : 1);
     if (q->data == NULL) return -1;
     return 0;
 }
 
 void queue_deinit(queue_t *q) {
-    q->front = 0;
-    q->rear = 0;
-    q->size = 0;
+    atomic_store(&q->head, 0);
+    atomic_store(&q->tail, 0);
     q->capacity = 0;
+    q->mask = 0;
     free(q->data);
     q->data = NULL;
 }
 
 void queue_clear(queue_t *q) {
-    q->rear = 0;
-    q->front = 0;
-    q->size = 0;
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    atomic_store_explicit(&q->head, tail, memory_order_release);
+}
+
+size_t queue_tail(queue_t *q) {
+    return atomic_load_explicit(&q->tail, memory_order_relaxed);
+}
+
+void queue_discard_until(queue_t *q, size_t tail) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    // Positions are free-running, so compare their distance.
+    if ((ptrdiff_t) (tail - head) <= 0) return;
+    atomic_store_explicit(&q->head, tail, memory_order_release);
+}
+
+size_t queue_push_bulk(queue_t *q, const uint8_t *buf, size_t count) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    size_t space = q->capacity - (tail - head);
+    if (count > space) count = space;
+    if (count == 0) return 0;
+
+    size_t pos = tail & q->mask;
+    size_t first = q->capacity - pos;
+    if (first > count) first = count;
+    memcpy(q->data + pos, buf, first);
+    memcpy(q->data, buf + first, count - first);
+
+    atomic_store_explicit(&q->tail, tail + count, memory_order_release);
+    return count;
+}
+
+size_t queue_pop_bulk(queue_t *q, uint8_t *buf, size_t count) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    size_t size = tail - head;
+    if (count > size) count = size;
+    if (count == 0) return 0;
+
+    size_t pos = head & q->mask;
+    size_t first = q->capacity - pos;
+    if (first > count) first = count;
+    memcpy(buf, q->data + pos, first);
+    memcpy(buf + first, q->data, count - first);
+
+    atomic_store_explicit(&q->head, head + count, memory_order_release);
+    return count;
+}
+
+int queue_peek(queue_t *q, struct iovec iov[2]) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    size_t size = tail - head;
+    if (size == 0) return 0;
+
+    size_t pos = head & q->mask;
+    size_t first = q->capacity - pos;
+    if (first > size) first = size;
+    iov[0] = (struct iovec) { .iov_base = q->data + pos, .iov_len = first };
+    if (first == size) return 1;
+    iov[1] = (struct iovec) { .iov_base = q->data, .iov_len = size - first };
+    return 2;
+}
+
+void queue_discard(queue_t *q, size_t count) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    atomic_store_explicit(&q->head, head + count, memory_order_release);
 }
 
 int queue_push(queue_t *q, uint8_t b) {
-    if (q->capacity == 0) return -1;
-    if (q->size == q->capacity) return -1;
-    q->data[q->rear] = b;
-    q->size++;
-    q->rear = (q->rear + 1) % q->capacity;
-    return 0;
+    return queue_push_bulk(q, &b, 1) == 1 ? 0 : -1;
 }
 
 int queue_pop(queue_t *q, uint8_t *b) {
-    if (q->size == 0) return -1;
-    *b = q->data[q->front];
-    q->front = (q->front + 1) % q->capacity;
-    q->size--;
-    return 0;
+    return queue_pop_bulk(q, b, 1) == 1 ? 0 : -1;
 }
 
 size_t queue_size(queue_t *q) {
-    return q->size;
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    return tail - head;
 }
 
 size_t queue_capacity(queue_t *q) {
@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+
+#include <ringlog.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RINGLOG_TIMESTAMP_LEN 32
+
+static int ringlog_map(ringlog_t *log) {
+    int fd = open(log->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) goto error0;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) goto error1;
+
+    size_t total = RINGLOG_HEADER_SIZE + log->data_size;
+    int resume = (size_t) st.st_size == total;
+    if (!resume) {
+        // Discard the previous contents so that the data area reads as zero.
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, total) < 0) goto error1;
+    }
+
+    void *map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) goto error1;
+
+    ringlog_header_t *header = map;
+    if (resume && (memcmp(header->magic, RINGLOG_MAGIC, sizeof(header->magic)) != 0 ||
+                   header->version != RINGLOG_VERSION ||
+                   header->header_size != RINGLOG_HEADER_SIZE ||
+                   header->data_size != log->data_size)) {
+        memset(map, 0, total);
+        resume = 0;
+    }
+
+    if (!resume) {
+        memcpy(header->magic, RINGLOG_MAGIC, sizeof(header->magic));
+        header->version = RINGLOG_VERSION;
+        header->header_size = RINGLOG_HEADER_SIZE;
+        header->data_size = log->data_size;
+        atomic_store(&header->flags, 0);
+        atomic_store(&header->write_begin, 0);
+        atomic_store(&header->write_offset, 0);
+    } else {
+        atomic_store(&header->flags, 0);
+        // Discard a write that was interrupted by a crash.
+        atomic_store(&header->write_begin, atomic_load(&header->write_offset));
+    }
+
+    log->fd = fd;
+    log->header = header;
+    log->data = (uint8_t*) map + RINGLOG_HEADER_SIZE;
+
+    uint64_t offset = atomic_load(&header->write_offset);
+    log->line_start = offset == 0 || log->data[(offset - 1) % log->data_size] == '\n';
+
+    return 0;
+
+error1:
+    close(fd);
+error0:
+    return -1;
+}
+
+static void ringlog_unmap(ringlog_t *log) {
+    munmap(log->header, RINGLOG_HEADER_SIZE + log->data_size);
+    close(log->fd);
+}
+
+int ringlog_init(ringlog_t *log, const char *path, size_t size, unsigned rotate, int flags) {
+    if (size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(log, 0, sizeof(ringlog_t));
+    log->path = strdup(path);
+    if (log->path == NULL) return -1;
+    log->data_size = size;
+    log->rotate = rotate;
+    log->flags = flags;
+
+    if (ringlog_map(log) < 0) {
+        free(log->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int ringlog_parse_size(const char *s, size_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(s, &end, 0);
+    if (errno != 0 || end == s) return -1;
+    switch (*end) {
+    case 'K': case 'k': value <<= 10; end++; break;
+    case 'M': case 'm': value <<= 20; end++; break;
+    case 'G': case 'g': value <<= 30; end++; break;
+    }
+    if (*end != '\0') return -1;
+    *size = value;
+    return 0;
+}
+
+int ringlog_init_spec(ringlog_t *log, const char *spec) {
+    char *buf = strdup(spec);
+    if (buf == NULL) return -1;
+
+    size_t size = RINGLOG_DEFAULT_SIZE;
+    size_t rotate = 0;
+    int flags = 0;
+
+    char *save;
+    char *path = strtok_r(buf, ",", &save);
+    if (path == NULL) goto einval;
+
+    char *opt;
+    while ((opt = strtok_r(NULL, ",", &save)) != NULL) {
+        if (strncmp(opt, "size=", 5) == 0) {
+            if (ringlog_parse_size(opt + 5, &size) < 0) goto einval;
+        } else if (strncmp(opt, "rotate=", 7) == 0) {
+            if (ringlog_parse_size(opt + 7, &rotate) < 0 || rotate > UINT_MAX) goto einval;
+        } else if (strcmp(opt, "timestamps") == 0) {
+            flags |= RINGLOG_TIMESTAMPS;
+        } else {
+            goto einval;
+        }
+    }
+
+    int res = ringlog_init(log, path, size, rotate, flags);
+    free(buf);
+    return res;
+
+einval:
+    free(buf);
+    errno = EINVAL;
+    return -1;
+}
+
+void ringlog_deinit(ringlog_t *log) {
+    msync(log->header, RINGLOG_HEADER_SIZE + log->data_size, MS_ASYNC);
+    ringlog_unmap(log);
+    free(log->path);
+}
+
+/**
+ * ringlog_rotate shifts `path.<i>` to `path.<i+1>`, renames the current log
+ * to `path.1` and starts a fresh log at `path`.
+ */
+static int ringlog_rotate(ringlog_t *log) {
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+    for (unsigned i = log->rotate; i > 1; i--) {
+        snprintf(from, sizeof(from), "%s.%u", log->path, i - 1);
+        snprintf(to, sizeof(to), "%s.%u", log->path, i);
+        if (rename(from, to) < 0 && errno != ENOENT) return -1;
+    }
+    snprintf(to, sizeof(to), "%s.1", log->path);
+    if (rename(log->path, to) < 0) return -1;
+
+    ringlog_t old = *log;
+    if (ringlog_map(log) < 0) return -1;
+
+    atomic_fetch_or(&old.header->flags, RINGLOG_F_ROTATED);
+    ringlog_unmap(&old);
+
+    return 0;
+}
+
+/**
+ * ringlog_append appends the `count` bytes at `buf` to the log.
+ *
+ * \return The number of bytes appended, which is less than `count` only if
+ *         a rotation failed, with errno set to indicate the error.
+ */
+static size_t ringlog_append(ringlog_t *log, const uint8_t *buf, size_t count) {
+    size_t done = 0;
+    while (done < count) {
+        uint64_t offset = atomic_load_explicit(&log->header->write_offset, memory_order_relaxed);
+        size_t n = count - done < log->data_size ? count - done : log->data_size;
+        if (log->rotate > 0) {
+            // A log resumed from a run without rotation may have wrapped.
+            if (offset >= log->data_size) {
+                if (ringlog_rotate(log) < 0) break;
+                continue;
+            }
+            if (n > log->data_size - offset) n = log->data_size - offset;
+        }
+
+        // Announce the bytes about to be overwritten before touching them.
+        atomic_store(&log->header->write_begin, offset + n);
+
+        size_t pos = offset % log->data_size;
+        size_t first = log->data_size - pos;
+        if (first > n) first = n;
+        memcpy(log->data + pos, buf + done, first);
+        memcpy(log->data, buf + done + first, n - first);
+
+        atomic_store_explicit(&log->header->write_offset, offset + n, memory_order_release);
+        done += n;
+    }
+    return done;
+}
+
+static int ringlog_timestamp(ringlog_t *log) {
+    struct timespec ts;
+    struct tm tm;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    gmtime_r(&ts.tv_sec, &tm);
+
+    char buf[RINGLOG_TIMESTAMP_LEN];
+    size_t len = strftime(buf, sizeof(buf), "[%Y-%m-%dT%H:%M:%S", &tm);
+    len += snprintf(buf + len, sizeof(buf) - len, ".%06ldZ] ", ts.tv_nsec / 1000);
+    return ringlog_append(log, (uint8_t*) buf, len) == len ? 0 : -1;
+}
+
+ssize_t ringlog_writev(ringlog_t *log, const struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        const uint8_t *buf = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        if (!(log->flags & RINGLOG_TIMESTAMPS)) {
+            size_t res = ringlog_append(log, buf, len);
+            total += res;
+            if (res < len) goto error;
+            continue;
+        }
+
+        while (len > 0) {
+            if (log->line_start) {
+                if (ringlog_timestamp(log) < 0) goto error;
+                log->line_start = 0;
+            }
+            const uint8_t *eol = memchr(buf, '\n', len);
+            size_t n = eol != NULL ? (size_t) (eol - buf) + 1 : len;
+            size_t res = ringlog_append(log, buf, n);
+            total += res;
+            if (res < n) goto error;
+            log->line_start = eol != NULL;
+            buf += n;
+            len -= n;
+        }
+    }
+    return total;
+
+error:
+    // The bytes already appended must not be written again.
+    return total > 0 ? total : -1;
+}
@@ -1,6 +1,8 @@
 #include <errno.h>
 #include <pthread.h>
+#include <string.h>
 #include <unistd.h>
+#include <stdatomic.h>
 
 #include <sys/eventfd.h>
 #include <linux/serial.h>
@@ -9,8 +11,6 @@
 #include <queue.h>
 #include <serial.h>
 
-#define SERIAL_IO_ADDR 0x3f8
-
 // backport UAPI constants defined in 6.3
 // https://github.com/torvalds/linux/commit/3398cc4f2b1592148a2ebabc5a2df3e303d4e77c
 #define UART_IIR_FIFO_ENABLED           0xc0 /* FIFOs enabled / port type identification */
@@ -66,20 +66,15 @@ int serial_write(serial_t *dev, uint8_t *buf, size_t nbytes) {
         goto error;
     }
 
-    size_t nwritten = 0;
-    while (nwritten < nbytes) {
-        if (queue_push(&dev->rx_queue, buf[nwritten]) < 0) {
-            break;
-        }
-        dev->regs.lsr |= UART_LSR_DR;
-        nwritten++;
-    }
+    size_t nwritten = queue_push_bulk(&dev->rx_queue, buf, nbytes);
+    metric_inc(&dev->stats.rx_bytes, nwritten);
 
     if (nwritten == 0) {
         errno = EAGAIN;
         goto error;
     }
 
+    dev->regs.lsr |= UART_LSR_DR;
     serial_update_irq(dev);
     pthread_mutex_unlock(&dev->mu);
     return nwritten;
@@ -89,48 +84,114 @@ error:
     return -1;
 }
 
-int serial_read(serial_t *dev, uint8_t *buf, size_t nbytes) {
-    pthread_mutex_lock(&dev->mu);
+// The tx queue applies backpressure to the guest once less than half a
+// hardware FIFO of space is left, and releases it once a full hardware FIFO
+// of space is available. For a tx queue of SERIAL_FIFO_LEN bytes this is
+// exactly the 16550A behaviour, for larger host buffers the guest sees a
+// transmitter that drains instantly until the host falls behind.
+static int serial_tx_full(serial_t *dev) {
+    return queue_capacity(&dev->tx_queue) - queue_size(&dev->tx_queue) <= SERIAL_FIFO_LEN / 2;
+}
+
+static int serial_tx_relieved(serial_t *dev) {
+    return queue_capacity(&dev->tx_queue) - queue_size(&dev->tx_queue) >= SERIAL_FIFO_LEN;
+}
+
+// serial_tx_arm arms the eventfd and re-checks the tx queue. It returns 0 if
+// the queue is still empty, in which case the producer is guaranteed to
+// signal the eventfd on its next push.
+//
+//          Producer           |          Consumer
+//                             |
+// tail = tail + 1             | armed = 1
+// fence(seq_cst)              | fence(seq_cst)
+// if (exchange(armed, 0))     | if (tail != head)
+//     signal(eventfd)         |     continue draining
+static int serial_tx_arm(serial_t *dev) {
+    atomic_store_explicit(&dev->tx_armed, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (queue_size(&dev->tx_queue) == 0) return 0;
+    atomic_store_explicit(&dev->tx_armed, 0, memory_order_relaxed);
+    return 1;
+}
+
+// serial_tx_consumed releases guest backpressure after the consumer has
+// freed space in the tx queue.
+static void serial_tx_consumed(serial_t *dev, size_t count) {
+    metric_inc(&dev->stats.tx_bytes, count);
+    if (!atomic_load_explicit(&dev->tx_blocked, memory_order_acquire)) return;
 
-    size_t nread = 0;
-    while(nread < nbytes) {
-        if (queue_pop(&dev->tx_queue, &buf[nread]) == 0) nread++;
-        else break;
+    pthread_mutex_lock(&dev->mu);
+    // Re-check under the lock, the guest may have pushed in the meantime.
+    if (atomic_load_explicit(&dev->tx_blocked, memory_order_relaxed) && serial_tx_relieved(dev)) {
+        atomic_store_explicit(&dev->tx_blocked, 0, memory_order_relaxed);
+        dev->regs.lsr |= UART_LSR_TEMT | UART_LSR_THRE;
+        serial_update_irq(dev);
     }
-    if (queue_size(&dev->tx_queue) == 0) {
-        if (nread == 0) {
+    pthread_mutex_unlock(&dev->mu);
+}
+
+// serial_tx_clear discards the bytes of the tx queue the guest cleared
+// before the consumer reads it.
+static void serial_tx_clear(serial_t *dev) {
+    if (!atomic_exchange_explicit(&dev->tx_clear, 0, memory_order_acquire)) return;
+    size_t tail = atomic_load_explicit(&dev->tx_clear_tail, memory_order_relaxed);
+    queue_discard_until(&dev->tx_queue, tail);
+    serial_tx_consumed(dev, 0);
+}
+
+int serial_read(serial_t *dev, uint8_t *buf, size_t nbytes) {
+    // The caller is the only consumer of the tx queue, so bytes are popped
+    // without the device lock.
+    serial_tx_clear(dev);
+    size_t nread = queue_pop_bulk(&dev->tx_queue, buf, nbytes);
+    if (nread == 0) {
+        if (!serial_tx_arm(dev)) {
             errno = EAGAIN;
-            pthread_mutex_unlock(&dev->mu);
             return -1;
-        } else {
-            dev->regs.lsr |= UART_LSR_TEMT | UART_LSR_THRE;
         }
+        nread = queue_pop_bulk(&dev->tx_queue, buf, nbytes);
     }
 
-    serial_update_irq(dev);
-    pthread_mutex_unlock(&dev->mu);
+    serial_tx_consumed(dev, nread);
     return nread;
 }
 
-void serial_out(serial_t *dev, uint16_t port, uint8_t *data, size_t len) {
-    pthread_mutex_lock(&dev->mu);
-    switch (port) {
-    case SERIAL_IO_ADDR + UART_TX:
-        if (dev->regs.lcr & UART_LCR_DLAB) {
-            dev->regs.dll = *data;
-            break;
+int serial_peek(serial_t *dev, struct iovec iov[2]) {
+    serial_tx_clear(dev);
+    int iovcnt = queue_peek(&dev->tx_queue, iov);
+    if (iovcnt == 0) {
+        if (!serial_tx_arm(dev)) {
+            errno = EAGAIN;
+            return -1;
         }
+        iovcnt = queue_peek(&dev->tx_queue, iov);
+    }
+    return iovcnt;
+}
 
-        // While in loopback mode, write the tx to rx queue.
-        if (dev->regs.mcr & UART_MCR_LOOP) {
-            if (queue_push(&dev->rx_queue, *data) == 0) {
-                dev->regs.lsr |= UART_LSR_DR;
-            }
-            break;
+void serial_consume(serial_t *dev, size_t count) {
+    queue_discard(&dev->tx_queue, count);
+    serial_tx_consumed(dev, count);
+}
+
+// serial_tx transmits `len` bytes written to THR, in one batch for string
+// port IO. Bytes that do not fit are dropped like on a hardware overrun,
+// but the guest only overruns if it ignores THRE.
+static void serial_tx(serial_t *dev, const uint8_t *data, size_t len) {
+    // While in loopback mode, write the tx to rx queue.
+    if (dev->regs.mcr & UART_MCR_LOOP) {
+        if (queue_push_bulk(&dev->rx_queue, data, len) > 0) {
+            dev->regs.lsr |= UART_LSR_DR;
         }
-        
-        if (queue_push(&dev->tx_queue, *data) == 0) {
-            dev->regs.lsr &= ~UART_LSR_TEMT;
+        return;
+    }
+
+    if (queue_push_bulk(&dev->tx_queue, data, len) > 0) {
+        // Only signal the consumer if it has drained the queue and armed
+        // the eventfd, see serial_tx_arm.
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_exchange_explicit(&dev->tx_armed, 0, memory_order_relaxed) && dev->eventfd >= 0) {
             if (write(dev->eventfd, (void*) &(uint64_t){1}, sizeof(uint64_t)) < 0) {
                 // The number of unhandled events has exceeded 0xffffffffffffffff.
                 // We never expect this to happen under ordinary conditions, but it
@@ -138,22 +199,34 @@ void serial_out(serial_t *dev, uint16_t port, uint8_t *data, size_t len) {
                 // TODO: Add warning log if the eventfd has not been read.
             }
         }
+    }
 
-        if (queue_size(&dev->tx_queue) >= SERIAL_FIFO_LEN / 2)
-            dev->regs.lsr &= ~UART_LSR_THRE;
+    if (serial_tx_full(dev)) {
+        dev->regs.lsr &= ~(UART_LSR_TEMT | UART_LSR_THRE);
+        atomic_store_explicit(&dev->tx_blocked, 1, memory_order_release);
+    }
+}
 
+static void serial_out_reg(serial_t *dev, uint16_t port, uint8_t value) {
+    switch (port) {
+    case SERIAL_IO_ADDR + UART_TX:
+        if (dev->regs.lcr & UART_LCR_DLAB) {
+            dev->regs.dll = value;
+            break;
+        }
+        serial_tx(dev, &value, 1);
         break;
     case SERIAL_IO_ADDR + UART_IER:
         if (dev->regs.lcr & UART_LCR_DLAB)
-            dev->regs.dlm = *data;
+            dev->regs.dlm = value;
         else
-            dev->regs.ier = *data & 0x0f;
+            dev->regs.ier = value & 0x0f;
         break;
     case SERIAL_IO_ADDR + UART_FCR:
-        dev->regs.fcr = *data;
+        dev->regs.fcr = value;
         break;
     case SERIAL_IO_ADDR + UART_LCR:
-        dev->regs.lcr = *data;
+        dev->regs.lcr = value;
         
         // clear rx queue
         if (dev->regs.lcr & UART_FCR_CLEAR_RCVR) {
@@ -165,13 +238,20 @@ void serial_out(serial_t *dev, uint16_t port, uint8_t *data, size_t len) {
         // clear tx queue
         if (dev->regs.lcr & UART_FCR_CLEAR_XMIT) {
             dev->regs.lcr &= ~UART_FCR_CLEAR_XMIT;
-            queue_clear(&dev->tx_queue);
-            dev->regs.lsr |= UART_LSR_TEMT | UART_LSR_THRE;
+            // The consumer pops without the lock, so it discards the
+            // queue itself, see serial_tx_clear. Until then the guest is
+            // still held back by the bytes pending in the queue.
+            atomic_store_explicit(&dev->tx_clear_tail, queue_tail(&dev->tx_queue), memory_order_relaxed);
+            atomic_store_explicit(&dev->tx_clear, 1, memory_order_release);
+            if (!serial_tx_full(dev)) {
+                dev->regs.lsr |= UART_LSR_TEMT | UART_LSR_THRE;
+                atomic_store_explicit(&dev->tx_blocked, 0, memory_order_relaxed);
+            }
         }
 
         break;
     case SERIAL_IO_ADDR + UART_MCR:
-        dev->regs.mcr = *data;
+        dev->regs.mcr = value;
         break;
     case SERIAL_IO_ADDR + UART_LSR:
         // lsr is read-only.
@@ -180,74 +260,91 @@ void serial_out(serial_t *dev, uint16_t port, uint8_t *data, size_t len) {
         // msr is read-only.
         break;
     case SERIAL_IO_ADDR + UART_SCR:
-        dev->regs.scr = *data;
+        dev->regs.scr = value;
         break;
     default:
         break;
     }
-    serial_update_irq(dev);
-    pthread_mutex_unlock(&dev->mu);
 }
 
-void serial_in(serial_t *dev, uint16_t port, uint8_t *data, size_t len) {
+void serial_out(serial_t *dev, uint16_t port, uint8_t *data, size_t len) {
+    metric_inc(&dev->stats.pio_exits, 1);
     pthread_mutex_lock(&dev->mu);
-    switch (port) {
-        case SERIAL_IO_ADDR + UART_RX:
-        if (dev->regs.lcr & UART_LCR_DLAB) {
-            *data = dev->regs.dll;
-            break;
-        }
-
-        if (queue_size(&dev->rx_queue) == 0)
-            break;
+    if (port == SERIAL_IO_ADDR + UART_TX && !(dev->regs.lcr & UART_LCR_DLAB)) {
+        serial_tx(dev, data, len);
+    } else {
+        for (size_t i = 0; i < len; i++) serial_out_reg(dev, port, data[i]);
+    }
+    serial_update_irq(dev);
+    pthread_mutex_unlock(&dev->mu);
+}
 
+// serial_rx pops up to `len` received bytes for string port IO. Reads past
+// the end of the rx queue return 0.
+static void serial_rx(serial_t *dev, uint8_t *data, size_t len) {
+    size_t n = 0;
+    if (queue_size(&dev->rx_queue) > 0) {
         /* Break issued ? */
         if (dev->regs.lsr & UART_LSR_BI) {
             dev->regs.lsr &= ~UART_LSR_BI;
-            *data = 0x00;
-            break;
+            data[n++] = 0x00;
+        } else {
+            n = queue_pop_bulk(&dev->rx_queue, data, len);
         }
-        
-        queue_pop(&dev->rx_queue, data);
         if (queue_size(&dev->rx_queue) == 0) {
             dev->regs.lsr &= ~UART_LSR_DR;
-        }                      
+        }
+    }
+    memset(data + n, 0, len - n);
+}
 
-        break;
+static uint8_t serial_in_reg(serial_t *dev, uint16_t port) {
+    switch (port) {
     case SERIAL_IO_ADDR + UART_IER:
         if (dev->regs.lcr & UART_LCR_DLAB)
-            *data = dev->regs.dlm;
-        else
-            *data = dev->regs.ier;
-        break;
+            return dev->regs.dlm;
+        return dev->regs.ier;
     case SERIAL_IO_ADDR + UART_IIR:
-        *data = dev->regs.iir | UART_IIR_FIFO_ENABLED_16550A;
-        break;
+        return dev->regs.iir | UART_IIR_FIFO_ENABLED_16550A;
     case SERIAL_IO_ADDR + UART_LCR:
-        *data = dev->regs.lcr;
-        break;
+        return dev->regs.lcr;
     case SERIAL_IO_ADDR + UART_MCR:
-        *data = dev->regs.mcr;
-        break;
+        return dev->regs.mcr;
     case SERIAL_IO_ADDR + UART_LSR:
-        *data = dev->regs.lsr;
-        break;
+        return dev->regs.lsr;
     case SERIAL_IO_ADDR + UART_MSR:
-        *data = dev->regs.msr;
-        break;
+        return dev->regs.msr;
     case SERIAL_IO_ADDR + UART_SCR:
-        *data = dev->regs.scr;
-        break;
+        return dev->regs.scr;
     default:
-        break;
+        return 0;
+    }
+}
+
+void serial_in(serial_t *dev, uint16_t port, uint8_t *data, size_t len) {
+    metric_inc(&dev->stats.pio_exits, 1);
+    pthread_mutex_lock(&dev->mu);
+    if (port == SERIAL_IO_ADDR + UART_RX) {
+        if (dev->regs.lcr & UART_LCR_DLAB) {
+            memset(data, dev->regs.dll, len);
+        } else {
+            serial_rx(dev, data, len);
+        }
+    } else {
+        memset(data, serial_in_reg(dev, port), len);
     }
     serial_update_irq(dev);
     pthread_mutex_unlock(&dev->mu);
 }
 
-int serial_init(serial_t *dev, irq_line_func irq_line, irq_arg_t irq_arg) {
+int serial_init(serial_t *dev, size_t tx_buffer_len, irq_line_func irq_line, irq_arg_t irq_arg) {
+    if (tx_buffer_len < SERIAL_FIFO_LEN) tx_buffer_len = SERIAL_FIFO_LEN;
     if (queue_init(&dev->rx_queue, SERIAL_FIFO_LEN) < 0) return -1;
-    if (queue_init(&dev->tx_queue, SERIAL_FIFO_LEN) < 0) return -1;
+    if (queue_init(&dev->tx_queue, tx_buffer_len) < 0) return -1;
+    atomic_init(&dev->tx_armed, 1);
+    atomic_init(&dev->tx_blocked, 0);
+    atomic_init(&dev->tx_clear, 0);
+    atomic_init(&dev->tx_clear_tail, 0);
     dev->irq_arg = irq_arg;
     dev->irq_line = irq_line;
     dev->eventfd = -1;
@@ -270,6 +367,8 @@ int serial_open(serial_t *dev) {
     int res = eventfd(0, EFD_NONBLOCK);
     if (res >= 0) {
         dev->eventfd = res;
+        // Signal the first push.
+        atomic_store(&dev->tx_armed, 1);
     }
 
     pthread_mutex_unlock(&dev->mu);
@@ -289,3 +388,13 @@ int serial_close(serial_t *dev, int fd) {
     pthread_mutex_unlock(&dev->mu);
     return res;
 }
+
+int serial_register_metrics(serial_t *dev, metrics_t *m, const char *labels) {
+    if (metrics_register(m, "tomu_serial_tx_bytes_total", "Bytes transmitted by the guest.",
+                         labels, METRIC_COUNTER, &dev->stats.tx_bytes) < 0) return -1;
+    if (metrics_register(m, "tomu_serial_rx_bytes_total", "Bytes received by the guest.",
+                         labels, METRIC_COUNTER, &dev->stats.rx_bytes) < 0) return -1;
+    if (metrics_register(m, "tomu_serial_pio_exits_total", "Port IO exits handled by the device.",
+                         labels, METRIC_COUNTER, &dev->stats.pio_exits) < 0) return -1;
+    return 0;
+}
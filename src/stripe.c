@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+
+#include <stripe.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#define STRIPE_PREFIX "stripe:"
+#define CONCAT_PREFIX "concat:"
+
+int stripe_is_spec(const char *path) {
+    return strncmp(path, STRIPE_PREFIX, strlen(STRIPE_PREFIX)) == 0 ||
+           strncmp(path, CONCAT_PREFIX, strlen(CONCAT_PREFIX)) == 0;
+}
+
+static int stripe_parse_size(const char *s, uint64_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(s, &end, 0);
+    if (errno != 0 || end == s) return -1;
+    switch (*end) {
+    case 'K': case 'k': value <<= 10; end++; break;
+    case 'M': case 'm': value <<= 20; end++; break;
+    }
+    if (*end != '\0') return -1;
+    *size = value;
+    return 0;
+}
+
+static int stripe_open_member(stripe_member_t *member, const char *path, int flags) {
+    member->fd = open(path, flags);
+    if (member->fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(member->fd, &st) < 0) goto error;
+    member->size = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(member->fd, BLKGETSIZE64, &member->size) < 0) goto error;
+    return 0;
+
+error:
+    close(member->fd);
+    return -1;
+}
+
+int stripe_open_spec(stripe_t *stripe, const char *spec, int flags) {
+    memset(stripe, 0, sizeof(stripe_t));
+    if (strncmp(spec, STRIPE_PREFIX, strlen(STRIPE_PREFIX)) == 0) {
+        stripe->mode = STRIPE_MODE_STRIPE;
+        spec += strlen(STRIPE_PREFIX);
+    } else if (strncmp(spec, CONCAT_PREFIX, strlen(CONCAT_PREFIX)) == 0) {
+        stripe->mode = STRIPE_MODE_CONCAT;
+        spec += strlen(CONCAT_PREFIX);
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char *buf = strdup(spec);
+    if (buf == NULL) return -1;
+
+    uint64_t chunk_size = STRIPE_DEFAULT_CHUNK_SIZE;
+    char *save;
+    char *opt;
+    for (opt = strtok_r(buf, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save)) {
+        if (strncmp(opt, "chunk=", 6) == 0) {
+            if (stripe_parse_size(opt + 6, &chunk_size) < 0) goto einval;
+            continue;
+        }
+        if (stripe->member_count == STRIPE_MAX_MEMBERS) goto einval;
+        if (stripe_open_member(&stripe->members[stripe->member_count], opt, flags) < 0) goto error;
+        stripe->member_count++;
+    }
+    if (stripe->member_count == 0) goto einval;
+
+    // __builtin_ctzll is undefined for 0.
+    if (chunk_size == 0 || (chunk_size & (chunk_size - 1)) != 0) goto einval;
+    stripe->chunk_bits = __builtin_ctzll(chunk_size);
+    if (stripe->chunk_bits < STRIPE_MIN_CHUNK_BITS || stripe->chunk_bits > STRIPE_MAX_CHUNK_BITS) {
+        goto einval;
+    }
+
+    if (stripe->mode == STRIPE_MODE_STRIPE) {
+        // Every member holds the same number of chunks, bounded by the
+        // smallest one.
+        uint64_t size = UINT64_MAX;
+        for (size_t i = 0; i < stripe->member_count; i++) {
+            if (stripe->members[i].size < size) size = stripe->members[i].size;
+        }
+        size &= ~(chunk_size - 1);
+        for (size_t i = 0; i < stripe->member_count; i++) stripe->members[i].size = size;
+        stripe->size = size * stripe->member_count;
+    } else {
+        for (size_t i = 0; i < stripe->member_count; i++) {
+            stripe_member_t *member = &stripe->members[i];
+            member->size &= ~(uint64_t) (STRIPE_SECTOR_SIZE - 1);
+            member->start = stripe->size;
+            stripe->size += member->size;
+        }
+    }
+    if (stripe->size == 0) goto einval;
+
+    free(buf);
+    return 0;
+
+einval:
+    errno = EINVAL;
+error:
+    free(buf);
+    stripe_close(stripe);
+    return -1;
+}
+
+void stripe_close(stripe_t *stripe) {
+    for (size_t i = 0; i < stripe->member_count; i++) {
+        close(stripe->members[i].fd);
+    }
+    stripe->member_count = 0;
+}
+
+void stripe_map(const stripe_t *stripe, uint64_t offset, uint64_t len, stripe_extent_t *extent) {
+    if (stripe->mode == STRIPE_MODE_STRIPE) {
+        uint64_t chunk = offset >> stripe->chunk_bits;
+        uint64_t chunk_offset = offset & ((1ULL << stripe->chunk_bits) - 1);
+        const stripe_member_t *member = &stripe->members[chunk % stripe->member_count];
+        uint64_t n = (1ULL << stripe->chunk_bits) - chunk_offset;
+
+        extent->fd = member->fd;
+        extent->offset = ((chunk / stripe->member_count) << stripe->chunk_bits) + chunk_offset;
+        extent->len = len < n ? len : n;
+        return;
+    }
+
+    // Concatenations have few members, so a linear search is cheapest.
+    size_t i = 0;
+    while (i + 1 < stripe->member_count && offset >= stripe->members[i].start + stripe->members[i].size) i++;
+    const stripe_member_t *member = &stripe->members[i];
+    uint64_t n = member->start + member->size - offset;
+
+    extent->fd = member->fd;
+    extent->offset = offset - member->start;
+    extent->len = len < n ? len : n;
+}
+
+size_t stripe_max_extents(const stripe_t *stripe, uint64_t offset, uint64_t len) {
+    if (stripe->mode == STRIPE_MODE_CONCAT) return stripe->member_count;
+    return ((offset + len - 1) >> stripe->chunk_bits) - (offset >> stripe->chunk_bits) + 1;
+}
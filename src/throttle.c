@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+
+#include <throttle.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int throttle_parse_rate(const char *s, uint64_t *rate) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(s, &end, 0);
+    if (errno != 0 || end == s) return -1;
+    switch (*end) {
+    case 'K': case 'k': value <<= 10; end++; break;
+    case 'M': case 'm': value <<= 20; end++; break;
+    case 'G': case 'g': value <<= 30; end++; break;
+    }
+    if (*end != '\0') return -1;
+    *rate = value;
+    return 0;
+}
+
+int throttle_limits_parse(throttle_limits_t *limits, const char *spec) {
+    memset(limits, 0, sizeof(throttle_limits_t));
+    limits->burst_ms = THROTTLE_DEFAULT_BURST_MS;
+
+    char *buf = strdup(spec);
+    if (buf == NULL) return -1;
+
+    char *save;
+    char *opt;
+    for (opt = strtok_r(buf, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(opt, '=');
+        if (value == NULL) goto einval;
+        *value++ = '\0';
+
+        uint64_t rate;
+        if (throttle_parse_rate(value, &rate) < 0) goto einval;
+        if (strcmp(opt, "read-iops") == 0) {
+            limits->rate[THROTTLE_READ_IOPS] = rate;
+        } else if (strcmp(opt, "write-iops") == 0) {
+            limits->rate[THROTTLE_WRITE_IOPS] = rate;
+        } else if (strcmp(opt, "iops") == 0) {
+            limits->rate[THROTTLE_READ_IOPS] = limits->rate[THROTTLE_WRITE_IOPS] = rate;
+        } else if (strcmp(opt, "read-bps") == 0) {
+            limits->rate[THROTTLE_READ_BPS] = rate;
+        } else if (strcmp(opt, "write-bps") == 0) {
+            limits->rate[THROTTLE_WRITE_BPS] = rate;
+        } else if (strcmp(opt, "bps") == 0) {
+            limits->rate[THROTTLE_READ_BPS] = limits->rate[THROTTLE_WRITE_BPS] = rate;
+        } else if (strcmp(opt, "burst") == 0 && rate > 0 && rate <= 60000) {
+            limits->burst_ms = rate;
+        } else {
+            goto einval;
+        }
+    }
+
+    free(buf);
+    return 0;
+
+einval:
+    free(buf);
+    errno = EINVAL;
+    return -1;
+}
+
+uint64_t throttle_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void throttle_init(throttle_t *throttle, const throttle_limits_t *limits, double share) {
+    for (int i = 0; i < THROTTLE_BUCKETS; i++) {
+        throttle_bucket_t *bucket = &throttle->buckets[i];
+        bucket->rate = limits->rate[i] * share;
+        bucket->burst = bucket->rate * limits->burst_ms / 1000.0;
+        // A bucket must hold at least one request.
+        if (i <= THROTTLE_WRITE_IOPS && bucket->burst < 1.0) bucket->burst = 1.0;
+        bucket->tokens = bucket->burst;
+    }
+    throttle->last_ns = throttle_now();
+}
+
+static void throttle_refill(throttle_t *throttle, uint64_t now) {
+    if (now <= throttle->last_ns) return;
+    double elapsed = (now - throttle->last_ns) / 1e9;
+    throttle->last_ns = now;
+    for (int i = 0; i < THROTTLE_BUCKETS; i++) {
+        throttle_bucket_t *bucket = &throttle->buckets[i];
+        if (bucket->rate == 0) continue;
+        bucket->tokens += elapsed * bucket->rate;
+        if (bucket->tokens > bucket->burst) bucket->tokens = bucket->burst;
+    }
+}
+
+int throttle_admit(throttle_t *throttle, int write, size_t bytes) {
+    throttle_bucket_t *iops = &throttle->buckets[write ? THROTTLE_WRITE_IOPS : THROTTLE_READ_IOPS];
+    throttle_bucket_t *bps = &throttle->buckets[write ? THROTTLE_WRITE_BPS : THROTTLE_READ_BPS];
+
+    // The clock is only read once a bucket of the request runs dry.
+    if ((iops->rate != 0 && iops->tokens < 1.0) || (bps->rate != 0 && bps->tokens <= 0)) {
+        throttle_refill(throttle, throttle_now());
+        if ((iops->rate != 0 && iops->tokens < 1.0) || (bps->rate != 0 && bps->tokens <= 0)) return 0;
+    }
+
+    if (iops->rate != 0) iops->tokens -= 1.0;
+    if (bps->rate != 0) bps->tokens -= bytes;
+    return 1;
+}
+
+void throttle_refund(throttle_t *throttle, int write, size_t bytes) {
+    throttle_bucket_t *iops = &throttle->buckets[write ? THROTTLE_WRITE_IOPS : THROTTLE_READ_IOPS];
+    throttle_bucket_t *bps = &throttle->buckets[write ? THROTTLE_WRITE_BPS : THROTTLE_READ_BPS];
+    if (iops->rate != 0) iops->tokens += 1.0;
+    if (bps->rate != 0) bps->tokens += bytes;
+    // A refill may have topped the buckets up since the charge.
+    if (iops->tokens > iops->burst) iops->tokens = iops->burst;
+    if (bps->tokens > bps->burst) bps->tokens = bps->burst;
+}
+
+uint64_t throttle_delay(throttle_t *throttle, int write, uint64_t now) {
+    throttle_refill(throttle, now);
+    throttle_bucket_t *iops = &throttle->buckets[write ? THROTTLE_WRITE_IOPS : THROTTLE_READ_IOPS];
+    throttle_bucket_t *bps = &throttle->buckets[write ? THROTTLE_WRITE_BPS : THROTTLE_READ_BPS];
+
+    double delay = 0;
+    if (iops->rate != 0 && iops->tokens < 1.0) delay = (1.0 - iops->tokens) / iops->rate;
+    if (bps->rate != 0 && bps->tokens <= 0) {
+        // Wait for a full byte, so the bucket is positive once the delay has passed.
+        double d = (1.0 - bps->tokens) / bps->rate;
+        if (d > delay) delay = d;
+    }
+    return (uint64_t) (delay * 1e9) + 1;
+}
@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+
+#include <trace.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <metrics.h>
+
+#define TRACE_SUB_BUCKETS (1ULL << TRACE_HIST_SUB_BITS)
+
+// The names of the histograms, see trace_t.
+static const char *trace_hist_names[TRACE_STAGES] = {
+    [TRACE_POP] = "total",
+    [TRACE_SUBMIT] = "submit",
+    [TRACE_REAP] = "device",
+    [TRACE_PUBLISH] = "complete",
+    [TRACE_IRQ] = "irq",
+};
+
+void trace_init(trace_t *trace) {
+    memset(trace->ring, 0, sizeof(trace->ring));
+    atomic_init(&trace->head, 0);
+    for (int i = 0; i < TRACE_STAGES; i++) {
+        trace_hist_t *hist = &trace->hists[i];
+        for (size_t j = 0; j < TRACE_HIST_BUCKETS; j++) atomic_init(&hist->counts[j], 0);
+        atomic_init(&hist->count, 0);
+        atomic_init(&hist->sum, 0);
+    }
+}
+
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t trace_hist_index(uint64_t ns) {
+    if (ns < TRACE_SUB_BUCKETS) return ns;
+    unsigned exp = 63 - __builtin_clzll(ns);
+    if (exp >= TRACE_HIST_MAX_BITS) return TRACE_HIST_BUCKETS - 1;
+    return ((exp - TRACE_HIST_SUB_BITS + 1) << TRACE_HIST_SUB_BITS) |
+           ((ns >> (exp - TRACE_HIST_SUB_BITS)) & (TRACE_SUB_BUCKETS - 1));
+}
+
+/**
+ * trace_hist_upper returns the exclusive upper bound of bucket `i`.
+ */
+static uint64_t trace_hist_upper(size_t i) {
+    if (i < TRACE_SUB_BUCKETS) return i + 1;
+    unsigned exp = (i >> TRACE_HIST_SUB_BITS) + TRACE_HIST_SUB_BITS - 1;
+    uint64_t width = 1ULL << (exp - TRACE_HIST_SUB_BITS);
+    return (1ULL << exp) + ((i & (TRACE_SUB_BUCKETS - 1)) + 1) * width;
+}
+
+static void trace_hist_record(trace_hist_t *hist, uint64_t ns) {
+    metric_inc(&hist->counts[trace_hist_index(ns)], 1);
+    metric_inc(&hist->count, 1);
+    metric_inc(&hist->sum, ns);
+}
+
+void trace_record(trace_t *trace, const trace_event_t *event) {
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    trace->ring[head & (TRACE_RING_SIZE - 1)] = *event;
+    atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+
+    const uint64_t *ts = event->ts;
+    for (int i = TRACE_POP + 1; i < TRACE_STAGES; i++) {
+        if (ts[i - 1] != 0 && ts[i] >= ts[i - 1]) trace_hist_record(&trace->hists[i], ts[i] - ts[i - 1]);
+    }
+    if (ts[TRACE_IRQ] >= ts[TRACE_POP]) {
+        trace_hist_record(&trace->hists[TRACE_POP], ts[TRACE_IRQ] - ts[TRACE_POP]);
+    }
+}
+
+uint64_t trace_hist_quantile(trace_hist_t *hist, double q) {
+    uint64_t counts[TRACE_HIST_BUCKETS];
+    uint64_t total = 0;
+    for (size_t i = 0; i < TRACE_HIST_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0) return 0;
+
+    uint64_t rank = q * total;
+    if (rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < TRACE_HIST_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen > rank) return trace_hist_upper(i);
+    }
+    return trace_hist_upper(TRACE_HIST_BUCKETS - 1);
+}
+
+void trace_write_hists(trace_t *trace, FILE *f, const char *name, const char *labels, int header) {
+    const char *sep = labels != NULL && *labels ? "," : "";
+    if (labels == NULL) labels = "";
+    if (header) {
+        fprintf(f, "# HELP %s Latency of each stage of a request.\n", name);
+        fprintf(f, "# TYPE %s histogram\n", name);
+    }
+
+    for (int i = 0; i < TRACE_STAGES; i++) {
+        trace_hist_t *hist = &trace->hists[i];
+        // Buckets are exported at every power of two, which are bucket
+        // boundaries of the histogram, to keep the exposition short.
+        uint64_t cumulative = 0;
+        size_t j = 0;
+        for (unsigned exp = TRACE_HIST_SUB_BITS; exp <= TRACE_HIST_MAX_BITS; exp++) {
+            for (; j < TRACE_HIST_BUCKETS && trace_hist_upper(j) <= (1ULL << exp); j++) {
+                cumulative += atomic_load_explicit(&hist->counts[j], memory_order_relaxed);
+            }
+            fprintf(f, "%s_bucket{%s%sstage=\"%s\",le=\"%g\"} %llu\n", name, labels, sep, trace_hist_names[i],
+                    (double) (1ULL << exp) / 1e9, (unsigned long long) cumulative);
+        }
+        fprintf(f, "%s_bucket{%s%sstage=\"%s\",le=\"+Inf\"} %llu\n", name, labels, sep, trace_hist_names[i],
+                (unsigned long long) atomic_load_explicit(&hist->count, memory_order_relaxed));
+        fprintf(f, "%s_sum{%s%sstage=\"%s\"} %.9f\n", name, labels, sep, trace_hist_names[i],
+                atomic_load_explicit(&hist->sum, memory_order_relaxed) / 1e9);
+        fprintf(f, "%s_count{%s%sstage=\"%s\"} %llu\n", name, labels, sep, trace_hist_names[i],
+                (unsigned long long) atomic_load_explicit(&hist->count, memory_order_relaxed));
+    }
+}
+
+void trace_dump(trace_t *trace, FILE *f) {
+    fprintf(f, "%-8s %10s %10s %10s %10s %10s\n", "stage", "count", "p50_ns", "p90_ns", "p99_ns", "p999_ns");
+    for (int i = 0; i < TRACE_STAGES; i++) {
+        trace_hist_t *hist = &trace->hists[i];
+        fprintf(f, "%-8s %10llu %10llu %10llu %10llu %10llu\n", trace_hist_names[i],
+                (unsigned long long) atomic_load_explicit(&hist->count, memory_order_relaxed),
+                (unsigned long long) trace_hist_quantile(hist, 0.5),
+                (unsigned long long) trace_hist_quantile(hist, 0.9),
+                (unsigned long long) trace_hist_quantile(hist, 0.99),
+                (unsigned long long) trace_hist_quantile(hist, 0.999));
+    }
+
+    // Copy the ring, then drop the events the writer may have overwritten
+    // while it was copied: recording event n rewrites the slot of event
+    // n - TRACE_RING_SIZE before `head` is advanced past n.
+    trace_event_t *events = malloc(TRACE_RING_SIZE * sizeof(trace_event_t));
+    if (events == NULL) return;
+    uint64_t end = atomic_load_explicit(&trace->head, memory_order_acquire);
+    uint64_t start = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+    for (uint64_t n = start; n < end; n++) {
+        events[n - start] = trace->ring[n & (TRACE_RING_SIZE - 1)];
+    }
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    uint64_t valid = head + 1 > TRACE_RING_SIZE ? head + 1 - TRACE_RING_SIZE : 0;
+
+    fprintf(f, "\n%-6s %-4s %-8s %-6s %-16s %10s %10s %10s %10s\n", "head", "type", "len", "status", "pop_ns",
+            "submit", "device", "complete", "irq");
+    for (uint64_t n = start > valid ? start : valid; n < end; n++) {
+        trace_event_t *event = &events[n - start];
+        fprintf(f, "%-6u %-4u %-8u %-6u %-16llu", event->head, event->type, event->len, event->status,
+                (unsigned long long) event->ts[TRACE_POP]);
+        for (int i = TRACE_POP + 1; i < TRACE_STAGES; i++) {
+            if (event->ts[i - 1] != 0 && event->ts[i] >= event->ts[i - 1]) {
+                fprintf(f, " %10llu", (unsigned long long) (event->ts[i] - event->ts[i - 1]));
+            } else {
+                fprintf(f, " %10s", "-");
+            }
+        }
+        fprintf(f, "\n");
+    }
+    free(events);
+}
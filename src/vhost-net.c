@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+
+#include <vhost-net.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/vhost.h>
+
+int vhost_net_open(vhost_net_t *vhost, size_t queue_count) {
+    memset(vhost, 0, sizeof(vhost_net_t));
+    for (size_t i = 0; i < NET_BACKEND_MAX_QUEUES; i++) {
+        vhost->fds[i] = -1;
+        vhost->call_fds[i][0] = vhost->call_fds[i][1] = -1;
+    }
+    if (queue_count == 0 || queue_count > NET_BACKEND_MAX_QUEUES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t i = 0; i < queue_count; i++) {
+        vhost->queue_count++;
+        vhost->fds[i] = open("/dev/vhost-net", O_RDWR | O_CLOEXEC);
+        if (vhost->fds[i] < 0) goto error0;
+        if (ioctl(vhost->fds[i], VHOST_SET_OWNER) < 0) goto error0;
+        if (ioctl(vhost->fds[i], VHOST_GET_FEATURES, &vhost->features) < 0) goto error0;
+        for (size_t j = 0; j < 2; j++) {
+            vhost->call_fds[i][j] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (vhost->call_fds[i][j] < 0) goto error0;
+        }
+    }
+    return 0;
+
+error0:
+    vhost_net_close(vhost);
+    return -1;
+}
+
+void vhost_net_close(vhost_net_t *vhost) {
+    for (size_t i = 0; i < vhost->queue_count; i++) {
+        vhost_net_stop(vhost, i);
+        if (vhost->fds[i] >= 0) close(vhost->fds[i]);
+        for (size_t j = 0; j < 2; j++) {
+            if (vhost->call_fds[i][j] >= 0) close(vhost->call_fds[i][j]);
+        }
+    }
+    vhost->queue_count = 0;
+}
+
+static int vhost_net_set_mem_table(int fd, mem_map_t *mem) {
+    mem_slot_t slots[VHOST_NET_MAX_REGIONS];
+    size_t count = mem_map_slots(mem, slots, VHOST_NET_MAX_REGIONS);
+    if (count > VHOST_NET_MAX_REGIONS) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    struct vhost_memory *table = calloc(1, sizeof(struct vhost_memory) +
+                                           count * sizeof(struct vhost_memory_region));
+    if (table == NULL) return -1;
+    table->nregions = count;
+    for (size_t i = 0; i < count; i++) {
+        table->regions[i] = (struct vhost_memory_region) {
+            .guest_phys_addr = slots[i].gpa,
+            .memory_size = slots[i].size,
+            .userspace_addr = (uintptr_t) slots[i].hva,
+        };
+    }
+    int res = ioctl(fd, VHOST_SET_MEM_TABLE, table);
+    free(table);
+    return res;
+}
+
+static int vhost_net_set_vring(int fd, uint32_t index, virt_queue_t *queue, int call_fd, int tap_fd) {
+    struct vhost_vring_state num = { .index = index, .num = queue->vring.num };
+    if (ioctl(fd, VHOST_SET_VRING_NUM, &num) < 0) return -1;
+    struct vhost_vring_state base = { .index = index, .num = (uint16_t) queue->last_avail_idx };
+    if (ioctl(fd, VHOST_SET_VRING_BASE, &base) < 0) return -1;
+    struct vhost_vring_addr addr = {
+        .index = index,
+        .desc_user_addr = (uintptr_t) queue->vring.desc,
+        .avail_user_addr = (uintptr_t) queue->vring.avail,
+        .used_user_addr = (uintptr_t) queue->vring.used,
+    };
+    if (ioctl(fd, VHOST_SET_VRING_ADDR, &addr) < 0) return -1;
+    struct vhost_vring_file kick = { .index = index, .fd = queue->kick_fd };
+    if (ioctl(fd, VHOST_SET_VRING_KICK, &kick) < 0) return -1;
+    struct vhost_vring_file call = { .index = index, .fd = call_fd };
+    if (ioctl(fd, VHOST_SET_VRING_CALL, &call) < 0) return -1;
+    struct vhost_vring_file backend = { .index = index, .fd = tap_fd };
+    return ioctl(fd, VHOST_NET_SET_BACKEND, &backend);
+}
+
+int vhost_net_start(vhost_net_t *vhost, size_t pair, uint64_t features, mem_map_t *mem,
+                    virt_queue_t *rx, virt_queue_t *tx, int tap_fd) {
+    int fd = vhost->fds[pair];
+    if (rx->kick_fd < 0 || tx->kick_fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // The tap interface adds and strips the virtio-net header itself.
+    features &= vhost->features;
+    if (ioctl(fd, VHOST_SET_FEATURES, &features) < 0) goto error0;
+    if (vhost_net_set_mem_table(fd, mem) < 0) goto error0;
+    if (vhost_net_set_vring(fd, 0, rx, vhost->call_fds[pair][0], tap_fd) < 0) goto error0;
+    if (vhost_net_set_vring(fd, 1, tx, vhost->call_fds[pair][1], tap_fd) < 0) goto error0;
+    vhost->running[pair] = 1;
+    return 0;
+
+error0:
+    vhost->running[pair] = 1;
+    vhost_net_stop(vhost, pair);
+    return -1;
+}
+
+void vhost_net_stop(vhost_net_t *vhost, size_t pair) {
+    if (!vhost->running[pair]) return;
+    for (uint32_t index = 0; index < 2; index++) {
+        struct vhost_vring_file backend = { .index = index, .fd = -1 };
+        ioctl(vhost->fds[pair], VHOST_NET_SET_BACKEND, &backend);
+        struct vhost_vring_state base = { .index = index };
+        ioctl(vhost->fds[pair], VHOST_GET_VRING_BASE, &base);
+    }
+    vhost->running[pair] = 0;
+}
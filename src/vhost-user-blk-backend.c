@@ -0,0 +1,550 @@
+#define _GNU_SOURCE
+
+#include <vhost-user-blk-backend.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <linux/virtio_mmio.h>
+#include <linux/virtio_ring.h>
+
+#define VHOST_USER_BLK_BACKEND_PROTOCOL_FEATURES ((1ULL << VHOST_USER_PROTOCOL_F_MQ) | \
+                                                  (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) | \
+                                                  (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))
+
+// How long a message may keep the loop waiting for the rest of it, or for
+// the front-end to take a reply.
+#define VHOST_USER_BLK_BACKEND_TIMEOUT_MS 1000
+
+// The virtio-mmio interrupt does not tell the queue it signals, so it is
+// relayed on the call eventfd of the only queue.
+_Static_assert(VIRTIO_BLK_QUEUE_COUNT == 1, "virtio-blk interrupts are relayed to the call eventfd of queue 0");
+
+static uint64_t vhost_user_blk_backend_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void vhost_user_blk_backend_irq(uint16_t irq, int level, irq_arg_t arg) {
+    vhost_user_blk_backend_t *b = arg;
+    if (!level || b->call_fds[0] < 0) return;
+    // The eventfd only fails to count once it overflows, which still wakes
+    // the front-end.
+    if (write(b->call_fds[0], &(uint64_t){1}, sizeof(uint64_t)) < 0) return;
+}
+
+// vhost_user_blk_backend_write writes `value` to the virtio-mmio register at
+// `offset` of the device, as the driver would.
+static void vhost_user_blk_backend_write(vhost_user_blk_backend_t *b, uint32_t offset, uint32_t value) {
+    virtio_mmio_write(&b->blk.mmio, offset, &value, sizeof(value));
+}
+
+static void vhost_user_blk_backend_notify(vhost_user_blk_backend_t *b, uint32_t index) {
+    vhost_user_blk_backend_write(b, VIRTIO_MMIO_QUEUE_NOTIFY, index);
+}
+
+static void vhost_user_blk_backend_kick(void *arg, uint32_t events) {
+    virt_queue_t *queue = arg;
+    vhost_user_blk_backend_t *b = (vhost_user_blk_backend_t*) ((uint8_t*) queue->cfg -
+                                                               offsetof(vhost_user_blk_backend_t, blk.mmio));
+
+    uint64_t count;
+    if (read(b->kick_fds[queue->index], &count, sizeof(count)) < 0) return;
+    vhost_user_blk_backend_notify(b, queue->index);
+}
+
+/**
+ * vhost_user_blk_backend_gpa translates the front-end address `uaddr` to a
+ * guest physical address.
+ */
+static int vhost_user_blk_backend_gpa(vhost_user_blk_backend_t *b, uint64_t uaddr, uint64_t *gpa) {
+    for (size_t i = 0; i < b->region_count; i++) {
+        vhost_user_blk_region_t *region = &b->regions[i];
+        if (uaddr - region->uaddr < region->size) {
+            *gpa = region->gpa + (uaddr - region->uaddr);
+            return 0;
+        }
+    }
+    errno = EFAULT;
+    return -1;
+}
+
+static void vhost_user_blk_backend_unmap(vhost_user_blk_backend_t *b) {
+    for (size_t i = 0; i < b->region_count; i++) {
+        mem_map_remove(&b->mem, b->regions[i].gpa);
+        munmap(b->regions[i].addr, b->regions[i].len);
+    }
+    b->region_count = 0;
+}
+
+/**
+ * vhost_user_blk_backend_drain waits for the requests in flight on ring
+ * `index`, which still write to guest memory, and publishes their
+ * completions, so that the ring can be handed back.
+ */
+static void vhost_user_blk_backend_drain(vhost_user_blk_backend_t *b, uint32_t index) {
+    virt_queue_t *queue = &b->blk.mmio.queues[index];
+    bdev_queue_t *bdev_queue = b->blk.queues[index].bdev_queue;
+    uint64_t deadline = vhost_user_blk_backend_now_ms() + VHOST_USER_BLK_DRAIN_MS;
+    // Every request popped is filled into the used ring once it completes.
+    while ((uint16_t) (queue->last_avail_idx - queue->used_idx) != 0) {
+        if (vhost_user_blk_backend_now_ms() >= deadline) {
+            fprintf(stderr, "%s: requests still in flight after %d ms\n", b->path, VHOST_USER_BLK_DRAIN_MS);
+            break;
+        }
+        if (bdev_queue_poll(bdev_queue) < 0) break;
+    }
+    // The completions were reaped here rather than on the loop.
+    uint64_t count;
+    if (read(bdev_queue_eventfd(bdev_queue), &count, sizeof(count)) < 0) {
+        // Nothing completed since the last reap.
+    }
+
+    pthread_mutex_lock(&b->blk.mu);
+    virt_queue_flush(&b->blk.mmio, queue);
+    pthread_mutex_unlock(&b->blk.mu);
+}
+
+static int vhost_user_blk_backend_start(vhost_user_blk_backend_t *b, uint32_t index) {
+    virt_queue_t *queue = &b->blk.mmio.queues[index];
+    int enabled = b->enabled[index] || !(b->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES));
+    if (queue->ready || b->kick_fds[index] < 0 || !enabled) return 0;
+
+    vhost_user_blk_backend_write(b, VIRTIO_MMIO_QUEUE_SEL, index);
+    vhost_user_blk_backend_write(b, VIRTIO_MMIO_QUEUE_READY, 1);
+    if (!queue->ready) {
+        errno = EFAULT;
+        return -1;
+    }
+    queue->last_avail_idx = b->bases[index];
+    queue->used_idx = queue->vring.used->idx;
+    if (b->flags & VHOST_USER_BLK_POLL) {
+        queue->vring.used->flags |= VRING_USED_F_NO_NOTIFY;
+    }
+
+    // Requests made available before the ring was handed over.
+    vhost_user_blk_backend_notify(b, index);
+    return 0;
+}
+
+static void vhost_user_blk_backend_disable(vhost_user_blk_backend_t *b, uint32_t index) {
+    virt_queue_t *queue = &b->blk.mmio.queues[index];
+    if (!queue->ready) return;
+    vhost_user_blk_backend_drain(b, index);
+    b->bases[index] = queue->last_avail_idx;
+    vhost_user_blk_backend_write(b, VIRTIO_MMIO_QUEUE_SEL, index);
+    vhost_user_blk_backend_write(b, VIRTIO_MMIO_QUEUE_READY, 0);
+}
+
+static void vhost_user_blk_backend_set_kick(vhost_user_blk_backend_t *b, uint32_t index, int fd) {
+    if (b->kicks[index] != NULL) event_loop_remove(b->loop, b->kicks[index]);
+    b->kicks[index] = NULL;
+    if (b->kick_fds[index] >= 0) close(b->kick_fds[index]);
+    b->kick_fds[index] = fd;
+}
+
+/**
+ * vhost_user_blk_backend_stop stops every ring once its requests in flight
+ * complete, and resets the device for the next front-end.
+ */
+static void vhost_user_blk_backend_stop(vhost_user_blk_backend_t *b) {
+    for (uint32_t i = 0; i < VIRTIO_BLK_QUEUE_COUNT; i++) {
+        vhost_user_blk_backend_disable(b, i);
+        vhost_user_blk_backend_set_kick(b, i, -1);
+        b->enabled[i] = 0;
+    }
+    virtio_mmio_reset(&b->blk.mmio);
+}
+
+static void vhost_user_blk_backend_disconnect(vhost_user_blk_backend_t *b) {
+    if (b->sock < 0) return;
+    vhost_user_blk_backend_stop(b);
+    for (uint32_t i = 0; i < VIRTIO_BLK_QUEUE_COUNT; i++) {
+        if (b->call_fds[i] >= 0) close(b->call_fds[i]);
+        b->call_fds[i] = -1;
+        b->bases[i] = 0;
+    }
+    vhost_user_blk_backend_unmap(b);
+    event_loop_remove(b->loop, b->conn);
+    b->conn = NULL;
+    close(b->sock);
+    b->sock = -1;
+    b->features = 0;
+    b->protocol_features = 0;
+}
+
+static int vhost_user_blk_backend_set_mem_table(vhost_user_blk_backend_t *b, vhost_user_msg_t *msg,
+                                                int *fds, size_t fd_count) {
+    vhost_user_memory_t *memory = &msg->payload.memory;
+    if (msg->size < offsetof(vhost_user_memory_t, regions) || memory->nregions > VHOST_USER_MAX_REGIONS ||
+        memory->nregions != fd_count ||
+        msg->size < offsetof(vhost_user_memory_t, regions) + memory->nregions * sizeof(vhost_user_region_t)) {
+        errno = EINVAL;
+        return -1;
+    }
+    // The rings point into the current regions.
+    for (uint32_t i = 0; i < VIRTIO_BLK_QUEUE_COUNT; i++) {
+        if (b->blk.mmio.queues[i].ready) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+
+    vhost_user_blk_backend_unmap(b);
+    for (size_t i = 0; i < memory->nregions; i++) {
+        vhost_user_region_t *region = &memory->regions[i];
+        size_t len = region->mmap_offset + region->size;
+        if (region->size == 0 || len < region->size) {
+            errno = EINVAL;
+            goto error0;
+        }
+        void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], 0);
+        if (addr == MAP_FAILED) goto error0;
+        b->regions[b->region_count++] = (vhost_user_blk_region_t) {
+            .gpa = region->gpa,
+            .size = region->size,
+            .uaddr = region->uaddr,
+            .addr = addr,
+            .len = len,
+        };
+        if (mem_map_add(&b->mem, region->gpa, region->size, (uint8_t*) addr + region->mmap_offset) < 0) {
+            goto error0;
+        }
+    }
+    return 0;
+
+error0:
+    vhost_user_blk_backend_unmap(b);
+    return -1;
+}
+
+static int vhost_user_blk_backend_set_vring_addr(vhost_user_blk_backend_t *b, struct vhost_vring_addr *addr) {
+    uint64_t desc, avail, used;
+    if (vhost_user_blk_backend_gpa(b, addr->desc_user_addr, &desc) < 0 ||
+        vhost_user_blk_backend_gpa(b, addr->avail_user_addr, &avail) < 0 ||
+        vhost_user_blk_backend_gpa(b, addr->used_user_addr, &used) < 0) return -1;
+    vhost_user_blk_backend_write(b, VIRTIO_MMIO_QUEUE_SEL, addr->index);
+    vhost_user_blk_backend_write(b, VIRTIO_MMIO_QUEUE_DESC_LOW, (uint32_t) desc);
+    vhost_user_blk_backend_write(b, VIRTIO_MMIO_QUEUE_DESC_HIGH, (uint32_t) (desc >> 32));
+    vhost_user_blk_backend_write(b, VIRTIO_MMIO_QUEUE_AVAIL_LOW, (uint32_t) avail);
+    vhost_user_blk_backend_write(b, VIRTIO_MMIO_QUEUE_AVAIL_HIGH, (uint32_t) (avail >> 32));
+    vhost_user_blk_backend_write(b, VIRTIO_MMIO_QUEUE_USED_LOW, (uint32_t) used);
+    vhost_user_blk_backend_write(b, VIRTIO_MMIO_QUEUE_USED_HIGH, (uint32_t) (used >> 32));
+    return 0;
+}
+
+/**
+ * vhost_user_blk_backend_set_fd handles SET_VRING_KICK and SET_VRING_CALL,
+ * taking the fd passed with `msg` unless it carries none.
+ */
+static int vhost_user_blk_backend_set_fd(vhost_user_blk_backend_t *b, vhost_user_msg_t *msg,
+                                         int *fds, size_t fd_count) {
+    uint32_t index = msg->payload.u64 & VHOST_USER_VRING_INDEX_MASK;
+    int nofd = (msg->payload.u64 & VHOST_USER_VRING_NOFD) != 0;
+    if (index >= VIRTIO_BLK_QUEUE_COUNT || (!nofd && fd_count != 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = nofd ? -1 : fds[0];
+    fds[0] = -1;
+
+    if (msg->request == VHOST_USER_SET_VRING_CALL) {
+        if (b->call_fds[index] >= 0) close(b->call_fds[index]);
+        b->call_fds[index] = fd;
+        return 0;
+    }
+
+    // Without a kick fd the front-end expects the ring to be polled.
+    vhost_user_blk_backend_set_kick(b, index, fd);
+    if (fd >= 0) {
+        b->kicks[index] = event_loop_add_fd(b->loop, fd, EPOLLIN, vhost_user_blk_backend_kick,
+                                            &b->blk.mmio.queues[index]);
+        if (b->kicks[index] == NULL) return -1;
+    }
+    return vhost_user_blk_backend_start(b, index);
+}
+
+static int vhost_user_blk_backend_handle(vhost_user_blk_backend_t *b, vhost_user_msg_t *msg,
+                                         int *fds, size_t fd_count) {
+    size_t min_size = 0;
+    // Whether the payload starts with a ring index.
+    int ring = 0;
+    switch (msg->request) {
+    case VHOST_USER_SET_FEATURES:
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+        min_size = sizeof(uint64_t);
+        break;
+    case VHOST_USER_SET_VRING_NUM:
+    case VHOST_USER_SET_VRING_BASE:
+    case VHOST_USER_GET_VRING_BASE:
+    case VHOST_USER_SET_VRING_ENABLE:
+        min_size = sizeof(struct vhost_vring_state);
+        ring = 1;
+        break;
+    case VHOST_USER_SET_VRING_ADDR:
+        min_size = sizeof(struct vhost_vring_addr);
+        ring = 1;
+        break;
+    case VHOST_USER_GET_CONFIG:
+        min_size = VHOST_USER_CONFIG_HDR_SIZE;
+        break;
+    }
+    if (msg->size < min_size || (ring && msg->payload.state.index >= VIRTIO_BLK_QUEUE_COUNT)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint32_t index = msg->payload.state.index;
+    switch (msg->request) {
+    case VHOST_USER_SET_OWNER:
+        return 0;
+    case VHOST_USER_GET_FEATURES:
+        msg->size = sizeof(uint64_t);
+        msg->payload.u64 = ((uint64_t) b->blk.mmio.device_features[1] << 32) | b->blk.mmio.device_features[0] |
+                           (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+        return 0;
+    case VHOST_USER_SET_FEATURES:
+        b->features = msg->payload.u64;
+        vhost_user_blk_backend_write(b, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 0);
+        vhost_user_blk_backend_write(b, VIRTIO_MMIO_DRIVER_FEATURES, (uint32_t) b->features);
+        vhost_user_blk_backend_write(b, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 1);
+        vhost_user_blk_backend_write(b, VIRTIO_MMIO_DRIVER_FEATURES, (uint32_t) (b->features >> 32));
+        return 0;
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        msg->size = sizeof(uint64_t);
+        msg->payload.u64 = VHOST_USER_BLK_BACKEND_PROTOCOL_FEATURES;
+        return 0;
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+        b->protocol_features = msg->payload.u64 & VHOST_USER_BLK_BACKEND_PROTOCOL_FEATURES;
+        return 0;
+    case VHOST_USER_GET_QUEUE_NUM:
+        msg->size = sizeof(uint64_t);
+        msg->payload.u64 = VIRTIO_BLK_QUEUE_COUNT;
+        return 0;
+    case VHOST_USER_SET_MEM_TABLE:
+        return vhost_user_blk_backend_set_mem_table(b, msg, fds, fd_count);
+    case VHOST_USER_SET_VRING_NUM:
+        if (b->blk.mmio.queues[index].ready) {
+            errno = EBUSY;
+            return -1;
+        }
+        vhost_user_blk_backend_write(b, VIRTIO_MMIO_QUEUE_SEL, index);
+        vhost_user_blk_backend_write(b, VIRTIO_MMIO_QUEUE_NUM, msg->payload.state.num);
+        return 0;
+    case VHOST_USER_SET_VRING_ADDR:
+        if (b->blk.mmio.queues[index].ready) {
+            errno = EBUSY;
+            return -1;
+        }
+        return vhost_user_blk_backend_set_vring_addr(b, &msg->payload.addr);
+    case VHOST_USER_SET_VRING_BASE:
+        b->bases[index] = msg->payload.state.num;
+        return 0;
+    case VHOST_USER_GET_VRING_BASE:
+        vhost_user_blk_backend_stop(b);
+        msg->size = sizeof(struct vhost_vring_state);
+        msg->payload.state.num = b->bases[index];
+        return 0;
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+        return vhost_user_blk_backend_set_fd(b, msg, fds, fd_count);
+    case VHOST_USER_SET_VRING_ENABLE:
+        b->enabled[index] = msg->payload.state.num != 0;
+        if (!b->enabled[index]) {
+            vhost_user_blk_backend_disable(b, index);
+            return 0;
+        }
+        return vhost_user_blk_backend_start(b, index);
+    case VHOST_USER_GET_CONFIG:
+        {
+            vhost_user_config_t *config = &msg->payload.config;
+            if (config->size > VHOST_USER_CONFIG_SIZE || config->offset > sizeof(struct virtio_blk_config) ||
+                config->size > sizeof(struct virtio_blk_config) - config->offset) {
+                errno = EINVAL;
+                return -1;
+            }
+            memcpy(config->region, (uint8_t*) &b->blk.config + config->offset, config->size);
+            msg->size = VHOST_USER_CONFIG_HDR_SIZE + config->size;
+            return 0;
+        }
+    default:
+        errno = ENOSYS;
+        return -1;
+    }
+}
+
+static void vhost_user_blk_backend_message(void *arg, uint32_t events) {
+    vhost_user_blk_backend_t *b = arg;
+    vhost_user_msg_t msg;
+    int fds[VHOST_USER_MAX_FDS];
+    size_t fd_count;
+    if (vhost_user_recv(b->sock, &msg, fds, &fd_count) < 0) {
+        if (errno != ECONNRESET) fprintf(stderr, "%s: %s\n", b->path, strerror(errno));
+        vhost_user_blk_backend_disconnect(b);
+        return;
+    }
+    metric_inc(&b->stats.messages, 1);
+
+    uint32_t request = msg.request;
+    int res = vhost_user_blk_backend_handle(b, &msg, fds, fd_count);
+    for (size_t i = 0; i < fd_count; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    if (res < 0) {
+        fprintf(stderr, "%s: request %u failed: %s\n", b->path, request, strerror(errno));
+        // The front-end waits for an answer that cannot be given.
+        if (vhost_user_has_reply(request)) {
+            vhost_user_blk_backend_disconnect(b);
+            return;
+        }
+    }
+
+    if (!vhost_user_has_reply(request)) {
+        if (!(msg.flags & VHOST_USER_NEED_REPLY) ||
+            !(b->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK))) return;
+        msg.size = sizeof(uint64_t);
+        msg.payload.u64 = res < 0;
+    }
+    msg.flags = VHOST_USER_VERSION | VHOST_USER_REPLY;
+    if (vhost_user_send(b->sock, &msg, NULL, 0) < 0) {
+        fprintf(stderr, "%s: %s\n", b->path, strerror(errno));
+        vhost_user_blk_backend_disconnect(b);
+    }
+}
+
+static void vhost_user_blk_backend_accept(void *arg, uint32_t events) {
+    vhost_user_blk_backend_t *b = arg;
+    int sock = accept4(b->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0) return;
+    if (b->sock >= 0) {
+        fprintf(stderr, "%s: refusing a second front-end\n", b->path);
+        close(sock);
+        return;
+    }
+
+    // The loop serves other front-ends, so a stalled one is disconnected.
+    struct timeval timeout = {
+        .tv_sec = VHOST_USER_BLK_BACKEND_TIMEOUT_MS / 1000,
+        .tv_usec = (VHOST_USER_BLK_BACKEND_TIMEOUT_MS % 1000) * 1000,
+    };
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+        close(sock);
+        return;
+    }
+    b->conn = event_loop_add_fd(b->loop, sock, EPOLLIN, vhost_user_blk_backend_message, b);
+    if (b->conn == NULL) {
+        close(sock);
+        return;
+    }
+    b->sock = sock;
+    metric_inc(&b->stats.connections, 1);
+}
+
+static int vhost_user_blk_backend_listen(vhost_user_blk_backend_t *b) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(b->path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, b->path);
+    b->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (b->listen_fd < 0) return -1;
+    unlink(b->path);
+    if (bind(b->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) return -1;
+    if (listen(b->listen_fd, 16) < 0) return -1;
+    b->listen = event_loop_add_fd(b->loop, b->listen_fd, EPOLLIN, vhost_user_blk_backend_accept, b);
+    return b->listen == NULL ? -1 : 0;
+}
+
+int vhost_user_blk_backend_init(vhost_user_blk_backend_t *b, const char *path, bdev_t *bdev,
+                                event_loop_t *loop, int flags) {
+    memset(b, 0, sizeof(vhost_user_blk_backend_t));
+    b->bdev = bdev;
+    b->loop = loop;
+    b->flags = flags;
+    b->listen_fd = -1;
+    b->sock = -1;
+    for (size_t i = 0; i < VIRTIO_BLK_QUEUE_COUNT; i++) {
+        b->kick_fds[i] = -1;
+        b->call_fds[i] = -1;
+    }
+
+    if (mem_map_init(&b->mem) < 0) return -1;
+    // The device is not on any bus: the back-end writes its registers.
+    if (virtio_blk_init(&b->blk, 0, 0, &b->mem, vhost_user_blk_backend_irq, b, bdev) < 0) {
+        mem_map_deinit(&b->mem);
+        return -1;
+    }
+    for (size_t i = 0; i < VIRTIO_BLK_QUEUE_COUNT; i++) {
+        // Completions reaped on the loop are flushed once per wakeup.
+        b->blk.mmio.queues[i].loop = loop;
+    }
+
+    b->path = strdup(path);
+    if (b->path == NULL) goto error0;
+    for (size_t i = 0; i < VIRTIO_BLK_QUEUE_COUNT; i++) {
+        if (bdev_queue_attach(b->blk.queues[i].bdev_queue, loop) < 0) goto error0;
+    }
+    if (vhost_user_blk_backend_listen(b) < 0) goto error0;
+    return 0;
+
+error0:
+    vhost_user_blk_backend_deinit(b);
+    return -1;
+}
+
+void vhost_user_blk_backend_deinit(vhost_user_blk_backend_t *b) {
+    vhost_user_blk_backend_disconnect(b);
+    if (b->listen != NULL) event_loop_remove(b->loop, b->listen);
+    b->listen = NULL;
+    if (b->listen_fd >= 0) {
+        close(b->listen_fd);
+        unlink(b->path);
+    }
+    b->listen_fd = -1;
+    for (size_t i = 0; i < VIRTIO_BLK_QUEUE_COUNT; i++) {
+        bdev_queue_detach(b->blk.queues[i].bdev_queue);
+    }
+    virtio_blk_deinit(&b->blk);
+    mem_map_deinit(&b->mem);
+    free(b->path);
+    b->path = NULL;
+}
+
+size_t vhost_user_blk_backend_poll(vhost_user_blk_backend_t *b) {
+    size_t count = 0;
+    for (uint32_t i = 0; i < VIRTIO_BLK_QUEUE_COUNT; i++) {
+        virt_queue_t *queue = &b->blk.mmio.queues[i];
+        if (!queue->ready) continue;
+        if (*(volatile uint16_t*) &queue->vring.avail->idx == (uint16_t) queue->last_avail_idx) continue;
+        metric_inc(&b->stats.polls, 1);
+        vhost_user_blk_backend_notify(b, i);
+        count++;
+    }
+    return count;
+}
+
+int vhost_user_blk_backend_register_metrics(vhost_user_blk_backend_t *b, metrics_t *m, const char *labels) {
+    if (virtio_blk_register_metrics(&b->blk, m, labels) < 0) return -1;
+    if (metrics_register(m, "tomu_vhost_user_blk_connections_total", "Front-ends connected to the back-end.",
+                         labels, METRIC_COUNTER, &b->stats.connections) < 0) return -1;
+    if (metrics_register(m, "tomu_vhost_user_blk_messages_total", "vhost-user messages received.",
+                         labels, METRIC_COUNTER, &b->stats.messages) < 0) return -1;
+    if (metrics_register(m, "tomu_vhost_user_blk_polls_total",
+                         "Polls of the rings that found requests without a kick.",
+                         labels, METRIC_COUNTER, &b->stats.polls) < 0) return -1;
+    return 0;
+}
@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+
+#include <vhost-user-blk.h>
+#include <vhost-user.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <linux/virtio_config.h>
+
+// The protocol features the device uses when the back-end offers them.
+#define VHOST_USER_BLK_PROTOCOL_FEATURES ((1ULL << VHOST_USER_PROTOCOL_F_MQ) | \
+                                          (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) | \
+                                          (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))
+
+/**
+ * vhost_user_blk_call sends `msg` to the back-end and, if the request is
+ * answered, waits for the reply into `msg`. Other requests are acknowledged
+ * once the back-end supports REPLY_ACK, so that an error surfaces on the
+ * request that caused it.
+ *
+ * \return On success, 0 is returned. On error, -1 is returned and errno is
+ *         set to indicate the error.
+ *
+ * \exception EIO - The back-end failed the request.
+ */
+static int vhost_user_blk_call(vhost_user_blk_t *blk, vhost_user_msg_t *msg, const int *fds, size_t fd_count) {
+    uint32_t request = msg->request;
+    int reply = vhost_user_has_reply(request);
+    int ack = !reply && (blk->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK));
+    msg->flags = VHOST_USER_VERSION | (ack ? VHOST_USER_NEED_REPLY : 0);
+    if (vhost_user_send(blk->sock, msg, fds, fd_count) < 0) return -1;
+    if (!reply && !ack) return 0;
+
+    int reply_fds[VHOST_USER_MAX_FDS];
+    size_t reply_fd_count;
+    if (vhost_user_recv(blk->sock, msg, reply_fds, &reply_fd_count) < 0) return -1;
+    for (size_t i = 0; i < reply_fd_count; i++) {
+        close(reply_fds[i]);
+    }
+    if (msg->request != request || !(msg->flags & VHOST_USER_REPLY)) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (ack) {
+        if (msg->size != sizeof(uint64_t)) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (msg->payload.u64 != 0) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int vhost_user_blk_set_u64(vhost_user_blk_t *blk, uint32_t request, uint64_t value) {
+    vhost_user_msg_t msg = { .request = request, .size = sizeof(uint64_t), .payload.u64 = value };
+    return vhost_user_blk_call(blk, &msg, NULL, 0);
+}
+
+static int vhost_user_blk_get_u64(vhost_user_blk_t *blk, uint32_t request, uint64_t *value) {
+    vhost_user_msg_t msg = { .request = request };
+    if (vhost_user_blk_call(blk, &msg, NULL, 0) < 0) return -1;
+    if (msg.size != sizeof(uint64_t)) {
+        errno = EPROTO;
+        return -1;
+    }
+    *value = msg.payload.u64;
+    return 0;
+}
+
+static int vhost_user_blk_set_state(vhost_user_blk_t *blk, uint32_t request, uint32_t index, uint32_t num) {
+    vhost_user_msg_t msg = {
+        .request = request,
+        .size = sizeof(struct vhost_vring_state),
+        .payload.state = { .index = index, .num = num },
+    };
+    return vhost_user_blk_call(blk, &msg, NULL, 0);
+}
+
+static int vhost_user_blk_set_fd(vhost_user_blk_t *blk, uint32_t request, uint32_t index, int fd) {
+    vhost_user_msg_t msg = { .request = request, .size = sizeof(uint64_t), .payload.u64 = index };
+    return vhost_user_blk_call(blk, &msg, &fd, 1);
+}
+
+static int vhost_user_blk_get_config(vhost_user_blk_t *blk) {
+    vhost_user_msg_t msg = {
+        .request = VHOST_USER_GET_CONFIG,
+        .size = VHOST_USER_CONFIG_HDR_SIZE + sizeof(struct virtio_blk_config),
+        .payload.config = { .offset = 0, .size = sizeof(struct virtio_blk_config) },
+    };
+    if (vhost_user_blk_call(blk, &msg, NULL, 0) < 0) return -1;
+    if (msg.size != VHOST_USER_CONFIG_HDR_SIZE + sizeof(struct virtio_blk_config) ||
+        msg.payload.config.size != sizeof(struct virtio_blk_config)) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(&blk->config, msg.payload.config.region, sizeof(struct virtio_blk_config));
+    return 0;
+}
+
+/**
+ * vhost_user_blk_set_mem_table describes every slot of guest memory to the
+ * back-end with the fd it maps the slot from.
+ */
+static int vhost_user_blk_set_mem_table(vhost_user_blk_t *blk) {
+    mem_slot_t slots[VHOST_USER_MAX_REGIONS];
+    size_t count = mem_map_slots(blk->mmio.mem, slots, VHOST_USER_MAX_REGIONS);
+    if (count > VHOST_USER_MAX_REGIONS) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    vhost_user_msg_t msg = {
+        .request = VHOST_USER_SET_MEM_TABLE,
+        .size = offsetof(vhost_user_memory_t, regions) + count * sizeof(vhost_user_region_t),
+        .payload.memory.nregions = count,
+    };
+    int fds[VHOST_USER_MAX_REGIONS];
+    for (size_t i = 0; i < count; i++) {
+        if (slots[i].fd < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        msg.payload.memory.regions[i] = (vhost_user_region_t) {
+            .gpa = slots[i].gpa,
+            .size = slots[i].size,
+            .uaddr = (uintptr_t) slots[i].hva,
+            .mmap_offset = slots[i].fd_offset,
+        };
+        fds[i] = slots[i].fd;
+    }
+    return vhost_user_blk_call(blk, &msg, fds, count);
+}
+
+static int vhost_user_blk_set_vring(vhost_user_blk_t *blk, uint32_t index, virt_queue_t *queue) {
+    if (vhost_user_blk_set_state(blk, VHOST_USER_SET_VRING_NUM, index, queue->vring.num) < 0) return -1;
+    if (vhost_user_blk_set_state(blk, VHOST_USER_SET_VRING_BASE, index, (uint16_t) queue->last_avail_idx) < 0) {
+        return -1;
+    }
+    vhost_user_msg_t msg = {
+        .request = VHOST_USER_SET_VRING_ADDR,
+        .size = sizeof(struct vhost_vring_addr),
+        .payload.addr = {
+            .index = index,
+            .desc_user_addr = (uintptr_t) queue->vring.desc,
+            .used_user_addr = (uintptr_t) queue->vring.used,
+            .avail_user_addr = (uintptr_t) queue->vring.avail,
+        },
+    };
+    if (vhost_user_blk_call(blk, &msg, NULL, 0) < 0) return -1;
+    if (vhost_user_blk_set_fd(blk, VHOST_USER_SET_VRING_CALL, index, blk->call_fds[index]) < 0) return -1;
+    if (vhost_user_blk_set_fd(blk, VHOST_USER_SET_VRING_KICK, index, queue->kick_fd) < 0) return -1;
+    // Rings start disabled once protocol features are negotiated.
+    if ((blk->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) &&
+        vhost_user_blk_set_state(blk, VHOST_USER_SET_VRING_ENABLE, index, 1) < 0) return -1;
+    return 0;
+}
+
+/**
+ * vhost_user_blk_stop takes the rings back from the back-end, which
+ * completes the requests in flight first.
+ */
+static void vhost_user_blk_stop(vhost_user_blk_t *blk) {
+    if (!blk->running) return;
+    for (uint32_t i = 0; i < blk->mmio.queue_count; i++) {
+        if (!blk->mmio.queues[i].ready) continue;
+        vhost_user_msg_t msg = {
+            .request = VHOST_USER_GET_VRING_BASE,
+            .size = sizeof(struct vhost_vring_state),
+            .payload.state = { .index = i },
+        };
+        if (vhost_user_blk_call(blk, &msg, NULL, 0) < 0) {
+            perror("vhost-user-blk");
+            break;
+        }
+    }
+    blk->running = 0;
+}
+
+static int vhost_user_blk_start(vhost_user_blk_t *blk) {
+    uint64_t features = ((uint64_t) blk->mmio.driver_features[1] << 32) | blk->mmio.driver_features[0];
+    features |= blk->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+    blk->running = 1;
+    if (vhost_user_blk_set_u64(blk, VHOST_USER_SET_FEATURES, features) < 0) goto error0;
+    if (vhost_user_blk_set_mem_table(blk) < 0) goto error0;
+    for (uint32_t i = 0; i < blk->mmio.queue_count; i++) {
+        virt_queue_t *queue = &blk->mmio.queues[i];
+        if (!queue->ready) continue;
+        if (queue->kick_fd < 0) {
+            errno = EINVAL;
+            goto error0;
+        }
+        if (vhost_user_blk_set_vring(blk, i, queue) < 0) goto error0;
+    }
+    return 0;
+
+error0:
+    vhost_user_blk_stop(blk);
+    return -1;
+}
+
+static void vhost_user_blk_config_read(void *dev, uint32_t offset, void *data, size_t size) {
+    vhost_user_blk_t *blk = (vhost_user_blk_t*) dev;
+    if (offset + size > sizeof(struct virtio_blk_config)) return;
+    memcpy(data, (uint8_t*) &blk->config + offset, size);
+}
+
+// The driver's kicks go straight to the back-end through the ioeventfds.
+static void vhost_user_blk_notify(void *dev, uint32_t queue) {
+}
+
+static void vhost_user_blk_status(void *dev, uint32_t status) {
+    vhost_user_blk_t *blk = (vhost_user_blk_t*) dev;
+    if (!(status & VIRTIO_CONFIG_S_DRIVER_OK) || blk->running) return;
+    if (vhost_user_blk_start(blk) < 0) {
+        perror("vhost-user-blk");
+        blk->mmio.status |= VIRTIO_CONFIG_S_NEEDS_RESET;
+    }
+}
+
+static void vhost_user_blk_reset(void *dev) {
+    vhost_user_blk_stop((vhost_user_blk_t*) dev);
+}
+
+static const virtio_device_ops_t vhost_user_blk_ops = {
+    .config_read = vhost_user_blk_config_read,
+    .notify = vhost_user_blk_notify,
+    .status = vhost_user_blk_status,
+    .reset = vhost_user_blk_reset,
+};
+
+/**
+ * vhost_user_blk_connect connects to the back-end and negotiates the
+ * protocol features.
+ */
+static int vhost_user_blk_connect(vhost_user_blk_t *blk) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(blk->path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, blk->path);
+    blk->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (blk->sock < 0) return -1;
+    if (connect(blk->sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) return -1;
+    struct timeval timeout = {
+        .tv_sec = VHOST_USER_BLK_TIMEOUT_MS / 1000,
+        .tv_usec = (VHOST_USER_BLK_TIMEOUT_MS % 1000) * 1000,
+    };
+    if (setsockopt(blk->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+        setsockopt(blk->sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) return -1;
+
+    vhost_user_msg_t msg = { .request = VHOST_USER_SET_OWNER };
+    if (vhost_user_blk_call(blk, &msg, NULL, 0) < 0) return -1;
+    if (vhost_user_blk_get_u64(blk, VHOST_USER_GET_FEATURES, &blk->features) < 0) return -1;
+    if (blk->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) {
+        uint64_t protocol_features;
+        if (vhost_user_blk_get_u64(blk, VHOST_USER_GET_PROTOCOL_FEATURES, &protocol_features) < 0) return -1;
+        protocol_features &= VHOST_USER_BLK_PROTOCOL_FEATURES;
+        if (vhost_user_blk_set_u64(blk, VHOST_USER_SET_PROTOCOL_FEATURES, protocol_features) < 0) return -1;
+        blk->protocol_features = protocol_features;
+    }
+    return 0;
+}
+
+int vhost_user_blk_init(vhost_user_blk_t *blk, uintptr_t base, uint32_t irq, mem_map_t *mem,
+                        irq_line_func irq_line, irq_arg_t irq_arg, const char *path) {
+    memset(blk, 0, sizeof(vhost_user_blk_t));
+    blk->sock = -1;
+    for (size_t i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        blk->call_fds[i] = -1;
+    }
+    virtio_mmio_config_init(&blk->mmio, base, irq, mem, irq_line, irq_arg, &vhost_user_blk_ops, blk);
+    blk->mmio.device_id = VIRTIO_DEVICE_BLOCK;
+
+    blk->path = strdup(path);
+    if (blk->path == NULL) return -1;
+    if (vhost_user_blk_connect(blk) < 0) goto error0;
+
+    // The capacity and limits of the disk are only known to the back-end.
+    if (!(blk->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))) {
+        errno = ENOTSUP;
+        goto error0;
+    }
+    if (vhost_user_blk_get_config(blk) < 0) goto error0;
+
+    uint64_t queue_count = 1;
+    if (blk->features & (1ULL << VIRTIO_BLK_F_MQ)) {
+        queue_count = blk->config.num_queues;
+        uint64_t max = VIRTIO_QUEUE_MAX;
+        if ((blk->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_MQ)) &&
+            vhost_user_blk_get_u64(blk, VHOST_USER_GET_QUEUE_NUM, &max) < 0) goto error0;
+        if (queue_count > max) queue_count = max;
+        if (queue_count > VIRTIO_QUEUE_MAX) queue_count = VIRTIO_QUEUE_MAX;
+        if (queue_count == 0) queue_count = 1;
+        blk->config.num_queues = queue_count;
+    }
+    blk->mmio.queue_count = queue_count;
+    for (size_t i = 0; i < queue_count; i++) {
+        blk->mmio.queues[i].num_max = VHOST_USER_BLK_QUEUE_NUM;
+        blk->call_fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (blk->call_fds[i] < 0) goto error0;
+    }
+
+    // The rings are walked by the back-end, so the device offers what it
+    // does, except the packed layout the transport cannot translate.
+    uint64_t features = blk->features & ~((1ULL << VHOST_USER_F_PROTOCOL_FEATURES) |
+                                          (1ULL << VIRTIO_F_RING_PACKED));
+    blk->mmio.device_features[0] |= (uint32_t) features;
+    blk->mmio.device_features[1] |= (uint32_t) (features >> 32);
+    return 0;
+
+error0:
+    vhost_user_blk_deinit(blk);
+    return -1;
+}
+
+void vhost_user_blk_deinit(vhost_user_blk_t *blk) {
+    if (blk->sock >= 0) {
+        vhost_user_blk_stop(blk);
+        close(blk->sock);
+    }
+    blk->sock = -1;
+    for (size_t i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (blk->call_fds[i] >= 0) close(blk->call_fds[i]);
+        blk->call_fds[i] = -1;
+    }
+    free(blk->path);
+    blk->path = NULL;
+}
+
+static void vhost_user_blk_call_event(void *arg, uint32_t events) {
+    virt_queue_t *queue = arg;
+    vhost_user_blk_t *blk = queue->cfg->dev;
+
+    uint64_t count;
+    if (read(blk->call_fds[queue->index], &count, sizeof(count)) < 0) return;
+    virtio_mmio_interrupt(queue->cfg, queue);
+}
+
+int vhost_user_blk_attach_queue(vhost_user_blk_t *blk, uint32_t queue, int vm_fd, event_loop_t *loop) {
+    if (queue >= blk->mmio.queue_count) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (virtio_mmio_attach_queue(&blk->mmio, queue, vm_fd, NULL) < 0) return -1;
+    blk->calls[queue] = event_loop_add_fd(loop, blk->call_fds[queue], EPOLLIN, vhost_user_blk_call_event,
+                                          &blk->mmio.queues[queue]);
+    if (blk->calls[queue] == NULL) return -1;
+    blk->loops[queue] = loop;
+    return 0;
+}
+
+void vhost_user_blk_detach(vhost_user_blk_t *blk) {
+    for (size_t i = 0; i < blk->mmio.queue_count; i++) {
+        if (blk->calls[i] != NULL) event_loop_remove(blk->loops[i], blk->calls[i]);
+        blk->calls[i] = NULL;
+        blk->loops[i] = NULL;
+    }
+    virtio_mmio_detach(&blk->mmio);
+}
+
+int vhost_user_blk_register_metrics(vhost_user_blk_t *blk, metrics_t *m, const char *labels) {
+    return virtio_mmio_register_metrics(&blk->mmio, m, labels);
+}
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+
+#include <vhost-user.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+int vhost_user_has_reply(uint32_t request) {
+    return request == VHOST_USER_GET_FEATURES || request == VHOST_USER_GET_PROTOCOL_FEATURES ||
+           request == VHOST_USER_GET_QUEUE_NUM || request == VHOST_USER_GET_VRING_BASE ||
+           request == VHOST_USER_GET_CONFIG;
+}
+
+int vhost_user_send(int sock, const vhost_user_msg_t *msg, const int *fds, size_t fd_count) {
+    if (msg->size > sizeof(msg->payload) || fd_count > VHOST_USER_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct iovec iov[2] = {
+        { .iov_base = (void*) msg, .iov_len = VHOST_USER_HDR_SIZE },
+        { .iov_base = (void*) &msg->payload, .iov_len = msg->size },
+    };
+    union {
+        char buf[CMSG_SPACE(VHOST_USER_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr hdr = {
+        .msg_iov = iov,
+        .msg_iovlen = msg->size > 0 ? 2 : 1,
+    };
+    if (fd_count > 0) {
+        memset(&control, 0, sizeof(control));
+        hdr.msg_control = control.buf;
+        hdr.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+    }
+
+    size_t len = VHOST_USER_HDR_SIZE + msg->size;
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t res = sendmsg(sock, &hdr, MSG_NOSIGNAL);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        // The fds went with the first bytes.
+        sent += res;
+        hdr.msg_control = NULL;
+        hdr.msg_controllen = 0;
+        while (hdr.msg_iovlen > 0 && (size_t) res >= hdr.msg_iov->iov_len) {
+            res -= hdr.msg_iov->iov_len;
+            hdr.msg_iov++;
+            hdr.msg_iovlen--;
+        }
+        if (hdr.msg_iovlen > 0) {
+            hdr.msg_iov->iov_base = (uint8_t*) hdr.msg_iov->iov_base + res;
+            hdr.msg_iov->iov_len -= res;
+        }
+    }
+    return 0;
+}
+
+// vhost_user_read reads exactly `len` bytes of `sock` into `buf`.
+static int vhost_user_read(int sock, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = recv(sock, (uint8_t*) buf + done, len - done, 0);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (res == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        done += res;
+    }
+    return 0;
+}
+
+int vhost_user_recv(int sock, vhost_user_msg_t *msg, int *fds, size_t *fd_count) {
+    *fd_count = 0;
+    union {
+        char buf[CMSG_SPACE(VHOST_USER_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = msg, .iov_len = VHOST_USER_HDR_SIZE };
+    struct msghdr hdr = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t res;
+    do {
+        res = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+    } while (res < 0 && errno == EINTR);
+    if (res < 0) return -1;
+    if (res == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds + *fd_count, CMSG_DATA(cmsg), count * sizeof(int));
+        *fd_count += count;
+    }
+    if (hdr.msg_flags & MSG_CTRUNC) {
+        errno = EPROTO;
+        goto error0;
+    }
+
+    if ((size_t) res < VHOST_USER_HDR_SIZE &&
+        vhost_user_read(sock, (uint8_t*) msg + res, VHOST_USER_HDR_SIZE - res) < 0) goto error0;
+    if ((msg->flags & VHOST_USER_VERSION_MASK) != VHOST_USER_VERSION || msg->size > sizeof(msg->payload)) {
+        errno = EPROTO;
+        goto error0;
+    }
+    if (msg->size > 0 && vhost_user_read(sock, &msg->payload, msg->size) < 0) goto error0;
+    return 0;
+
+error0:
+    for (size_t i = 0; i < *fd_count; i++) {
+        close(fds[i]);
+    }
+    *fd_count = 0;
+    return -1;
+}
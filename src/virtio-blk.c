@@ -0,0 +1,508 @@
+#define _GNU_SOURCE
+
+#include <virtio-blk.h>
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <linux/virtio_blk.h>
+
+#define VIRTIO_BLK_ID "tomu"
+
+static void virtio_blk_config_read(void *dev, uint32_t offset, void *data, size_t size) {
+    virtio_blk_t *blk = (virtio_blk_t*) dev;
+    if (offset + size > sizeof(struct virtio_blk_config)) return;
+    memcpy(data, (uint8_t*) &blk->config + offset, size);
+}
+
+/**
+ * virtio_blk_flush publishes the completions filled since the last flush
+ * with one store of the used index and one interrupt, and records their
+ * trace events. Must be called with blk->mu held.
+ */
+static void virtio_blk_flush(virtio_blk_queue_t *queue) {
+    if (queue->done_len == 0) return;
+    uint64_t publish = trace_now();
+    virt_queue_flush(&queue->blk->mmio, queue->vq);
+    uint64_t irq = trace_now();
+    for (size_t i = 0; i < queue->done_len; i++) {
+        queue->done[i].ts[TRACE_PUBLISH] = publish;
+        queue->done[i].ts[TRACE_IRQ] = irq;
+        trace_record(&queue->trace, &queue->done[i]);
+    }
+    queue->done_len = 0;
+}
+
+// virtio_blk_next_event returns the trace event of the next completion
+// filled into the used ring. A driver reusing heads within one drain can
+// fill more entries than the queue depth, which are then published early.
+static trace_event_t* virtio_blk_next_event(virtio_blk_queue_t *queue) {
+    if (queue->done_len == VIRTIO_BLK_QUEUE_DEPTH) virtio_blk_flush(queue);
+    return &queue->done[queue->done_len++];
+}
+
+static void virtio_blk_flush_deferred(void *arg) {
+    virtio_blk_queue_t *queue = arg;
+    virtio_blk_t *blk = queue->blk;
+    pthread_mutex_lock(&blk->mu);
+    queue->flush_pending = 0;
+    virtio_blk_flush(queue);
+    pthread_mutex_unlock(&blk->mu);
+}
+
+/**
+ * virtio_blk_release frees `req` and every request merged into it that was
+ * allocated, and gives the others' slots back to their heads, once their
+ * completions are filled into the used ring.
+ */
+static void virtio_blk_release(virtio_blk_req_t *req) {
+    virtio_blk_req_t *next;
+    for (virtio_blk_req_t *iter = req; iter != NULL; iter = next) {
+        next = iter->merged;
+        if (iter->allocated) {
+            free(iter);
+        } else {
+            atomic_store_explicit(&iter->inflight, 0, memory_order_release);
+        }
+    }
+}
+
+/**
+ * virtio_blk_complete completes `req` and every request merged into it
+ * with `status`. Must be called with blk->mu held.
+ *
+ * The completions are only filled into the used ring. Those of a notify are
+ * flushed when it returns, and those reaped by the bdev queue once the loop
+ * has dispatched every completion of the same wakeup.
+ */
+static void virtio_blk_complete(virtio_blk_req_t *req, uint8_t status) {
+    virtio_blk_queue_t *queue = req->queue;
+    uint64_t submit = req->ts[TRACE_SUBMIT];
+    uint64_t reap = req->ts[TRACE_REAP];
+    for (virtio_blk_req_t *iter = req; iter != NULL; iter = iter->merged) {
+        *iter->status = status;
+        uint32_t len = (iter->type == VIRTIO_BLK_T_IN || iter->type == VIRTIO_BLK_T_GET_ID) ? iter->len : 0;
+        virt_queue_fill(queue->vq, iter->head, len + 1);
+
+        // The event is built now, since the request may be reused as soon
+        // as the driver sees it completed.
+        trace_event_t *event = virtio_blk_next_event(queue);
+        *event = (trace_event_t) {
+            .type = iter->type,
+            .len = iter->len,
+            .head = iter->head,
+            .status = status,
+        };
+        memcpy(event->ts, iter->ts, sizeof(event->ts));
+        // Merged requests were submitted and reaped with their leader.
+        event->ts[TRACE_SUBMIT] = submit;
+        event->ts[TRACE_REAP] = reap;
+    }
+    virtio_blk_release(req);
+
+    if (queue->in_notify || queue->flush_pending) return;
+    if (queue->vq->loop == NULL || event_loop_defer(queue->vq->loop, virtio_blk_flush_deferred, queue) < 0) {
+        virtio_blk_flush(queue);
+        return;
+    }
+    queue->flush_pending = 1;
+}
+
+static void virtio_blk_complete_now(virtio_blk_req_t *req, uint8_t status) {
+    virtio_blk_t *blk = req->queue->blk;
+    pthread_mutex_lock(&blk->mu);
+    virtio_blk_complete(req, status);
+    pthread_mutex_unlock(&blk->mu);
+}
+
+static void virtio_blk_req_done(bdev_io_t *io, ssize_t res) {
+    virtio_blk_req_t *req = (virtio_blk_req_t*) io;
+    virtio_blk_t *blk = req->queue->blk;
+    req->ts[TRACE_REAP] = trace_now();
+
+    pthread_mutex_lock(&blk->mu);
+    if (req->generation == blk->generation) {
+        virtio_blk_complete(req, res == (ssize_t) req->merged_len ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
+    } else {
+        // The queue was reset while the request was in flight, only its
+        // slot is left to release.
+        virtio_blk_release(req);
+    }
+    pthread_mutex_unlock(&blk->mu);
+}
+
+static void virtio_blk_submit(virtio_blk_req_t *req) {
+    virtio_blk_queue_t *queue = req->queue;
+    off_t offset = req->sector * VIRTIO_BLK_SECTOR_SIZE;
+    int res;
+    req->ts[TRACE_SUBMIT] = trace_now();
+    if (req->type == VIRTIO_BLK_T_IN) {
+        res = bdev_queue_readv(queue->bdev_queue, &req->io, req->iov, req->merged_iovcnt, offset);
+    } else {
+        res = bdev_queue_writev(queue->bdev_queue, &req->io, req->iov, req->merged_iovcnt, offset, 0);
+    }
+    if (res < 0) {
+        virtio_blk_complete_now(req, VIRTIO_BLK_S_IOERR);
+        return;
+    }
+    metric_inc(&queue->blk->stats.submitted, 1);
+}
+
+/**
+ * virtio_blk_submit_barrier submits a flush, discard or write-zeroes
+ * request, which the bdev queue orders after every request submitted before
+ * it.
+ */
+static void virtio_blk_submit_barrier(virtio_blk_req_t *req) {
+    virtio_blk_queue_t *queue = req->queue;
+    bdev_queue_t *bdev_queue = queue->bdev_queue;
+    req->io.cb = virtio_blk_req_done;
+    req->len = 0;
+    req->merged_len = 0;
+
+    if (req->type == VIRTIO_BLK_T_FLUSH) {
+        req->ts[TRACE_SUBMIT] = trace_now();
+        if (bdev_queue_flush(bdev_queue, &req->io) < 0) virtio_blk_complete_now(req, VIRTIO_BLK_S_IOERR);
+        return;
+    }
+
+    // The driver sends max_discard_seg and max_write_zeroes_seg, i.e. one,
+    // segments, which may be split across descriptors.
+    struct virtio_blk_discard_write_zeroes seg;
+    size_t len = 0;
+    for (size_t i = 0; i < req->iovcnt && len < sizeof(seg); i++) {
+        size_t count = req->iov[i].iov_len < sizeof(seg) - len ? req->iov[i].iov_len : sizeof(seg) - len;
+        memcpy((uint8_t*) &seg + len, req->iov[i].iov_base, count);
+        len += count;
+    }
+    uint32_t max_sectors = req->type == VIRTIO_BLK_T_DISCARD ? queue->blk->config.max_discard_sectors
+                                                              : queue->blk->config.max_write_zeroes_sectors;
+    if (len < sizeof(seg) || seg.num_sectors > max_sectors ||
+        seg.num_sectors > queue->blk->config.capacity ||
+        seg.sector > queue->blk->config.capacity - seg.num_sectors) {
+        virtio_blk_complete_now(req, VIRTIO_BLK_S_IOERR);
+        return;
+    }
+    if (req->type == VIRTIO_BLK_T_DISCARD ? seg.flags != 0 : (seg.flags & ~VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP)) {
+        virtio_blk_complete_now(req, VIRTIO_BLK_S_UNSUPP);
+        return;
+    }
+
+    off_t offset = seg.sector * VIRTIO_BLK_SECTOR_SIZE;
+    off_t count = (off_t) seg.num_sectors * VIRTIO_BLK_SECTOR_SIZE;
+    int res;
+    req->ts[TRACE_SUBMIT] = trace_now();
+    if (req->type == VIRTIO_BLK_T_DISCARD) {
+        res = bdev_queue_discard(bdev_queue, &req->io, offset, count);
+    } else {
+        res = bdev_queue_write_zeroes(bdev_queue, &req->io, offset, count,
+                                      seg.flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP);
+    }
+    if (res < 0) virtio_blk_complete_now(req, VIRTIO_BLK_S_IOERR);
+}
+
+/**
+ * virtio_blk_can_merge returns whether `req` continues the request `leader`,
+ * whose iovecs end where those of `req` start.
+ */
+static int virtio_blk_can_merge(virtio_blk_req_t *leader, virtio_blk_req_t *req) {
+    return leader->type == req->type &&
+           leader->sector + leader->merged_len / VIRTIO_BLK_SECTOR_SIZE == req->sector &&
+           leader->merged_len % VIRTIO_BLK_SECTOR_SIZE == 0 &&
+           leader->merged_len + req->len <= VIRTIO_BLK_MERGE_MAX_BYTES &&
+           leader->merged_iovcnt + req->iovcnt <= VIRTIO_BLK_MERGE_MAX_SEGS &&
+           leader->iov + leader->merged_iovcnt == req->iov;
+}
+
+/**
+ * virtio_blk_drop returns the malformed chain `head`, which has no status
+ * byte to report an error in, to the driver and marks the device as needing
+ * a reset.
+ */
+static void virtio_blk_drop(virtio_blk_queue_t *queue, uint16_t head) {
+    virtio_blk_t *blk = queue->blk;
+    pthread_mutex_lock(&blk->mu);
+    blk->mmio.status |= VIRTIO_CONFIG_S_NEEDS_RESET;
+    if (head < queue->vq->vring.num) {
+        virt_queue_fill(queue->vq, head, 0);
+        *virtio_blk_next_event(queue) = (trace_event_t) {
+            .ts[TRACE_POP] = trace_now(),
+            .head = head,
+            .status = VIRTIO_BLK_S_IOERR,
+        };
+    }
+    pthread_mutex_unlock(&blk->mu);
+}
+
+/**
+ * virtio_blk_parse translates the descriptor chain `iov` of `head` into a
+ * request, copying its data iovecs into the arena.
+ *
+ * \return On success, the request is returned. If the chain is malformed,
+ *         NULL is returned. If it has a status byte, the request is
+ *         completed with VIRTIO_BLK_S_IOERR, otherwise it is dropped.
+ */
+static virtio_blk_req_t* virtio_blk_parse(virtio_blk_queue_t *queue, uint16_t head,
+                                          struct iovec *iov, size_t n, size_t out_num) {
+    if (head >= VIRTIO_BLK_QUEUE_DEPTH || n == out_num || iov[n - 1].iov_len == 0) {
+        virtio_blk_drop(queue, head);
+        return NULL;
+    }
+
+    virtio_blk_req_t *req = &queue->reqs[head];
+    int allocated = atomic_load_explicit(&req->inflight, memory_order_acquire);
+    if (allocated) {
+        req = malloc(sizeof(virtio_blk_req_t));
+        if (req == NULL) {
+            virtio_blk_drop(queue, head);
+            return NULL;
+        }
+    }
+    req->allocated = allocated;
+    atomic_store_explicit(&req->inflight, 1, memory_order_relaxed);
+    memset(req->ts, 0, sizeof(req->ts));
+    req->ts[TRACE_POP] = trace_now();
+    req->queue = queue;
+    req->head = head;
+    req->generation = queue->blk->generation;
+    req->merged = NULL;
+    req->len = 0;
+    req->iovcnt = 0;
+    req->iov = queue->arena + queue->arena_len;
+
+    // The status byte is the last byte of the chain.
+    struct iovec *last = &iov[n - 1];
+    req->status = (uint8_t*) last->iov_base + last->iov_len - 1;
+    last->iov_len--;
+
+    if (out_num == 0 || iov[0].iov_len < sizeof(struct virtio_blk_outhdr)) {
+        req->type = VIRTIO_BLK_T_IN;
+        virtio_blk_complete_now(req, VIRTIO_BLK_S_IOERR);
+        return NULL;
+    }
+    struct virtio_blk_outhdr *hdr = (struct virtio_blk_outhdr*) iov[0].iov_base;
+    req->type = hdr->type;
+    req->sector = hdr->sector;
+
+    for (size_t i = 1; i < n; i++) {
+        if (iov[i].iov_len == 0) continue;
+        queue->arena[queue->arena_len++] = iov[i];
+        req->iovcnt++;
+        req->len += iov[i].iov_len;
+    }
+    req->merged_iovcnt = req->iovcnt;
+    req->merged_len = req->len;
+
+    return req;
+}
+
+static void virtio_blk_notify(void *dev, uint32_t queue_id) {
+    virtio_blk_t *blk = (virtio_blk_t*) dev;
+    virtio_blk_queue_t *queue = &blk->queues[queue_id];
+
+    // The request being built by merging, and the last request merged.
+    virtio_blk_req_t *leader = NULL;
+    virtio_blk_req_t *tail = NULL;
+
+    pthread_mutex_lock(&blk->mu);
+    queue->in_notify = 1;
+    pthread_mutex_unlock(&blk->mu);
+
+    queue->arena_len = 0;
+    bdev_queue_plug(queue->bdev_queue);
+    virt_queue_batch_t *batch = &queue->batch;
+    while (virt_queue_pop_batch(&blk->mmio, queue->vq, batch) != 0) {
+        for (size_t i = 0; i < batch->count; i++) {
+            int n = batch->elems[i].iovcnt;
+            struct iovec *iov = batch->elems[i].iov;
+            // The arena holds the iovecs of one batch, so it only runs out
+            // if requests were popped before the driver reused their
+            // descriptors. Submit what has been merged so far.
+            if (n > 0 && queue->arena_len + n > VIRTIO_QUEUE_NUM_MAX) {
+                if (leader != NULL) virtio_blk_submit(leader);
+                leader = tail = NULL;
+                bdev_queue_unplug(queue->bdev_queue);
+                bdev_queue_plug(queue->bdev_queue);
+                queue->arena_len = 0;
+            }
+
+            if (n <= 0) virtio_blk_drop(queue, batch->elems[i].head);
+            virtio_blk_req_t *req = n > 0 ? virtio_blk_parse(queue, batch->elems[i].head, iov, n,
+                                                              batch->elems[i].out_num) : NULL;
+            if (req == NULL) {
+                // Counted rather than logged, since the guest controls the rate.
+                metric_inc(&blk->stats.invalid_chains, 1);
+                continue;
+            }
+
+            switch (req->type) {
+            case VIRTIO_BLK_T_IN:
+            case VIRTIO_BLK_T_OUT:
+                // Compared in sectors, since the byte offset of a large
+                // sector overflows.
+                if (req->len == 0 || req->sector > blk->config.capacity ||
+                    (req->len + VIRTIO_BLK_SECTOR_SIZE - 1) / VIRTIO_BLK_SECTOR_SIZE >
+                    blk->config.capacity - req->sector) {
+                    virtio_blk_complete_now(req, VIRTIO_BLK_S_IOERR);
+                    break;
+                }
+                if (leader != NULL && virtio_blk_can_merge(leader, req)) {
+                    leader->merged_iovcnt += req->iovcnt;
+                    leader->merged_len += req->len;
+                    tail->merged = req;
+                    tail = req;
+                    metric_inc(&blk->stats.merged, 1);
+                    break;
+                }
+                if (leader != NULL) virtio_blk_submit(leader);
+                leader = tail = req;
+                req->io.cb = virtio_blk_req_done;
+                break;
+            case VIRTIO_BLK_T_FLUSH:
+            case VIRTIO_BLK_T_DISCARD:
+            case VIRTIO_BLK_T_WRITE_ZEROES:
+                // Requests popped earlier must be ordered before the barrier.
+                if (leader != NULL) virtio_blk_submit(leader);
+                leader = tail = NULL;
+                virtio_blk_submit_barrier(req);
+                break;
+            case VIRTIO_BLK_T_GET_ID:
+                {
+                    char id[VIRTIO_BLK_ID_BYTES] = VIRTIO_BLK_ID;
+                    size_t len = 0;
+                    for (size_t j = 0; j < req->iovcnt && len < sizeof(id); j++) {
+                        size_t count = req->iov[j].iov_len < sizeof(id) - len ? req->iov[j].iov_len
+                                                                               : sizeof(id) - len;
+                        memcpy(req->iov[j].iov_base, id + len, count);
+                        len += count;
+                    }
+                    req->len = len;
+                    virtio_blk_complete_now(req, VIRTIO_BLK_S_OK);
+                    break;
+                }
+            default:
+                req->len = 0;
+                virtio_blk_complete_now(req, VIRTIO_BLK_S_UNSUPP);
+                break;
+            }
+        }
+    }
+
+    if (leader != NULL) virtio_blk_submit(leader);
+    bdev_queue_unplug(queue->bdev_queue);
+
+    pthread_mutex_lock(&blk->mu);
+    queue->in_notify = 0;
+    virtio_blk_flush(queue);
+    pthread_mutex_unlock(&blk->mu);
+}
+
+static void virtio_blk_reset(void *dev) {
+    virtio_blk_t *blk = (virtio_blk_t*) dev;
+    pthread_mutex_lock(&blk->mu);
+    blk->generation++;
+    // The used ring is torn down with the queues.
+    for (size_t i = 0; i < VIRTIO_BLK_QUEUE_COUNT; i++) {
+        blk->queues[i].done_len = 0;
+    }
+    pthread_mutex_unlock(&blk->mu);
+}
+
+static const virtio_device_ops_t virtio_blk_ops = {
+    .config_read = virtio_blk_config_read,
+    .notify = virtio_blk_notify,
+    .reset = virtio_blk_reset,
+};
+
+int virtio_blk_init(virtio_blk_t *blk, uintptr_t base, uint32_t irq, mem_map_t *mem,
+                    irq_line_func irq_line, irq_arg_t irq_arg, bdev_t *bdev) {
+    if (bdev->queue_count < VIRTIO_BLK_QUEUE_COUNT || bdev->queue_depth < VIRTIO_BLK_QUEUE_DEPTH) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(blk, 0, sizeof(virtio_blk_t));
+    if (pthread_mutex_init(&blk->mu, NULL) != 0) {
+        return -1;
+    }
+
+    virtio_mmio_config_init(&blk->mmio, base, irq, mem, irq_line, irq_arg, &virtio_blk_ops, blk);
+    blk->mmio.device_id = VIRTIO_DEVICE_BLOCK;
+    blk->mmio.queue_count = VIRTIO_BLK_QUEUE_COUNT;
+    blk->bdev = bdev;
+    for (size_t i = 0; i < VIRTIO_BLK_QUEUE_COUNT; i++) {
+        blk->mmio.queues[i].num_max = VIRTIO_BLK_QUEUE_DEPTH;
+        blk->queues[i].blk = blk;
+        blk->queues[i].vq = &blk->mmio.queues[i];
+        blk->queues[i].bdev_queue = bdev_get_queue(bdev, i);
+        trace_init(&blk->queues[i].trace);
+    }
+
+    blk->config.capacity = bdev->size / VIRTIO_BLK_SECTOR_SIZE;
+    blk->config.seg_max = VIRTIO_BLK_SEG_MAX;
+    blk->config.max_discard_sectors = VIRTIO_BLK_MAX_DISCARD_SECTORS;
+    blk->config.max_discard_seg = 1;
+    blk->config.discard_sector_alignment = VIRTIO_BLK_DISCARD_ALIGNMENT;
+    blk->config.max_write_zeroes_sectors = VIRTIO_BLK_MAX_DISCARD_SECTORS;
+    blk->config.max_write_zeroes_seg = 1;
+    blk->config.write_zeroes_may_unmap = 1;
+    virtio_mmio_add_feature(&blk->mmio, VIRTIO_BLK_F_SEG_MAX);
+    virtio_mmio_add_feature(&blk->mmio, VIRTIO_BLK_F_FLUSH);
+    virtio_mmio_add_feature(&blk->mmio, VIRTIO_BLK_F_DISCARD);
+    virtio_mmio_add_feature(&blk->mmio, VIRTIO_BLK_F_WRITE_ZEROES);
+    //virtio_mmio_add_feature(&blk->mmio, VIRTIO_BLK_F_MQ);
+    // virtio_mmio_add_feature(&blk->mmio, VIRTIO_F_RING_PACKED);
+    // virtio_mmio_add_feature(&blk->mmio, VIRTIO_BLK_F_SIZE_MAX);
+    // virtio_mmio_add_feature(&blk->mmio, VIRTIO_BLK_F_GEOMETRY);
+    // virtio_mmio_add_feature(&blk->mmio, VIRTIO_BLK_F_BLK_SIZE);
+    // virtio_mmio_add_feature(&blk->mmio, VIRTIO_BLK_F_TOPOLOGY);
+
+    return 0;
+}
+
+void virtio_blk_deinit(virtio_blk_t *blk) {
+    pthread_mutex_destroy(&blk->mu);
+    free(blk->trace_labels);
+}
+
+static void virtio_blk_write_hists(void *arg, FILE *f) {
+    virtio_blk_t *blk = arg;
+    for (size_t i = 0; i < VIRTIO_BLK_QUEUE_COUNT; i++) {
+        char labels[256];
+        snprintf(labels, sizeof(labels), "%s%squeue=\"%zu\"", blk->trace_labels,
+                 *blk->trace_labels ? "," : "", i);
+        trace_write_hists(&blk->queues[i].trace, f, "tomu_virtio_blk_stage_latency_seconds", labels, i == 0);
+    }
+}
+
+static void virtio_blk_write_trace(void *arg, FILE *f) {
+    virtio_blk_t *blk = arg;
+    for (size_t i = 0; i < VIRTIO_BLK_QUEUE_COUNT; i++) {
+        fprintf(f, "queue %zu\n", i);
+        trace_dump(&blk->queues[i].trace, f);
+    }
+}
+
+int virtio_blk_register_trace(virtio_blk_t *blk, metrics_t *m, const char *path) {
+    return metrics_add_writer(m, path, virtio_blk_write_trace, blk);
+}
+
+int virtio_blk_register_metrics(virtio_blk_t *blk, metrics_t *m, const char *labels) {
+    if (virtio_mmio_register_metrics(&blk->mmio, m, labels) < 0) return -1;
+    if (metrics_register(m, "tomu_virtio_blk_merged_requests_total",
+                         "Requests merged into the preceding request of the same drain.",
+                         labels, METRIC_COUNTER, &blk->stats.merged) < 0) return -1;
+    if (metrics_register(m, "tomu_virtio_blk_submissions_total", "Read and write requests submitted to the bdev.",
+                         labels, METRIC_COUNTER, &blk->stats.submitted) < 0) return -1;
+    if (metrics_register(m, "tomu_virtio_blk_invalid_chains_total",
+                         "Descriptor chains dropped as malformed, which also mark the device as needing a reset.",
+                         labels, METRIC_COUNTER, &blk->stats.invalid_chains) < 0) return -1;
+
+    free(blk->trace_labels);
+    blk->trace_labels = strdup(labels != NULL ? labels : "");
+    if (blk->trace_labels == NULL) return -1;
+    if (metrics_add_writer(m, NULL, virtio_blk_write_hists, blk) < 0) return -1;
+    return 0;
+}
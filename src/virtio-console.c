@@ -0,0 +1,603 @@
+#define _GNU_SOURCE
+
+#include <virtio-console.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <linux/virtio_config.h>
+#include <linux/virtio_console.h>
+
+#define VIRTIO_CONSOLE_CTRL_RX 2
+#define VIRTIO_CONSOLE_CTRL_TX 3
+
+// The epoll data of the kick eventfd, port fds use their port id.
+#define VIRTIO_CONSOLE_EVENTFD_KEY UINT32_MAX
+
+static uint32_t virtio_console_rxq(uint32_t port) {
+    return port == 0 ? 0 : 2 * (port + 1);
+}
+
+static uint32_t virtio_console_txq(uint32_t port) {
+    return virtio_console_rxq(port) + 1;
+}
+
+static int virtio_console_multiport(virtio_console_t *con) {
+    return virtio_mmio_has_feature(&con->mmio, VIRTIO_CONSOLE_F_MULTIPORT);
+}
+
+// virtio_console_active_ports returns the number of ports the driver uses.
+static size_t virtio_console_active_ports(virtio_console_t *con) {
+    return virtio_console_multiport(con) ? con->port_count : (con->port_count > 0);
+}
+
+static int virtio_console_driver_ok(virtio_console_t *con) {
+    return con->mmio.status & VIRTIO_CONFIG_S_DRIVER_OK;
+}
+
+static int virtio_console_queue_ready(virtio_console_t *con, uint32_t queue) {
+    return queue < con->mmio.queue_count && con->mmio.queues[queue].ready;
+}
+
+// iov_from_buf copies `len` bytes of `buf` into `iov`.
+static size_t iov_from_buf(struct iovec *iov, size_t iovcnt, const void *buf, size_t len) {
+    size_t copied = 0;
+    for (size_t i = 0; i < iovcnt && copied < len; i++) {
+        size_t n = len - copied < iov[i].iov_len ? len - copied : iov[i].iov_len;
+        memcpy(iov[i].iov_base, (const uint8_t*) buf + copied, n);
+        copied += n;
+    }
+    return copied;
+}
+
+// iov_to_buf copies up to `len` bytes of `iov` into `buf`.
+static size_t iov_to_buf(const struct iovec *iov, size_t iovcnt, void *buf, size_t len) {
+    size_t copied = 0;
+    for (size_t i = 0; i < iovcnt && copied < len; i++) {
+        size_t n = len - copied < iov[i].iov_len ? len - copied : iov[i].iov_len;
+        memcpy((uint8_t*) buf + copied, iov[i].iov_base, n);
+        copied += n;
+    }
+    return copied;
+}
+
+static void virtio_console_ctrl_send(virtio_console_t *con, uint32_t id, uint16_t event, uint16_t value,
+                                     const char *name) {
+    if (con->pending_len == VIRTIO_CONSOLE_CTRL_PENDING) {
+        printf("virtio-console control queue overflow\r\n");
+        fflush(stdout);
+        return;
+    }
+
+    size_t i = (con->pending_head + con->pending_len++) % VIRTIO_CONSOLE_CTRL_PENDING;
+    virtio_console_ctrl_t *ctrl = &con->pending[i];
+    ctrl->msg = (struct virtio_console_control) {
+        .id = id,
+        .event = event,
+        .value = value,
+    };
+    ctrl->name_len = 0;
+    if (name != NULL) {
+        ctrl->name_len = strnlen(name, VIRTIO_CONSOLE_PORT_NAME_LEN - 1);
+        memcpy(ctrl->name, name, ctrl->name_len);
+        ctrl->name[ctrl->name_len++] = '\0';
+    }
+}
+
+// virtio_console_ctrl_flush delivers pending control messages to the driver
+// for as long as it has posted control receiveq buffers.
+static void virtio_console_ctrl_flush(virtio_console_t *con) {
+    if (!virtio_console_queue_ready(con, VIRTIO_CONSOLE_CTRL_RX)) return;
+    virt_queue_t *queue = &con->mmio.queues[VIRTIO_CONSOLE_CTRL_RX];
+
+    while (con->pending_len > 0) {
+        struct iovec iov[VIRTIO_CONSOLE_QUEUE_DEPTH];
+        size_t out_num;
+        uint16_t head;
+        int n = virt_queue_pop(&con->mmio, queue, &head, iov, VIRTIO_CONSOLE_QUEUE_DEPTH, &out_num);
+        if (n == 0) break;
+        if (n < 0) continue;
+
+        virtio_console_ctrl_t *ctrl = &con->pending[con->pending_head];
+        uint8_t buf[sizeof(struct virtio_console_control) + VIRTIO_CONSOLE_PORT_NAME_LEN];
+        memcpy(buf, &ctrl->msg, sizeof(ctrl->msg));
+        memcpy(buf + sizeof(ctrl->msg), ctrl->name, ctrl->name_len);
+        size_t len = iov_from_buf(iov + out_num, n - out_num, buf, sizeof(ctrl->msg) + ctrl->name_len);
+        virt_queue_fill(queue, head, len);
+
+        con->pending_head = (con->pending_head + 1) % VIRTIO_CONSOLE_CTRL_PENDING;
+        con->pending_len--;
+    }
+
+    virt_queue_flush(&con->mmio, queue);
+}
+
+static void virtio_console_port_ready(virtio_console_t *con, uint32_t id) {
+    virtio_console_port_t *port = &con->ports[id];
+    if (id == 0) {
+        virtio_console_ctrl_send(con, id, VIRTIO_CONSOLE_CONSOLE_PORT, 1, NULL);
+    }
+    virtio_console_ctrl_send(con, id, VIRTIO_CONSOLE_PORT_NAME, 1, port->name);
+    if (port->host_connected) {
+        virtio_console_ctrl_send(con, id, VIRTIO_CONSOLE_PORT_OPEN, 1, NULL);
+    }
+}
+
+static void virtio_console_ctrl_handle(virtio_console_t *con, struct virtio_console_control *msg) {
+    switch (msg->event) {
+    case VIRTIO_CONSOLE_DEVICE_READY:
+        if (msg->value != 1) break;
+        for (uint32_t i = 0; i < con->port_count; i++) {
+            virtio_console_ctrl_send(con, i, VIRTIO_CONSOLE_PORT_ADD, 1, NULL);
+        }
+        break;
+    case VIRTIO_CONSOLE_PORT_READY:
+        if (msg->id >= con->port_count || msg->value != 1) break;
+        virtio_console_port_ready(con, msg->id);
+        break;
+    case VIRTIO_CONSOLE_PORT_OPEN:
+        if (msg->id >= con->port_count) break;
+        con->ports[msg->id].guest_connected = msg->value;
+        break;
+    default:
+        break;
+    }
+}
+
+static void virtio_console_process_ctrl(virtio_console_t *con) {
+    if (!virtio_console_queue_ready(con, VIRTIO_CONSOLE_CTRL_TX)) return;
+    virt_queue_t *queue = &con->mmio.queues[VIRTIO_CONSOLE_CTRL_TX];
+
+    struct iovec iov[VIRTIO_CONSOLE_QUEUE_DEPTH];
+    size_t out_num;
+    uint16_t head;
+    int n;
+    while ((n = virt_queue_pop(&con->mmio, queue, &head, iov, VIRTIO_CONSOLE_QUEUE_DEPTH, &out_num)) != 0) {
+        if (n > 0) {
+            struct virtio_console_control msg;
+            if (iov_to_buf(iov, out_num, &msg, sizeof(msg)) == sizeof(msg)) {
+                virtio_console_ctrl_handle(con, &msg);
+            }
+        }
+        virt_queue_fill(queue, head, 0);
+    }
+
+    virt_queue_flush(&con->mmio, queue);
+}
+
+static void virtio_console_host_disconnect(virtio_console_t *con, uint32_t id) {
+    virtio_console_port_t *port = &con->ports[id];
+    if (!port->host_connected) return;
+    port->host_connected = 0;
+    if (virtio_console_multiport(con)) {
+        virtio_console_ctrl_send(con, id, VIRTIO_CONSOLE_PORT_OPEN, 0, NULL);
+    }
+}
+
+// virtio_console_iov_advance advances `iov` past the first `count` bytes.
+static void virtio_console_iov_advance(struct iovec **iov, size_t *iovcnt, size_t count) {
+    while (*iovcnt > 0 && count >= (*iov)->iov_len) {
+        count -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (uint8_t*) (*iov)->iov_base + count;
+        (*iov)->iov_len -= count;
+    }
+}
+
+// virtio_console_port_write writes `iov` to the host fd of `port`. It returns
+// the number of bytes written, which is short if the fd would block.
+static ssize_t virtio_console_port_write(virtio_console_port_t *port, struct iovec *iov, size_t iovcnt) {
+    size_t written = 0;
+    while (iovcnt > 0) {
+        ssize_t res;
+        if (port->is_socket) {
+            struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+            res = sendmsg(port->out_fd, &msg, MSG_NOSIGNAL);
+        } else {
+            res = writev(port->out_fd, iov, iovcnt);
+        }
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            // stdout shares the O_NONBLOCK file description of a tty stdin.
+            if (errno == EAGAIN) break;
+            return -1;
+        }
+        written += res;
+        virtio_console_iov_advance(&iov, &iovcnt, res);
+    }
+    return written;
+}
+
+static ssize_t virtio_console_port_read(virtio_console_port_t *port, struct iovec *iov, size_t iovcnt) {
+    if (port->is_socket) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        return recvmsg(port->in_fd, &msg, MSG_DONTWAIT);
+    }
+    return readv(port->in_fd, iov, iovcnt);
+}
+
+static void virtio_console_process_tx(virtio_console_t *con, uint32_t id) {
+    uint32_t queue_id = virtio_console_txq(id);
+    if (!virtio_console_queue_ready(con, queue_id)) return;
+    virt_queue_t *queue = &con->mmio.queues[queue_id];
+    virtio_console_port_t *port = &con->ports[id];
+
+    struct iovec iov[VIRTIO_CONSOLE_QUEUE_DEPTH];
+    size_t out_num;
+    uint16_t head;
+    int n;
+    port->tx_blocked = 0;
+    while ((n = virt_queue_pop(&con->mmio, queue, &head, iov, VIRTIO_CONSOLE_QUEUE_DEPTH, &out_num)) != 0) {
+        if (n > 0 && port->host_connected && port->out_fd >= 0) {
+            size_t len = 0;
+            for (size_t i = 0; i < out_num; i++) len += iov[i].iov_len;
+
+            // Resume a chain that was partially written before blocking.
+            struct iovec *out = iov;
+            size_t out_cnt = out_num;
+            virtio_console_iov_advance(&out, &out_cnt, port->tx_offset);
+            ssize_t res = virtio_console_port_write(port, out, out_cnt);
+            if (res < 0) {
+                virtio_console_host_disconnect(con, id);
+            } else {
+                metric_inc(&con->stats.tx_bytes, res);
+                if (port->tx_offset + res < len) {
+                    // Leave the chain for when out_fd is writable.
+                    port->tx_offset += res;
+                    port->tx_blocked = 1;
+                    virt_queue_unpop(queue);
+                    break;
+                }
+            }
+        }
+        port->tx_offset = 0;
+        virt_queue_fill(queue, head, 0);
+    }
+
+    virt_queue_flush(&con->mmio, queue);
+}
+
+// virtio_console_can_rx returns whether host input may be delivered to the
+// port. The guest discards input for ports that it has not opened.
+static int virtio_console_can_rx(virtio_console_t *con, uint32_t id) {
+    virtio_console_port_t *port = &con->ports[id];
+    if (port->in_fd < 0 || !port->host_connected) return 0;
+    if (id != 0 && !port->guest_connected) return 0;
+    return virtio_console_queue_ready(con, virtio_console_rxq(id));
+}
+
+static void virtio_console_process_rx(virtio_console_t *con, uint32_t id) {
+    if (!virtio_console_can_rx(con, id)) return;
+    virt_queue_t *queue = &con->mmio.queues[virtio_console_rxq(id)];
+    virtio_console_port_t *port = &con->ports[id];
+
+    struct iovec iov[VIRTIO_CONSOLE_QUEUE_DEPTH];
+    size_t out_num;
+    uint16_t head;
+    int n;
+    while ((n = virt_queue_pop(&con->mmio, queue, &head, iov, VIRTIO_CONSOLE_QUEUE_DEPTH, &out_num)) != 0) {
+        if (n < 0) {
+            virt_queue_fill(queue, head, 0);
+            continue;
+        }
+
+        ssize_t res = virtio_console_port_read(port, iov + out_num, n - out_num);
+        if (res <= 0) {
+            // Leave the buffer for the next read.
+            virt_queue_unpop(queue);
+            if (res == 0 || (errno != EAGAIN && errno != EINTR)) {
+                virtio_console_host_disconnect(con, id);
+            }
+            break;
+        }
+
+        metric_inc(&con->stats.rx_bytes, res);
+        virt_queue_fill(queue, head, res);
+    }
+
+    virt_queue_flush(&con->mmio, queue);
+}
+
+// virtio_console_update_polling only polls a port's in_fd while its input
+// can be delivered and the guest has posted receive buffers, since the
+// level-triggered in_fd would otherwise keep the device thread spinning.
+// Likewise, out_fd is only polled for EPOLLOUT while it would block.
+static void virtio_console_update_polling(virtio_console_t *con) {
+    for (uint32_t id = 0; id < con->port_count; id++) {
+        virtio_console_port_t *port = &con->ports[id];
+
+        int polling = 0;
+        if (port->in_fd >= 0 && id < virtio_console_active_ports(con) && virtio_console_driver_ok(con) &&
+            virtio_console_can_rx(con, id)) {
+            virt_queue_t *queue = &con->mmio.queues[virtio_console_rxq(id)];
+            polling = *(volatile uint16_t*) &queue->vring.avail->idx != (uint16_t) queue->last_avail_idx;
+        }
+        int out_polling = port->out_fd >= 0 && port->tx_blocked;
+
+        // Socket backends wait for both directions on the same fd.
+        if (port->out_fd == port->in_fd) {
+            if (polling == port->polling && out_polling == port->out_polling) continue;
+            struct epoll_event event = {
+                .events = (polling ? EPOLLIN : 0) | (out_polling ? EPOLLOUT : 0),
+                .data.u32 = id,
+            };
+            if (epoll_ctl(con->epollfd, EPOLL_CTL_MOD, port->in_fd, &event) == 0) {
+                port->polling = polling;
+                port->out_polling = out_polling;
+            }
+            continue;
+        }
+
+        if (port->in_fd >= 0 && polling != port->polling) {
+            struct epoll_event event = {
+                .events = polling ? EPOLLIN : 0,
+                .data.u32 = id,
+            };
+            if (epoll_ctl(con->epollfd, EPOLL_CTL_MOD, port->in_fd, &event) == 0) {
+                port->polling = polling;
+            }
+        }
+
+        // Only fds that can block are ever added, so regular files are not.
+        if (port->out_fd >= 0 && out_polling != port->out_polling) {
+            struct epoll_event event = {
+                .events = out_polling ? EPOLLOUT : 0,
+                .data.u32 = id,
+            };
+            int op = port->out_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+            if (epoll_ctl(con->epollfd, op, port->out_fd, &event) == 0) {
+                port->out_registered = 1;
+                port->out_polling = out_polling;
+            }
+        }
+    }
+}
+
+int virtio_console_process(virtio_console_t *con) {
+    // The transport lock keeps a reset from tearing down the queues while
+    // they are processed.
+    pthread_mutex_lock(&con->mmio.mu);
+    pthread_mutex_lock(&con->mu);
+
+    uint64_t count;
+    if (read(con->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        pthread_mutex_unlock(&con->mu);
+        pthread_mutex_unlock(&con->mmio.mu);
+        return -1;
+    }
+
+    if (virtio_console_driver_ok(con)) {
+        if (virtio_console_multiport(con)) {
+            virtio_console_process_ctrl(con);
+        }
+        size_t ports = virtio_console_active_ports(con);
+        for (uint32_t id = 0; id < ports; id++) {
+            virtio_console_process_tx(con, id);
+            virtio_console_process_rx(con, id);
+        }
+        if (virtio_console_multiport(con)) {
+            virtio_console_ctrl_flush(con);
+        }
+    }
+    virtio_console_update_polling(con);
+
+    pthread_mutex_unlock(&con->mu);
+    pthread_mutex_unlock(&con->mmio.mu);
+    return 0;
+}
+
+static void virtio_console_config_read(void *dev, uint32_t offset, void *data, size_t size) {
+    virtio_console_t *con = (virtio_console_t*) dev;
+    if (offset + size > sizeof(struct virtio_console_config)) return;
+    memcpy(data, (uint8_t*) &con->config + offset, size);
+}
+
+static void virtio_console_config_write(void *dev, uint32_t offset, void *data, size_t size) {
+    virtio_console_t *con = (virtio_console_t*) dev;
+    // Emergency writes go to the console port before the queues are set up.
+    if (offset == offsetof(struct virtio_console_config, emerg_wr) && con->port_count > 0) {
+        virtio_console_port_t *port = &con->ports[0];
+        if (port->out_fd >= 0) {
+            uint8_t c = *(uint8_t*) data;
+            if (write(port->out_fd, &c, 1) < 0) {
+                // Emergency output is best effort.
+            }
+        }
+    }
+}
+
+static void virtio_console_notify(void *dev, uint32_t queue) {
+    virtio_console_t *con = (virtio_console_t*) dev;
+    if (write(con->eventfd, (void*) &(uint64_t){1}, sizeof(uint64_t)) < 0) {
+        // The eventfd counter can only overflow if the device thread is stuck.
+    }
+}
+
+static void virtio_console_reset(void *dev) {
+    virtio_console_t *con = (virtio_console_t*) dev;
+    pthread_mutex_lock(&con->mu);
+    con->pending_head = 0;
+    con->pending_len = 0;
+    for (size_t i = 0; i < con->port_count; i++) {
+        con->ports[i].guest_connected = 0;
+        con->ports[i].tx_blocked = 0;
+        con->ports[i].tx_offset = 0;
+    }
+    pthread_mutex_unlock(&con->mu);
+}
+
+static const virtio_device_ops_t virtio_console_ops = {
+    .config_read = virtio_console_config_read,
+    .config_write = virtio_console_config_write,
+    .notify = virtio_console_notify,
+    .reset = virtio_console_reset,
+};
+
+int virtio_console_init(virtio_console_t *con, uintptr_t base, uint32_t irq, mem_map_t *mem,
+                        irq_line_func irq_line, irq_arg_t irq_arg) {
+    memset(con, 0, sizeof(virtio_console_t));
+    virtio_mmio_config_init(&con->mmio, base, irq, mem, irq_line, irq_arg, &virtio_console_ops, con);
+    con->mmio.device_id = VIRTIO_DEVICE_CONSOLE;
+    con->mmio.queue_count = 2;
+    for (size_t i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        con->mmio.queues[i].num_max = VIRTIO_CONSOLE_QUEUE_DEPTH;
+    }
+    virtio_mmio_add_feature(&con->mmio, VIRTIO_CONSOLE_F_MULTIPORT);
+    virtio_mmio_add_feature(&con->mmio, VIRTIO_CONSOLE_F_EMERG_WRITE);
+
+    if (pthread_mutex_init(&con->mu, NULL) != 0) {
+        goto error0;
+    }
+
+    con->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (con->eventfd < 0) {
+        goto error1;
+    }
+
+    con->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (con->epollfd < 0) {
+        goto error2;
+    }
+
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.u32 = VIRTIO_CONSOLE_EVENTFD_KEY,
+    };
+    if (epoll_ctl(con->epollfd, EPOLL_CTL_ADD, con->eventfd, &event) < 0) {
+        goto error3;
+    }
+
+    return 0;
+
+error3:
+    close(con->epollfd);
+error2:
+    close(con->eventfd);
+error1:
+    pthread_mutex_destroy(&con->mu);
+error0:
+    return -1;
+}
+
+void virtio_console_deinit(virtio_console_t *con) {
+    for (size_t i = 0; i < con->port_count; i++) {
+        virtio_console_port_t *port = &con->ports[i];
+        if (port->in_fd > STDERR_FILENO) close(port->in_fd);
+        if (port->out_fd > STDERR_FILENO && port->out_fd != port->in_fd) close(port->out_fd);
+    }
+    close(con->epollfd);
+    close(con->eventfd);
+    pthread_mutex_destroy(&con->mu);
+}
+
+int virtio_console_add_port(virtio_console_t *con, const char *name, int in_fd, int out_fd, int is_socket) {
+    if (con->port_count == VIRTIO_CONSOLE_MAX_PORTS) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    uint32_t id = con->port_count;
+    virtio_console_port_t *port = &con->ports[id];
+    memset(port, 0, sizeof(virtio_console_port_t));
+    snprintf(port->name, sizeof(port->name), "%s", name);
+    port->in_fd = in_fd;
+    port->out_fd = out_fd;
+    port->is_socket = is_socket;
+    port->host_connected = 1;
+
+    if (in_fd >= 0) {
+        // Sockets are read with MSG_DONTWAIT so that writes remain blocking.
+        if (!is_socket) {
+            int flags = fcntl(in_fd, F_GETFL, 0);
+            if (flags < 0 || fcntl(in_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+                return -1;
+            }
+        }
+        struct epoll_event event = { .events = 0, .data.u32 = id };
+        if (epoll_ctl(con->epollfd, EPOLL_CTL_ADD, in_fd, &event) < 0) {
+            return -1;
+        }
+    }
+
+    con->port_count++;
+    con->config.max_nr_ports = con->port_count;
+    con->mmio.queue_count = 2 * (con->port_count + 1);
+    return id;
+}
+
+static int virtio_console_connect(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int virtio_console_add_port_spec(virtio_console_t *con, const char *spec) {
+    const char *backend = strchr(spec, '=');
+    if (backend == NULL || backend == spec || backend - spec >= VIRTIO_CONSOLE_PORT_NAME_LEN) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char name[VIRTIO_CONSOLE_PORT_NAME_LEN];
+    memcpy(name, spec, backend - spec);
+    name[backend - spec] = '\0';
+    backend++;
+
+    if (strcmp(backend, "stdout") == 0) {
+        return virtio_console_add_port(con, name, -1, STDOUT_FILENO, 0);
+    }
+
+    if (strncmp(backend, "file:", 5) == 0) {
+        int fd = open(backend + 5, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) return -1;
+        int res = virtio_console_add_port(con, name, -1, fd, 0);
+        if (res < 0) close(fd);
+        return res;
+    }
+
+    if (strncmp(backend, "unix:", 5) == 0) {
+        int fd = virtio_console_connect(backend + 5);
+        if (fd < 0) return -1;
+        int res = virtio_console_add_port(con, name, fd, fd, 1);
+        if (res < 0) close(fd);
+        return res;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+int virtio_console_fd(virtio_console_t *con) {
+    return con->epollfd;
+}
+
+int virtio_console_register_metrics(virtio_console_t *con, metrics_t *m, const char *labels) {
+    if (metrics_register(m, "tomu_virtio_console_tx_bytes_total", "Bytes written by the guest to host fds.",
+                         labels, METRIC_COUNTER, &con->stats.tx_bytes) < 0) return -1;
+    if (metrics_register(m, "tomu_virtio_console_rx_bytes_total", "Bytes read from host fds into the guest.",
+                         labels, METRIC_COUNTER, &con->stats.rx_bytes) < 0) return -1;
+    return virtio_mmio_register_metrics(&con->mmio, m, labels);
+}
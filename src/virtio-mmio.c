@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <virtio-mmio.h>
 #include <irq.h>
 
@@ -5,60 +7,100 @@
 #include <stdio.h>
 #include <stdatomic.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <linux/kvm.h>
 
 #include <linux/virtio_mmio.h>
 #include <linux/virtio_config.h>
-#include <linux/virtio_blk.h>
 #include <linux/virtio_ring.h>
 
 void virtio_mmio_add_feature(virtio_mmio_config_t *cfg, uint32_t flag) {
         cfg->device_features[flag / 32] |= 1 << (flag % 32);
 }
 
-struct virtio_blk_config config = {
-    .capacity = 2097152,
-};
+int virtio_mmio_has_feature(virtio_mmio_config_t *cfg, uint32_t flag) {
+    return (cfg->driver_features[flag / 32] >> (flag % 32)) & 1;
+}
 
-void virtio_mmio_config_init(virtio_mmio_config_t *cfg, void *mem, irq_line_func irq_line, irq_arg_t irq_arg) {
+void virtio_mmio_config_init(virtio_mmio_config_t *cfg, uintptr_t base, uint32_t irq, mem_map_t *mem,
+                             irq_line_func irq_line, irq_arg_t irq_arg,
+                             const virtio_device_ops_t *ops, void *dev) {
     memset(cfg, 0, sizeof(virtio_mmio_config_t));
     cfg->mem = mem;
+    cfg->base = base;
     cfg->irq_line = irq_line;
     cfg->irq_arg = irq_arg;
-    cfg->irq = 5;
-    cfg->device_id = VIRTIO_DEVICE_BLOCK;
+    cfg->irq = irq;
+    cfg->ops = ops;
+    cfg->dev = dev;
     cfg->device_features_len = 2;
     cfg->driver_features_len = 2;
-    for (size_t i = 0; i < VIRTIO_QUEUE_COUNT; i++) {
-        cfg->queues[i].num_max = VIRTIO_BLK_QUEUE_DEPTH;
+    cfg->vm_fd = -1;
+    pthread_mutex_init(&cfg->mu, NULL);
+    for (size_t i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        cfg->queues[i].num_max = VIRTIO_QUEUE_NUM_MAX;
+        cfg->queues[i].cfg = cfg;
+        cfg->queues[i].index = i;
+        cfg->queues[i].kick_fd = -1;
+        cfg->queues[i].irq_timer_fd = -1;
     }
-    // if (bdev_init(&cfg->bdev, "/dev/nvme0n1") < 0) {
-    //     perror("failed to open block device\r\n");
-    //     exit(1);
-    // }
     virtio_mmio_add_feature(cfg, VIRTIO_F_VERSION_1);
-    //virtio_mmio_add_feature(cfg, VIRTIO_BLK_F_MQ);
-    // virtio_mmio_add_feature(cfg, VIRTIO_F_RING_PACKED);
-    // virtio_mmio_add_feature(cfg, VIRTIO_BLK_F_SIZE_MAX);
-    // virtio_mmio_add_feature(cfg, VIRTIO_BLK_F_SEG_MAX);
-    // virtio_mmio_add_feature(cfg, VIRTIO_BLK_F_GEOMETRY);
-    // virtio_mmio_add_feature(cfg, VIRTIO_BLK_F_BLK_SIZE);
-    // virtio_mmio_add_feature(cfg, VIRTIO_BLK_F_FLUSH);
-    // virtio_mmio_add_feature(cfg, VIRTIO_BLK_F_TOPOLOGY);
-    // virtio_mmio_add_feature(cfg, VIRTIO_BLK_F_DISCARD);
-    // virtio_mmio_add_feature(cfg, VIRTIO_BLK_F_WRITE_ZEROES);
+}
+
+static virt_queue_t* virtio_mmio_selected_queue(virtio_mmio_config_t *cfg) {
+    if (cfg->queue_sel < cfg->queue_count) {
+        return &cfg->queues[cfg->queue_sel];
+    }
+    return NULL;
+}
+
+// virt_queue_enable translates the ring addresses programmed by the driver
+// once it marks the queue ready. A queue whose rings are not entirely backed
+// by guest memory is left disabled and the device needs a reset.
+static void virt_queue_enable(virtio_mmio_config_t *cfg, virt_queue_t *queue) {
+    uint64_t desc_table = ((uint64_t) queue->desc_hi << 32 ) | queue->desc_lo;
+    uint64_t avail_ring = ((uint64_t) queue->avail_hi << 32 ) | queue->avail_lo;
+    uint64_t used_ring = ((uint64_t) queue->used_hi << 32 ) | queue->used_lo;
+    uint32_t num = queue->vring.num;
+    if (num == 0 || num > queue->num_max) goto error0;
+
+    queue->vring.desc = mem_map_translate(cfg->mem, desc_table, sizeof(struct vring_desc) * num);
+    queue->vring.avail = mem_map_translate(cfg->mem, avail_ring,
+                                           sizeof(struct vring_avail) + sizeof(uint16_t) * (num + 1));
+    queue->vring.used = mem_map_translate(cfg->mem, used_ring,
+                                          sizeof(struct vring_used) + sizeof(vring_used_elem_t) * num +
+                                          sizeof(uint16_t));
+    if (queue->vring.desc == NULL || queue->vring.avail == NULL || queue->vring.used == NULL) goto error0;
+    queue->last_avail_idx = 0;
+    queue->used_idx = 0;
+    queue->used_pending = 0;
+    return;
+
+error0:
+    queue->ready = 0;
+    queue->vring = (struct vring) { .num = num };
+    cfg->status |= VIRTIO_CONFIG_S_NEEDS_RESET;
 }
 
 void virtio_mmio_read(virtio_mmio_config_t *cfg, uintptr_t guest_phys_addr, void *data, size_t size) {
-    if (guest_phys_addr >= X86_VIRTIO_MMIO_AREA + VIRTIO_MMIO_CONFIG && 
-        guest_phys_addr < X86_VIRTIO_MMIO_AREA + VIRTIO_MMIO_CONFIG + sizeof(struct virtio_blk_config) &&
-        guest_phys_addr + size < X86_VIRTIO_MMIO_AREA + VIRTIO_MMIO_CONFIG + sizeof(struct virtio_blk_config)) {
-        memcpy(data, &((uint8_t*)&config)[guest_phys_addr - X86_VIRTIO_MMIO_AREA - VIRTIO_MMIO_CONFIG], size);
+    if (guest_phys_addr < cfg->base) return;
+    uintptr_t offset = guest_phys_addr - cfg->base;
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        if (cfg->ops->config_read) {
+            cfg->ops->config_read(cfg->dev, offset - VIRTIO_MMIO_CONFIG, data, size);
+        }
+        return;
     }
     if (size != sizeof(uint32_t)) return;
-     if (guest_phys_addr < X86_VIRTIO_MMIO_AREA) return;
-    switch (guest_phys_addr - X86_VIRTIO_MMIO_AREA) {
+    virt_queue_t *queue = virtio_mmio_selected_queue(cfg);
+    switch (offset) {
         case VIRTIO_MMIO_MAGIC_VALUE:
             *((uint32_t*) data) = VIRTIO_MMIO_MAGIC;
             break;
@@ -79,29 +121,35 @@ void virtio_mmio_read(virtio_mmio_config_t *cfg, uintptr_t guest_phys_addr, void
             }
             break;
         case VIRTIO_MMIO_QUEUE_NUM_MAX:
-            if (cfg->queue_sel < VIRTIO_QUEUE_COUNT) {
-                *((uint32_t*) data) = cfg->queues[cfg->queue_sel].num_max;
-            } else {
-                *((uint32_t*) data) = 0;
-            }
+            *((uint32_t*) data) = queue ? queue->num_max : 0;
             break;
         case VIRTIO_MMIO_QUEUE_READY:
-            if (cfg->queue_sel < VIRTIO_QUEUE_COUNT) {
-                *((uint32_t*) data) = cfg->queues[cfg->queue_sel].ready;
-            } else {
-                *((uint32_t*) data) = 0;
-            }
+            *((uint32_t*) data) = queue ? queue->ready : 0;
             break;
         case VIRTIO_MMIO_INTERRUPT_STATUS:
-            *((uint32_t*) data) = cfg->interrupt_status;
+            *((uint32_t*) data) = atomic_load(&cfg->interrupt_status);
+            break;
+        case VIRTIO_MMIO_STATUS:
+            *((uint32_t*) data) = cfg->status;
+            break;
+        case VIRTIO_MMIO_CONFIG_GENERATION:
+            *((uint32_t*) data) = 0;
             break;
     }
 }
 
 void virtio_mmio_write(virtio_mmio_config_t *cfg, uintptr_t guest_phys_addr, void *data, size_t size) {
+    if (guest_phys_addr < cfg->base) return;
+    uintptr_t offset = guest_phys_addr - cfg->base;
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        if (cfg->ops->config_write) {
+            cfg->ops->config_write(cfg->dev, offset - VIRTIO_MMIO_CONFIG, data, size);
+        }
+        return;
+    }
     if (size != sizeof(uint32_t)) return;
-    if (guest_phys_addr < X86_VIRTIO_MMIO_AREA) return;
-    switch (guest_phys_addr - X86_VIRTIO_MMIO_AREA) {
+    virt_queue_t *queue = virtio_mmio_selected_queue(cfg);
+    switch (offset) {
         case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
             cfg->device_features_sel = *((uint32_t*) data);
             break;
@@ -117,155 +165,416 @@ void virtio_mmio_write(virtio_mmio_config_t *cfg, uintptr_t guest_phys_addr, voi
             cfg->queue_sel = *((uint32_t*) data);
             break;
         case VIRTIO_MMIO_QUEUE_NUM:
-            if (cfg->queue_sel < VIRTIO_QUEUE_COUNT) {
-                cfg->queues[cfg->queue_sel].vring.num = *((uint32_t*) data);
+            if (queue) {
+                queue->vring.num = *((uint32_t*) data);
             }
             break;
         case VIRTIO_MMIO_QUEUE_READY:
-            if (cfg->queue_sel < VIRTIO_QUEUE_COUNT) {
-                cfg->queues[cfg->queue_sel].ready = *((uint32_t*) data);
+            if (queue) {
+                queue->ready = *((uint32_t*) data);
+                if (queue->ready) {
+                    virt_queue_enable(cfg, queue);
+                }
             }
             break;
         case VIRTIO_MMIO_QUEUE_NOTIFY:
         {
-            //uint32_t queue_id = *(uint32_t*)data;
-            virt_queue_t *queue = &cfg->queues[cfg->queue_sel];
-            uintptr_t desc_table = ((uintptr_t) queue->desc_hi << 32 ) | queue->desc_lo;
-            uintptr_t avail_ring = ((uintptr_t) queue->avail_hi << 32 ) | queue->avail_lo;
-            uintptr_t used_ring = ((uintptr_t) queue->used_hi << 32 ) | queue->used_lo;
-            queue->vring.desc = (struct vring_desc*) ((uint8_t*) cfg->mem + desc_table);
-            queue->vring.avail = (struct vring_avail*) ((uint8_t*) cfg->mem + avail_ring);
-            queue->vring.used = (struct vring_used*) ((uint8_t*) cfg->mem + used_ring);
-            
-            // virt-queue synchronization between the guest and host is performed in a
-            // lock-free manner using memory fences. See sections 2.6.13 and 2.6.14 of
-            // the virtio 1.1 specification for more details.
-            //
-            //           Guest            |           Host
-            //                            |
-            // avail.ring[i] = next       | while(avail.idx != j) {
-            // fence(acquire)             |     fence(release)
-            // avail.idx = ++i            |     next = avail.ring[j++]
-            //                            |     ...
-            //                            | }
-            while(queue->vring.avail->idx != queue->last_avail_idx) {
-                atomic_thread_fence(memory_order_acquire);
-                uint32_t buffer_id = queue->vring.avail->ring[queue->last_avail_idx++ % queue->vring.num];
-
-                struct iovec iov[VIRTIO_BLK_QUEUE_DEPTH];
-                size_t n = 0;
-
-                uint32_t iter = buffer_id;
-                while (queue->vring.desc[iter].flags & VRING_DESC_F_NEXT) {
-                    if (n == VIRTIO_BLK_QUEUE_DEPTH) {
-                        // printf("invalid next\r\n");
-                        // fflush(stdout);
-                        exit(1);
-                    }
-
-                    iov[n++] = (struct iovec) {
-                        .iov_base =  (uint8_t*) cfg->mem + queue->vring.desc[iter].addr,
-                        .iov_len = queue->vring.desc[iter].len
-                    };
-                    
-                    iter = queue->vring.desc[iter].next;
-                    if (iter >= VIRTIO_BLK_QUEUE_DEPTH) {
-                        printf("invalid next\r\n");
-                        fflush(stdout);
-                        exit(1);
-                    }
-                }
-                iov[n++] = (struct iovec) {
-                    .iov_base =  (uint8_t*) cfg->mem + queue->vring.desc[iter].addr,
-                    .iov_len = queue->vring.desc[iter].len
-                };
-
-                struct virtio_blk_outhdr* hdr = (struct virtio_blk_outhdr*) iov[0].iov_base;
-                switch (hdr->type) {
-                case VIRTIO_BLK_T_IN:
-                   // bdev_read(&cfg->bdev, iov[1].iov_base, iov[1].iov_len, hdr->sector * 512);
-                  //  printf("read [%04x] of size [%04x]\r\n", hdr->sector, iov[1].iov_len);
-                   // fflush(stdout);
-                    break;
-                case VIRTIO_BLK_T_OUT:
-                  //  bdev_write(&cfg->bdev, iov[1].iov_base, iov[1].iov_len, hdr->sector * 512);
-                   // printf("write [%04x] of size [%04x]\r\n", hdr->sector, iov[1].iov_len);
-                   // fflush(stdout);
-                    break;
-                default:
-                  //  printf("unknown blk io type %d\r\n", hdr->type);
-                  //  fflush(stdout);
-                  break;
-                }
-                //printf("completing io %d %d %d\r\n", buffer_id, n, iov[n - 1].iov_len);
-                fflush(stdout);
-                *((uint8_t*) iov[n - 1].iov_base) = VIRTIO_BLK_S_OK;
-                queue->vring.used->ring[queue->vring.used->idx] = (vring_used_elem_t) {
-                    .id = buffer_id,
-                    .len = n,
-                };
-                atomic_thread_fence(memory_order_release);
-                queue->vring.used->idx++;
-
-                cfg->interrupt_status |= VIRTIO_MMIO_INT_VRING;
-                cfg->irq_line(cfg->irq, 1, cfg->irq_arg);
-	            cfg->irq_line(cfg->irq, 0, cfg->irq_arg);
-            }
-            
-            // TODO: Writing a value to this register notifies the
-            // device that there are new buffers to process in a queue.
-            // When VIRTIO_F_NOTIFICATION_DATA has not been negotiated,
-            // the value written is the queue index.
+            // When VIRTIO_F_NOTIFICATION_DATA has not been negotiated, the
+            // value written is the queue index.
+            uint32_t queue_id = *((uint32_t*) data);
+            if (queue_id >= cfg->queue_count || !cfg->queues[queue_id].ready) break;
+            metric_inc(&cfg->queues[queue_id].stats.notifies, 1);
+            pthread_mutex_lock(&cfg->mu);
+            cfg->ops->notify(cfg->dev, queue_id);
+            pthread_mutex_unlock(&cfg->mu);
             break;
         }
         case VIRTIO_MMIO_INTERRUPT_ACK:
-            cfg->interrupt_status &= ~*((uint32_t*) data);
+            atomic_fetch_and(&cfg->interrupt_status, ~*((uint32_t*) data));
             break;
         case VIRTIO_MMIO_STATUS:
             {
                 uint32_t value = *((uint32_t*) data);
                 if (value) {
                     cfg->status = value;
+                    if (cfg->ops->status) {
+                        pthread_mutex_lock(&cfg->mu);
+                        cfg->ops->status(cfg->dev, value);
+                        pthread_mutex_unlock(&cfg->mu);
+                    }
                 } else {
                     virtio_mmio_reset(cfg);
                 }
             }
             break;
         case VIRTIO_MMIO_QUEUE_DESC_LOW:
-            if (cfg->queue_sel < VIRTIO_QUEUE_COUNT) {
-                cfg->queues[cfg->queue_sel].desc_lo = *((uint32_t*) data);
+            if (queue) {
+                queue->desc_lo = *((uint32_t*) data);
             }
             break;
         case VIRTIO_MMIO_QUEUE_DESC_HIGH:
-            if (cfg->queue_sel < VIRTIO_QUEUE_COUNT) {
-                cfg->queues[cfg->queue_sel].desc_hi = *((uint32_t*) data);
+            if (queue) {
+                queue->desc_hi = *((uint32_t*) data);
             }
             break;
         case VIRTIO_MMIO_QUEUE_AVAIL_LOW:
-            if (cfg->queue_sel < VIRTIO_QUEUE_COUNT) {
-                cfg->queues[cfg->queue_sel].avail_lo = *((uint32_t*) data);
+            if (queue) {
+                queue->avail_lo = *((uint32_t*) data);
             }
             break;
         case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
-            if (cfg->queue_sel < VIRTIO_QUEUE_COUNT) {
-                cfg->queues[cfg->queue_sel].avail_hi = *((uint32_t*) data);
+            if (queue) {
+                queue->avail_hi = *((uint32_t*) data);
             }
             break;
         case VIRTIO_MMIO_QUEUE_USED_LOW:
-            if (cfg->queue_sel < VIRTIO_QUEUE_COUNT) {
-                cfg->queues[cfg->queue_sel].used_lo = *((uint32_t*) data);
+            if (queue) {
+                queue->used_lo = *((uint32_t*) data);
             }
             break;
         case VIRTIO_MMIO_QUEUE_USED_HIGH:
-            if (cfg->queue_sel < VIRTIO_QUEUE_COUNT) {
-                cfg->queues[cfg->queue_sel].used_hi = *((uint32_t*) data);
+            if (queue) {
+                queue->used_hi = *((uint32_t*) data);
             }
             break;
     }
 }
 
 void virtio_mmio_reset(virtio_mmio_config_t *cfg) {
-    printf("virtio-mmio device reset\r\n");
-    fflush(stdout);
-    // TODO: Reset appropriately
+    pthread_mutex_lock(&cfg->mu);
+    // Quiesce the device before tearing down the queues it may be using.
+    if (cfg->ops->reset) {
+        cfg->ops->reset(cfg->dev);
+    }
+
+    cfg->status = 0;
+    cfg->queue_sel = 0;
+    cfg->device_features_sel = 0;
+    cfg->driver_features_sel = 0;
+    memset(cfg->driver_features, 0, sizeof(cfg->driver_features));
+    atomic_store(&cfg->interrupt_status, 0);
+    for (size_t i = 0; i < cfg->queue_count; i++) {
+        virt_queue_t *queue = &cfg->queues[i];
+        queue->ready = 0;
+        queue->last_avail_idx = 0;
+        queue->used_idx = 0;
+        queue->used_pending = 0;
+        atomic_store(&queue->irq_pending, 0);
+        queue->vring = (struct vring) {0};
+        queue->desc_lo = queue->desc_hi = 0;
+        queue->avail_lo = queue->avail_hi = 0;
+        queue->used_lo = queue->used_hi = 0;
+    }
+    pthread_mutex_unlock(&cfg->mu);
+}
+
+static void virt_queue_kick(void *arg, uint32_t events) {
+    virt_queue_t *queue = arg;
+    virtio_mmio_config_t *cfg = queue->cfg;
+
+    uint64_t count;
+    if (read(queue->kick_fd, &count, sizeof(count)) < 0) return;
+    metric_inc(&queue->stats.notifies, 1);
+
+    pthread_mutex_lock(&cfg->mu);
+    if (queue->ready) {
+        cfg->ops->notify(cfg->dev, queue->index);
+    }
+    pthread_mutex_unlock(&cfg->mu);
+}
+
+// virt_queue_irq_timeout interrupts the driver for the completions still
+// pending when the moderation delay expires.
+static void virt_queue_irq_timeout(void *arg, uint32_t events) {
+    virt_queue_t *queue = arg;
+
+    uint64_t count;
+    if (read(queue->irq_timer_fd, &count, sizeof(count)) < 0) return;
+
+    // Disarm before taking the pending completions, so that a flush racing
+    // with the timeout either is taken here or arms the timer again.
+    atomic_store(&queue->irq_armed, 0);
+    if (atomic_exchange(&queue->irq_pending, 0) > 0) {
+        metric_inc(&queue->stats.irq_timeouts, 1);
+        virtio_mmio_interrupt(queue->cfg, queue);
+    }
+}
+
+void virtio_mmio_set_irqmod(virtio_mmio_config_t *cfg, const irqmod_config_t *config) {
+    for (size_t i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        irqmod_init(&cfg->queues[i].irqmod, config);
+    }
+}
+
+static int virtio_mmio_ioeventfd(virtio_mmio_config_t *cfg, virt_queue_t *queue, int vm_fd, uint32_t flags) {
+    struct kvm_ioeventfd ioeventfd = {
+        .datamatch = queue->index,
+        .addr = cfg->base + VIRTIO_MMIO_QUEUE_NOTIFY,
+        .len = 4,
+        .fd = queue->kick_fd,
+        .flags = KVM_IOEVENTFD_FLAG_DATAMATCH | flags,
+    };
+    return ioctl(vm_fd, KVM_IOEVENTFD, &ioeventfd);
+}
+
+int virtio_mmio_attach_queue(virtio_mmio_config_t *cfg, uint32_t queue_id, int vm_fd, event_loop_t *loop) {
+    if (queue_id >= cfg->queue_count) {
+        errno = EINVAL;
+        goto error0;
+    }
+    virt_queue_t *queue = &cfg->queues[queue_id];
+
+    queue->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->kick_fd < 0) goto error0;
+
+    if (loop != NULL) {
+        queue->kick = event_loop_add_fd(loop, queue->kick_fd, EPOLLIN, virt_queue_kick, queue);
+        if (queue->kick == NULL) goto error1;
+    }
+
+    if (loop != NULL && queue->irqmod.config.usecs > 0) {
+        queue->irq_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (queue->irq_timer_fd < 0) goto error2;
+        queue->irq_timer = event_loop_add_fd(loop, queue->irq_timer_fd, EPOLLIN, virt_queue_irq_timeout, queue);
+        if (queue->irq_timer == NULL) goto error3;
+    }
+
+    if (virtio_mmio_ioeventfd(cfg, queue, vm_fd, 0) < 0) goto error4;
+
+    queue->loop = loop;
+    cfg->vm_fd = vm_fd;
+    return 0;
+
+error4:
+    if (queue->irq_timer != NULL) event_loop_remove(loop, queue->irq_timer);
+    queue->irq_timer = NULL;
+error3:
+    if (queue->irq_timer_fd >= 0) close(queue->irq_timer_fd);
+    queue->irq_timer_fd = -1;
+error2:
+    if (queue->kick != NULL) event_loop_remove(loop, queue->kick);
+    queue->kick = NULL;
+error1:
+    close(queue->kick_fd);
+    queue->kick_fd = -1;
+error0:
+    return -1;
+}
+
+void virtio_mmio_detach(virtio_mmio_config_t *cfg) {
+    for (size_t i = 0; i < cfg->queue_count; i++) {
+        virt_queue_t *queue = &cfg->queues[i];
+        if (queue->kick_fd < 0) continue;
+        virtio_mmio_ioeventfd(cfg, queue, cfg->vm_fd, KVM_IOEVENTFD_FLAG_DEASSIGN);
+        if (queue->kick != NULL) event_loop_remove(queue->loop, queue->kick);
+        close(queue->kick_fd);
+        queue->kick_fd = -1;
+        queue->kick = NULL;
+        if (queue->irq_timer != NULL) {
+            event_loop_remove(queue->loop, queue->irq_timer);
+            close(queue->irq_timer_fd);
+            queue->irq_timer_fd = -1;
+            queue->irq_timer = NULL;
+        }
+        queue->loop = NULL;
+    }
+}
+
+void virtio_mmio_interrupt(virtio_mmio_config_t *cfg, virt_queue_t *queue) {
+    atomic_fetch_or(&cfg->interrupt_status, VIRTIO_MMIO_INT_VRING);
+    metric_inc(&queue->stats.interrupts, 1);
+    cfg->irq_line(cfg->irq, 1, cfg->irq_arg);
+    cfg->irq_line(cfg->irq, 0, cfg->irq_arg);
+}
+
+// virt_queue_walk translates the descriptor chain starting at `head` into
+// at most `iov_len` iovecs, returning their number, or -1 if the chain is
+// malformed. errno is set to ENOBUFS if the chain needs more iovecs.
+static int virt_queue_walk(virtio_mmio_config_t *cfg, virt_queue_t *queue, uint16_t head,
+                           struct iovec *iov, size_t iov_len, size_t *out_num) {
+    size_t n = 0;
+    size_t readable = 0;
+    uint16_t iter = head;
+    while (1) {
+        if (iter >= queue->vring.num) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (n == iov_len) {
+            errno = ENOBUFS;
+            return -1;
+        }
+
+        struct vring_desc *desc = &queue->vring.desc[iter];
+        int count = 1;
+        if (desc->len == 0) {
+            iov[n] = (struct iovec) { .iov_base = NULL, .iov_len = 0 };
+        } else {
+            count = mem_map_translate_iov(cfg->mem, desc->addr, desc->len, iov + n, iov_len - n);
+            if (count < 0) return -1;
+        }
+        // Device-readable buffers must precede device-writable buffers.
+        if (!(desc->flags & VRING_DESC_F_WRITE)) {
+            if (readable != n) {
+                errno = EINVAL;
+                return -1;
+            }
+            readable += count;
+        }
+        n += count;
+
+        if (!(desc->flags & VRING_DESC_F_NEXT)) break;
+        iter = desc->next;
+        __builtin_prefetch(&queue->vring.desc[iter]);
+    }
+
+    *out_num = readable;
+    return n;
+}
+
+int virt_queue_pop(virtio_mmio_config_t *cfg, virt_queue_t *queue, uint16_t *head,
+                   struct iovec *iov, size_t iov_len, size_t *out_num) {
+    // virt-queue synchronization between the guest and host is performed in a
+    // lock-free manner using memory fences. See sections 2.6.13 and 2.6.14 of
+    // the virtio 1.1 specification for more details.
+    //
+    //           Guest            |           Host
+    //                            |
+    // avail.ring[i] = next       | while(avail.idx != j) {
+    // fence(release)             |     fence(acquire)
+    // avail.idx = ++i            |     next = avail.ring[j++]
+    //                            |     ...
+    //                            | }
+    if (*(volatile uint16_t*) &queue->vring.avail->idx == (uint16_t) queue->last_avail_idx) {
+        return 0;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    uint16_t buffer_id = queue->vring.avail->ring[queue->last_avail_idx++ % queue->vring.num];
+    metric_inc(&queue->stats.requests, 1);
+    *head = buffer_id;
+    return virt_queue_walk(cfg, queue, buffer_id, iov, iov_len, out_num);
+}
+
+size_t virt_queue_pop_batch(virtio_mmio_config_t *cfg, virt_queue_t *queue, virt_queue_batch_t *batch) {
+    batch->count = 0;
+    // A single acquire of the available index covers every entry up to it,
+    // as in virt_queue_pop.
+    uint16_t avail_idx = *(volatile uint16_t*) &queue->vring.avail->idx;
+    uint16_t count = avail_idx - (uint16_t) queue->last_avail_idx;
+    if (count == 0) return 0;
+    atomic_thread_fence(memory_order_acquire);
+    // A driver cannot make more chains available than the queue holds.
+    if (count > queue->vring.num) count = queue->vring.num;
+
+    // Start loading the head descriptors while the ring entries are read, so
+    // that the walks below do not stall on each of them in turn.
+    for (uint16_t i = 0; i < count; i++) {
+        uint16_t head = queue->vring.avail->ring[(uint16_t) (queue->last_avail_idx + i) % queue->vring.num];
+        batch->elems[i].head = head;
+        if (head < queue->vring.num) __builtin_prefetch(&queue->vring.desc[head]);
+    }
+
+    size_t iov_used = 0;
+    for (uint16_t i = 0; i < count; i++) {
+        virt_queue_elem_t *elem = &batch->elems[i];
+        elem->iov = batch->iov + iov_used;
+        elem->out_num = 0;
+        elem->iovcnt = virt_queue_walk(cfg, queue, elem->head, elem->iov, VIRTIO_QUEUE_NUM_MAX - iov_used,
+                                       &elem->out_num);
+        // Descriptors split across memory slots can take more iovecs than
+        // are left, the chain then starts the next batch. Only a chain that
+        // does not fit an empty batch is malformed.
+        if (elem->iovcnt < 0 && errno == ENOBUFS && iov_used > 0) {
+            count = i;
+            break;
+        }
+        if (elem->iovcnt > 0) iov_used += elem->iovcnt;
+    }
+
+    queue->last_avail_idx += count;
+    metric_inc(&queue->stats.requests, count);
+    batch->count = count;
+    return count;
+}
+
+void virt_queue_unpop(virt_queue_t *queue) {
+    queue->last_avail_idx--;
+}
+
+void virt_queue_fill(virt_queue_t *queue, uint16_t head, uint32_t len) {
+    queue->vring.used->ring[queue->used_idx++ % queue->vring.num] = (vring_used_elem_t) {
+        .id = head,
+        .len = len,
+    };
+    queue->used_pending++;
+}
+
+size_t virt_queue_publish(virt_queue_t *queue) {
+    size_t pending = queue->used_pending;
+    if (pending == 0) return 0;
+    // The used elements must be visible before the index that covers them.
+    atomic_thread_fence(memory_order_release);
+    *(volatile uint16_t*) &queue->vring.used->idx = queue->used_idx;
+    queue->used_pending = 0;
+    return pending;
+}
+
+// virt_queue_signal interrupts the driver for `count` published completions
+// once the moderation limits of `queue` are reached.
+static void virt_queue_signal(virtio_mmio_config_t *cfg, virt_queue_t *queue, size_t count) {
+    if (queue->irq_timer == NULL) {
+        virtio_mmio_interrupt(cfg, queue);
+        return;
+    }
+
+    irqmod_sample(&queue->irqmod, count);
+    uint64_t usecs = atomic_load_explicit(&queue->irqmod.usecs, memory_order_relaxed);
+    uint64_t frames = atomic_load_explicit(&queue->irqmod.frames, memory_order_relaxed);
+    uint32_t pending = atomic_fetch_add(&queue->irq_pending, count) + count;
+    if (usecs == 0 || (frames != 0 && pending >= frames)) {
+        if (atomic_exchange(&queue->irq_pending, 0) > 0) virtio_mmio_interrupt(cfg, queue);
+        return;
+    }
+
+    if (!atomic_exchange(&queue->irq_armed, 1)) {
+        struct itimerspec spec = {
+            .it_value = { .tv_sec = usecs / 1000000, .tv_nsec = (usecs % 1000000) * 1000 },
+        };
+        timerfd_settime(queue->irq_timer_fd, 0, &spec, NULL);
+    }
+}
+
+size_t virt_queue_flush(virtio_mmio_config_t *cfg, virt_queue_t *queue) {
+    size_t pending = virt_queue_publish(queue);
+    if (pending > 0) virt_queue_signal(cfg, queue, pending);
+    return pending;
+}
+
+void virt_queue_push(virt_queue_t *queue, uint16_t head, uint32_t len) {
+    virt_queue_fill(queue, head, len);
+    virt_queue_publish(queue);
+}
+
+int virtio_mmio_register_metrics(virtio_mmio_config_t *cfg, metrics_t *m, const char *labels) {
+    for (size_t i = 0; i < cfg->queue_count; i++) {
+        virt_queue_t *queue = &cfg->queues[i];
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%s%svq=\"%zu\"", labels ? labels : "", labels && *labels ? "," : "", i);
+
+        if (metrics_register(m, "tomu_virtqueue_notifies_total", "Queue notifications from the driver.",
+                             buf, METRIC_COUNTER, &queue->stats.notifies) < 0) return -1;
+        if (metrics_register(m, "tomu_virtqueue_requests_total", "Available ring entries processed.",
+                             buf, METRIC_COUNTER, &queue->stats.requests) < 0) return -1;
+        if (metrics_register(m, "tomu_virtqueue_interrupts_total", "Used ring interrupts raised.",
+                             buf, METRIC_COUNTER, &queue->stats.interrupts) < 0) return -1;
+        if (queue->irqmod.config.usecs == 0) continue;
+        if (metrics_register(m, "tomu_virtqueue_irq_timeouts_total",
+                             "Interrupts raised by the moderation timer rather than the frame limit.",
+                             buf, METRIC_COUNTER, &queue->stats.irq_timeouts) < 0) return -1;
+        if (metrics_register(m, "tomu_virtqueue_irq_usecs", "Current interrupt moderation delay.",
+                             buf, METRIC_GAUGE, &queue->irqmod.usecs) < 0) return -1;
+        if (metrics_register(m, "tomu_virtqueue_irq_frames", "Current interrupt moderation frame limit.",
+                             buf, METRIC_GAUGE, &queue->irqmod.frames) < 0) return -1;
+    }
+    return 0;
 }
@@ -0,0 +1,564 @@
+#define _GNU_SOURCE
+
+#include <virtio-net.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/random.h>
+
+#include <linux/virtio_config.h>
+
+#define VIRTIO_NET_HDR_LEN sizeof(struct virtio_net_hdr_v1)
+
+static uint32_t virtio_net_rxq(uint32_t pair) {
+    return 2 * pair;
+}
+
+static uint32_t virtio_net_txq(uint32_t pair) {
+    return 2 * pair + 1;
+}
+
+// virtio_net_ctrlq returns the index of the control queue, which follows
+// every queue pair with VIRTIO_NET_F_MQ and the first one otherwise.
+static uint32_t virtio_net_ctrlq(virtio_net_t *net) {
+    return virtio_mmio_has_feature(&net->mmio, VIRTIO_NET_F_MQ) ? 2 * net->queue_pairs : 2;
+}
+
+static uint64_t virtio_net_driver_features(virtio_net_t *net) {
+    return net->mmio.driver_features[0] | (uint64_t) net->mmio.driver_features[1] << 32;
+}
+
+// iov_from_buf copies `len` bytes of `buf` into `iov`.
+static size_t iov_from_buf(struct iovec *iov, size_t iovcnt, const void *buf, size_t len) {
+    size_t copied = 0;
+    for (size_t i = 0; i < iovcnt && copied < len; i++) {
+        size_t n = len - copied < iov[i].iov_len ? len - copied : iov[i].iov_len;
+        memcpy(iov[i].iov_base, (const uint8_t*) buf + copied, n);
+        copied += n;
+    }
+    return copied;
+}
+
+// iov_to_buf copies up to `len` bytes of `iov` into `buf`.
+static size_t iov_to_buf(const struct iovec *iov, size_t iovcnt, void *buf, size_t len) {
+    size_t copied = 0;
+    for (size_t i = 0; i < iovcnt && copied < len; i++) {
+        size_t n = len - copied < iov[i].iov_len ? len - copied : iov[i].iov_len;
+        memcpy((uint8_t*) buf + copied, iov[i].iov_base, n);
+        copied += n;
+    }
+    return copied;
+}
+
+// iov_byte returns the byte at `offset` of `iov`, which must be in range.
+static uint8_t* iov_byte(struct iovec *iov, size_t offset) {
+    while (offset >= iov->iov_len) {
+        offset -= iov->iov_len;
+        iov++;
+    }
+    return (uint8_t*) iov->iov_base + offset;
+}
+
+static void virtio_net_config_read(void *dev, uint32_t offset, void *data, size_t size) {
+    virtio_net_t *net = (virtio_net_t*) dev;
+    if (offset + size > sizeof(struct virtio_net_config)) return;
+    memcpy(data, (uint8_t*) &net->config + offset, size);
+}
+
+static void virtio_net_update_events(virtio_net_pair_t *pair) {
+    if (pair->backend == NULL) return;
+    uint32_t events = (pair->rx_blocked ? 0 : EPOLLIN) | (pair->tx_blocked ? EPOLLOUT : 0);
+    if (events == pair->events) return;
+    if (event_loop_mod(pair->loop, pair->backend, events) == 0) pair->events = events;
+}
+
+// virtio_net_backend_down stops polling a backend queue that hung up or
+// failed. Frames sent to it are dropped from then on.
+static void virtio_net_backend_down(virtio_net_pair_t *pair) {
+    if (pair->backend == NULL) return;
+    printf("virtio-net queue %u backend disconnected\r\n", pair->index);
+    fflush(stdout);
+    event_loop_remove(pair->loop, pair->backend);
+    pair->backend = NULL;
+    pair->tx_blocked = 0;
+}
+
+static void virtio_net_tx(virtio_net_pair_t *pair) {
+    virtio_net_t *net = pair->net;
+    virt_queue_t *vq = &net->mmio.queues[virtio_net_txq(pair->index)];
+    virt_queue_batch_t *batch = &pair->batch;
+    if (pair->tx_blocked) return;
+
+    while (!pair->tx_blocked && virt_queue_pop_batch(&net->mmio, vq, batch) != 0) {
+        for (size_t i = 0; i < batch->count; i++) {
+            virt_queue_elem_t *elem = &batch->elems[i];
+            if (elem->iovcnt <= 0 || elem->out_num == 0) {
+                metric_inc(&net->stats.tx_dropped, 1);
+                virt_queue_fill(vq, elem->head, 0);
+                continue;
+            }
+
+            ssize_t res = net_backend_send(net->backend, pair->index, elem->iov, elem->out_num);
+            if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && pair->backend != NULL) {
+                // Leave the rest of the batch to the driver until the
+                // backend drains.
+                for (size_t j = i; j < batch->count; j++) {
+                    virt_queue_unpop(vq);
+                }
+                pair->tx_blocked = 1;
+                break;
+            }
+            if (res < (ssize_t) VIRTIO_NET_HDR_LEN) {
+                metric_inc(&net->stats.tx_dropped, 1);
+            } else {
+                metric_inc(&net->stats.tx_frames, 1);
+                metric_inc(&net->stats.tx_bytes, res - VIRTIO_NET_HDR_LEN);
+            }
+            virt_queue_fill(vq, elem->head, 0);
+        }
+    }
+    virt_queue_flush(&net->mmio, vq);
+}
+
+/**
+ * virtio_net_csum completes the partial checksum of a received frame for a
+ * driver that did not negotiate VIRTIO_NET_F_GUEST_CSUM. The checksum field
+ * holds the sum of the pseudo-header, so the sum from csum_start on is the
+ * full checksum.
+ */
+static int virtio_net_csum(struct iovec *iov, size_t iovcnt, size_t len, struct virtio_net_hdr_v1 *hdr) {
+    size_t start = VIRTIO_NET_HDR_LEN + hdr->csum_start;
+    size_t field = start + hdr->csum_offset;
+    if (field + sizeof(uint16_t) > len) return -1;
+
+    uint64_t sum = 0;
+    size_t pos = 0;
+    for (size_t i = 0; i < iovcnt && pos < len; i++) {
+        const uint8_t *data = iov[i].iov_base;
+        for (size_t j = 0; j < iov[i].iov_len && pos < len; j++, pos++) {
+            if (pos < start) continue;
+            sum += (pos - start) % 2 ? data[j] : (uint64_t) data[j] << 8;
+        }
+    }
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    // A zero checksum is sent as its other one's complement form, which
+    // UDP requires and TCP accepts.
+    uint16_t csum = ~sum ? ~sum : 0xffff;
+    *iov_byte(iov, field) = csum >> 8;
+    *iov_byte(iov, field + 1) = csum & 0xff;
+    hdr->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    return 0;
+}
+
+/**
+ * virtio_net_rx_offload checks a received frame against the offloads the
+ * driver negotiated. A seqpacket peer sends frames as its own driver built
+ * them, which may leave the checksum or the segmentation to the receiver.
+ *
+ * \return 0 if the frame can be passed to the driver, -1 if it must be
+ *         dropped.
+ */
+static int virtio_net_rx_offload(virtio_net_t *net, struct iovec *iov, size_t iovcnt, size_t len,
+                                 struct virtio_net_hdr_v1 *hdr) {
+    if (hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+        uint32_t feature;
+        switch (hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+        case VIRTIO_NET_HDR_GSO_TCPV4:
+            feature = VIRTIO_NET_F_GUEST_TSO4;
+            break;
+        case VIRTIO_NET_HDR_GSO_TCPV6:
+            feature = VIRTIO_NET_F_GUEST_TSO6;
+            break;
+        default:
+            return -1;
+        }
+        if (!virtio_mmio_has_feature(&net->mmio, feature)) return -1;
+        if ((hdr->gso_type & VIRTIO_NET_HDR_GSO_ECN) &&
+            !virtio_mmio_has_feature(&net->mmio, VIRTIO_NET_F_GUEST_ECN)) return -1;
+    }
+    if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+        !virtio_mmio_has_feature(&net->mmio, VIRTIO_NET_F_GUEST_CSUM)) {
+        return virtio_net_csum(iov, iovcnt, len, hdr);
+    }
+    return 0;
+}
+
+// virtio_net_rx_target returns the buffer space to gather before receiving
+// a frame into merged buffers.
+static size_t virtio_net_rx_target(virtio_net_t *net) {
+    if (virtio_mmio_has_feature(&net->mmio, VIRTIO_NET_F_GUEST_TSO4) ||
+        virtio_mmio_has_feature(&net->mmio, VIRTIO_NET_F_GUEST_TSO6)) {
+        return VIRTIO_NET_MAX_FRAME;
+    }
+    return VIRTIO_NET_MAX_MTU_FRAME;
+}
+
+/**
+ * virtio_net_rx_gather pops receive buffers until the next frame fits them.
+ *
+ * \return 1 if a frame can be received, 0 if the driver must post more
+ *         buffers first.
+ */
+static int virtio_net_rx_gather(virtio_net_pair_t *pair, virt_queue_t *vq, int mergeable, size_t target) {
+    virtio_net_t *net = pair->net;
+    while (mergeable ? pair->rx_space < target : pair->rx_chain_count == 0) {
+        // Buffers for a smaller frame are all the driver can post.
+        if (pair->rx_chain_count == vq->vring.num ||
+            pair->rx_iovcnt > VIRTIO_NET_RX_IOV - VIRTIO_QUEUE_NUM_MAX) return 1;
+
+        uint16_t head;
+        size_t out_num;
+        struct iovec *iov = pair->rx_iov + pair->rx_iovcnt;
+        int n = virt_queue_pop(&net->mmio, vq, &head, iov, VIRTIO_NET_RX_IOV - pair->rx_iovcnt, &out_num);
+        if (n == 0) return 0;
+        if (n < 0 || out_num != 0) {
+            printf("invalid virtio-net receive buffer\r\n");
+            fflush(stdout);
+            virt_queue_fill(vq, head, 0);
+            continue;
+        }
+
+        size_t len = 0;
+        for (int i = 0; i < n; i++) {
+            len += iov[i].iov_len;
+        }
+        pair->rx_chains[pair->rx_chain_count++] = (virtio_net_rx_chain_t) {
+            .head = head,
+            .iovcnt = n,
+            .len = len,
+        };
+        pair->rx_iovcnt += n;
+        pair->rx_space += len;
+    }
+    return 1;
+}
+
+/**
+ * virtio_net_rx receives frames from the backend queue of `pair` until it
+ * is empty or the driver runs out of receive buffers. A frame spans as many
+ * merged buffers as it needs, or a single buffer otherwise.
+ */
+static void virtio_net_rx(virtio_net_pair_t *pair) {
+    virtio_net_t *net = pair->net;
+    virt_queue_t *vq = &net->mmio.queues[virtio_net_rxq(pair->index)];
+    int mergeable = virtio_mmio_has_feature(&net->mmio, VIRTIO_NET_F_MRG_RXBUF);
+    size_t target = virtio_net_rx_target(net);
+
+    while (pair->backend != NULL) {
+        if (!virtio_net_rx_gather(pair, vq, mergeable, target)) {
+            pair->rx_blocked = 1;
+            break;
+        }
+
+        size_t iovcnt = mergeable ? pair->rx_iovcnt : pair->rx_chains[0].iovcnt;
+        ssize_t len = net_backend_recv(net->backend, pair->index, pair->rx_iov, iovcnt);
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (len < 0 && (errno == EMSGSIZE || errno == EFAULT || errno == EINVAL)) {
+            // The frame did not fit the buffers, which are reused.
+            metric_inc(&net->stats.rx_dropped, 1);
+            continue;
+        }
+        if (len <= 0) {
+            virtio_net_backend_down(pair);
+            break;
+        }
+
+        struct virtio_net_hdr_v1 hdr;
+        if (iov_to_buf(pair->rx_iov, iovcnt, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            virtio_net_rx_offload(net, pair->rx_iov, iovcnt, len, &hdr) < 0) {
+            metric_inc(&net->stats.rx_dropped, 1);
+            continue;
+        }
+
+        // Complete the buffers the frame filled, and keep the rest for the
+        // next one.
+        size_t used = 0;
+        size_t used_iovcnt = 0;
+        size_t remaining = len;
+        do {
+            virtio_net_rx_chain_t *chain = &pair->rx_chains[used++];
+            size_t written = remaining < chain->len ? remaining : chain->len;
+            virt_queue_fill(vq, chain->head, written);
+            used_iovcnt += chain->iovcnt;
+            pair->rx_space -= chain->len;
+            remaining -= written;
+        } while (remaining > 0 && used < pair->rx_chain_count);
+
+        hdr.num_buffers = used;
+        iov_from_buf(pair->rx_iov, iovcnt, &hdr, sizeof(hdr));
+
+        pair->rx_chain_count -= used;
+        pair->rx_iovcnt -= used_iovcnt;
+        memmove(pair->rx_chains, pair->rx_chains + used, pair->rx_chain_count * sizeof(virtio_net_rx_chain_t));
+        memmove(pair->rx_iov, pair->rx_iov + used_iovcnt, pair->rx_iovcnt * sizeof(struct iovec));
+        metric_inc(&net->stats.rx_frames, 1);
+        metric_inc(&net->stats.rx_bytes, len - VIRTIO_NET_HDR_LEN);
+    }
+    virt_queue_flush(&net->mmio, vq);
+}
+
+static void virtio_net_backend_ready(void *arg, uint32_t events) {
+    virtio_net_pair_t *pair = arg;
+    virtio_net_t *net = pair->net;
+
+    pthread_mutex_lock(&net->mmio.mu);
+    if (events & EPOLLOUT) {
+        pair->tx_blocked = 0;
+        if (net->mmio.queues[virtio_net_txq(pair->index)].ready) virtio_net_tx(pair);
+    }
+    if ((events & EPOLLIN) && net->mmio.queues[virtio_net_rxq(pair->index)].ready) {
+        virtio_net_rx(pair);
+    } else if (events & (EPOLLHUP | EPOLLERR)) {
+        virtio_net_backend_down(pair);
+    }
+    virtio_net_update_events(pair);
+    pthread_mutex_unlock(&net->mmio.mu);
+}
+
+// virtio_net_vhost_call relays the used buffer notification of a queue
+// served by vhost-net.
+static void virtio_net_vhost_call(void *arg, uint32_t events) {
+    virt_queue_t *queue = arg;
+    virtio_net_t *net = queue->cfg->dev;
+
+    uint64_t count;
+    if (read(net->vhost.call_fds[queue->index / 2][queue->index % 2], &count, sizeof(count)) < 0) return;
+    virtio_mmio_interrupt(queue->cfg, queue);
+}
+
+static void virtio_net_ctrl(virtio_net_t *net, virt_queue_t *vq) {
+    uint16_t head;
+    struct iovec iov[8];
+    size_t out_num;
+    int n;
+    while ((n = virt_queue_pop(&net->mmio, vq, &head, iov, 8, &out_num)) != 0) {
+        if (n < 0 || (size_t) n == out_num) {
+            printf("invalid virtio-net control command\r\n");
+            fflush(stdout);
+            virt_queue_fill(vq, head, 0);
+            continue;
+        }
+
+        struct {
+            struct virtio_net_ctrl_hdr hdr;
+            struct virtio_net_ctrl_mq mq;
+        } __attribute__((packed)) cmd;
+        size_t len = iov_to_buf(iov, out_num, &cmd, sizeof(cmd));
+        virtio_net_ctrl_ack ack = VIRTIO_NET_ERR;
+        if (len == sizeof(cmd) && cmd.hdr.class == VIRTIO_NET_CTRL_MQ &&
+            cmd.hdr.cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET &&
+            virtio_mmio_has_feature(&net->mmio, VIRTIO_NET_F_MQ) &&
+            cmd.mq.virtqueue_pairs >= VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN &&
+            cmd.mq.virtqueue_pairs <= net->queue_pairs) {
+            net->curr_queue_pairs = cmd.mq.virtqueue_pairs;
+            ack = VIRTIO_NET_OK;
+        }
+        virt_queue_fill(vq, head, iov_from_buf(iov + out_num, n - out_num, &ack, sizeof(ack)));
+    }
+    virt_queue_flush(&net->mmio, vq);
+}
+
+static void virtio_net_notify(void *dev, uint32_t queue) {
+    virtio_net_t *net = (virtio_net_t*) dev;
+    if (queue == virtio_net_ctrlq(net)) {
+        virtio_net_ctrl(net, &net->mmio.queues[queue]);
+        return;
+    }
+    if (net->vhost_enabled || queue / 2 >= net->queue_pairs) return;
+
+    virtio_net_pair_t *pair = &net->pairs[queue / 2];
+    if (queue == virtio_net_rxq(pair->index)) {
+        pair->rx_blocked = 0;
+        virtio_net_rx(pair);
+    } else {
+        virtio_net_tx(pair);
+    }
+    virtio_net_update_events(pair);
+}
+
+// virtio_net_vhost_start hands every queue pair the driver set up to
+// vhost-net once it is ready.
+static int virtio_net_vhost_start(virtio_net_t *net) {
+    uint64_t features = virtio_net_driver_features(net);
+    for (size_t i = 0; i < net->queue_pairs; i++) {
+        virt_queue_t *rx = &net->mmio.queues[virtio_net_rxq(i)];
+        virt_queue_t *tx = &net->mmio.queues[virtio_net_txq(i)];
+        if (net->vhost.running[i] || !rx->ready || !tx->ready) continue;
+        if (vhost_net_start(&net->vhost, i, features, net->mmio.mem, rx, tx, net->backend->fds[i]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void virtio_net_status(void *dev, uint32_t status) {
+    virtio_net_t *net = (virtio_net_t*) dev;
+
+    // Without VIRTIO_NET_F_MQ the control queue takes the place of the
+    // second receive queue, whose kicks go to vhost-net.
+    if (net->vhost_enabled && net->queue_pairs > 1 && (status & VIRTIO_CONFIG_S_FEATURES_OK) &&
+        virtio_mmio_has_feature(&net->mmio, VIRTIO_NET_F_CTRL_VQ) &&
+        !virtio_mmio_has_feature(&net->mmio, VIRTIO_NET_F_MQ)) {
+        net->mmio.status &= ~VIRTIO_CONFIG_S_FEATURES_OK;
+        return;
+    }
+    if (!(status & VIRTIO_CONFIG_S_DRIVER_OK)) return;
+
+    if (net_backend_set_offload(net->backend, virtio_net_driver_features(net)) < 0) {
+        perror("virtio-net offload");
+    }
+    if (net->vhost_enabled && virtio_net_vhost_start(net) < 0) {
+        perror("vhost-net");
+        net->mmio.status |= VIRTIO_CONFIG_S_NEEDS_RESET;
+    }
+}
+
+static void virtio_net_reset(void *dev) {
+    virtio_net_t *net = (virtio_net_t*) dev;
+    for (size_t i = 0; i < net->queue_pairs; i++) {
+        virtio_net_pair_t *pair = &net->pairs[i];
+        if (net->vhost_enabled) vhost_net_stop(&net->vhost, i);
+        // The receive buffers are torn down with the queues.
+        pair->rx_chain_count = 0;
+        pair->rx_iovcnt = 0;
+        pair->rx_space = 0;
+        pair->rx_blocked = 1;
+        pair->tx_blocked = 0;
+        virtio_net_update_events(pair);
+    }
+    net->curr_queue_pairs = 1;
+}
+
+static const virtio_device_ops_t virtio_net_ops = {
+    .config_read = virtio_net_config_read,
+    .notify = virtio_net_notify,
+    .status = virtio_net_status,
+    .reset = virtio_net_reset,
+};
+
+int virtio_net_init(virtio_net_t *net, uintptr_t base, uint32_t irq, mem_map_t *mem,
+                    irq_line_func irq_line, irq_arg_t irq_arg, net_backend_t *backend) {
+    if (backend->queue_count == 0 || backend->queue_count > VIRTIO_NET_MAX_QUEUE_PAIRS ||
+        2 * backend->queue_count + 1 > VIRTIO_QUEUE_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(net, 0, sizeof(virtio_net_t));
+    virtio_mmio_config_init(&net->mmio, base, irq, mem, irq_line, irq_arg, &virtio_net_ops, net);
+    net->mmio.device_id = VIRTIO_DEVICE_NETWORK_CARD;
+    net->backend = backend;
+    net->queue_pairs = backend->queue_count;
+    net->curr_queue_pairs = 1;
+    // Every queue pair and the control queue.
+    net->mmio.queue_count = 2 * net->queue_pairs + 1;
+    for (size_t i = 0; i < net->mmio.queue_count; i++) {
+        net->mmio.queues[i].num_max = VIRTIO_NET_QUEUE_DEPTH;
+    }
+    for (size_t i = 0; i < net->queue_pairs; i++) {
+        net->pairs[i].net = net;
+        net->pairs[i].index = i;
+        net->pairs[i].rx_blocked = 1;
+    }
+
+    // A locally administered unicast address in the range QEMU uses.
+    net->config.mac[0] = 0x52;
+    net->config.mac[1] = 0x54;
+    net->config.mac[2] = 0x00;
+    if (getrandom(net->config.mac + 3, 3, 0) != 3) return -1;
+    net->config.status = VIRTIO_NET_S_LINK_UP;
+    net->config.max_virtqueue_pairs = net->queue_pairs;
+
+    virtio_mmio_add_feature(&net->mmio, VIRTIO_NET_F_MAC);
+    virtio_mmio_add_feature(&net->mmio, VIRTIO_NET_F_STATUS);
+    virtio_mmio_add_feature(&net->mmio, VIRTIO_NET_F_MRG_RXBUF);
+    virtio_mmio_add_feature(&net->mmio, VIRTIO_NET_F_CTRL_VQ);
+    virtio_mmio_add_feature(&net->mmio, VIRTIO_NET_F_CSUM);
+    virtio_mmio_add_feature(&net->mmio, VIRTIO_NET_F_GUEST_CSUM);
+    virtio_mmio_add_feature(&net->mmio, VIRTIO_NET_F_HOST_TSO4);
+    virtio_mmio_add_feature(&net->mmio, VIRTIO_NET_F_HOST_TSO6);
+    virtio_mmio_add_feature(&net->mmio, VIRTIO_NET_F_HOST_ECN);
+    virtio_mmio_add_feature(&net->mmio, VIRTIO_NET_F_GUEST_TSO4);
+    virtio_mmio_add_feature(&net->mmio, VIRTIO_NET_F_GUEST_TSO6);
+    virtio_mmio_add_feature(&net->mmio, VIRTIO_NET_F_GUEST_ECN);
+    if (net->queue_pairs > 1) virtio_mmio_add_feature(&net->mmio, VIRTIO_NET_F_MQ);
+
+    // Without vhost-net, the queues are served by the VMM.
+    if (backend->type == NET_BACKEND_TAP && backend->vhost &&
+        vhost_net_open(&net->vhost, net->queue_pairs) == 0) {
+        net->vhost_enabled = 1;
+    }
+    return 0;
+}
+
+void virtio_net_deinit(virtio_net_t *net) {
+    if (net->vhost_enabled) vhost_net_close(&net->vhost);
+    net->vhost_enabled = 0;
+}
+
+int virtio_net_attach_pair(virtio_net_t *net, uint32_t pair_id, int vm_fd, event_loop_t *loop) {
+    if (pair_id >= net->queue_pairs) {
+        errno = EINVAL;
+        return -1;
+    }
+    virtio_net_pair_t *pair = &net->pairs[pair_id];
+
+    // vhost-net takes the kicks of the queue pairs from their ioeventfds.
+    event_loop_t *queue_loop = net->vhost_enabled ? NULL : loop;
+    if (virtio_mmio_attach_queue(&net->mmio, virtio_net_rxq(pair_id), vm_fd, queue_loop) < 0) return -1;
+    if (virtio_mmio_attach_queue(&net->mmio, virtio_net_txq(pair_id), vm_fd, queue_loop) < 0) return -1;
+    if (pair_id == 0 && virtio_mmio_attach_queue(&net->mmio, 2 * net->queue_pairs, vm_fd, loop) < 0) return -1;
+
+    pair->loop = loop;
+    if (net->vhost_enabled) {
+        for (size_t i = 0; i < 2; i++) {
+            virt_queue_t *queue = &net->mmio.queues[2 * pair_id + i];
+            pair->calls[i] = event_loop_add_fd(loop, net->vhost.call_fds[pair_id][i], EPOLLIN,
+                                               virtio_net_vhost_call, queue);
+            if (pair->calls[i] == NULL) return -1;
+        }
+        return 0;
+    }
+
+    // Frames are only polled for once the driver posts receive buffers.
+    pair->backend = event_loop_add_fd(loop, net->backend->fds[pair_id], 0, virtio_net_backend_ready, pair);
+    if (pair->backend == NULL) return -1;
+    pair->events = 0;
+    return 0;
+}
+
+void virtio_net_detach(virtio_net_t *net) {
+    for (size_t i = 0; i < net->queue_pairs; i++) {
+        virtio_net_pair_t *pair = &net->pairs[i];
+        if (pair->backend != NULL) event_loop_remove(pair->loop, pair->backend);
+        pair->backend = NULL;
+        for (size_t j = 0; j < 2; j++) {
+            if (pair->calls[j] != NULL) event_loop_remove(pair->loop, pair->calls[j]);
+            pair->calls[j] = NULL;
+        }
+        pair->loop = NULL;
+    }
+    virtio_mmio_detach(&net->mmio);
+}
+
+int virtio_net_register_metrics(virtio_net_t *net, metrics_t *m, const char *labels) {
+    if (metrics_register(m, "tomu_virtio_net_rx_frames_total", "Frames received by the guest.",
+                         labels, METRIC_COUNTER, &net->stats.rx_frames) < 0) return -1;
+    if (metrics_register(m, "tomu_virtio_net_rx_bytes_total", "Frame bytes received by the guest.",
+                         labels, METRIC_COUNTER, &net->stats.rx_bytes) < 0) return -1;
+    if (metrics_register(m, "tomu_virtio_net_rx_dropped_total",
+                         "Frames dropped because they did not fit the receive buffers or offloads.",
+                         labels, METRIC_COUNTER, &net->stats.rx_dropped) < 0) return -1;
+    if (metrics_register(m, "tomu_virtio_net_tx_frames_total", "Frames sent by the guest.",
+                         labels, METRIC_COUNTER, &net->stats.tx_frames) < 0) return -1;
+    if (metrics_register(m, "tomu_virtio_net_tx_bytes_total", "Frame bytes sent by the guest.",
+                         labels, METRIC_COUNTER, &net->stats.tx_bytes) < 0) return -1;
+    if (metrics_register(m, "tomu_virtio_net_tx_dropped_total", "Frames the backend failed to send.",
+                         labels, METRIC_COUNTER, &net->stats.tx_dropped) < 0) return -1;
+    return virtio_mmio_register_metrics(&net->mmio, m, labels);
+}
@@ -0,0 +1,33 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+/**
+ * CHECK fails the enclosing test, which returns -1, if `cond` is false, and
+ * prints the failed condition.
+ */
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);  \
+            return -1;                                                  \
+        }                                                               \
+    } while (0)
+
+// The number of failed tests, which main returns through TEST_STATUS.
+static int test_failures;
+
+/**
+ * RUN_TEST runs the test `call`, which returns a negative value on failure,
+ * and counts its failure.
+ */
+#define RUN_TEST(call)                                                  \
+    do {                                                                \
+        if ((call) < 0) test_failures++;                                \
+    } while (0)
+
+// The exit status of a test binary: 0 if every test passed.
+#define TEST_STATUS (test_failures != 0)
+
+#endif /* TEST_H */
@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <bdev.h>
+
+#include "test.h"
+
+#define DISK_SIZE (1 << 20)
+#define BLOCK_SIZE 4096
+
+static char path[] = "/tmp/test_bdev.XXXXXX";
+
+// The requests of a test, in the order they completed.
+typedef struct request {
+    bdev_io_t io;
+    ssize_t res;
+    int order;
+} request_t;
+
+static int completed;
+
+static void request_done(bdev_io_t *io, ssize_t res) {
+    request_t *req = (request_t*) io;
+    req->res = res;
+    req->order = ++completed;
+}
+
+static void request_init(request_t *reqs, size_t count) {
+    completed = 0;
+    for (size_t i = 0; i < count; i++) reqs[i] = (request_t) { .io.cb = request_done };
+}
+
+static int poll_all(bdev_queue_t *queue, int count) {
+    while (completed < count) CHECK(bdev_queue_poll(queue) >= 0);
+    return 0;
+}
+
+// A barrier waits for the reads and writes submitted before it, but not
+// for the ones submitted after it.
+static int test_barriers(void) {
+    bdev_t bdev;
+    CHECK(bdev_init(&bdev, path, 1, 8) == 0);
+    bdev_queue_t *queue = bdev_get_queue(&bdev, 0);
+    uint8_t *buf = aligned_alloc(BLOCK_SIZE, 3 * BLOCK_SIZE);
+    CHECK(buf != NULL);
+    memset(buf, 0xab, 3 * BLOCK_SIZE);
+
+    request_t reqs[5];
+    request_init(reqs, 5);
+    CHECK(bdev_queue_write(queue, &reqs[0].io, buf, BLOCK_SIZE, 0) == 0);
+    CHECK(bdev_queue_write(queue, &reqs[1].io, buf + BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE) == 0);
+    CHECK(bdev_queue_flush(queue, &reqs[2].io) == 0);
+    CHECK(bdev_queue_discard(queue, &reqs[3].io, 0, BLOCK_SIZE) == 0);
+    CHECK(bdev_queue_write(queue, &reqs[4].io, buf + 2 * BLOCK_SIZE, BLOCK_SIZE, 2 * BLOCK_SIZE) == 0);
+
+    // The writes before the barriers are tagged 0, and the one after both 2.
+    CHECK(reqs[0].io.tag == 0 && reqs[1].io.tag == 0 && reqs[4].io.tag == 2);
+    CHECK(queue->barrier_len == 2 && queue->barrier_head == &reqs[2].io);
+    CHECK(reqs[2].order == 0 && reqs[3].order == 0);
+
+    CHECK(poll_all(queue, 5) == 0);
+    for (int i = 0; i < 5; i++) CHECK(reqs[i].res == (i == 2 || i == 3 ? 0 : BLOCK_SIZE));
+    CHECK(reqs[2].order > reqs[0].order && reqs[2].order > reqs[1].order);
+    CHECK(reqs[3].order > reqs[0].order && reqs[3].order > reqs[1].order);
+    CHECK(queue->barrier_len == 0 && queue->barrier_head == NULL);
+    CHECK(queue->stats.flushes == 1 && queue->stats.discards == 1);
+
+    free(buf);
+    bdev_deinit(&bdev);
+    return 0;
+}
+
+// Tags wrap modulo queue_depth + 1, which is safe since at most
+// queue_depth barriers are queued.
+static int test_tag_wrap(void) {
+    bdev_t bdev;
+    CHECK(bdev_init(&bdev, path, 1, 2) == 0);
+    bdev_queue_t *queue = bdev_get_queue(&bdev, 0);
+    uint8_t *buf = aligned_alloc(BLOCK_SIZE, BLOCK_SIZE);
+    CHECK(buf != NULL);
+    memset(buf, 0xcd, BLOCK_SIZE);
+
+    for (int round = 0; round < 4; round++) {
+        request_t reqs[3];
+        request_init(reqs, 3);
+        CHECK(bdev_queue_write(queue, &reqs[0].io, buf, BLOCK_SIZE, 0) == 0);
+        CHECK(bdev_queue_flush(queue, &reqs[1].io) == 0);
+        CHECK(bdev_queue_flush(queue, &reqs[2].io) == 0);
+        // A third barrier does not fit until the first one ran.
+        request_t extra = { .io.cb = request_done };
+        CHECK(bdev_queue_flush(queue, &extra.io) < 0 && errno == EAGAIN);
+
+        CHECK(poll_all(queue, 3) == 0);
+        // Both flushes run once the write completed, in either order.
+        CHECK(reqs[0].order == 1);
+        CHECK(reqs[1].res == 0 && reqs[2].res == 0);
+    }
+    CHECK(queue->tag == 8);
+    for (size_t i = 0; i <= bdev.queue_depth; i++) CHECK(queue->inflight[i] == 0);
+
+    free(buf);
+    bdev_deinit(&bdev);
+    return 0;
+}
+
+// Requests at offsets O_DIRECT rejects are staged through a bounce buffer
+// covering their blocks, and partial writes keep the rest of the blocks.
+static int test_unaligned(void) {
+    bdev_t bdev;
+    CHECK(bdev_init(&bdev, path, 1, 8) == 0);
+    bdev_queue_t *queue = bdev_get_queue(&bdev, 0);
+    uint8_t *disk = aligned_alloc(BLOCK_SIZE, 2 * BLOCK_SIZE);
+    uint8_t *buf = aligned_alloc(BLOCK_SIZE, 2 * BLOCK_SIZE);
+    CHECK(disk != NULL && buf != NULL);
+    for (int i = 0; i < 2 * BLOCK_SIZE; i++) disk[i] = i * 7;
+
+    request_t reqs[3];
+    request_init(reqs, 1);
+    CHECK(bdev_queue_write(queue, &reqs[0].io, disk, 2 * BLOCK_SIZE, 0) == 0);
+    CHECK(poll_all(queue, 1) == 0);
+    CHECK(reqs[0].res == 2 * BLOCK_SIZE && queue->stats.bounced == 0);
+
+    request_init(reqs, 1);
+    CHECK(bdev_queue_read(queue, &reqs[0].io, buf, 1000, 100) == 0);
+    CHECK(poll_all(queue, 1) == 0);
+    CHECK(reqs[0].res == 1000 && queue->stats.bounced == 1);
+    CHECK(memcmp(buf, disk + 100, 1000) == 0);
+
+    // A barrier submitted after a partial write waits for it to be written
+    // back.
+    memset(buf, 0xee, 3000);
+    memset(disk + 1000, 0xee, 3000);
+    request_init(reqs, 2);
+    CHECK(bdev_queue_write(queue, &reqs[0].io, buf, 3000, 1000) == 0);
+    CHECK(bdev_queue_flush(queue, &reqs[1].io) == 0);
+    CHECK(poll_all(queue, 2) == 0);
+    CHECK(reqs[0].res == 3000 && reqs[1].res == 0 && reqs[1].order > reqs[0].order);
+    CHECK(queue->stats.bounced == 2 && queue->inflight[queue->tag % (bdev.queue_depth + 1)] == 0);
+
+    request_init(reqs, 1);
+    CHECK(bdev_queue_read(queue, &reqs[0].io, buf, 2 * BLOCK_SIZE, 0) == 0);
+    CHECK(poll_all(queue, 1) == 0);
+    CHECK(reqs[0].res == 2 * BLOCK_SIZE && memcmp(buf, disk, 2 * BLOCK_SIZE) == 0);
+
+    free(buf);
+    free(disk);
+    bdev_deinit(&bdev);
+    return 0;
+}
+
+static int test_set_limits(void) {
+    bdev_t bdev;
+    CHECK(bdev_init(&bdev, path, 2, 8) == 0);
+    throttle_limits_t limits;
+    CHECK(throttle_limits_parse(&limits, "iops=100") == 0);
+    CHECK(bdev_set_limits(&bdev, &limits) == 0);
+    throttle_t *throttle = bdev.queues[0].throttle;
+    CHECK(throttle != NULL && bdev.queues[1].throttle != NULL);
+
+    // The limits are set once, so the throttles and timers are not leaked.
+    CHECK(bdev_set_limits(&bdev, &limits) < 0 && errno == EBUSY);
+    CHECK(bdev.queues[0].throttle == throttle);
+    bdev_deinit(&bdev);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int fd = mkstemp(path);
+    if (fd < 0) return 1;
+    int res = ftruncate(fd, DISK_SIZE);
+    close(fd);
+    if (res < 0) {
+        unlink(path);
+        return 1;
+    }
+    RUN_TEST(test_barriers());
+    RUN_TEST(test_tag_wrap());
+    RUN_TEST(test_unaligned());
+    RUN_TEST(test_set_limits());
+    unlink(path);
+    return TEST_STATUS;
+}
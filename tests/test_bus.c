@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bus.h>
+
+#include "test.h"
+
+#define DEVICE_COUNT 40
+
+typedef struct device {
+    int id;
+    uint64_t last_addr;
+    size_t writes;
+    size_t string_calls;
+} device_t;
+
+static void device_read(void *arg, uint64_t addr, uint8_t *data, size_t len) {
+    device_t *device = (device_t*) arg;
+    device->last_addr = addr;
+    memset(data, device->id, len);
+}
+
+static void device_write(void *arg, uint64_t addr, uint8_t *data, size_t len) {
+    device_t *device = (device_t*) arg;
+    device->last_addr = addr;
+    device->writes++;
+}
+
+static void device_write_string(void *arg, uint64_t addr, uint8_t *data, size_t size, size_t count) {
+    device_t *device = (device_t*) arg;
+    device->string_calls++;
+    device->writes += count;
+}
+
+static const bus_ops_t ops = {
+    .read = device_read,
+    .write = device_write,
+};
+
+static const bus_ops_t string_ops = {
+    .read = device_read,
+    .write = device_write,
+    .write_string = device_write_string,
+};
+
+// Ranges are registered in descending order so that every insertion
+// shifts the table.
+static int test_dispatch(void) {
+    bus_t bus;
+    bus_cache_t cache = {0};
+    device_t devices[DEVICE_COUNT + 1] = {0};
+    CHECK(bus_init(&bus) == 0);
+    for (int i = DEVICE_COUNT; i > 0; i--) {
+        devices[i].id = i;
+        int flags = i % 2 ? BUS_LOCKLESS : 0;
+        CHECK(bus_register(&bus, i * 0x100, 0x10, &ops, &devices[i], flags) == 0);
+    }
+
+    CHECK(bus_register(&bus, 0x105, 4, &ops, &devices[0], 0) < 0 && errno == EEXIST);
+    CHECK(bus_register(&bus, 0xf8, 0x10, &ops, &devices[0], 0) < 0 && errno == EEXIST);
+    CHECK(bus_register(&bus, 0x10f, 0x10, &ops, &devices[0], 0) < 0 && errno == EEXIST);
+
+    uint8_t data[4];
+    for (int i = 1; i <= DEVICE_COUNT; i++) {
+        CHECK(bus_dispatch(&bus, &cache, i * 0x100 + 0xf, 0, data, 1) == 0);
+        CHECK(data[0] == i && devices[i].last_addr == i * 0x100 + 0xf);
+        CHECK(bus_dispatch(&bus, NULL, i * 0x100, 0, data, 4) == 0);
+        CHECK(data[3] == i);
+    }
+
+    // Addresses between the ranges read as an open bus.
+    memset(data, 0, sizeof(data));
+    CHECK(bus_dispatch(&bus, &cache, 0x110, 0, data, 2) < 0 && errno == ENOENT);
+    CHECK(data[0] == 0xff && data[1] == 0xff);
+    CHECK(bus_dispatch(&bus, &cache, 0x10, 1, data, 1) < 0 && errno == ENOENT);
+    CHECK(bus_dispatch(&bus, &cache, UINT64_MAX, 0, data, 1) < 0 && errno == ENOENT);
+    CHECK(bus.stats.unhandled == 3);
+    bus_deinit(&bus);
+    return 0;
+}
+
+// Repeated accesses to one range hit the cache until the table changes.
+static int test_cache(void) {
+    bus_t bus;
+    bus_cache_t cache = {0};
+    device_t a = { .id = 1 }, b = { .id = 2 };
+    CHECK(bus_init(&bus) == 0);
+    CHECK(bus_register(&bus, 0x1000, 0x100, &ops, &a, 0) == 0);
+
+    uint8_t data = 0;
+    for (int i = 0; i < 10; i++) CHECK(bus_dispatch(&bus, &cache, 0x1050, 1, &data, 1) == 0);
+    CHECK(a.writes == 10);
+    CHECK(cache.stats.dispatches == 10 && cache.stats.cache_hits == 9);
+    CHECK(bus.stats.dispatches == 0);
+
+    // A miss on another address does not dispatch to the cached range.
+    CHECK(bus_dispatch(&bus, &cache, 0x2000, 0, &data, 1) < 0);
+    CHECK(bus_dispatch(&bus, &cache, 0x1050, 1, &data, 1) == 0);
+    CHECK(cache.stats.cache_hits == 9);
+
+    CHECK(bus_register(&bus, 0x2000, 0x100, &ops, &b, 0) == 0);
+    CHECK(bus_dispatch(&bus, &cache, 0x2000, 0, &data, 1) == 0 && data == 2);
+    CHECK(bus_dispatch(&bus, &cache, 0x1000, 0, &data, 1) == 0 && data == 1);
+    CHECK(cache.stats.cache_hits == 9);
+    bus_deinit(&bus);
+    return 0;
+}
+
+// The counts of each vCPU are added up with those of the bus.
+static int test_metrics(void) {
+    bus_t bus;
+    bus_cache_t caches[2] = {0};
+    device_t a = { .id = 1 };
+    metrics_t m;
+    CHECK(bus_init(&bus) == 0);
+    CHECK(metrics_init(&m) == 0);
+    CHECK(bus_register(&bus, 0x1000, 0x100, &ops, &a, 0) == 0);
+    CHECK(bus_register_metrics(&bus, &m, "space=\"pio\"") == 0);
+    CHECK(bus_cache_register_metrics(&caches[0], &m, "space=\"pio\"") == 0);
+    CHECK(bus_cache_register_metrics(&caches[1], &m, "space=\"pio\"") == 0);
+
+    uint8_t data = 0;
+    for (int i = 0; i < 3; i++) CHECK(bus_dispatch(&bus, &caches[0], 0x1000, 0, &data, 1) == 0);
+    for (int i = 0; i < 2; i++) CHECK(bus_dispatch(&bus, &caches[1], 0x1000, 0, &data, 1) == 0);
+    CHECK(bus_dispatch(&bus, NULL, 0x1000, 0, &data, 1) == 0);
+
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&text, &len);
+    CHECK(f != NULL);
+    CHECK(metrics_write(&m, f) == 0);
+    fclose(f);
+    const char *dispatches = strstr(text, "tomu_bus_dispatches_total{space=\"pio\"} 6\n");
+    int res = dispatches != NULL && strstr(dispatches + 1, "tomu_bus_dispatches_total{") == NULL &&
+              strstr(text, "tomu_bus_cache_hits_total{space=\"pio\"} 3\n") != NULL;
+    free(text);
+    CHECK(res);
+    metrics_deinit(&m);
+    bus_deinit(&bus);
+    return 0;
+}
+
+static int test_string(void) {
+    bus_t bus;
+    device_t a = { .id = 1 }, b = { .id = 2 };
+    CHECK(bus_init(&bus) == 0);
+    CHECK(bus_register(&bus, 0x3f8, 8, &ops, &a, 0) == 0);
+    CHECK(bus_register(&bus, 0x400, 8, &string_ops, &b, 0) == 0);
+
+    // Without string handlers, each access is a separate call.
+    uint8_t data[16] = {0};
+    CHECK(bus_dispatch_string(&bus, NULL, 0x3f8, 0, data, 2, 8) == 0);
+    for (size_t i = 0; i < sizeof(data); i++) CHECK(data[i] == 1);
+    CHECK(bus_dispatch_string(&bus, NULL, 0x3f8, 1, data, 1, 16) == 0);
+    CHECK(a.writes == 16);
+
+    CHECK(bus_dispatch_string(&bus, NULL, 0x400, 1, data, 1, 16) == 0);
+    CHECK(b.writes == 16 && b.string_calls == 1);
+    // A single access goes to the plain handler.
+    CHECK(bus_dispatch_string(&bus, NULL, 0x400, 1, data, 1, 1) == 0);
+    CHECK(b.writes == 17 && b.string_calls == 1);
+    bus_deinit(&bus);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    RUN_TEST(test_dispatch());
+    RUN_TEST(test_cache());
+    RUN_TEST(test_metrics());
+    RUN_TEST(test_string());
+    return TEST_STATUS;
+}
@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cow.h>
+
+#include "test.h"
+
+#define CLUSTER_SIZE (64 * 1024)
+// The base ends in the middle of the fourth cluster of the overlay.
+#define BASE_SIZE (4 * CLUSTER_SIZE - 4096)
+#define DISK_SIZE (8 * CLUSTER_SIZE)
+
+static char dir[] = "/tmp/test_cow.XXXXXX";
+static char base_path[64];
+static char overlay_path[64];
+
+static int create_base(void) {
+    CHECK(mkdtemp(dir) != NULL);
+    snprintf(base_path, sizeof(base_path), "%s/base.img", dir);
+    snprintf(overlay_path, sizeof(overlay_path), "%s/overlay.cow", dir);
+
+    uint8_t *buf = malloc(BASE_SIZE);
+    CHECK(buf != NULL);
+    for (size_t i = 0; i < BASE_SIZE; i++) buf[i] = i / 512;
+    int fd = open(base_path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    int res = fd >= 0 && write(fd, buf, BASE_SIZE) == BASE_SIZE;
+    if (fd >= 0) close(fd);
+    free(buf);
+    CHECK(res);
+    return 0;
+}
+
+static void remove_files(void) {
+    unlink(overlay_path);
+    unlink(base_path);
+    rmdir(dir);
+}
+
+static int test_create(void) {
+    // The cluster size must be a power of two within the supported range.
+    CHECK(cow_create(overlay_path, "base.img", 0, 0) < 0 && errno == EINVAL);
+    CHECK(cow_create(overlay_path, "base.img", 0, 3 * 4096) < 0 && errno == EINVAL);
+    CHECK(cow_create(overlay_path, "base.img", 0, 2048) < 0 && errno == EINVAL);
+    CHECK(cow_create(overlay_path, "base.img", 0, 4 << 20) < 0 && errno == EINVAL);
+    CHECK(access(overlay_path, F_OK) < 0);
+
+    // A relative base path is resolved against the overlay's directory.
+    CHECK(cow_create(overlay_path, "base.img", DISK_SIZE, CLUSTER_SIZE) == 0);
+    CHECK(cow_create(overlay_path, "base.img", DISK_SIZE, CLUSTER_SIZE) < 0 && errno == EEXIST);
+
+    int fd = open(overlay_path, O_RDONLY);
+    CHECK(fd >= 0);
+    CHECK(cow_probe(fd) == 1);
+    close(fd);
+    fd = open(base_path, O_RDONLY);
+    CHECK(fd >= 0);
+    CHECK(cow_probe(fd) == 0);
+    close(fd);
+    return 0;
+}
+
+static int test_map(void) {
+    int fd = open(overlay_path, O_RDWR);
+    CHECK(fd >= 0);
+    cow_t cow;
+    CHECK(cow_open(&cow, overlay_path, fd) == 0);
+    CHECK(cow.size == DISK_SIZE && cow.base_size == BASE_SIZE);
+
+    cow_extent_t extent;
+    CHECK(cow_map(&cow, 0, 0, COW_MAP_READ, &extent) < 0 && errno == EINVAL);
+    CHECK(cow_map(&cow, DISK_SIZE - 512, 1024, COW_MAP_READ, &extent) < 0 && errno == EINVAL);
+
+    // Untouched clusters are read from the base, and zeros past its end.
+    CHECK(cow_map(&cow, 4096, DISK_SIZE - 4096, COW_MAP_READ, &extent) == 0);
+    CHECK(extent.fd == cow.base_fd && extent.offset == 4096 && extent.len == BASE_SIZE - 4096);
+    CHECK(cow_map(&cow, BASE_SIZE, 8192, COW_MAP_READ, &extent) == 0);
+    CHECK(extent.fd == -1 && extent.len == 8192);
+    CHECK(cow.stats.base_reads == 1);
+
+    // A write copies the clusters it touches into the overlay.
+    CHECK(cow_map(&cow, CLUSTER_SIZE - 512, 1024, COW_MAP_WRITE, &extent) == 0);
+    CHECK(extent.fd == cow.fd && extent.len == 1024);
+    CHECK(cow.stats.allocated == 2);
+    uint8_t buf[1024];
+    CHECK(pread(cow.fd, buf, sizeof(buf), extent.offset) == sizeof(buf));
+    for (size_t i = 0; i < sizeof(buf); i++) CHECK(buf[i] == (uint8_t) ((CLUSTER_SIZE - 512 + i) / 512));
+
+    // Allocated clusters are mapped again without copying.
+    CHECK(cow_map(&cow, 0, 2 * CLUSTER_SIZE, COW_MAP_READ, &extent) == 0);
+    CHECK(extent.fd == cow.fd && extent.len == 2 * CLUSTER_SIZE);
+    uint64_t first = extent.offset;
+    CHECK(cow_map(&cow, 0, 3 * CLUSTER_SIZE, COW_MAP_WRITE, &extent) == 0);
+    CHECK(extent.fd == cow.fd && extent.offset == first && extent.len == 2 * CLUSTER_SIZE);
+    CHECK(cow.stats.allocated == 2);
+
+    // Clusters entirely zeroed are not copied from the base.
+    CHECK(cow_map(&cow, 2 * CLUSTER_SIZE, 2 * CLUSTER_SIZE + 512, COW_MAP_ZERO, &extent) == 0);
+    CHECK(extent.fd == cow.fd && extent.len == 2 * CLUSTER_SIZE + 512);
+    CHECK(cow.stats.allocated == 5);
+    CHECK(pread(cow.fd, buf, sizeof(buf), extent.offset) == sizeof(buf));
+    for (size_t i = 0; i < sizeof(buf); i++) CHECK(buf[i] == 0);
+
+    cow_close(&cow);
+
+    // The mapping table persists across a reopen.
+    CHECK(cow_open(&cow, overlay_path, fd) == 0);
+    CHECK(cow_map(&cow, 0, DISK_SIZE, COW_MAP_READ, &extent) == 0);
+    CHECK(extent.fd == cow.fd && extent.offset == first && extent.len == 5 * CLUSTER_SIZE);
+    cow_close(&cow);
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (create_base() < 0) {
+        remove_files();
+        return 1;
+    }
+    RUN_TEST(test_create());
+    RUN_TEST(test_map());
+    remove_files();
+    return TEST_STATUS;
+}
@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <irqmod.h>
+
+#include "test.h"
+
+static int test_parse(void) {
+    irqmod_config_t config;
+    CHECK(irqmod_config_parse(&config, "") == 0);
+    CHECK(config.usecs == 0 && config.frames == 0 && !config.adaptive);
+
+    CHECK(irqmod_config_parse(&config, "usecs=50,frames=0x20,adaptive") == 0);
+    CHECK(config.usecs == 50 && config.frames == 32 && config.adaptive);
+    CHECK(irqmod_config_parse(&config, "frames=4294967295") == 0);
+    CHECK(config.usecs == 0 && config.frames == UINT32_MAX && !config.adaptive);
+
+    CHECK(irqmod_config_parse(&config, "usecs") < 0 && errno == EINVAL);
+    CHECK(irqmod_config_parse(&config, "usecs=") < 0 && errno == EINVAL);
+    CHECK(irqmod_config_parse(&config, "usecs=10us") < 0 && errno == EINVAL);
+    CHECK(irqmod_config_parse(&config, "frames=4294967296") < 0 && errno == EINVAL);
+    CHECK(irqmod_config_parse(&config, "delay=10") < 0 && errno == EINVAL);
+    CHECK(irqmod_config_parse(&config, "adaptive=1") < 0 && errno == EINVAL);
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// sample accounts for `completions` over the last second.
+static void sample(irqmod_t *mod, size_t completions) {
+    mod->window_start_ns = now_ns() - 1000000000;
+    mod->window_completions = 0;
+    irqmod_sample(mod, completions);
+}
+
+static int test_static(void) {
+    irqmod_config_t config;
+    CHECK(irqmod_config_parse(&config, "usecs=100,frames=32") == 0);
+    irqmod_t mod;
+    irqmod_init(&mod, &config);
+    CHECK(mod.usecs == 100 && mod.frames == 32);
+    sample(&mod, 1000000);
+    CHECK(mod.usecs == 100 && mod.frames == 32);
+    return 0;
+}
+
+// The completions of a second give rates just below the ones sampled, since
+// a bit more than a second elapses.
+static int test_adaptive(void) {
+    irqmod_config_t config;
+    CHECK(irqmod_config_parse(&config, "usecs=100,frames=32,adaptive") == 0);
+    irqmod_t mod;
+    irqmod_init(&mod, &config);
+    CHECK(mod.usecs == 0 && mod.frames == 0);
+
+    // Within a window, the limits are kept.
+    irqmod_sample(&mod, 1000000);
+    CHECK(mod.usecs == 0 && mod.frames == 0);
+
+    // A low rate signals every completion.
+    sample(&mod, IRQMOD_RATE_LOW / 2);
+    CHECK(mod.usecs == 0 && mod.frames == 1);
+
+    // A high rate uses the configured delay, and as many frames as
+    // complete within it up to the configured count.
+    sample(&mod, 2 * IRQMOD_RATE_HIGH);
+    CHECK(mod.usecs == 100 && mod.frames == 32);
+    sample(&mod, IRQMOD_RATE_HIGH + 100000);
+    CHECK(mod.usecs == 100 && (mod.frames == 29 || mod.frames == 30));
+
+    // In between, the delay is scaled linearly.
+    sample(&mod, (IRQMOD_RATE_LOW + IRQMOD_RATE_HIGH) / 2);
+    CHECK(mod.usecs == 49 || mod.usecs == 50);
+    CHECK(mod.frames == 5);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    RUN_TEST(test_parse());
+    RUN_TEST(test_static());
+    RUN_TEST(test_adaptive());
+    return TEST_STATUS;
+}
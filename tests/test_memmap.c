@@ -0,0 +1,160 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <memmap.h>
+
+#include "test.h"
+
+#define SLOT_SIZE 0x1000
+
+// Three slots: two adjacent ones, and one after a hole.
+static uint8_t memory[3][SLOT_SIZE];
+
+static int map_init(mem_map_t *map) {
+    CHECK(mem_map_init(map) == 0);
+    CHECK(mem_map_add(map, 0x10000, SLOT_SIZE, memory[1]) == 0);
+    CHECK(mem_map_add(map, 0x0f000, SLOT_SIZE, memory[0]) == 0);
+    CHECK(mem_map_add_fd(map, 0x20000, SLOT_SIZE, memory[2], 7, 0x8000) == 0);
+    return 0;
+}
+
+static int test_add(void) {
+    mem_map_t map;
+    CHECK(map_init(&map) == 0);
+    CHECK(mem_map_add(&map, 0x10800, 0x100, memory[0]) < 0 && errno == EEXIST);
+    CHECK(mem_map_add(&map, 0x1f800, SLOT_SIZE, memory[0]) < 0 && errno == EEXIST);
+    CHECK(mem_map_add(&map, 0x0e800, SLOT_SIZE, memory[0]) < 0 && errno == EEXIST);
+    CHECK(mem_map_add(&map, 0x30000, 0, memory[0]) < 0 && errno == EINVAL);
+    CHECK(mem_map_add(&map, UINT64_MAX - 0xff, 0x1000, memory[0]) < 0 && errno == EINVAL);
+
+    mem_slot_t slots[2];
+    CHECK(mem_map_slots(&map, slots, 2) == 3);
+    CHECK(slots[0].gpa == 0x0f000 && slots[0].hva == memory[0] && slots[0].fd == -1);
+    CHECK(slots[1].gpa == 0x10000 && slots[1].hva == memory[1]);
+
+    CHECK(mem_map_remove(&map, 0x10800) < 0 && errno == ENOENT);
+    CHECK(mem_map_remove(&map, 0x10000) == 0);
+    mem_slot_t slot;
+    CHECK(mem_map_slots(&map, &slot, 1) == 2);
+    CHECK(mem_map_slots(&map, slots, 2) == 2);
+    CHECK(slots[1].gpa == 0x20000 && slots[1].fd == 7 && slots[1].fd_offset == 0x8000);
+    mem_map_deinit(&map);
+    return 0;
+}
+
+static int test_translate(void) {
+    mem_map_t map;
+    CHECK(map_init(&map) == 0);
+    CHECK(mem_map_translate(&map, 0x10010, 16) == memory[1] + 0x10);
+    CHECK(mem_map_translate(&map, 0x10000, SLOT_SIZE) == memory[1]);
+    CHECK(mem_map_translate(&map, 0x20fff, 1) == memory[2] + 0xfff);
+
+    // Ranges crossing the end of a slot fault, even into an adjacent slot.
+    CHECK(mem_map_translate(&map, 0x0fff0, 32) == NULL && errno == EFAULT);
+    CHECK(mem_map_translate(&map, 0x11000, 1) == NULL && errno == EFAULT);
+    CHECK(mem_map_translate(&map, 0x0, 1) == NULL && errno == EFAULT);
+    CHECK(mem_map_translate(&map, 0x10010, UINT64_MAX) == NULL && errno == EFAULT);
+    CHECK(map.stats.faults == 4);
+
+    // A removed slot is not translated from the cache of the last lookup.
+    CHECK(mem_map_translate(&map, 0x10010, 16) != NULL);
+    CHECK(mem_map_remove(&map, 0x10000) == 0);
+    CHECK(mem_map_translate(&map, 0x10010, 16) == NULL && errno == EFAULT);
+    mem_map_deinit(&map);
+    return 0;
+}
+
+static int test_translate_iov(void) {
+    mem_map_t map;
+    CHECK(map_init(&map) == 0);
+
+    struct iovec iov[2];
+    CHECK(mem_map_translate_iov(&map, 0x0ff00, 0x200, iov, 2) == 2);
+    CHECK(iov[0].iov_base == memory[0] + 0xf00 && iov[0].iov_len == 0x100);
+    CHECK(iov[1].iov_base == memory[1] && iov[1].iov_len == 0x100);
+
+    CHECK(mem_map_translate_iov(&map, 0x10000, 0x10, iov, 2) == 1);
+    CHECK(mem_map_translate_iov(&map, 0x0ff00, 0x200, iov, 1) < 0 && errno == ENOBUFS);
+    CHECK(mem_map_translate_iov(&map, 0x10f00, 0x200, iov, 2) < 0 && errno == EFAULT);
+    mem_map_deinit(&map);
+    return 0;
+}
+
+// The cache of a map does not outlive it, even if the next map is
+// allocated at the same address.
+static int test_reinit(void) {
+    mem_map_t map;
+    CHECK(mem_map_init(&map) == 0);
+    CHECK(mem_map_add(&map, 0x10000, SLOT_SIZE, memory[0]) == 0);
+    CHECK(mem_map_translate(&map, 0x10010, 16) == memory[0] + 0x10);
+    mem_map_deinit(&map);
+
+    CHECK(mem_map_init(&map) == 0);
+    CHECK(mem_map_add(&map, 0x10000, SLOT_SIZE, memory[1]) == 0);
+    CHECK(mem_map_translate(&map, 0x10010, 16) == memory[1] + 0x10);
+    mem_map_deinit(&map);
+    return 0;
+}
+
+#define READERS 4
+#define REPLACEMENTS 2000
+
+typedef struct reader {
+    mem_map_t *map;
+    atomic_int *done;
+    int failures;
+} reader_t;
+
+static void *reader_run(void *arg) {
+    reader_t *reader = (reader_t*) arg;
+    mem_slot_t slots[3];
+    while (!atomic_load(reader->done)) {
+        uint8_t *hva = mem_map_translate(reader->map, 0x10010, 16);
+        if (hva != NULL && hva != memory[1] + 0x10) reader->failures++;
+        hva = mem_map_translate(reader->map, 0x0f010, 16);
+        if (hva != memory[0] + 0x10) reader->failures++;
+        size_t count = mem_map_slots(reader->map, slots, 3);
+        if (count < 2 || count > 3 || slots[0].hva != memory[0]) reader->failures++;
+    }
+    return NULL;
+}
+
+// Tables replaced while other threads translate are freed, and none of
+// them is freed under a reader, which AddressSanitizer would catch.
+static int test_replace(void) {
+    mem_map_t map;
+    CHECK(map_init(&map) == 0);
+    atomic_int done = 0;
+    reader_t readers[READERS];
+    pthread_t threads[READERS];
+    for (int i = 0; i < READERS; i++) {
+        readers[i] = (reader_t) { .map = &map, .done = &done };
+        CHECK(pthread_create(&threads[i], NULL, reader_run, &readers[i]) == 0);
+    }
+
+    int res = 0;
+    for (int i = 0; i < REPLACEMENTS && res == 0; i++) {
+        res = mem_map_remove(&map, 0x10000) == 0 && mem_map_add(&map, 0x10000, SLOT_SIZE, memory[1]) == 0 ? 0 : -1;
+    }
+    atomic_store(&done, 1);
+    int failures = 0;
+    for (int i = 0; i < READERS; i++) {
+        pthread_join(threads[i], NULL);
+        failures += readers[i].failures;
+    }
+    mem_map_deinit(&map);
+    CHECK(res == 0);
+    CHECK(failures == 0);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    RUN_TEST(test_add());
+    RUN_TEST(test_translate());
+    RUN_TEST(test_translate_iov());
+    RUN_TEST(test_reinit());
+    RUN_TEST(test_replace());
+    return TEST_STATUS;
+}
@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <linux/kvm.h>
+
+#include <metrics.h>
+
+#include "test.h"
+
+#define NAME_SIZE 32
+#define DESC_SIZE (sizeof(struct kvm_stats_desc) + NAME_SIZE)
+
+typedef struct stat_spec {
+    const char *name;
+    uint32_t flags;
+    int16_t exponent;
+    uint16_t size;
+    uint32_t bucket_size;
+} stat_spec_t;
+
+static const stat_spec_t specs[] = {
+    { "exits", KVM_STATS_TYPE_CUMULATIVE | KVM_STATS_UNIT_NONE, 0, 1, 0 },
+    { "halt_wait_ns", KVM_STATS_TYPE_CUMULATIVE | KVM_STATS_UNIT_SECONDS, -9, 1, 0 },
+    { "blocking", KVM_STATS_TYPE_INSTANT | KVM_STATS_UNIT_BOOLEAN, 0, 1, 0 },
+    { "wait_hist", KVM_STATS_TYPE_LOG_HIST | KVM_STATS_UNIT_SECONDS, -9, 4, 0 },
+    { "depth_hist", KVM_STATS_TYPE_LINEAR_HIST | KVM_STATS_UNIT_NONE, 0, 3, 10 },
+};
+
+#define STAT_COUNT (sizeof(specs) / sizeof(specs[0]))
+
+/**
+ * stats_fd returns a file laid out like a KVM binary statistics fd, with
+ * the statistics of `specs` holding `values`.
+ */
+static int stats_fd(const uint64_t *values, size_t values_len) {
+    struct kvm_stats_header header = {
+        .name_size = NAME_SIZE,
+        .num_desc = STAT_COUNT,
+        .desc_offset = sizeof(struct kvm_stats_header),
+        .data_offset = sizeof(struct kvm_stats_header) + STAT_COUNT * DESC_SIZE,
+    };
+    uint8_t desc[STAT_COUNT * DESC_SIZE];
+    memset(desc, 0, sizeof(desc));
+    uint32_t offset = 0;
+    for (size_t i = 0; i < STAT_COUNT; i++) {
+        struct kvm_stats_desc *d = (struct kvm_stats_desc*) (desc + i * DESC_SIZE);
+        d->flags = specs[i].flags;
+        d->exponent = specs[i].exponent;
+        d->size = specs[i].size;
+        d->offset = offset;
+        d->bucket_size = specs[i].bucket_size;
+        strcpy(d->name, specs[i].name);
+        offset += specs[i].size * sizeof(uint64_t);
+    }
+
+    int fd = memfd_create("stats", 0);
+    if (fd < 0) return -1;
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        pwrite(fd, desc, sizeof(desc), header.desc_offset) != sizeof(desc) ||
+        pwrite(fd, values, values_len * sizeof(uint64_t), header.data_offset) !=
+        (ssize_t) (values_len * sizeof(uint64_t))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static char* write_text(metrics_t *m) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&text, &len);
+    if (f == NULL) return NULL;
+    metrics_write(m, f);
+    fclose(f);
+    return text;
+}
+
+static int count_lines(const char *text, const char *prefix) {
+    int count = 0;
+    const char *line = text;
+    while (*line) {
+        if (strncmp(line, prefix, strlen(prefix)) == 0) count++;
+        const char *end = strchr(line, '\n');
+        if (end == NULL) break;
+        line = end + 1;
+    }
+    return count;
+}
+
+static int test_kvm(void) {
+    metrics_t m;
+    CHECK(metrics_init(&m) == 0);
+    // exits, halt_wait_ns, blocking, wait_hist[4], depth_hist[3]
+    const uint64_t vcpu0[] = { 7, 1500000000, 1, 1, 2, 0, 3, 4, 0, 5 };
+    const uint64_t vcpu1[] = { 9, 250, 0, 0, 0, 0, 0, 0, 0, 0 };
+    int fd0 = stats_fd(vcpu0, sizeof(vcpu0) / sizeof(vcpu0[0]));
+    CHECK(fd0 >= 0);
+    CHECK(metrics_add_kvm_stats(&m, fd0, "kvm_vcpu", "vcpu=\"0\"") == 0);
+    int fd1 = stats_fd(vcpu1, sizeof(vcpu1) / sizeof(vcpu1[0]));
+    CHECK(fd1 >= 0);
+    CHECK(metrics_add_kvm_stats(&m, fd1, "kvm_vcpu", "vcpu=\"1\"") == 0);
+
+    char *text = write_text(&m);
+    CHECK(text != NULL);
+    static const char *lines[] = {
+        // One header per family, whatever the number of vCPUs.
+        "# HELP kvm_vcpu_exits KVM binary statistic exits.\n"
+        "# TYPE kvm_vcpu_exits counter\n"
+        "kvm_vcpu_exits{vcpu=\"0\"} 7\n"
+        "kvm_vcpu_exits{vcpu=\"1\"} 9\n",
+        // Nanoseconds are exported in seconds.
+        "# TYPE kvm_vcpu_halt_wait_seconds counter\n"
+        "kvm_vcpu_halt_wait_seconds{vcpu=\"0\"} 1.500000000\n"
+        "kvm_vcpu_halt_wait_seconds{vcpu=\"1\"} 0.000000250\n",
+        "# TYPE kvm_vcpu_blocking gauge\n",
+        // Bucket j of a log histogram holds [2^(j - 1), 2^j).
+        "# TYPE kvm_vcpu_wait_hist_seconds histogram\n"
+        "kvm_vcpu_wait_hist_seconds_bucket{vcpu=\"0\",le=\"0.000000000\"} 1\n"
+        "kvm_vcpu_wait_hist_seconds_bucket{vcpu=\"0\",le=\"0.000000001\"} 3\n"
+        "kvm_vcpu_wait_hist_seconds_bucket{vcpu=\"0\",le=\"0.000000003\"} 3\n"
+        "kvm_vcpu_wait_hist_seconds_bucket{vcpu=\"0\",le=\"+Inf\"} 6\n"
+        "kvm_vcpu_wait_hist_seconds_count{vcpu=\"0\"} 6\n",
+        "# TYPE kvm_vcpu_depth_hist histogram\n"
+        "kvm_vcpu_depth_hist_bucket{vcpu=\"0\",le=\"9\"} 4\n"
+        "kvm_vcpu_depth_hist_bucket{vcpu=\"0\",le=\"19\"} 4\n"
+        "kvm_vcpu_depth_hist_bucket{vcpu=\"0\",le=\"+Inf\"} 9\n"
+        "kvm_vcpu_depth_hist_count{vcpu=\"0\"} 9\n",
+    };
+    int res = 0;
+    for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+        if (strstr(text, lines[i]) == NULL) {
+            fprintf(stderr, "missing:\n%s", lines[i]);
+            res = -1;
+        }
+    }
+    int headers = count_lines(text, "# TYPE ");
+    int helps = count_lines(text, "# HELP ");
+    free(text);
+    CHECK(res == 0);
+    CHECK(headers == STAT_COUNT && helps == STAT_COUNT);
+    metrics_deinit(&m);
+    return 0;
+}
+
+// Series of the same name and labels are added up, and the others are
+// grouped under one header.
+static int test_vmm(void) {
+    metrics_t m;
+    _Atomic uint64_t values[3];
+    atomic_init(&values[0], 1);
+    atomic_init(&values[1], 2);
+    atomic_init(&values[2], 4);
+    CHECK(metrics_init(&m) == 0);
+    CHECK(metrics_register(&m, "tomu_a_total", "A.", "q=\"0\"", METRIC_COUNTER, &values[0]) == 0);
+    CHECK(metrics_register(&m, "tomu_a_total", "A.", "q=\"1\"", METRIC_COUNTER, &values[1]) == 0);
+    CHECK(metrics_register(&m, "tomu_a_total", "A.", "q=\"0\"", METRIC_COUNTER, &values[2]) == 0);
+
+    char *text = write_text(&m);
+    CHECK(text != NULL);
+    int res = strcmp(text, "# HELP tomu_a_total A.\n"
+                           "# TYPE tomu_a_total counter\n"
+                           "tomu_a_total{q=\"0\"} 5\n"
+                           "tomu_a_total{q=\"1\"} 2\n") == 0;
+    free(text);
+    CHECK(res);
+    metrics_deinit(&m);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    RUN_TEST(test_kvm());
+    RUN_TEST(test_vmm());
+    return TEST_STATUS;
+}
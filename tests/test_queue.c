@@ -0,0 +1,183 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <queue.h>
+
+#include "test.h"
+
+#define STRESS_CAPACITY 4096
+#define STRESS_TOTAL (16 << 20)
+#define CHUNK_MAX 1024
+
+static int test_capacity(void) {
+    queue_t q;
+    CHECK(queue_init(&q, 100) == 0);
+    CHECK(queue_capacity(&q) == 128);
+    CHECK(queue_size(&q) == 0);
+    queue_deinit(&q);
+    return 0;
+}
+
+// Bulk pushes and pops straddle the end of the ring at every offset.
+static int test_wraparound(void) {
+    queue_t q;
+    CHECK(queue_init(&q, 16) == 0);
+    uint8_t in[16], out[16];
+    for (size_t off = 0; off < 16; off++) {
+        for (size_t i = 0; i < sizeof(in); i++) in[i] = off * 16 + i;
+        CHECK(queue_push_bulk(&q, in, 11) == 11);
+        CHECK(queue_push_bulk(&q, in + 11, 16) == 5);
+        CHECK(queue_push(&q, 0) == -1);
+        CHECK(queue_size(&q) == 16);
+        CHECK(queue_pop_bulk(&q, out, 32) == 16);
+        CHECK(memcmp(in, out, 16) == 0);
+        CHECK(queue_pop(&q, out) == -1);
+
+        // Shift the next round by one byte.
+        CHECK(queue_push(&q, 0xaa) == 0);
+        CHECK(queue_pop(&q, out) == 0 && out[0] == 0xaa);
+    }
+    queue_deinit(&q);
+    return 0;
+}
+
+static int test_peek(void) {
+    queue_t q;
+    CHECK(queue_init(&q, 8) == 0);
+    uint8_t buf[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    struct iovec iov[2];
+    CHECK(queue_peek(&q, iov) == 0);
+
+    CHECK(queue_push_bulk(&q, buf, 6) == 6);
+    CHECK(queue_pop_bulk(&q, buf, 4) == 4);
+    CHECK(queue_push_bulk(&q, (uint8_t[]){ 6, 7, 8, 9 }, 4) == 4);
+
+    // The six bytes pending wrap at the end of the ring.
+    CHECK(queue_peek(&q, iov) == 2);
+    CHECK(iov[0].iov_len == 4 && iov[1].iov_len == 2);
+    CHECK(((uint8_t*) iov[0].iov_base)[0] == 4);
+    CHECK(((uint8_t*) iov[1].iov_base)[0] == 8);
+
+    queue_discard(&q, 5);
+    CHECK(queue_peek(&q, iov) == 1);
+    CHECK(iov[0].iov_len == 1 && ((uint8_t*) iov[0].iov_base)[0] == 9);
+    queue_deinit(&q);
+    return 0;
+}
+
+// A clear recorded by the producer only drops the bytes pushed before it.
+static int test_discard_until(void) {
+    queue_t q;
+    CHECK(queue_init(&q, 16) == 0);
+    CHECK(queue_push_bulk(&q, (uint8_t[]){ 1, 2, 3 }, 3) == 3);
+    size_t tail = queue_tail(&q);
+    CHECK(queue_push_bulk(&q, (uint8_t[]){ 4, 5 }, 2) == 2);
+
+    queue_discard_until(&q, tail);
+    CHECK(queue_size(&q) == 2);
+    uint8_t b;
+    CHECK(queue_pop(&q, &b) == 0 && b == 4);
+
+    // The consumer already read past the position.
+    queue_discard_until(&q, tail);
+    CHECK(queue_size(&q) == 1);
+
+    queue_clear(&q);
+    CHECK(queue_size(&q) == 0);
+    queue_deinit(&q);
+    return 0;
+}
+
+typedef struct stress {
+    queue_t q;
+    size_t chunk;
+    unsigned long long errors;
+} stress_t;
+
+// The producer pushes an incrementing byte sequence in chunks of
+// pseudo-random size so that pushes straddle the end of the ring at every
+// possible offset.
+static void* producer_func(void *arg) {
+    stress_t *s = (stress_t*) arg;
+    uint8_t buf[CHUNK_MAX];
+    unsigned int seed = 1;
+    uint8_t next = 0;
+    unsigned long long sent = 0;
+    while (sent < STRESS_TOTAL) {
+        size_t n = s->chunk ? s->chunk : 1 + rand_r(&seed) % CHUNK_MAX;
+        if (n > STRESS_TOTAL - sent) n = STRESS_TOTAL - sent;
+        for (size_t i = 0; i < n; i++) buf[i] = next + i;
+
+        size_t off = 0;
+        while (off < n) {
+            size_t res = queue_push_bulk(&s->q, buf + off, n - off);
+            if (res == 0) sched_yield();
+            off += res;
+        }
+        next += n;
+        sent += n;
+    }
+    return NULL;
+}
+
+// The consumer verifies that every byte arrives exactly once and in order,
+// alternating between popping and peeking.
+static void* consumer_func(void *arg) {
+    stress_t *s = (stress_t*) arg;
+    uint8_t buf[CHUNK_MAX];
+    unsigned int seed = 2;
+    uint8_t expect = 0;
+    unsigned long long received = 0;
+    while (received < STRESS_TOTAL) {
+        size_t n = 0;
+        if (received & 1) {
+            struct iovec iov[2];
+            int iovcnt = queue_peek(&s->q, iov);
+            for (int i = 0; i < iovcnt; i++) {
+                for (size_t j = 0; j < iov[i].iov_len; j++) {
+                    if (((uint8_t*) iov[i].iov_base)[j] != expect++) s->errors++;
+                }
+                n += iov[i].iov_len;
+            }
+            if (n > STRESS_CAPACITY) s->errors++;
+            queue_discard(&s->q, n);
+        } else {
+            n = queue_pop_bulk(&s->q, buf, s->chunk ? s->chunk : 1 + rand_r(&seed) % CHUNK_MAX);
+            for (size_t i = 0; i < n; i++) {
+                if (buf[i] != expect++) s->errors++;
+            }
+        }
+        if (n == 0) sched_yield();
+        received += n;
+    }
+    return NULL;
+}
+
+static int test_cross_thread(size_t chunk) {
+    stress_t s = { .chunk = chunk };
+    CHECK(queue_init(&s.q, STRESS_CAPACITY) == 0);
+    pthread_t producer, consumer;
+    CHECK(pthread_create(&producer, NULL, producer_func, &s) == 0);
+    CHECK(pthread_create(&consumer, NULL, consumer_func, &s) == 0);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+    queue_deinit(&s.q);
+    CHECK(s.errors == 0);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    RUN_TEST(test_capacity());
+    RUN_TEST(test_wraparound());
+    RUN_TEST(test_peek());
+    RUN_TEST(test_discard_until());
+    RUN_TEST(test_cross_thread(1));
+    RUN_TEST(test_cross_thread(512));
+    RUN_TEST(test_cross_thread(0));
+    return TEST_STATUS;
+}
@@ -0,0 +1,203 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <ringlog.h>
+
+#include "test.h"
+
+#define DATA_SIZE 16
+
+static char dir[] = "/tmp/test_ringlog.XXXXXX";
+static char path[64];
+
+static void remove_files(void) {
+    char buf[128];
+    for (int i = 0; i <= 3; i++) {
+        if (i == 0) snprintf(buf, sizeof(buf), "%s", path);
+        else snprintf(buf, sizeof(buf), "%s.%d", path, i);
+        unlink(buf);
+    }
+    snprintf(buf, sizeof(buf), "%s.1/file", path);
+    unlink(buf);
+    snprintf(buf, sizeof(buf), "%s.1", path);
+    rmdir(buf);
+}
+
+static ssize_t write_bytes(ringlog_t *log, uint8_t first, size_t len) {
+    uint8_t buf[256];
+    for (size_t i = 0; i < len; i++) buf[i] = first + i;
+    struct iovec iov[2] = {
+        { .iov_base = buf, .iov_len = len / 2 },
+        { .iov_base = buf + len / 2, .iov_len = len - len / 2 },
+    };
+    return ringlog_writev(log, iov, 2);
+}
+
+/**
+ * check_file checks that the log file at `name` holds the bytes up to
+ * `write_offset` of the sequence written by write_bytes, starting at
+ * `first`.
+ */
+static int check_file(const char *name, uint8_t first, uint64_t write_offset, int rotated) {
+    int fd = open(name, O_RDONLY);
+    CHECK(fd >= 0);
+    ringlog_header_t header;
+    uint8_t data[DATA_SIZE];
+    int res = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+              pread(fd, data, DATA_SIZE, RINGLOG_HEADER_SIZE) == DATA_SIZE;
+    close(fd);
+    CHECK(res);
+    CHECK(memcmp(header.magic, RINGLOG_MAGIC, sizeof(header.magic)) == 0);
+    CHECK(header.data_size == DATA_SIZE);
+    CHECK(header.write_offset == write_offset && header.write_begin == write_offset);
+    CHECK(!!(header.flags & RINGLOG_F_ROTATED) == rotated);
+
+    uint64_t start = write_offset > DATA_SIZE ? write_offset - DATA_SIZE : 0;
+    for (uint64_t o = start; o < write_offset; o++) CHECK(data[o % DATA_SIZE] == (uint8_t) (first + o));
+    return 0;
+}
+
+// Without rotation, the log keeps the last DATA_SIZE bytes.
+static int test_wrap(void) {
+    ringlog_t log;
+    CHECK(ringlog_init(&log, path, DATA_SIZE, 0, 0) == 0);
+    CHECK(write_bytes(&log, 0, 10) == 10);
+    CHECK(write_bytes(&log, 10, 30) == 30);
+    CHECK(log.header->write_offset == 40);
+    ringlog_deinit(&log);
+    CHECK(check_file(path, 0, 40, 0) == 0);
+
+    // A log of the same size is appended to.
+    CHECK(ringlog_init(&log, path, DATA_SIZE, 0, 0) == 0);
+    CHECK(write_bytes(&log, 40, 5) == 5);
+    ringlog_deinit(&log);
+    CHECK(check_file(path, 0, 45, 0) == 0);
+
+    // A log of another size is started over.
+    CHECK(ringlog_init(&log, path, 2 * DATA_SIZE, 0, 0) == 0);
+    CHECK(log.header->write_offset == 0);
+    ringlog_deinit(&log);
+    return 0;
+}
+
+static int test_rotate(void) {
+    ringlog_t log;
+    char name[128];
+    CHECK(ringlog_init(&log, path, DATA_SIZE, 2, 0) == 0);
+    CHECK(write_bytes(&log, 0, 56) == 56);
+    ringlog_deinit(&log);
+
+    // Each log holds DATA_SIZE bytes, and the oldest one was dropped.
+    CHECK(check_file(path, 48, 8, 0) == 0);
+    snprintf(name, sizeof(name), "%s.1", path);
+    CHECK(check_file(name, 32, DATA_SIZE, 1) == 0);
+    snprintf(name, sizeof(name), "%s.2", path);
+    CHECK(check_file(name, 16, DATA_SIZE, 1) == 0);
+    snprintf(name, sizeof(name), "%s.3", path);
+    CHECK(access(name, F_OK) < 0);
+    return 0;
+}
+
+// A log written without rotation may have wrapped. Resuming it with
+// rotation rotates it away before the first write.
+static int test_resume_wrapped(void) {
+    ringlog_t log;
+    char name[128];
+    CHECK(ringlog_init(&log, path, DATA_SIZE, 0, 0) == 0);
+    CHECK(write_bytes(&log, 0, 40) == 40);
+    ringlog_deinit(&log);
+
+    CHECK(ringlog_init(&log, path, DATA_SIZE, 1, 0) == 0);
+    CHECK(write_bytes(&log, 0, 4) == 4);
+    ringlog_deinit(&log);
+    CHECK(check_file(path, 0, 4, 0) == 0);
+    snprintf(name, sizeof(name), "%s.1", path);
+    CHECK(check_file(name, 0, 40, 1) == 0);
+    return 0;
+}
+
+// The bytes appended before a rotation fails are reported, so that the
+// caller does not write them again.
+static int test_rotate_error(void) {
+    ringlog_t log;
+    char name[128];
+    // A non-empty directory cannot be replaced by the rotated log.
+    snprintf(name, sizeof(name), "%s.1", path);
+    CHECK(mkdir(name, 0755) == 0);
+    snprintf(name, sizeof(name), "%s.1/file", path);
+    int fd = open(name, O_CREAT | O_WRONLY, 0644);
+    CHECK(fd >= 0);
+    close(fd);
+
+    CHECK(ringlog_init(&log, path, DATA_SIZE, 1, 0) == 0);
+    CHECK(write_bytes(&log, 0, 20) == DATA_SIZE);
+    CHECK(write_bytes(&log, DATA_SIZE, 4) < 0);
+    ringlog_deinit(&log);
+    CHECK(check_file(path, 0, DATA_SIZE, 0) == 0);
+    return 0;
+}
+
+static int test_timestamps(void) {
+    ringlog_t log;
+    CHECK(ringlog_init(&log, path, 256, 0, RINGLOG_TIMESTAMPS) == 0);
+    struct iovec iov[2] = {
+        { .iov_base = "one\ntw", .iov_len = 6 },
+        { .iov_base = "o\n", .iov_len = 2 },
+    };
+    CHECK(ringlog_writev(&log, iov, 2) == 8);
+
+    // Every line is prefixed with `[YYYY-MM-DDTHH:MM:SS.uuuuuuZ] `.
+    const char *data = (const char*) log.data;
+    size_t prefix = strlen("[2000-01-01T00:00:00.000000Z] ");
+    CHECK(log.header->write_offset == 2 * prefix + 8);
+    CHECK(data[0] == '[' && data[prefix - 2] == ']' && data[prefix - 1] == ' ');
+    CHECK(memcmp(data + prefix, "one\n[", 5) == 0);
+    CHECK(memcmp(data + 2 * prefix + 4, "two\n", 4) == 0);
+    ringlog_deinit(&log);
+    return 0;
+}
+
+static int test_spec(void) {
+    ringlog_t log;
+    char spec[128];
+    snprintf(spec, sizeof(spec), "%s,size=4K,rotate=3,timestamps", path);
+    CHECK(ringlog_init_spec(&log, spec) == 0);
+    CHECK(log.data_size == 4096 && log.rotate == 3 && log.flags == RINGLOG_TIMESTAMPS);
+    ringlog_deinit(&log);
+
+    snprintf(spec, sizeof(spec), "%s,size=4X", path);
+    CHECK(ringlog_init_spec(&log, spec) < 0 && errno == EINVAL);
+    snprintf(spec, sizeof(spec), "%s,colors", path);
+    CHECK(ringlog_init_spec(&log, spec) < 0 && errno == EINVAL);
+    snprintf(spec, sizeof(spec), "%s,size=0", path);
+    CHECK(ringlog_init_spec(&log, spec) < 0 && errno == EINVAL);
+    return 0;
+}
+
+// Every test starts without log files.
+static int run(int (*test)(void)) {
+    int res = test();
+    remove_files();
+    return res;
+}
+
+int main(int argc, char *argv[]) {
+    if (mkdtemp(dir) == NULL) return 1;
+    snprintf(path, sizeof(path), "%s/console.log", dir);
+    RUN_TEST(run(test_wrap));
+    RUN_TEST(run(test_rotate));
+    RUN_TEST(run(test_resume_wrapped));
+    RUN_TEST(run(test_rotate_error));
+    RUN_TEST(run(test_timestamps));
+    RUN_TEST(run(test_spec));
+    rmdir(dir);
+    return TEST_STATUS;
+}
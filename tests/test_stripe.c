@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stripe.h>
+
+#include "test.h"
+
+#define MEMBER_COUNT 3
+
+static char paths[MEMBER_COUNT][32];
+
+static int create_members(void) {
+    // The last member is larger, and not a multiple of a chunk or sector.
+    static const off_t sizes[MEMBER_COUNT] = { 8 << 20, 8 << 20, (9 << 20) + 100 };
+    for (int i = 0; i < MEMBER_COUNT; i++) {
+        strcpy(paths[i], "/tmp/test_stripe.XXXXXX");
+        int fd = mkstemp(paths[i]);
+        CHECK(fd >= 0);
+        CHECK(ftruncate(fd, sizes[i]) == 0);
+        close(fd);
+    }
+    return 0;
+}
+
+static void remove_members(void) {
+    for (int i = 0; i < MEMBER_COUNT; i++) unlink(paths[i]);
+}
+
+static int open_spec(stripe_t *stripe, const char *mode, const char *opts) {
+    char spec[256];
+    snprintf(spec, sizeof(spec), "%s:%s,%s,%s%s", mode, paths[0], paths[1], paths[2], opts);
+    return stripe_open_spec(stripe, spec, O_RDONLY);
+}
+
+static int test_spec(void) {
+    stripe_t stripe;
+    CHECK(stripe_is_spec("stripe:a,b"));
+    CHECK(stripe_is_spec("concat:a"));
+    CHECK(!stripe_is_spec("/dev/vda"));
+
+    // The chunk size must be a power of two within the supported range.
+    CHECK(open_spec(&stripe, "stripe", ",chunk=0") < 0 && errno == EINVAL);
+    CHECK(open_spec(&stripe, "stripe", ",chunk=96K") < 0 && errno == EINVAL);
+    CHECK(open_spec(&stripe, "stripe", ",chunk=2K") < 0 && errno == EINVAL);
+    CHECK(open_spec(&stripe, "stripe", ",chunk=32M") < 0 && errno == EINVAL);
+    CHECK(open_spec(&stripe, "stripe", ",chunk=64X") < 0 && errno == EINVAL);
+    CHECK(stripe_open_spec(&stripe, "stripe:", O_RDONLY) < 0 && errno == EINVAL);
+    CHECK(stripe_open_spec(&stripe, "mirror:a", O_RDONLY) < 0 && errno == EINVAL);
+
+    CHECK(open_spec(&stripe, "stripe", "") == 0);
+    CHECK(stripe.chunk_bits == 17);
+    stripe_close(&stripe);
+    return 0;
+}
+
+// Chunks are distributed round-robin, and every member holds as many chunks
+// as the smallest one.
+static int test_stripe_map(void) {
+    stripe_t stripe;
+    CHECK(open_spec(&stripe, "stripe", ",chunk=64K") == 0);
+    CHECK(stripe.member_count == MEMBER_COUNT);
+    CHECK(stripe.size == 24 << 20);
+
+    stripe_extent_t extent;
+    stripe_map(&stripe, 0, 4096, &extent);
+    CHECK(extent.fd == stripe.members[0].fd && extent.offset == 0 && extent.len == 4096);
+
+    // The fifth chunk is the second one of the second member.
+    stripe_map(&stripe, 4 * 65536 + 512, 1 << 20, &extent);
+    CHECK(extent.fd == stripe.members[1].fd);
+    CHECK(extent.offset == 65536 + 512);
+    CHECK(extent.len == 65536 - 512);
+
+    CHECK(stripe_max_extents(&stripe, 0, 65536) == 1);
+    CHECK(stripe_max_extents(&stripe, 65535, 2) == 2);
+    CHECK(stripe_max_extents(&stripe, 512, 4 * 65536) == 5);
+
+    // Splitting a request covers it exactly once.
+    uint64_t offset = 3 * 65536 - 4096;
+    uint64_t len = 300000;
+    size_t count = 0;
+    while (len > 0) {
+        stripe_map(&stripe, offset, len, &extent);
+        CHECK(extent.len > 0 && extent.len <= len);
+        offset += extent.len;
+        len -= extent.len;
+        count++;
+    }
+    CHECK(count <= stripe_max_extents(&stripe, 3 * 65536 - 4096, 300000));
+    stripe_close(&stripe);
+    return 0;
+}
+
+// The members are laid out one after the other in whole sectors.
+static int test_concat_map(void) {
+    stripe_t stripe;
+    CHECK(open_spec(&stripe, "concat", "") == 0);
+    CHECK(stripe.size == 25 << 20);
+    CHECK(stripe.members[2].start == 16 << 20);
+    CHECK(stripe.members[2].size == 9 << 20);
+
+    stripe_extent_t extent;
+    stripe_map(&stripe, (8 << 20) - 4096, 65536, &extent);
+    CHECK(extent.fd == stripe.members[0].fd);
+    CHECK(extent.offset == (8 << 20) - 4096 && extent.len == 4096);
+
+    stripe_map(&stripe, 8 << 20, 65536, &extent);
+    CHECK(extent.fd == stripe.members[1].fd && extent.offset == 0 && extent.len == 65536);
+
+    stripe_map(&stripe, (16 << 20) + 512, 65536, &extent);
+    CHECK(extent.fd == stripe.members[2].fd && extent.offset == 512);
+
+    CHECK(stripe_max_extents(&stripe, 0, 512) == MEMBER_COUNT);
+    stripe_close(&stripe);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (create_members() < 0) {
+        remove_members();
+        return 1;
+    }
+    RUN_TEST(test_spec());
+    RUN_TEST(test_stripe_map());
+    RUN_TEST(test_concat_map());
+    remove_members();
+    return TEST_STATUS;
+}
@@ -0,0 +1,116 @@
+#include <errno.h>
+#include <stdio.h>
+
+#include <throttle.h>
+
+#include "test.h"
+
+#define MS 1000000ULL
+
+static int test_parse(void) {
+    throttle_limits_t limits;
+    CHECK(throttle_limits_parse(&limits, "") == 0);
+    CHECK(limits.burst_ms == THROTTLE_DEFAULT_BURST_MS);
+    for (int i = 0; i < THROTTLE_BUCKETS; i++) CHECK(limits.rate[i] == 0);
+
+    CHECK(throttle_limits_parse(&limits, "read-iops=100,write-bps=4M,burst=50") == 0);
+    CHECK(limits.rate[THROTTLE_READ_IOPS] == 100 && limits.rate[THROTTLE_WRITE_IOPS] == 0);
+    CHECK(limits.rate[THROTTLE_WRITE_BPS] == 4 << 20 && limits.rate[THROTTLE_READ_BPS] == 0);
+    CHECK(limits.burst_ms == 50);
+
+    CHECK(throttle_limits_parse(&limits, "iops=1000,bps=1G") == 0);
+    CHECK(limits.rate[THROTTLE_READ_IOPS] == 1000 && limits.rate[THROTTLE_WRITE_IOPS] == 1000);
+    CHECK(limits.rate[THROTTLE_READ_BPS] == 1ULL << 30 && limits.rate[THROTTLE_WRITE_BPS] == 1ULL << 30);
+
+    CHECK(throttle_limits_parse(&limits, "iops") < 0 && errno == EINVAL);
+    CHECK(throttle_limits_parse(&limits, "iops=ten") < 0 && errno == EINVAL);
+    CHECK(throttle_limits_parse(&limits, "bps=1T") < 0 && errno == EINVAL);
+    CHECK(throttle_limits_parse(&limits, "depth=1") < 0 && errno == EINVAL);
+    CHECK(throttle_limits_parse(&limits, "burst=0") < 0 && errno == EINVAL);
+    CHECK(throttle_limits_parse(&limits, "burst=60001") < 0 && errno == EINVAL);
+    return 0;
+}
+
+// The rates are low enough that the buckets do not refill noticeably while
+// the test runs, and throttle_delay is passed explicit times.
+static int test_iops(void) {
+    throttle_limits_t limits;
+    CHECK(throttle_limits_parse(&limits, "read-iops=20,burst=1000") == 0);
+    throttle_t throttle;
+    throttle_init(&throttle, &limits, 0.5);
+
+    for (int i = 0; i < 10; i++) CHECK(throttle_admit(&throttle, 0, 4096));
+    CHECK(!throttle_admit(&throttle, 0, 4096));
+    // Writes are not limited.
+    for (int i = 0; i < 100; i++) CHECK(throttle_admit(&throttle, 1, 4096));
+
+    uint64_t delay = throttle_delay(&throttle, 0, throttle.last_ns);
+    CHECK(delay > 99 * MS && delay <= 100 * MS + 1);
+    CHECK(throttle_delay(&throttle, 1, throttle.last_ns) == 1);
+
+    // The bucket refills up to its burst only.
+    CHECK(throttle_delay(&throttle, 0, throttle.last_ns + 10000 * MS) == 1);
+    for (int i = 0; i < 10; i++) CHECK(throttle_admit(&throttle, 0, 4096));
+    CHECK(!throttle_admit(&throttle, 0, 4096));
+    return 0;
+}
+
+// A request is admitted while the bucket is positive and charged in full,
+// so one large request may overdraw it.
+static int test_bps(void) {
+    throttle_limits_t limits;
+    CHECK(throttle_limits_parse(&limits, "write-bps=1M") == 0);
+    throttle_t throttle;
+    throttle_init(&throttle, &limits, 1.0);
+    CHECK(throttle.buckets[THROTTLE_WRITE_BPS].burst > 104857 && throttle.buckets[THROTTLE_WRITE_BPS].burst < 104858);
+
+    CHECK(throttle_admit(&throttle, 1, 1 << 20));
+    CHECK(!throttle_admit(&throttle, 1, 512));
+    CHECK(throttle_admit(&throttle, 0, 1 << 20));
+
+    // The overdraft of 0.9 seconds is paid back before the next write.
+    uint64_t delay = throttle_delay(&throttle, 1, throttle.last_ns);
+    CHECK(delay > 899 * MS && delay < 901 * MS);
+    CHECK(throttle_delay(&throttle, 1, throttle.last_ns + delay) == 1);
+    CHECK(throttle_admit(&throttle, 1, 512));
+    return 0;
+}
+
+// The IOPS buckets hold at least one request, however low the rate.
+static int test_min_burst(void) {
+    throttle_limits_t limits;
+    CHECK(throttle_limits_parse(&limits, "iops=1,burst=10") == 0);
+    throttle_t throttle;
+    throttle_init(&throttle, &limits, 0.25);
+    CHECK(throttle_admit(&throttle, 0, 4096));
+    CHECK(throttle_admit(&throttle, 1, 4096));
+    CHECK(!throttle_admit(&throttle, 1, 4096));
+    return 0;
+}
+
+// A refund restores the tokens of a request that was not submitted, up to
+// the burst.
+static int test_refund(void) {
+    throttle_limits_t limits;
+    CHECK(throttle_limits_parse(&limits, "read-iops=10,read-bps=1M,burst=1000") == 0);
+    throttle_t throttle;
+    throttle_init(&throttle, &limits, 1.0);
+    CHECK(throttle_admit(&throttle, 0, 4096));
+    throttle_refund(&throttle, 0, 4096);
+    CHECK(throttle.buckets[THROTTLE_READ_IOPS].tokens == 10.0);
+    CHECK(throttle.buckets[THROTTLE_READ_BPS].tokens == 1 << 20);
+
+    throttle_refund(&throttle, 0, 4096);
+    CHECK(throttle.buckets[THROTTLE_READ_IOPS].tokens == 10.0);
+    CHECK(throttle.buckets[THROTTLE_READ_BPS].tokens == 1 << 20);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    RUN_TEST(test_parse());
+    RUN_TEST(test_iops());
+    RUN_TEST(test_bps());
+    RUN_TEST(test_min_burst());
+    RUN_TEST(test_refund());
+    return TEST_STATUS;
+}
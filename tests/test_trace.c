@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <trace.h>
+
+#include "test.h"
+
+static trace_event_t make_event(uint16_t head, uint64_t pop, uint64_t step) {
+    trace_event_t event = { .head = head, .type = 1, .len = 4096 };
+    for (int i = 0; i < TRACE_STAGES; i++) event.ts[i] = pop + i * step;
+    return event;
+}
+
+// Quantiles are upper bounds within the relative error of the buckets.
+static int test_quantile(void) {
+    static trace_t trace;
+    trace_init(&trace);
+    CHECK(trace_hist_quantile(&trace.hists[TRACE_SUBMIT], 0.5) == 0);
+
+    static const uint64_t steps[] = { 0, 3, 15, 16, 17, 1000, 123456, 1ULL << 39, 1ULL << 45 };
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        trace_t *t = malloc(sizeof(trace_t));
+        CHECK(t != NULL);
+        trace_init(t);
+        trace_event_t event = make_event(0, 1, steps[i]);
+        trace_record(t, &event);
+        uint64_t q = trace_hist_quantile(&t->hists[TRACE_SUBMIT], 0.5);
+        uint64_t total = trace_hist_quantile(&t->hists[TRACE_POP], 0.5);
+        free(t);
+        if (steps[i] >= 1ULL << TRACE_HIST_MAX_BITS) {
+            // Larger latencies land in the last bucket.
+            CHECK(q == 1ULL << TRACE_HIST_MAX_BITS);
+        } else {
+            CHECK(q > steps[i] && q <= steps[i] + steps[i] / 16 + 1);
+        }
+        if (4 * steps[i] >= 1ULL << TRACE_HIST_MAX_BITS) {
+            CHECK(total == 1ULL << TRACE_HIST_MAX_BITS);
+        } else {
+            CHECK(total > 4 * steps[i] && total <= 4 * steps[i] + 4 * steps[i] / 16 + 1);
+        }
+    }
+
+    // 90 fast and 10 slow requests.
+    for (int i = 0; i < 100; i++) {
+        trace_event_t event = make_event(i, 1000, i < 90 ? 100 : 100000);
+        trace_record(&trace, &event);
+    }
+    trace_hist_t *hist = &trace.hists[TRACE_REAP];
+    CHECK(hist->count == 100 && hist->sum == 90 * 100 + 10 * 100000);
+    CHECK(trace_hist_quantile(hist, 0.5) > 100 && trace_hist_quantile(hist, 0.5) <= 104);
+    CHECK(trace_hist_quantile(hist, 0.89) <= 104);
+    CHECK(trace_hist_quantile(hist, 0.9) > 100000);
+    CHECK(trace_hist_quantile(hist, 1.0) > 100000);
+    return 0;
+}
+
+// Stages a request skipped are left out of the histograms.
+static int test_skipped_stage(void) {
+    static trace_t trace;
+    trace_init(&trace);
+    trace_event_t event = make_event(0, 1000, 10);
+    event.ts[TRACE_SUBMIT] = 0;
+    event.ts[TRACE_REAP] = 0;
+    trace_record(&trace, &event);
+    CHECK(trace.hists[TRACE_SUBMIT].count == 0);
+    CHECK(trace.hists[TRACE_REAP].count == 0);
+    CHECK(trace.hists[TRACE_PUBLISH].count == 0);
+    CHECK(trace.hists[TRACE_IRQ].count == 1 && trace.hists[TRACE_IRQ].sum == 10);
+    CHECK(trace.hists[TRACE_POP].count == 1 && trace.hists[TRACE_POP].sum == 40);
+    return 0;
+}
+
+// The dump holds the events of the ring, oldest first, except the oldest
+// one, whose slot the writer may be overwriting with the next event.
+static int test_dump(void) {
+    static trace_t trace;
+    trace_init(&trace);
+    for (int i = 0; i < TRACE_RING_SIZE + 100; i++) {
+        trace_event_t event = make_event(i, 1000 + i, 10);
+        trace_record(&trace, &event);
+    }
+
+    char *buf;
+    size_t size;
+    FILE *f = open_memstream(&buf, &size);
+    CHECK(f != NULL);
+    trace_dump(&trace, f);
+    fclose(f);
+
+    size_t lines = 0;
+    for (char *p = buf; *p; p++) lines += *p == '\n';
+    // The quantiles, a blank line, the event header and the events.
+    CHECK(lines == 1 + TRACE_STAGES + 1 + 1 + TRACE_RING_SIZE - 1);
+    char *events = strstr(buf, "\nhead");
+    CHECK(events != NULL);
+    events = strchr(events + 1, '\n') + 1;
+    CHECK(strncmp(events, "101 ", 4) == 0);
+    CHECK(strstr(events, "\n1123 ") != NULL);
+    free(buf);
+    return 0;
+}
+
+static int test_write_hists(void) {
+    static trace_t trace;
+    trace_init(&trace);
+    trace_event_t event = make_event(0, 1000, 2000);
+    trace_record(&trace, &event);
+
+    char *buf;
+    size_t size;
+    FILE *f = open_memstream(&buf, &size);
+    CHECK(f != NULL);
+    trace_write_hists(&trace, f, "latency_seconds", "disk=\"vda\"", 1);
+    fclose(f);
+
+    CHECK(strstr(buf, "# TYPE latency_seconds histogram\n") != NULL);
+    CHECK(strstr(buf, "latency_seconds_count{disk=\"vda\",stage=\"total\"} 1\n") != NULL);
+    CHECK(strstr(buf, "latency_seconds_sum{disk=\"vda\",stage=\"submit\"} 0.000002000\n") != NULL);
+    // 2000ns falls below the 2048ns bucket boundary.
+    CHECK(strstr(buf, "latency_seconds_bucket{disk=\"vda\",stage=\"irq\",le=\"1.024e-06\"} 0\n") != NULL);
+    CHECK(strstr(buf, "latency_seconds_bucket{disk=\"vda\",stage=\"irq\",le=\"2.048e-06\"} 1\n") != NULL);
+    CHECK(strstr(buf, "latency_seconds_bucket{disk=\"vda\",stage=\"irq\",le=\"+Inf\"} 1\n") != NULL);
+    free(buf);
+
+    f = open_memstream(&buf, &size);
+    CHECK(f != NULL);
+    trace_write_hists(&trace, f, "latency_seconds", NULL, 0);
+    fclose(f);
+    CHECK(strstr(buf, "# TYPE") == NULL);
+    CHECK(strstr(buf, "latency_seconds_count{stage=\"device\"} 1\n") != NULL);
+    free(buf);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    RUN_TEST(test_quantile());
+    RUN_TEST(test_skipped_stage());
+    RUN_TEST(test_dump());
+    RUN_TEST(test_write_hists());
+    return TEST_STATUS;
+}
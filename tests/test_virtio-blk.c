@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <linux/virtio_mmio.h>
+#include <linux/virtio_ring.h>
+
+#include <virtio-blk.h>
+
+#include "test.h"
+
+#define MMIO_BASE 0xd0000000UL
+#define MEMORY_SIZE (4 << 20)
+#define DISK_SIZE (16 << 20)
+
+// The guest physical layout of the queue and of the requests.
+#define DESC_ADDR 0x1000
+#define AVAIL_ADDR 0x3000
+#define USED_ADDR 0x4000
+#define HEADER_ADDR 0x10000
+#define DATA_ADDR 0x100000
+#define BLOCK_SIZE 4096
+
+static char path[] = "/tmp/test_virtio_blk.XXXXXX";
+static uint8_t *memory;
+
+typedef struct device {
+    bdev_t bdev;
+    mem_map_t mem;
+    virtio_blk_t blk;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+} device_t;
+
+static void device_irq(uint16_t irq, int level, irq_arg_t arg) {}
+
+static void device_write(device_t *d, uint32_t reg, uint32_t value) {
+    virtio_mmio_write(&d->blk.mmio, MMIO_BASE + reg, &value, sizeof(value));
+}
+
+static int device_init(device_t *d) {
+    memset(memory, 0, MEMORY_SIZE);
+    CHECK(bdev_init(&d->bdev, path, VIRTIO_BLK_QUEUE_COUNT, VIRTIO_BLK_QUEUE_DEPTH) == 0);
+    CHECK(mem_map_init(&d->mem) == 0);
+    CHECK(mem_map_add(&d->mem, 0, MEMORY_SIZE, memory) == 0);
+    CHECK(virtio_blk_init(&d->blk, MMIO_BASE, 5, &d->mem, device_irq, NULL, &d->bdev) == 0);
+
+    device_write(d, VIRTIO_MMIO_QUEUE_SEL, 0);
+    device_write(d, VIRTIO_MMIO_QUEUE_NUM, VIRTIO_BLK_QUEUE_DEPTH);
+    device_write(d, VIRTIO_MMIO_QUEUE_DESC_LOW, DESC_ADDR);
+    device_write(d, VIRTIO_MMIO_QUEUE_AVAIL_LOW, AVAIL_ADDR);
+    device_write(d, VIRTIO_MMIO_QUEUE_USED_LOW, USED_ADDR);
+    device_write(d, VIRTIO_MMIO_QUEUE_READY, 1);
+    device_write(d, VIRTIO_MMIO_STATUS, VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER |
+                 VIRTIO_CONFIG_S_DRIVER_OK | VIRTIO_CONFIG_S_FEATURES_OK);
+    d->desc = (struct vring_desc*) (memory + DESC_ADDR);
+    d->avail = (struct vring_avail*) (memory + AVAIL_ADDR);
+    d->used = (struct vring_used*) (memory + USED_ADDR);
+    return 0;
+}
+
+static void device_deinit(device_t *d) {
+    virtio_blk_deinit(&d->blk);
+    mem_map_deinit(&d->mem);
+    bdev_deinit(&d->bdev);
+}
+
+/**
+ * device_post makes the `i`-th request, of `type` for the block at `sector`
+ * with the `i`-th data block, available with a header, data and status
+ * descriptor.
+ */
+static void device_post(device_t *d, int i, uint32_t type, uint64_t sector) {
+    uint16_t head = 3 * i;
+    struct virtio_blk_outhdr *header = (struct virtio_blk_outhdr*) (memory + HEADER_ADDR + 32 * i);
+    *header = (struct virtio_blk_outhdr) { .type = type, .sector = sector };
+    memory[HEADER_ADDR + 32 * i + 16] = 0xff;
+    uint16_t write = type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0;
+    d->desc[head] = (struct vring_desc) { HEADER_ADDR + 32 * i, 16, VRING_DESC_F_NEXT, head + 1 };
+    d->desc[head + 1] = (struct vring_desc) { DATA_ADDR + BLOCK_SIZE * i, BLOCK_SIZE, VRING_DESC_F_NEXT | write,
+                                              head + 2 };
+    d->desc[head + 2] = (struct vring_desc) { HEADER_ADDR + 32 * i + 16, 1, VRING_DESC_F_WRITE, 0 };
+    d->avail->ring[d->avail->idx % VIRTIO_BLK_QUEUE_DEPTH] = head;
+    d->avail->idx++;
+}
+
+// device_run notifies the device and waits for the `count` requests posted.
+static int device_run(device_t *d, int count) {
+    uint16_t idx = d->used->idx + count;
+    device_write(d, VIRTIO_MMIO_QUEUE_NOTIFY, 0);
+    while (d->used->idx != idx) CHECK(bdev_queue_poll(bdev_get_queue(&d->bdev, 0)) >= 0);
+    for (int i = 0; i < count; i++) CHECK(memory[HEADER_ADDR + 32 * i + 16] == VIRTIO_BLK_S_OK);
+    return 0;
+}
+
+// Requests for adjacent sectors are submitted to the bdev as one request,
+// and each of them is completed.
+static int test_merge(void) {
+    device_t d;
+    CHECK(device_init(&d) == 0);
+    bdev_queue_t *queue = bdev_get_queue(&d.bdev, 0);
+
+    for (int i = 0; i < 8; i++) {
+        memset(memory + DATA_ADDR + BLOCK_SIZE * i, 'a' + i, BLOCK_SIZE);
+        device_post(&d, i, VIRTIO_BLK_T_OUT, 8 * i);
+    }
+    CHECK(device_run(&d, 8) == 0);
+    CHECK(d.blk.stats.merged == 7 && queue->stats.writes == 1);
+    CHECK(queue->stats.write_bytes == 8 * BLOCK_SIZE);
+
+    memset(memory + DATA_ADDR, 0, 8 * BLOCK_SIZE);
+    for (int i = 0; i < 8; i++) device_post(&d, i, VIRTIO_BLK_T_IN, 8 * i);
+    CHECK(device_run(&d, 8) == 0);
+    CHECK(d.blk.stats.merged == 14 && queue->stats.reads == 1);
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < BLOCK_SIZE; j++) CHECK(memory[DATA_ADDR + BLOCK_SIZE * i + j] == 'a' + i);
+    }
+    device_deinit(&d);
+    return 0;
+}
+
+// A gap between sectors, a change of direction or a barrier ends a merge.
+static int test_merge_breaks(void) {
+    device_t d;
+    CHECK(device_init(&d) == 0);
+    bdev_queue_t *queue = bdev_get_queue(&d.bdev, 0);
+
+    device_post(&d, 0, VIRTIO_BLK_T_OUT, 0);
+    device_post(&d, 1, VIRTIO_BLK_T_OUT, 8);
+    device_post(&d, 2, VIRTIO_BLK_T_OUT, 24);
+    device_post(&d, 3, VIRTIO_BLK_T_IN, 32);
+    device_post(&d, 4, VIRTIO_BLK_T_FLUSH, 0);
+    device_post(&d, 5, VIRTIO_BLK_T_IN, 40);
+    CHECK(device_run(&d, 6) == 0);
+    CHECK(d.blk.stats.merged == 1);
+    CHECK(queue->stats.writes == 2 && queue->stats.reads == 2 && queue->stats.flushes == 1);
+    device_deinit(&d);
+    return 0;
+}
+
+// A chain without a status byte is dropped and counted, and the device
+// asks for a reset.
+static int test_invalid_chain(void) {
+    device_t d;
+    CHECK(device_init(&d) == 0);
+    d.desc[0] = (struct vring_desc) { HEADER_ADDR, 16, 0, 0 };
+    d.avail->ring[d.avail->idx % VIRTIO_BLK_QUEUE_DEPTH] = 0;
+    d.avail->idx++;
+    device_write(&d, VIRTIO_MMIO_QUEUE_NOTIFY, 0);
+    CHECK(d.used->idx == 1 && d.used->ring[0].id == 0 && d.used->ring[0].len == 0);
+    CHECK(d.blk.stats.invalid_chains == 1);
+    CHECK(d.blk.mmio.status & VIRTIO_CONFIG_S_NEEDS_RESET);
+    device_deinit(&d);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int fd = mkstemp(path);
+    if (fd < 0) return 1;
+    int res = ftruncate(fd, DISK_SIZE);
+    close(fd);
+    memory = aligned_alloc(BLOCK_SIZE, MEMORY_SIZE);
+    if (res < 0 || memory == NULL) {
+        unlink(path);
+        return 1;
+    }
+    RUN_TEST(test_merge());
+    RUN_TEST(test_merge_breaks());
+    RUN_TEST(test_invalid_chain());
+    free(memory);
+    unlink(path);
+    return TEST_STATUS;
+}